@@ -13,21 +13,135 @@ typedef int o_attr_id_t;
 
 #define MAX_ATTRS 32
 
+enum oDocFormat {
+    DOC_FORMAT_STREAM,
+    DOC_FORMAT_CHUNKED,
+};
+
+typedef enum oDocFormat oDocFormat;
+
+enum oDocStore {
+    DOC_STORE_HASH,
+    DOC_STORE_LOG,
+};
+
+typedef enum oDocStore oDocStore;
+
+/**
+ * INDEX_FORMAT_TEXT keys a bigram with its UTF-8 bytes. INDEX_FORMAT_PACKED
+ * keys it with a pair of codepoints in a 64-bit integer.
+ */
+enum oIndexFormat {
+    INDEX_FORMAT_TEXT,
+    INDEX_FORMAT_PACKED,
+};
+
+typedef enum oIndexFormat oIndexFormat;
+
+/**
+ * TOKENIZER_BIGRAM makes terms of every two characters. TOKENIZER_HYBRID makes
+ * terms of words in Latin text and of every two characters in the others.
+ */
+enum oTokenizerType {
+    TOKENIZER_BIGRAM,
+    TOKENIZER_HYBRID,
+};
+
+typedef enum oTokenizerType oTokenizerType;
+
+/**
+ * Sizes of grams. NGRAM_UNIGRAM_BIGRAM indexes every character alone too.
+ */
+enum oNgramType {
+    NGRAM_BIGRAM,
+    NGRAM_UNIGRAM_BIGRAM,
+    NGRAM_TRIGRAM,
+};
+
+typedef enum oNgramType oNgramType;
+
+/**
+ * POSTINGS_POSITIONS stores offsets of a term in a document. POSTINGS_DOCS
+ * stores only which documents have a term, and phrases are verified against
+ * documents.
+ */
+enum oPostingsType {
+    POSTINGS_POSITIONS,
+    POSTINGS_DOCS,
+};
+
+typedef enum oPostingsType oPostingsType;
+
+/**
+ * A handle given by oDB_share() has owner, and reads databases of it. Its own
+ * are msg, stats and query_log, so that each thread can search with its own
+ * handle.
+ */
 struct oDB {
     char* path;
     char msg[256];
     int lock_file;
+    int writable;
     o_doc_id_t next_doc_id;
-    TCBDB* index;
-    TCHDB* doc;
+    oDocFormat doc_format;
+    oDocStore doc_store;
+    oIndexFormat index_format;
+    oTokenizerType tokenizer;
+    oNgramType ngram;
+    oPostingsType postings;
+    const struct oCodec* codec;
+    char* dict;
+    int dict_size;
+    void* codec_data;
+    struct oStats* stats;
+    int query_log;
     TCHDB* attr2id;
-    TCHDB* attrs[MAX_ATTRS];
+    /**
+     * segments are in the order of document IDs. writing is the last of them
+     * while a writer puts documents, until they are committed. Postings of
+     * writing are flushed when they take buffer_size bytes in memory.
+     */
+    struct oSegment** segments;
+    int segments_num;
+    struct oSegment* writing;
+    int next_segment;
+    size_t buffer_size;
+    /**
+     * A writer logs documents to wal if uses_wal is set by oDB_set_wal().
+     */
+    int uses_wal;
+    int wal_sync_docs;
+    int wal_sync_ms;
+    struct oWAL* wal;
+    /**
+     * oDB_commit() merges segments unless defers_merges is set by
+     * oDB_defer_merges(). is_merging is set while a merge is begun.
+     */
+    int defers_merges;
+    int is_merging;
+    struct oDB* owner;
 };
 
 typedef struct oDB oDB;
 
+/**
+ * A span is from where a match begins to where it ends. Positions are
+ * characters of a normalized document, but a word of the hybrid tokenizer
+ * takes one position.
+ */
+struct oSpan {
+    int begin;
+    int end;
+};
+
+typedef struct oSpan oSpan;
+
+/**
+ * spans is NULL, or has the span of the match for each document.
+ */
 struct oHits {
     int num;
+    oSpan* spans;
     o_doc_id_t doc_id[1];
 };
 
@@ -40,17 +154,68 @@ struct oAttr {
 
 typedef struct oAttr oAttr;
 
+/**
+ * A sink receives a document piece by piece. Returning non-zero stops
+ * retrieval.
+ */
+typedef int (*oSink)(const char* s, size_t size, void* arg);
+
+/**
+ * oPut is a document being put piece by piece. It is created by
+ * oDB_put_begin(), and released by oDB_put_end() or oDB_put_abort().
+ */
+typedef struct oPut oPut;
+
+/**
+ * oMerge is a merge of segments. It is created by oDB_merge_begin(), and
+ * released by oDB_merge_end() or oDB_merge_abort(). If oDB_defer_merges() is
+ * called before the database is opened, oDB_merge_run(), which copies the
+ * segments, may run while another thread uses the database. Its message is
+ * set to the database by oDB_merge_abort().
+ */
+typedef struct oMerge oMerge;
+
 int oDB_create(oDB* db, const char* path, const char* attrs[], int attrs_num);
 void oDB_init(oDB* db);
 void oDB_fini(oDB* db);
 int oDB_open_to_read(oDB* db, const char* path);
 int oDB_open_to_write(oDB* db, const char* path);
+int oDB_open_to_share(oDB* db, const char* path);
+int oDB_share(oDB* db, oDB* owner);
+int oDB_commit(oDB* db);
+int oDB_sync(oDB* db);
 int oDB_close(oDB* db);
 int oDB_put(oDB* db, const char* doc, oAttr attrs[], int attrs_num);
+oPut* oDB_put_begin(oDB* db);
+int oDB_put_write(oDB* db, oPut* put, const char* s, size_t size);
+int oDB_put_end(oDB* db, oPut* put, oAttr attrs[], int attrs_num);
+void oDB_put_abort(oDB* db, oPut* put);
+int oDB_merge_begin(oDB* db, oMerge** pmerge);
+int oDB_merge_run(oDB* db, oMerge* merge);
+int oDB_merge_end(oDB* db, oMerge* merge);
+void oDB_merge_abort(oDB* db, oMerge* merge);
 char* oDB_get(oDB* db, o_doc_id_t doc_id);
+char* oDB_get_range(oDB* db, o_doc_id_t doc_id, int offset, int length);
+int oDB_get_to(oDB* db, o_doc_id_t doc_id, int offset, int length, oSink sink, void* arg);
+int oDB_get_to_fd(oDB* db, o_doc_id_t doc_id, int offset, int length, int fd);
 char* oDB_get_attr(oDB* db, o_doc_id_t doc_id, const char* attr);
 int oDB_search(oDB* db, const char* phrase, oHits** hits);
+char* oDB_get_plan(oDB* db, const char* phrase);
+char* oDB_explain(oDB* db, const char* phrase);
+int oDB_open_query_log(oDB* db, const char* path);
+void oHits_delete(oDB* db, oHits* hits);
 void oDB_set_msg_of_errno(oDB* db, const char* msg);
+int oDB_set_doc_format(oDB* db, const char* name);
+int oDB_set_doc_store(oDB* db, const char* name);
+int oDB_set_index_format(oDB* db, const char* name);
+int oDB_set_tokenizer(oDB* db, const char* name);
+int oDB_set_ngram(oDB* db, const char* name);
+int oDB_set_postings(oDB* db, const char* name);
+void oDB_set_buffer_size(oDB* db, size_t size);
+void oDB_set_wal(oDB* db, int sync_docs, int sync_ms);
+void oDB_defer_merges(oDB* db);
+int oDB_set_codec(oDB* db, const char* name);
+int oDB_train_dict(oDB* db, const char* samples[], int samples_num);
 
 #endif
 /**
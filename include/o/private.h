@@ -1,6 +1,7 @@
 #if !defined(O_PRIVATE_INCLUDED)
 #define O_PRIVATE_INCLUDED
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -11,6 +12,9 @@
 enum oNodeType {
     NODE_PHRASE,
     NODE_FUZZY,
+    NODE_REGEX,
+    NODE_WILDCARD,
+    NODE_NEAR,
     NODE_AND,
     NODE_OR,
     NODE_NOT,
@@ -18,8 +22,37 @@ enum oNodeType {
 
 typedef enum oNodeType oNodeType;
 
+/**
+ * Statistics of evaluating a node, which oDB_explain() collects. Counters are
+ * of work of the node itself, but seconds includes its children. detail has a
+ * line for each posting list read.
+ */
+struct oStats {
+    int evaluations;
+    int cached;
+    int terms;
+    int postings;
+    int64_t bytes;
+    int64_t comparisons;
+    int docs;
+    int hits;
+    double seconds;
+    TCXSTR* detail;
+};
+
+typedef struct oStats oStats;
+
+/**
+ * The optimizer shares identical subtrees. refs is the number of parents of a
+ * node, and hits caches the result of a shared node while a query is
+ * evaluated. A NOT node made by the optimizer has only the right operand, and
+ * is an operand of an AND.
+ */
 struct oNode {
     oNodeType type;
+    int refs;
+    oHits* hits;
+    oStats* stats;
     union {
         struct {
             TCXSTR* s;
@@ -28,6 +61,15 @@ struct oNode {
             struct oNode* left;
             struct oNode* right;
         } logical_op;
+        struct {
+            struct oNode** nodes;
+            int nodes_num;
+        } operands;
+        struct {
+            struct oNode* left;
+            struct oNode* right;
+            int distance;
+        } near;
     } u;
 };
 
@@ -51,6 +93,191 @@ typedef int BOOL;
 #define FALSE   (!TRUE)
 
 oNode* oParser_parse(oDB* db, const char* cond);
+void oNode_delete(oNode* node);
+oNode* oNode_alloc(oNodeType type);
+oNode* oNode_join(oNodeType type, oNode* left, oNode* right);
+
+oNode* oPlan_optimize(oNode* node);
+oStats* oStats_new();
+void oStats_delete(oStats* stats);
+void oPlan_dump(oNode* node, TCXSTR* plan);
+
+void oDB_set_msg(oDB* db, const char* msg, const char* reason);
+double oClock_get_seconds();
+
+int oKernel_compress_nums(const int nums[], int num, char* dest);
+int oKernel_decompress_nums(const char* src, int num, int nums[]);
+int oKernel_compress_posting(o_doc_id_t doc_id, int pos[], int pos_num, char* data);
+TCLIST* oKernel_decompress_postings(oDB* db, TCLIST* compressed_posting_list);
+void oKernel_delete_postings(oDB* db, TCLIST* posting_list);
+TCLIST* oKernel_intersect(oDB* db, TCLIST* posting_list1, TCLIST* posting_list2, int gap);
+int oKernel_and(oDB* db, oHits* hits[], int hits_num, oHits** phits);
+int oKernel_or(oDB* db, oHits* hits[], int hits_num, oHits** phits);
+int oKernel_not(oDB* db, oHits* left, oHits* right, oHits** phits);
+
+struct oCodec {
+    const char* name;
+    int dict_size;
+    int (*compress)(oDB* db, const char* src, int size, TCXSTR* dest);
+    int (*decompress)(oDB* db, const char* src, int size, int raw_size, oSink sink, void* arg);
+    void (*fini)(oDB* db);
+    /**
+     * prepare builds data which fini releases, so that handles sharing a
+     * database don't build it lazily at the same time. It can be NULL.
+     */
+    int (*prepare)(oDB* db);
+    /**
+     * Codecs which can compress a document in pieces have stream functions.
+     * The others have NULL for them.
+     */
+    void* (*stream_new)(oDB* db);
+    int (*stream_write)(oDB* db, void* stream, const char* src, int size, BOOL finish, TCXSTR* dest);
+    void (*stream_del)(void* stream);
+};
+
+typedef struct oCodec oCodec;
+
+const oCodec* oCodec_find(const char* name);
+const oCodec* oCodec_default();
+struct oDocLog {
+    int log_fd;
+    int idx_fd;
+    char* log_map;
+    size_t log_map_size;
+    char* idx_map;
+    size_t idx_map_size;
+    uint64_t log_size;
+    /**
+     * A log shared among threads is read under lock, and keeps old maps in
+     * retired until it is closed, because other threads may be reading them.
+     */
+    BOOL is_shared;
+    pthread_mutex_t lock;
+    TCLIST* retired;
+};
+
+typedef struct oDocLog oDocLog;
+
+int oDocLog_create(oDB* db, const char* dir);
+oDocLog* oDocLog_open(oDB* db, const char* dir, BOOL writable);
+int oDocLog_close(oDB* db, oDocLog* log);
+int oDocLog_write(oDB* db, oDocLog* log, size_t pos, const char* data, size_t size);
+int oDocLog_commit(oDB* db, oDocLog* log, o_doc_id_t doc_id, size_t size);
+const char* oDocLog_get(oDB* db, oDocLog* log, o_doc_id_t doc_id, size_t* size);
+int oDocLog_copy(oDB* db, oDocLog* dest, oDocLog* src, o_doc_id_t first_doc_id, o_doc_id_t end_doc_id);
+int oDocLog_sync(oDB* db, oDocLog* log);
+
+/**
+ * A segment has documents from first_doc_id to end_doc_id - 1. dir is where
+ * its files are. The segment being written has postings in memory, which are
+ * searched with index, until they are flushed into it in a row. A value of
+ * postings is postings of a term, each of which follows its size.
+ */
+struct oSegment {
+    char* name;
+    char* dir;
+    o_doc_id_t first_doc_id;
+    o_doc_id_t end_doc_id;
+    TCBDB* index;
+    TCTREE* postings;
+    TCHDB* doc;
+    oDocLog* doc_log;
+    TCHDB* attrs[MAX_ATTRS];
+};
+
+typedef struct oSegment oSegment;
+
+int oSegment_create_manifest(oDB* db, const char* path);
+int oSegment_open_all(oDB* db, BOOL is_shared);
+int oSegment_close_all(oDB* db);
+int oSegment_commit(oDB* db);
+int oSegment_merge_begin(oDB* db, oMerge** pmerge);
+int oSegment_merge_run(oDB* db, oMerge* merge);
+int oSegment_merge_end(oDB* db, oMerge* merge);
+void oSegment_merge_abort(oDB* db, oMerge* merge);
+oSegment* oSegment_find(oDB* db, o_doc_id_t doc_id);
+oSegment* oSegment_get_writing(oDB* db);
+int oSegment_flush(oDB* db, oSegment* segment);
+void oSegment_split_postings(const char* p, int size, TCLIST* list);
+
+/**
+ * written and synced are positions in the write-ahead log. pending is the
+ * number of documents which are not synced, and pending_since is when the
+ * first of them was written. One thread syncs at a time while is_syncing.
+ * end is the size of the file, and record is the offset of the record being
+ * written, whose document size and CRC so far are doc_size and crc. The log
+ * is_broken when a failed record can't be removed.
+ */
+struct oWAL {
+    int fd;
+    uint64_t written;
+    uint64_t synced;
+    BOOL is_syncing;
+    int sync_docs;
+    int sync_ms;
+    int pending;
+    double pending_since;
+    off_t end;
+    off_t record;
+    uint64_t doc_size;
+    uint32_t crc;
+    BOOL is_broken;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+typedef struct oWAL oWAL;
+typedef int (*oWALReplayer)(oDB* db, o_doc_id_t doc_id, oAttr attrs[], int attrs_num, const char* doc, size_t size);
+
+oWAL* oWAL_open(oDB* db, int sync_docs, int sync_ms);
+int oWAL_close(oDB* db, oWAL* wal);
+int oWAL_begin(oDB* db, oWAL* wal, o_doc_id_t doc_id);
+int oWAL_write(oDB* db, oWAL* wal, const char* s, size_t size);
+int oWAL_end(oDB* db, oWAL* wal, oAttr attrs[], int attrs_num);
+void oWAL_abort(oDB* db, oWAL* wal);
+int oWAL_sync(oDB* db, oWAL* wal);
+int oWAL_truncate(oDB* db, oWAL* wal);
+int oWAL_replay(oDB* db, oWALReplayer replay, int* replayed);
+
+/**
+ * oNormalizer normalizes a document piece by piece. A piece can end in the
+ * middle of a character.
+ */
+struct oNormalizer {
+    const uint8_t* classes;
+    BOOL is_prev_alpha;
+    BOOL has_space;
+    int kana;
+    char partial[3];
+    int partial_size;
+};
+
+typedef struct oNormalizer oNormalizer;
+
+/**
+ * What oNormalizer keeps from the previous piece is written with the next
+ * piece, so dest needs this margin more than a piece.
+ */
+#define NORMALIZE_MARGIN    16
+
+void oNormalizer_init(oNormalizer* normalizer, oTokenizerType tokenizer);
+size_t oNormalizer_normalize(oNormalizer* normalizer, char* dest, const char* src, size_t size);
+size_t oNormalizer_finish(oNormalizer* normalizer, char* dest);
+void oNormalize(char* dest, const char* src, oTokenizerType tokenizer);
+int oNormalize_lower(int codepoint);
+
+size_t oUTF8_scan(const char* s, size_t size, uint32_t* offsets);
+size_t oUTF8_count(const char* s, size_t size);
+const char* oUTF8_find(const char* s, size_t size, const char* needle, size_t needle_size);
+
+typedef struct oRegex oRegex;
+
+oRegex* oRegex_new(oDB* db, const char* pattern);
+void oRegex_delete(oRegex* regex);
+BOOL oRegex_match(oRegex* regex, const char* s);
+int oRegex_make_filter(oDB* db, const char* pattern, oNode** filter);
+
+int oCodec_train(oDB* db, const oCodec* codec, const char* samples[], const int sizes[], int samples_num, TCXSTR* dict);
 
 #endif
 /**
@@ -0,0 +1,740 @@
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "tcutil.h"
+#include "o.h"
+#include "o/private.h"
+
+/**
+ * o-bench makes a database of a synthetic corpus, and measures indexing and
+ * searching it. Results are printed as "name<TAB>value" lines, so that two
+ * runs can be compared by a script.
+ */
+
+struct Config {
+    int docs;
+    int doc_size;
+    int ja_percent;
+    int vocab_size;
+    double zipf;
+    uint64_t seed;
+    int queries;
+    int threads;
+};
+
+typedef struct Config Config;
+
+/**
+ * xorshift64*. A corpus must be the same on every platform for a seed, so
+ * rand() is not used.
+ */
+struct Random {
+    uint64_t state;
+};
+
+typedef struct Random Random;
+
+static void
+Random_init(Random* random, uint64_t seed)
+{
+    random->state = seed == 0 ? 0x9e3779b97f4a7c15ULL : seed;
+}
+
+static uint64_t
+Random_next(Random* random)
+{
+    uint64_t x = random->state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    random->state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static int
+Random_range(Random* random, int n)
+{
+    return (int)(Random_next(random) % (uint64_t)n);
+}
+
+static double
+Random_double(Random* random)
+{
+    return (Random_next(random) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Ranks are drawn with probabilities in proportion to 1 / rank ** s.
+ */
+struct Zipf {
+    int n;
+    double* cdf;
+};
+
+typedef struct Zipf Zipf;
+
+static void
+Zipf_init(Zipf* zipf, int n, double s)
+{
+    zipf->n = n;
+    zipf->cdf = (double*)tcmalloc(sizeof(zipf->cdf[0]) * n);
+    double sum = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        sum += 1.0 / pow(i + 1, s);
+        zipf->cdf[i] = sum;
+    }
+}
+
+static void
+Zipf_fini(Zipf* zipf)
+{
+    free(zipf->cdf);
+}
+
+static int
+Zipf_draw(Zipf* zipf, Random* random)
+{
+    double u = Random_double(random) * zipf->cdf[zipf->n - 1];
+    int low = 0;
+    int high = zipf->n - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (zipf->cdf[mid] <= u) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * Japanese words are made of characters drawn in Zipf's law too, so that both
+ * words and the bigrams in them have skewed frequencies like real text.
+ */
+#define HIRAGANA_BEGIN  0x3042
+#define HIRAGANA_NUM    82
+#define KANJI_BEGIN     0x4e00
+#define KANJI_NUM       2000
+
+struct Corpus {
+    Random random;
+    int ja_percent;
+    TCLIST* en_words;
+    TCLIST* ja_words;
+    Zipf words;
+};
+
+typedef struct Corpus Corpus;
+
+static void
+append_char(TCXSTR* s, int c)
+{
+    char buf[3] = {
+        (char)(0xe0 | (c >> 12)),
+        (char)(0x80 | ((c >> 6) & 0x3f)),
+        (char)(0x80 | (c & 0x3f)) };
+    tcxstrcat(s, buf, array_sizeof(buf));
+}
+
+static int
+get_ja_char(int rank)
+{
+    /**
+     * Frequent characters alternate between hiragana and kanji, as particles
+     * and common kanji are the most frequent in Japanese.
+     */
+    if (2 * HIRAGANA_NUM <= rank) {
+        return KANJI_BEGIN + rank - HIRAGANA_NUM;
+    }
+    return (rank % 2 == 0 ? HIRAGANA_BEGIN : KANJI_BEGIN) + rank / 2;
+}
+
+static void
+make_words(Corpus* corpus, int vocab_size, double s)
+{
+    Random* random = &corpus->random;
+    Zipf chars;
+    Zipf_init(&chars, HIRAGANA_NUM + KANJI_NUM, s);
+    TCXSTR* word = tcxstrnew();
+    int i;
+    for (i = 0; i < vocab_size; i++) {
+        tcxstrclear(word);
+        int size = 2 + Random_range(random, 8);
+        int j;
+        for (j = 0; j < size; j++) {
+            char c = 'a' + Random_range(random, 26);
+            tcxstrcat(word, &c, 1);
+        }
+        tclistpush(corpus->en_words, tcxstrptr(word), tcxstrsize(word));
+
+        tcxstrclear(word);
+        size = 1 + Random_range(random, 3);
+        for (j = 0; j < size; j++) {
+            append_char(word, get_ja_char(Zipf_draw(&chars, random)));
+        }
+        tclistpush(corpus->ja_words, tcxstrptr(word), tcxstrsize(word));
+    }
+    tcxstrdel(word);
+    Zipf_fini(&chars);
+}
+
+static void
+Corpus_init(Corpus* corpus, const Config* config)
+{
+    Random_init(&corpus->random, config->seed);
+    corpus->ja_percent = config->ja_percent;
+    corpus->en_words = tclistnew2(config->vocab_size);
+    corpus->ja_words = tclistnew2(config->vocab_size);
+    make_words(corpus, config->vocab_size, config->zipf);
+    Zipf_init(&corpus->words, config->vocab_size, config->zipf);
+}
+
+static void
+Corpus_fini(Corpus* corpus)
+{
+    Zipf_fini(&corpus->words);
+    tclistdel(corpus->ja_words);
+    tclistdel(corpus->en_words);
+}
+
+static BOOL
+draw_ja(Corpus* corpus)
+{
+    return Random_range(&corpus->random, 100) < corpus->ja_percent;
+}
+
+static const char*
+draw_word(Corpus* corpus, BOOL ja)
+{
+    int rank = Zipf_draw(&corpus->words, &corpus->random);
+    return tclistval2(ja ? corpus->ja_words : corpus->en_words, rank);
+}
+
+/**
+ * Appends a sentence of 4 to 15 words. English words are separated with
+ * spaces, and Japanese ones are not.
+ */
+static void
+append_sentence(Corpus* corpus, TCXSTR* doc)
+{
+    BOOL ja = draw_ja(corpus);
+    int words_num = 4 + Random_range(&corpus->random, 12);
+    int i;
+    for (i = 0; i < words_num; i++) {
+        if (!ja && (0 < i)) {
+            tcxstrcat2(doc, " ");
+        }
+        tcxstrcat2(doc, draw_word(corpus, ja));
+    }
+    tcxstrcat2(doc, ja ? "。" : ". ");
+}
+
+/**
+ * Sizes of documents are from a half to one and a half of size.
+ */
+static void
+make_doc(Corpus* corpus, int size, TCXSTR* doc)
+{
+    tcxstrclear(doc);
+    int target = size / 2 + Random_range(&corpus->random, size + 1);
+    while (tcxstrsize(doc) < target) {
+        append_sentence(corpus, doc);
+    }
+}
+
+static void
+print_error(const char* msg, const char* reason)
+{
+    if (reason[0] == '\0') {
+        fprintf(stderr, "%s\n", msg);
+        return;
+    }
+    fprintf(stderr, "%s - %s\n", msg, reason);
+}
+
+static void
+print_int(const char* name, long long val)
+{
+    printf("%s\t%lld\n", name, val);
+}
+
+static void
+print_double(const char* name, double val)
+{
+    printf("%s\t%.3f\n", name, val);
+}
+
+static int
+ingest(oDB* db, const char* path, const Config* config, Corpus* corpus)
+{
+    if (oDB_create(db, path, NULL, 0) != 0) {
+        print_error("Can't create database", db->msg);
+        return 1;
+    }
+    double begin = oClock_get_seconds();
+    if (oDB_open_to_write(db, path) != 0) {
+        print_error("Can't open database to write", db->msg);
+        return 1;
+    }
+    TCXSTR* doc = tcxstrnew();
+    long long bytes = 0;
+    int i;
+    for (i = 0; i < config->docs; i++) {
+        make_doc(corpus, config->doc_size, doc);
+        if (oDB_put(db, tcxstrptr(doc), NULL, 0) != 0) {
+            print_error("Can't put document", db->msg);
+            tcxstrdel(doc);
+            oDB_close(db);
+            return 1;
+        }
+        bytes += tcxstrsize(doc);
+    }
+    tcxstrdel(doc);
+    if (oDB_close(db) != 0) {
+        print_error("Can't close database", db->msg);
+        return 1;
+    }
+    double seconds = oClock_get_seconds() - begin;
+
+    print_int("ingest.docs", config->docs);
+    print_int("ingest.bytes", bytes);
+    print_double("ingest.seconds", seconds);
+    print_double("ingest.docs_per_sec", config->docs / seconds);
+    print_double("ingest.mb_per_sec", bytes / seconds / (1024 * 1024));
+    return 0;
+}
+
+/**
+ * Sums sizes of files named name, or all files if name is NULL, under path.
+ * Each segment of a database has its own index.
+ */
+static long long
+get_dir_size(const char* path, const char* name)
+{
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+    long long size = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) {
+            continue;
+        }
+        char child[PATH_MAX];
+        snprintf(child, array_sizeof(child), "%s/%s", path, entry->d_name);
+        struct stat st;
+        if (stat(child, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            size += get_dir_size(child, name);
+        }
+        else if ((name == NULL) || (strcmp(entry->d_name, name) == 0)) {
+            size += st.st_size;
+        }
+    }
+    closedir(dir);
+    return size;
+}
+
+static void
+print_size(const char* path)
+{
+    print_int("size.index_bytes", get_dir_size(path, "index.tcb"));
+    print_int("size.db_bytes", get_dir_size(path, NULL));
+}
+
+enum QueryType {
+    QUERY_PHRASE,
+    QUERY_FUZZY,
+    QUERY_AND,
+    QUERY_OR,
+    QUERY_NOT,
+};
+
+typedef enum QueryType QueryType;
+
+static const char* query_names[] = { "phrase", "fuzzy", "and", "or", "not" };
+
+/**
+ * A phrase is two words of a language. English ones are quoted, because a
+ * space between them means AND.
+ */
+static void
+append_phrase(Corpus* corpus, TCXSTR* query)
+{
+    BOOL ja = draw_ja(corpus);
+    const char* first = draw_word(corpus, ja);
+    const char* second = draw_word(corpus, ja);
+    if (ja) {
+        tcxstrprintf(query, "%s%s", first, second);
+        return;
+    }
+    tcxstrprintf(query, "\"%s %s\"", first, second);
+}
+
+/**
+ * Operands of boolean queries are single words, which match more documents
+ * than phrases do.
+ */
+static void
+make_query(Corpus* corpus, QueryType type, TCXSTR* query)
+{
+    tcxstrclear(query);
+    switch (type) {
+    case QUERY_PHRASE:
+        append_phrase(corpus, query);
+        break;
+    case QUERY_FUZZY:
+        {
+            BOOL ja = draw_ja(corpus);
+            tcxstrprintf(query, "%s?", draw_word(corpus, ja));
+        }
+        break;
+    case QUERY_AND:
+    case QUERY_OR:
+    case QUERY_NOT:
+        {
+            const char* ops[] = { " ", " OR ", " NOT " };
+            BOOL ja = draw_ja(corpus);
+            const char* left = draw_word(corpus, ja);
+            const char* right = draw_word(corpus, ja);
+            tcxstrprintf(query, "%s%s%s", left, ops[type - QUERY_AND], right);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static int
+compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : (y < x ? 1 : 0);
+}
+
+static double
+get_percentile(const double* sorted, int n, int percent)
+{
+    return sorted[(long long)(n - 1) * percent / 100];
+}
+
+static int
+run_queries(oDB* db, const Config* config, Corpus* corpus, QueryType type)
+{
+    int n = config->queries;
+    double* latencies = (double*)tcmalloc(sizeof(latencies[0]) * n);
+    TCXSTR* query = tcxstrnew();
+    long long hits_num = 0;
+    double total = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        make_query(corpus, type, query);
+        double begin = oClock_get_seconds();
+        oHits* hits = NULL;
+        if (oDB_search(db, tcxstrptr(query), &hits) != 0) {
+            print_error("Can't search document", db->msg);
+            tcxstrdel(query);
+            free(latencies);
+            return 1;
+        }
+        latencies[i] = oClock_get_seconds() - begin;
+        total += latencies[i];
+        hits_num += hits->num;
+        oHits_delete(db, hits);
+    }
+    tcxstrdel(query);
+    qsort(latencies, n, sizeof(latencies[0]), compare_doubles);
+
+    const char* name = query_names[type];
+    char key[64];
+    snprintf(key, array_sizeof(key), "%s.queries", name);
+    print_int(key, n);
+    snprintf(key, array_sizeof(key), "%s.hits_per_query", name);
+    print_double(key, (double)hits_num / n);
+    snprintf(key, array_sizeof(key), "%s.p50_ms", name);
+    print_double(key, get_percentile(latencies, n, 50) * 1000);
+    snprintf(key, array_sizeof(key), "%s.p99_ms", name);
+    print_double(key, get_percentile(latencies, n, 99) * 1000);
+    snprintf(key, array_sizeof(key), "%s.qps", name);
+    print_double(key, 0 < total ? n / total : 0);
+    free(latencies);
+    return 0;
+}
+
+static int
+search(oDB* db, const char* path, const Config* config, Corpus* corpus)
+{
+    if (oDB_open_to_read(db, path) != 0) {
+        print_error("Can't open database to read", db->msg);
+        return 1;
+    }
+    QueryType type;
+    for (type = QUERY_PHRASE; type <= QUERY_NOT; type++) {
+        if (run_queries(db, config, corpus, type) != 0) {
+            oDB_close(db);
+            return 1;
+        }
+    }
+    if (oDB_close(db) != 0) {
+        print_error("Can't close database", db->msg);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Threads search the same queries with their own handles on a database opened
+ * by oDB_open_to_share(), starting at different queries.
+ */
+struct Searcher {
+    oDB db;
+    TCLIST* queries;
+    int first;
+    int status;
+    pthread_t thread;
+};
+
+typedef struct Searcher Searcher;
+
+static void*
+run_searcher(void* arg)
+{
+    Searcher* searcher = (Searcher*)arg;
+    int n = tclistnum(searcher->queries);
+    int i;
+    for (i = 0; i < n; i++) {
+        const char* query = tclistval2(searcher->queries, (searcher->first + i) % n);
+        oHits* hits = NULL;
+        if (oDB_search(&searcher->db, query, &hits) != 0) {
+            searcher->status = 1;
+            return NULL;
+        }
+        oHits_delete(&searcher->db, hits);
+    }
+    return NULL;
+}
+
+static int
+run_threads(oDB* db, TCLIST* queries, int threads_num)
+{
+    Searcher* searchers = (Searcher*)tcmalloc(sizeof(searchers[0]) * threads_num);
+    int status = 0;
+    int started = 0;
+    double begin = oClock_get_seconds();
+    for (; started < threads_num; started++) {
+        Searcher* searcher = &searchers[started];
+        oDB_init(&searcher->db);
+        searcher->queries = queries;
+        searcher->first = tclistnum(queries) * started / threads_num;
+        searcher->status = 0;
+        if ((oDB_share(&searcher->db, db) != 0) || (pthread_create(&searcher->thread, NULL, run_searcher, searcher) != 0)) {
+            print_error("Can't start thread", searcher->db.msg);
+            oDB_fini(&searcher->db);
+            status = 1;
+            break;
+        }
+    }
+    int i;
+    for (i = 0; i < started; i++) {
+        pthread_join(searchers[i].thread, NULL);
+        if (searchers[i].status != 0) {
+            print_error("Can't search document", searchers[i].db.msg);
+            status = 1;
+        }
+        oDB_close(&searchers[i].db);
+        oDB_fini(&searchers[i].db);
+    }
+    double seconds = oClock_get_seconds() - begin;
+    free(searchers);
+    if (status != 0) {
+        return 1;
+    }
+    char key[64];
+    snprintf(key, array_sizeof(key), "threads.%d.qps", threads_num);
+    print_double(key, 0 < seconds ? tclistnum(queries) * threads_num / seconds : 0);
+    return 0;
+}
+
+/**
+ * Throughput is measured on 1, 2, 4, ... threads up to config->threads, with
+ * queries of all kinds.
+ */
+static int
+search_in_threads(oDB* db, const char* path, const Config* config, Corpus* corpus)
+{
+    if (oDB_open_to_share(db, path) != 0) {
+        print_error("Can't open database to share", db->msg);
+        return 1;
+    }
+    TCLIST* queries = tclistnew();
+    TCXSTR* query = tcxstrnew();
+    int i;
+    for (i = 0; i < config->queries; i++) {
+        make_query(corpus, i % (QUERY_NOT + 1), query);
+        tclistpush(queries, tcxstrptr(query), tcxstrsize(query));
+    }
+    tcxstrdel(query);
+    int n = 1;
+    int status;
+    while (((status = run_threads(db, queries, n)) == 0) && (n < config->threads)) {
+        n = n * 2 < config->threads ? n * 2 : config->threads;
+    }
+    tclistdel(queries);
+    if (oDB_close(db) != 0) {
+        print_error("Can't close database", db->msg);
+        return 1;
+    }
+    return status;
+}
+
+static void
+usage()
+{
+    printf("usage:\n");
+    printf("  o-bench [--docs=n] [--doc-size=bytes] [--ja=percent] [--vocab=n] [--zipf=s] [--seed=n] [--queries=n] [--threads=n] [--doc-store=hash|log] [--codec=zlib|lz4|zstd] [--index-format=text|packed] [--tokenizer=bigram|hybrid] [--ngram=2|1+2|3] [--postings=positions|docs] db\n");
+}
+
+static int
+set_option(oDB* db, int opt, const char* arg)
+{
+    int (*setters[])(oDB*, const char*) = {
+        oDB_set_doc_store,
+        oDB_set_codec,
+        oDB_set_index_format,
+        oDB_set_tokenizer,
+        oDB_set_ngram,
+        oDB_set_postings };
+    if (setters[opt - 'D'](db, arg) != 0) {
+        print_error("Can't create database", db->msg);
+        return 1;
+    }
+    return 0;
+}
+
+static int
+bench(oDB* db, int argc, char* argv[])
+{
+    Config config = {
+        .docs = 10000,
+        .doc_size = 1024,
+        .ja_percent = 50,
+        .vocab_size = 5000,
+        .zipf = 1.0,
+        .seed = 1,
+        .queries = 1000,
+        .threads = 0 };
+    /**
+     * Options to create a database are 'D' and the following letters, in the
+     * order of setters in set_option().
+     */
+    struct option options[] = {
+        { "docs", required_argument, NULL, 'n' },
+        { "doc-size", required_argument, NULL, 's' },
+        { "ja", required_argument, NULL, 'j' },
+        { "vocab", required_argument, NULL, 'v' },
+        { "zipf", required_argument, NULL, 'z' },
+        { "seed", required_argument, NULL, 'r' },
+        { "queries", required_argument, NULL, 'q' },
+        { "threads", required_argument, NULL, 't' },
+        { "doc-store", required_argument, NULL, 'D' },
+        { "codec", required_argument, NULL, 'E' },
+        { "index-format", required_argument, NULL, 'F' },
+        { "tokenizer", required_argument, NULL, 'G' },
+        { "ngram", required_argument, NULL, 'H' },
+        { "postings", required_argument, NULL, 'I' },
+        { 0, 0, 0, 0 } };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            config.docs = atoi(optarg);
+            break;
+        case 's':
+            config.doc_size = atoi(optarg);
+            break;
+        case 'j':
+            config.ja_percent = atoi(optarg);
+            break;
+        case 'v':
+            config.vocab_size = atoi(optarg);
+            break;
+        case 'z':
+            config.zipf = atof(optarg);
+            break;
+        case 'r':
+            config.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'q':
+            config.queries = atoi(optarg);
+            break;
+        case 't':
+            config.threads = atoi(optarg);
+            break;
+        case 'D':
+        case 'E':
+        case 'F':
+        case 'G':
+        case 'H':
+        case 'I':
+            if (set_option(db, opt, optarg) != 0) {
+                return 1;
+            }
+            break;
+        case '?':
+        default:
+            usage();
+            return 1;
+            break;
+        }
+    }
+    if ((argc <= optind) || (config.docs < 0) || (config.doc_size < 1) || (config.vocab_size < 1) || (config.queries < 1) || (config.threads < 0)) {
+        usage();
+        return 1;
+    }
+    const char* path = argv[optind];
+
+    Corpus corpus;
+    Corpus_init(&corpus, &config);
+    int status = ingest(db, path, &config, &corpus);
+    if (status == 0) {
+        print_size(path);
+        status = search(db, path, &config, &corpus);
+    }
+    if ((status == 0) && (0 < config.threads)) {
+        status = search_in_threads(db, path, &config, &corpus);
+    }
+    Corpus_fini(&corpus);
+    return status;
+}
+
+int
+main(int argc, char* argv[])
+{
+    oDB db;
+    oDB_init(&db);
+    int status = bench(&db, argc, argv);
+    oDB_fini(&db);
+
+    return status;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,536 @@
+#define _GNU_SOURCE
+#if defined(HAVE_CONFIG_H)
+#   include "o/config.h"
+#endif
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#if defined(HAVE_LZ4_H) && defined(HAVE_LIBLZ4)
+#   define USE_LZ4
+#   include <lz4.h>
+#endif
+#if defined(HAVE_ZSTD_H) && defined(HAVE_ZDICT_H) && defined(HAVE_LIBZSTD)
+#   define USE_ZSTD
+#   include <zdict.h>
+#   include <zstd.h>
+#endif
+#include "tcutil.h"
+#include "o.h"
+#include "o/private.h"
+
+/**
+ * zlib keeps only the last 32KB of a preset dictionary.
+ */
+#define ZLIB_DICT_SIZE  (32 * 1024)
+#define LZ4_DICT_SIZE   (64 * 1024)
+#define ZSTD_DICT_SIZE  (64 * 1024)
+
+/**
+ * A deflate stream compresses a document in pieces. Compressed bytes are
+ * appended to dest as they are produced.
+ */
+static void*
+zlib_stream_new(oDB* db)
+{
+    z_stream* z = (z_stream*)malloc(sizeof(z_stream));
+    if (z == NULL) {
+        oDB_set_msg_of_errno(db, "malloc failed");
+        return NULL;
+    }
+    z->zalloc = Z_NULL;
+    z->zfree = Z_NULL;
+    z->opaque = Z_NULL;
+    if (deflateInit(z, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        oDB_set_msg(db, "deflateInit failed", z->msg);
+        free(z);
+        return NULL;
+    }
+    if (db->dict != NULL) {
+        if (deflateSetDictionary(z, (Bytef*)db->dict, db->dict_size) != Z_OK) {
+            oDB_set_msg(db, "deflateSetDictionary failed", z->msg);
+            deflateEnd(z);
+            free(z);
+            return NULL;
+        }
+    }
+    return z;
+}
+
+static int
+zlib_stream_write(oDB* db, void* stream, const char* src, int size, BOOL finish, TCXSTR* dest)
+{
+    z_stream* z = (z_stream*)stream;
+    z->avail_in = size;
+    z->next_in = (Bytef*)src;
+#define CONCAT  tcxstrcat(dest, out_buf, sizeof(out_buf) - z->avail_out)
+    while (0 < z->avail_in) {
+        char out_buf[1024];
+        z->next_out = (Bytef*)out_buf;
+        z->avail_out = sizeof(out_buf);
+        if (deflate(z, Z_NO_FLUSH) != Z_OK) {
+            oDB_set_msg(db, "deflate failed for Z_NO_FLUSH", z->msg);
+            return 1;
+        }
+        CONCAT;
+    }
+    while (finish) {
+        char out_buf[1024];
+        z->next_out = (Bytef*)out_buf;
+        z->avail_out = sizeof(out_buf);
+        int retval = deflate(z, Z_FINISH);
+        if (retval == Z_STREAM_END) {
+            CONCAT;
+            break;
+        }
+        if (retval != Z_OK) {
+            oDB_set_msg(db, "deflate failed for Z_FINISH", z->msg);
+            return 1;
+        }
+        CONCAT;
+    }
+#undef CONCAT
+    return 0;
+}
+
+static void
+zlib_stream_del(void* stream)
+{
+    z_stream* z = (z_stream*)stream;
+    deflateEnd(z);
+    free(z);
+}
+
+static int
+zlib_compress(oDB* db, const char* src, int size, TCXSTR* dest)
+{
+    void* stream = zlib_stream_new(db);
+    if (stream == NULL) {
+        return 1;
+    }
+    int status = zlib_stream_write(db, stream, src, size, TRUE, dest);
+    zlib_stream_del(stream);
+    return status;
+}
+
+/**
+ * Decompressors write into a buffer of this size and pass it to a sink, so
+ * memory usage does not depend on document size.
+ */
+#define SINK_BUFFER_SIZE    (16 * 1024)
+
+static int
+zlib_decompress(oDB* db, const char* src, int size, int raw_size, oSink sink, void* arg)
+{
+    z_stream z;
+    z.zalloc = Z_NULL;
+    z.zfree = Z_NULL;
+    z.opaque = Z_NULL;
+    z.next_in = Z_NULL;
+    z.avail_in = 0;
+    if (inflateInit(&z) != Z_OK) {
+        oDB_set_msg(db, "inflateInit failed", z.msg);
+        return 1;
+    }
+
+    /**
+     * inflate() can consume all input before it writes all output, so this
+     * loop stops only at the end of the stream.
+     */
+    z.avail_in = size;
+    z.next_in = (Bytef*)src;
+    while (1) {
+#define FLUSH   sink(buf, sizeof(buf) - z.avail_out, arg)
+        char buf[SINK_BUFFER_SIZE];
+        z.next_out = (Bytef*)buf;
+        z.avail_out = sizeof(buf);
+        int retval = inflate(&z, Z_NO_FLUSH);
+        if ((retval == Z_NEED_DICT) && (db->dict != NULL)) {
+            retval = inflateSetDictionary(&z, (Bytef*)db->dict, db->dict_size);
+            if (retval == Z_OK) {
+                continue;
+            }
+        }
+        if (retval == Z_STREAM_END) {
+            if (FLUSH != 0) {
+                inflateEnd(&z);
+                return 1;
+            }
+            break;
+        }
+        if ((retval != Z_OK) || (FLUSH != 0)) {
+            oDB_set_msg(db, "inflate failed", z.msg);
+            inflateEnd(&z);
+            return 1;
+        }
+#undef FLUSH
+    }
+
+    if (inflateEnd(&z) != Z_OK) {
+        oDB_set_msg(db, "inflateEnd failed", z.msg);
+        return 1;
+    }
+    return 0;
+}
+
+#if defined(USE_LZ4)
+static int
+lz4_compress(oDB* db, const char* src, int size, TCXSTR* dest)
+{
+    int capacity = LZ4_compressBound(size);
+    char* buf = (char*)malloc(capacity);
+    if (buf == NULL) {
+        oDB_set_msg_of_errno(db, "malloc failed");
+        return 1;
+    }
+    LZ4_stream_t* stream = LZ4_createStream();
+    if (stream == NULL) {
+        oDB_set_msg(db, "LZ4_createStream failed", NULL);
+        free(buf);
+        return 1;
+    }
+    if (db->dict != NULL) {
+        LZ4_loadDict(stream, db->dict, db->dict_size);
+    }
+    int compressed_size = LZ4_compress_fast_continue(stream, src, buf, size, capacity, 1);
+    LZ4_freeStream(stream);
+    if (compressed_size <= 0) {
+        oDB_set_msg(db, "LZ4_compress_fast_continue failed", NULL);
+        free(buf);
+        return 1;
+    }
+    tcxstrcat(dest, buf, compressed_size);
+    free(buf);
+    return 0;
+}
+
+/**
+ * The LZ4 block format cannot be decompressed partially, so LZ4 needs a
+ * buffer of a whole block.
+ */
+static int
+lz4_decompress(oDB* db, const char* src, int size, int raw_size, oSink sink, void* arg)
+{
+    char* buf = (char*)malloc(raw_size + 1);
+    if (buf == NULL) {
+        oDB_set_msg_of_errno(db, "malloc failed");
+        return 1;
+    }
+    int n;
+    if (db->dict != NULL) {
+        n = LZ4_decompress_safe_usingDict(src, buf, size, raw_size, db->dict, db->dict_size);
+    }
+    else {
+        n = LZ4_decompress_safe(src, buf, size, raw_size);
+    }
+    if (n != raw_size) {
+        oDB_set_msg(db, "LZ4_decompress_safe failed", NULL);
+        free(buf);
+        return 1;
+    }
+    int status = sink(buf, n, arg);
+    free(buf);
+    return status;
+}
+#endif
+
+#if defined(USE_ZSTD)
+/**
+ * Digested dictionaries are expensive to build, so they are built at the first
+ * use and kept until oDB_fini(). A ZSTD_DDict can be shared among threads.
+ */
+struct ZstdDicts {
+    ZSTD_CDict* cdict;
+    ZSTD_DDict* ddict;
+};
+
+typedef struct ZstdDicts ZstdDicts;
+
+static ZstdDicts*
+get_zstd_dicts(oDB* db)
+{
+    if (db->codec_data != NULL) {
+        return (ZstdDicts*)db->codec_data;
+    }
+    ZstdDicts* dicts = (ZstdDicts*)malloc(sizeof(ZstdDicts));
+    if (dicts == NULL) {
+        oDB_set_msg_of_errno(db, "malloc failed");
+        return NULL;
+    }
+    dicts->cdict = ZSTD_createCDict(db->dict, db->dict_size, ZSTD_CLEVEL_DEFAULT);
+    dicts->ddict = ZSTD_createDDict(db->dict, db->dict_size);
+    if ((dicts->cdict == NULL) || (dicts->ddict == NULL)) {
+        oDB_set_msg(db, "Can't digest dictionary", NULL);
+        ZSTD_freeCDict(dicts->cdict);
+        ZSTD_freeDDict(dicts->ddict);
+        free(dicts);
+        return NULL;
+    }
+    db->codec_data = dicts;
+    return dicts;
+}
+
+static void
+zstd_fini(oDB* db)
+{
+    ZstdDicts* dicts = (ZstdDicts*)db->codec_data;
+    if (dicts == NULL) {
+        return;
+    }
+    ZSTD_freeCDict(dicts->cdict);
+    ZSTD_freeDDict(dicts->ddict);
+    free(dicts);
+    db->codec_data = NULL;
+}
+
+static int
+zstd_prepare(oDB* db)
+{
+    if (db->dict == NULL) {
+        return 0;
+    }
+    return get_zstd_dicts(db) != NULL ? 0 : 1;
+}
+
+static int
+zstd_compress(oDB* db, const char* src, int size, TCXSTR* dest)
+{
+    size_t capacity = ZSTD_compressBound(size);
+    char* buf = (char*)malloc(capacity);
+    if (buf == NULL) {
+        oDB_set_msg_of_errno(db, "malloc failed");
+        return 1;
+    }
+    ZSTD_CCtx* ctx = ZSTD_createCCtx();
+    if (ctx == NULL) {
+        oDB_set_msg(db, "ZSTD_createCCtx failed", NULL);
+        free(buf);
+        return 1;
+    }
+    size_t compressed_size;
+    if (db->dict != NULL) {
+        ZstdDicts* dicts = get_zstd_dicts(db);
+        if (dicts == NULL) {
+            ZSTD_freeCCtx(ctx);
+            free(buf);
+            return 1;
+        }
+        compressed_size = ZSTD_compress_usingCDict(ctx, buf, capacity, src, size, dicts->cdict);
+    }
+    else {
+        compressed_size = ZSTD_compressCCtx(ctx, buf, capacity, src, size, ZSTD_CLEVEL_DEFAULT);
+    }
+    ZSTD_freeCCtx(ctx);
+    if (ZSTD_isError(compressed_size)) {
+        oDB_set_msg(db, "ZSTD_compress failed", ZSTD_getErrorName(compressed_size));
+        free(buf);
+        return 1;
+    }
+    tcxstrcat(dest, buf, compressed_size);
+    free(buf);
+    return 0;
+}
+
+static int
+zstd_decompress(oDB* db, const char* src, int size, int raw_size, oSink sink, void* arg)
+{
+    ZSTD_DCtx* ctx = ZSTD_createDCtx();
+    if (ctx == NULL) {
+        oDB_set_msg(db, "ZSTD_createDCtx failed", NULL);
+        return 1;
+    }
+    if (db->dict != NULL) {
+        ZstdDicts* dicts = get_zstd_dicts(db);
+        if (dicts == NULL) {
+            ZSTD_freeDCtx(ctx);
+            return 1;
+        }
+        ZSTD_DCtx_refDDict(ctx, dicts->ddict);
+    }
+    ZSTD_inBuffer in = { src, size, 0 };
+    size_t retval = 1;
+    while (retval != 0) {
+        char buf[SINK_BUFFER_SIZE];
+        ZSTD_outBuffer out = { buf, sizeof(buf), 0 };
+        retval = ZSTD_decompressStream(ctx, &out, &in);
+        if (ZSTD_isError(retval)) {
+            oDB_set_msg(db, "ZSTD_decompressStream failed", ZSTD_getErrorName(retval));
+            ZSTD_freeDCtx(ctx);
+            return 1;
+        }
+        if ((0 < out.pos) && (sink(buf, out.pos, arg) != 0)) {
+            ZSTD_freeDCtx(ctx);
+            return 1;
+        }
+        if ((retval != 0) && (in.pos == in.size) && (out.pos < out.size)) {
+            oDB_set_msg(db, "ZSTD_decompressStream failed", "truncated frame");
+            ZSTD_freeDCtx(ctx);
+            return 1;
+        }
+    }
+    ZSTD_freeDCtx(ctx);
+    return 0;
+}
+#endif
+
+static const oCodec codecs[] = {
+    {
+        "zlib", ZLIB_DICT_SIZE, zlib_compress, zlib_decompress, NULL, NULL,
+        zlib_stream_new, zlib_stream_write, zlib_stream_del },
+#if defined(USE_LZ4)
+    {
+        "lz4", LZ4_DICT_SIZE, lz4_compress, lz4_decompress, NULL, NULL,
+        NULL, NULL, NULL },
+#endif
+#if defined(USE_ZSTD)
+    {
+        "zstd", ZSTD_DICT_SIZE, zstd_compress, zstd_decompress, zstd_fini, zstd_prepare,
+        NULL, NULL, NULL },
+#endif
+};
+
+const oCodec*
+oCodec_find(const char* name)
+{
+    int i;
+    for (i = 0; i < array_sizeof(codecs); i++) {
+        if (strcmp(codecs[i].name, name) == 0) {
+            return &codecs[i];
+        }
+    }
+    return NULL;
+}
+
+const oCodec*
+oCodec_default()
+{
+    return &codecs[0];
+}
+
+/**
+ * This dictionary builder is used for codecs which have no trainer. It picks
+ * 8 bytes sequences which appear repeatedly in samples, and places them so that
+ * the most frequent ones come last. Deflate and LZ4 reach the end of a dictionary
+ * with the shortest distances.
+ */
+#define GRAM_SIZE   8
+
+struct Gram {
+    const char* s;
+    int tf;
+};
+
+typedef struct Gram Gram;
+
+static int
+compare_grams(const void* a, const void* b)
+{
+    const Gram* x = (const Gram*)a;
+    const Gram* y = (const Gram*)b;
+    if (x->tf != y->tf) {
+        return y->tf - x->tf;
+    }
+    return memcmp(x->s, y->s, GRAM_SIZE);
+}
+
+static int
+build_dict(oDB* db, const char* samples[], const int sizes[], int samples_num, int capacity, TCXSTR* dict)
+{
+    TCMAP* gram2tf = tcmapnew();
+    int i;
+    for (i = 0; i < samples_num; i++) {
+        const char* sample = samples[i];
+        int pos;
+        for (pos = 0; pos + GRAM_SIZE <= sizes[i]; pos++) {
+            tcmapaddint(gram2tf, &sample[pos], GRAM_SIZE, 1);
+        }
+    }
+
+    int grams_num = 0;
+    Gram* grams = (Gram*)malloc(sizeof(Gram) * (tcmaprnum(gram2tf) + 1));
+    if (grams == NULL) {
+        oDB_set_msg_of_errno(db, "malloc failed");
+        tcmapdel(gram2tf);
+        return 1;
+    }
+    tcmapiterinit(gram2tf);
+    const char* key;
+    int key_size;
+    while ((key = (const char*)tcmapiternext(gram2tf, &key_size)) != NULL) {
+        int sp;
+        int tf = *((const int*)tcmapget(gram2tf, key, key_size, &sp));
+        if (tf < 2) {
+            continue;
+        }
+        grams[grams_num].s = key;
+        grams[grams_num].tf = tf;
+        grams_num++;
+    }
+    qsort(grams, grams_num, sizeof(grams[0]), compare_grams);
+
+    TCXSTR* picked = tcxstrnew();
+    for (i = 0; (i < grams_num) && (tcxstrsize(picked) + GRAM_SIZE <= capacity); i++) {
+        if (memmem(tcxstrptr(picked), tcxstrsize(picked), grams[i].s, GRAM_SIZE) != NULL) {
+            continue;
+        }
+        tcxstrcat(picked, grams[i].s, GRAM_SIZE);
+    }
+    const char* p = tcxstrptr(picked);
+    int pos;
+    for (pos = tcxstrsize(picked) - GRAM_SIZE; 0 <= pos; pos -= GRAM_SIZE) {
+        tcxstrcat(dict, &p[pos], GRAM_SIZE);
+    }
+    tcxstrdel(picked);
+    free(grams);
+    tcmapdel(gram2tf);
+    return 0;
+}
+
+int
+oCodec_train(oDB* db, const oCodec* codec, const char* samples[], const int sizes[], int samples_num, TCXSTR* dict)
+{
+#if defined(USE_ZSTD)
+    if (codec->compress == zstd_compress) {
+        size_t total = 0;
+        int i;
+        for (i = 0; i < samples_num; i++) {
+            total += sizes[i];
+        }
+        char* buf = (char*)malloc(total + 1);
+        size_t* sample_sizes = (size_t*)malloc(sizeof(size_t) * (samples_num + 1));
+        char* dict_buf = (char*)malloc(codec->dict_size);
+        if ((buf == NULL) || (sample_sizes == NULL) || (dict_buf == NULL)) {
+            oDB_set_msg_of_errno(db, "malloc failed");
+            free(dict_buf);
+            free(sample_sizes);
+            free(buf);
+            return 1;
+        }
+        size_t pos = 0;
+        for (i = 0; i < samples_num; i++) {
+            memcpy(&buf[pos], samples[i], sizes[i]);
+            pos += sizes[i];
+            sample_sizes[i] = sizes[i];
+        }
+        size_t size = ZDICT_trainFromBuffer(dict_buf, codec->dict_size, buf, sample_sizes, samples_num);
+        free(sample_sizes);
+        free(buf);
+        if (!ZDICT_isError(size)) {
+            tcxstrcat(dict, dict_buf, size);
+            free(dict_buf);
+            return 0;
+        }
+        /**
+         * ZDICT_trainFromBuffer() refuses too few samples. A raw content
+         * dictionary is still acceptable for zstd.
+         */
+        free(dict_buf);
+    }
+#endif
+    return build_dict(db, samples, sizes, samples_num, codec->dict_size, dict);
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -1,8 +1,8 @@
-#include <alloca.h>
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -11,13 +11,12 @@
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
-#include <zlib.h>
 #include "tcutil.h"
 #include "o.h"
 #include "o/private.h"
 
-#define BIGRAM_SIZE 2
 
 static void
 set_msg(oDB* db, const char* s, const char* t)
@@ -35,169 +34,372 @@ oDB_set_msg_of_errno(oDB* db, const char* msg)
     set_msg(db, msg, strerror(errno));
 }
 
+void
+oDB_set_msg(oDB* db, const char* msg, const char* reason)
+{
+    set_msg(db, msg, reason);
+}
+
+/**
+ * Postings being put are kept in memory up to this size.
+ */
+#define BUFFER_SIZE (64 * 1024 * 1024)
+
 void
 oDB_init(oDB* db)
 {
     db->path= NULL;
     db->msg[0] = '\0';
     db->lock_file = -1;
+    db->writable = FALSE;
     db->next_doc_id = 0;
-    db->index = tcbdbnew();
-    db->doc = tchdbnew();
+    db->doc_format = DOC_FORMAT_STREAM;
+    db->doc_store = DOC_STORE_HASH;
+    db->index_format = INDEX_FORMAT_TEXT;
+    db->tokenizer = TOKENIZER_BIGRAM;
+    db->ngram = NGRAM_BIGRAM;
+    db->postings = POSTINGS_POSITIONS;
+    db->codec = oCodec_default();
+    db->dict = NULL;
+    db->dict_size = 0;
+    db->codec_data = NULL;
+    db->stats = NULL;
+    db->query_log = -1;
     db->attr2id = tchdbnew();
-    int i;
-    for (i = 0; i < array_sizeof(db->attrs); i++) {
-        db->attrs[i] = NULL;
-    }
+    db->segments = NULL;
+    db->segments_num = 0;
+    db->writing = NULL;
+    db->next_segment = 1;
+    db->buffer_size = BUFFER_SIZE;
+    db->uses_wal = FALSE;
+    db->wal_sync_docs = 0;
+    db->wal_sync_ms = 0;
+    db->wal = NULL;
+    db->defers_merges = FALSE;
+    db->is_merging = FALSE;
+    db->owner = NULL;
 }
 
 void
 oDB_fini(oDB* db)
 {
+    if (db->query_log != -1) {
+        close(db->query_log);
+    }
+    if (db->owner != NULL) {
+        return;
+    }
+    if (db->codec->fini != NULL) {
+        db->codec->fini(db);
+    }
+    free(db->dict);
     tchdbdel(db->attr2id);
-    tchdbdel(db->doc);
-    tcbdbdel(db->index);
 }
 
-static int
-open_doc(oDB* db, const char* path, int omode)
-{
-    char doc[1024];
-    snprintf(doc, array_sizeof(doc), "%s/doc.tch", path);
-    if (!tchdbopen(db->doc, doc, omode)) {
-        set_msg(db, "Can't open doc", tchdberrmsg(tchdbecode(db->doc)));
-        return 1;
-    }
-    return 0;
-}
+static const char* doc_formats[] = { "stream", "chunked" };
+static const char* doc_stores[] = { "hash", "log" };
+static const char* index_formats[] = { "text", "packed" };
+static const char* tokenizers[] = { "bigram", "hybrid" };
+static const char* ngrams[] = { "2", "1+2", "3" };
+static const char* postings_types[] = { "positions", "docs" };
 
 static int
-open_index(oDB* db, const char* path, int omode)
+find_name(const char* names[], int names_num, const char* name)
 {
-    char index[1024];
-    snprintf(index, array_sizeof(index), "%s/index.tcb", path);
-    if (!tcbdbopen(db->index, index, omode)) {
-        set_msg(db, "Can't open index", tcbdberrmsg(tcbdbecode(db->index)));
-        return 1;
+    int i;
+    for (i = 0; i < names_num; i++) {
+        if (strcmp(names[i], name) == 0) {
+            return i;
+        }
     }
-    return 0;
+    return -1;
 }
 
 static FILE*
-open_doc_id(oDB* db, const char* path, const char* mode)
+open_config(oDB* db, const char* path, const char* mode)
 {
     char filename[1024];
-    snprintf(filename, array_sizeof(filename), "%s/doc_id", path);
-    FILE* fp = fopen(filename, mode);
-    if (fp == NULL) {
-        oDB_set_msg_of_errno(db, "Can't open doc_id");
-    }
-    return fp;
+    snprintf(filename, array_sizeof(filename), "%s/config", path);
+    return fopen(filename, mode);
 }
 
 static int
-write_doc_id(oDB* db, const char* path, o_doc_id_t doc_id)
+write_config(oDB* db, const char* path)
 {
-    FILE* fp = open_doc_id(db, path, "wb");
+    FILE* fp = open_config(db, path, "w");
     if (fp == NULL) {
+        oDB_set_msg_of_errno(db, "Can't open config");
         return 1;
     }
-    fwrite(&doc_id, sizeof(doc_id), 1, fp);
+    fprintf(fp, "doc_format %s\n", doc_formats[db->doc_format]);
+    fprintf(fp, "doc_store %s\n", doc_stores[db->doc_store]);
+    fprintf(fp, "codec %s\n", db->codec->name);
+    fprintf(fp, "index_format %s\n", index_formats[db->index_format]);
+    fprintf(fp, "tokenizer %s\n", tokenizers[db->tokenizer]);
+    fprintf(fp, "ngram %s\n", ngrams[db->ngram]);
+    fprintf(fp, "postings %s\n", postings_types[db->postings]);
     if (fclose(fp) != 0) {
-        oDB_set_msg_of_errno(db, "Can't close doc_id");
+        oDB_set_msg_of_errno(db, "Can't close config");
         return 1;
     }
     return 0;
 }
 
+/**
+ * Databases created before the config file was introduced have no config. All
+ * properties of these databases are defaults.
+ */
 static int
-read_doc_id(oDB* db, const char* path, o_doc_id_t* doc_id)
+read_config(oDB* db, const char* path)
 {
-    FILE* fp = open_doc_id(db, path, "rb");
+    FILE* fp = open_config(db, path, "r");
     if (fp == NULL) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        oDB_set_msg_of_errno(db, "Can't open config");
         return 1;
     }
-    fread(doc_id, sizeof(*doc_id), 1, fp);
+    char line[256];
+    int status = 0;
+    while (fgets(line, array_sizeof(line), fp) != NULL) {
+        char name[128];
+        char val[128];
+        if (sscanf(line, "%127s %127s", name, val) != 2) {
+            continue;
+        }
+        if (strcmp(name, "doc_format") == 0) {
+            int format = find_name(doc_formats, array_sizeof(doc_formats), val);
+            if (format == -1) {
+                set_msg(db, "Unknown document format", val);
+                status = 1;
+                break;
+            }
+            db->doc_format = format;
+        }
+        else if (strcmp(name, "doc_store") == 0) {
+            int store = find_name(doc_stores, array_sizeof(doc_stores), val);
+            if (store == -1) {
+                set_msg(db, "Unknown document store", val);
+                status = 1;
+                break;
+            }
+            db->doc_store = store;
+        }
+        else if (strcmp(name, "index_format") == 0) {
+            int format = find_name(index_formats, array_sizeof(index_formats), val);
+            if (format == -1) {
+                set_msg(db, "Unknown index format", val);
+                status = 1;
+                break;
+            }
+            db->index_format = format;
+        }
+        else if (strcmp(name, "tokenizer") == 0) {
+            int tokenizer = find_name(tokenizers, array_sizeof(tokenizers), val);
+            if (tokenizer == -1) {
+                set_msg(db, "Unknown tokenizer", val);
+                status = 1;
+                break;
+            }
+            db->tokenizer = tokenizer;
+        }
+        else if (strcmp(name, "ngram") == 0) {
+            int ngram = find_name(ngrams, array_sizeof(ngrams), val);
+            if (ngram == -1) {
+                set_msg(db, "Unknown n-gram", val);
+                status = 1;
+                break;
+            }
+            db->ngram = ngram;
+        }
+        else if (strcmp(name, "postings") == 0) {
+            int postings = find_name(postings_types, array_sizeof(postings_types), val);
+            if (postings == -1) {
+                set_msg(db, "Unknown postings", val);
+                status = 1;
+                break;
+            }
+            db->postings = postings;
+        }
+        else if (strcmp(name, "codec") == 0) {
+            const oCodec* codec = oCodec_find(val);
+            if (codec == NULL) {
+                set_msg(db, "Codec is not available", val);
+                status = 1;
+                break;
+            }
+            db->codec = codec;
+        }
+    }
     if (fclose(fp) != 0) {
-        oDB_set_msg_of_errno(db, "Can't close doc_id");
+        oDB_set_msg_of_errno(db, "Can't close config");
         return 1;
     }
-    return 0;
+    return status;
+}
+
+static void
+format_dict_path(char* s, size_t size, const char* dir)
+{
+    snprintf(s, size, "%s/dict", dir);
 }
 
 static int
-close_doc(oDB* db)
+write_dict(oDB* db, const char* path)
 {
-    if (!tchdbclose(db->doc)) {
-        set_msg(db, "Can't close doc", tchdberrmsg(tchdbecode(db->doc)));
+    if (db->dict == NULL) {
+        return 0;
+    }
+    char filename[1024];
+    format_dict_path(filename, array_sizeof(filename), path);
+    if (!tcwritefile(filename, db->dict, db->dict_size)) {
+        oDB_set_msg_of_errno(db, "Can't write dict");
         return 1;
     }
     return 0;
 }
 
 static int
-close_index(oDB* db)
+read_dict(oDB* db, const char* path)
+{
+    char filename[1024];
+    format_dict_path(filename, array_sizeof(filename), path);
+    if (access(filename, F_OK) != 0) {
+        return 0;
+    }
+    int size;
+    char* dict = (char*)tcreadfile(filename, 0, &size);
+    if (dict == NULL) {
+        oDB_set_msg_of_errno(db, "Can't read dict");
+        return 1;
+    }
+    free(db->dict);
+    db->dict = dict;
+    db->dict_size = size;
+    return 0;
+}
+
+int
+oDB_set_codec(oDB* db, const char* name)
 {
-    if (!tcbdbclose(db->index)) {
-        set_msg(db, "Can't close index", tcbdberrmsg(tcbdbecode(db->index)));
+    const oCodec* codec = oCodec_find(name);
+    if (codec == NULL) {
+        set_msg(db, "Codec is not available", name);
         return 1;
     }
+    db->codec = codec;
     return 0;
 }
 
-static int
-make_dir(oDB* db, const char* path)
+int
+oDB_set_doc_store(oDB* db, const char* name)
 {
-    if (mkdir(path, 0755) != 0) {
-        oDB_set_msg_of_errno(db, "mkdir failed");
+    int store = find_name(doc_stores, array_sizeof(doc_stores), name);
+    if (store == -1) {
+        set_msg(db, "Unknown document store", name);
         return 1;
     }
+    db->doc_store = store;
     return 0;
 }
 
-static void
-format_attrs_dir(char* s, size_t size, const char* dir)
+int
+oDB_set_index_format(oDB* db, const char* name)
+{
+    int format = find_name(index_formats, array_sizeof(index_formats), name);
+    if (format == -1) {
+        set_msg(db, "Unknown index format", name);
+        return 1;
+    }
+    db->index_format = format;
+    return 0;
+}
+
+int
+oDB_set_tokenizer(oDB* db, const char* name)
 {
-    snprintf(s, size, "%s/attrs", dir);
+    int tokenizer = find_name(tokenizers, array_sizeof(tokenizers), name);
+    if (tokenizer == -1) {
+        set_msg(db, "Unknown tokenizer", name);
+        return 1;
+    }
+    db->tokenizer = tokenizer;
+    return 0;
 }
 
-static int
-open_attr(oDB* db, TCHDB* hdb, const char* dir, const char* attr, int omode)
+int
+oDB_set_ngram(oDB* db, const char* name)
 {
-    char path[1024];
-    snprintf(path, array_sizeof(path), "%s/%s.tch", dir, attr);
-    if (!tchdbopen(hdb, path, omode)) {
-        set_msg(db, "Can't attribute index", tchdberrmsg(tchdbecode(hdb)));
+    int ngram = find_name(ngrams, array_sizeof(ngrams), name);
+    if (ngram == -1) {
+        set_msg(db, "Unknown n-gram", name);
         return 1;
     }
+    db->ngram = ngram;
     return 0;
 }
 
-static int
-close_attr(oDB* db, TCHDB* hdb)
+int
+oDB_set_postings(oDB* db, const char* name)
 {
-    if (!tchdbclose(hdb)) {
-        set_msg(db, "Can't close attribute index", tchdberrmsg(tchdbecode(hdb)));
+    int postings = find_name(postings_types, array_sizeof(postings_types), name);
+    if (postings == -1) {
+        set_msg(db, "Unknown postings", name);
+        return 1;
+    }
+    db->postings = postings;
+    return 0;
+}
+
+void
+oDB_set_buffer_size(oDB* db, size_t size)
+{
+    db->buffer_size = size;
+}
+
+/**
+ * A writer opened after this logs documents to the write-ahead log. It is
+ * synced every sync_docs documents or sync_ms milliseconds. If both are 0, it
+ * is synced only by oDB_sync().
+ */
+void
+oDB_set_wal(oDB* db, int sync_docs, int sync_ms)
+{
+    db->uses_wal = TRUE;
+    db->wal_sync_docs = sync_docs;
+    db->wal_sync_ms = sync_ms;
+}
+
+/**
+ * oDB_commit() of a writer opened after this leaves merges to
+ * oDB_merge_begin(), so that a caller merges segments without blocking the
+ * others.
+ */
+void
+oDB_defer_merges(oDB* db)
+{
+    db->defers_merges = TRUE;
+}
+
+int
+oDB_set_doc_format(oDB* db, const char* name)
+{
+    int format = find_name(doc_formats, array_sizeof(doc_formats), name);
+    if (format == -1) {
+        set_msg(db, "Unknown document format", name);
         return 1;
     }
+    db->doc_format = format;
     return 0;
 }
 
 static int
-create_attrs_index(oDB* db, const char* dir, const char* attrs[], int attrs_num)
+make_dir(oDB* db, const char* path)
 {
-    int i;
-    for (i = 0; i < attrs_num; i++) {
-        TCHDB* hdb = tchdbnew();
-        if (open_attr(db, hdb, dir, attrs[i], HDBOWRITER | HDBOCREAT) != 0) {
-            tchdbdel(hdb);
-            return 1;
-        }
-        if (close_attr(db, hdb) != 0) {
-            tchdbdel(hdb);
-            return 1;
-        }
-        tchdbdel(hdb);
+    if (mkdir(path, 0755) != 0) {
+        oDB_set_msg_of_errno(db, "mkdir failed");
+        return 1;
     }
     return 0;
 }
@@ -238,56 +440,47 @@ create_attr2id(oDB* db, const char* dir, const char* attrs[], int attrs_num)
     return 0;
 }
 
-static int
-create_index(oDB* db, const char* path)
+int
+oDB_create(oDB* db, const char* path, const char* attrs[], int attrs_num)
 {
-    if (open_index(db, path, BDBOWRITER | BDBOCREAT) != 0) {
-        return 1;
-    }
-    if (close_index(db) != 0) {
+    /**
+     * A word or a trigram can't be packed into a codepoint pair.
+     */
+    if ((db->index_format == INDEX_FORMAT_PACKED) && (db->tokenizer != TOKENIZER_BIGRAM)) {
+        set_msg(db, "Packed index needs the bigram tokenizer", NULL);
         return 1;
     }
-    return 0;
-}
-
-static int
-create_doc(oDB* db, const char* path)
-{
-    if (open_doc(db, path, HDBOWRITER | HDBOCREAT) != 0) {
+    if ((db->index_format == INDEX_FORMAT_PACKED) && (db->ngram == NGRAM_TRIGRAM)) {
+        set_msg(db, "Packed index can't hold trigrams", NULL);
         return 1;
     }
-    if (close_doc(db) != 0) {
+    /**
+     * Phrases are verified against stored documents, which keep the case of
+     * words.
+     */
+    if ((db->postings == POSTINGS_DOCS) && (db->tokenizer != TOKENIZER_BIGRAM)) {
+        set_msg(db, "Postings without positions need the bigram tokenizer", NULL);
         return 1;
     }
-    return 0;
-}
-
-int
-oDB_create(oDB* db, const char* path, const char* attrs[], int attrs_num)
-{
     if (make_dir(db, path) != 0) {
         return 1;
     }
-    char attrs_dir[1024];
-    format_attrs_dir(attrs_dir, array_sizeof(attrs_dir), path);
-    if (make_dir(db, attrs_dir) != 0) {
+    if (create_attr2id(db, path, attrs, attrs_num) != 0) {
         return 2;
     }
-    if (create_attrs_index(db, attrs_dir, attrs, attrs_num) != 0) {
+    if (write_config(db, path) != 0) {
         return 3;
     }
-    if (create_attr2id(db, path, attrs, attrs_num) != 0) {
+    if (write_dict(db, path) != 0) {
         return 4;
     }
-    if (create_index(db, path) != 0) {
+    /**
+     * The manifest is written last, because a database without it is taken
+     * as one of before segments.
+     */
+    if (oSegment_create_manifest(db, path) != 0) {
         return 5;
     }
-    if (write_doc_id(db, path, 0) != 0) {
-        return 6;
-    }
-    if (create_doc(db, path) != 0) {
-        return 7;
-    }
     return 0;
 }
 
@@ -303,32 +496,121 @@ close_attr2id(oDB* db)
 }
 
 int
-oDB_close(oDB* db)
+oDB_merge_begin(oDB* db, oMerge** pmerge)
 {
-    int status = 0;
-    TCHDB** phdb;
-    for (phdb = &db->attrs[0]; *phdb != NULL; phdb++) {
-        if (close_attr(db, *phdb) != 0) {
-            status = 1;
+    return oSegment_merge_begin(db, pmerge);
+}
+
+int
+oDB_merge_run(oDB* db, oMerge* merge)
+{
+    return oSegment_merge_run(db, merge);
+}
+
+int
+oDB_merge_end(oDB* db, oMerge* merge)
+{
+    return oSegment_merge_end(db, merge);
+}
+
+void
+oDB_merge_abort(oDB* db, oMerge* merge)
+{
+    oSegment_merge_abort(db, merge);
+}
+
+static int
+merge_segments(oDB* db)
+{
+    while (TRUE) {
+        oMerge* merge;
+        if (oDB_merge_begin(db, &merge) != 0) {
+            return 1;
+        }
+        if (merge == NULL) {
+            return 0;
+        }
+        if (oDB_merge_run(db, merge) != 0) {
+            oDB_merge_abort(db, merge);
+            return 1;
+        }
+        if (oDB_merge_end(db, merge) != 0) {
+            return 1;
         }
-        tchdbdel(*phdb);
     }
-    if (close_attr2id(db) != 0) {
-        status = 1;
+}
+
+/**
+ * Documents put so far are seen by handles opened after it. oDB_close()
+ * commits too.
+ */
+int
+oDB_commit(oDB* db)
+{
+    if (oSegment_commit(db) != 0) {
+        return 1;
+    }
+    if ((db->wal != NULL) && (oWAL_truncate(db, db->wal) != 0)) {
+        return 1;
+    }
+    return db->defers_merges ? 0 : merge_segments(db);
+}
+
+/**
+ * Documents put so far survive a crash after it. Threads calling it at once
+ * share one sync.
+ */
+int
+oDB_sync(oDB* db)
+{
+    return db->wal != NULL ? oWAL_sync(db, db->wal) : 0;
+}
+
+static void
+remove_wal(oDB* db)
+{
+    char path[1024];
+    snprintf(path, array_sizeof(path), "%s/wal", db->path);
+    unlink(path);
+}
+
+int
+oDB_close(oDB* db)
+{
+    if (db->owner != NULL) {
+        free(db->path);
+        return 0;
     }
-    if (close_doc(db) != 0) {
+    int status = 0;
+    if (db->writable && (oDB_commit(db) != 0)) {
         status = 1;
     }
-    if (write_doc_id(db, db->path, db->next_doc_id) != 0) {
+    if (db->wal != NULL) {
+        if (oWAL_close(db, db->wal) != 0) {
+            status = 1;
+        }
+        db->wal = NULL;
+        /**
+         * The log is kept for the next writer unless everything is committed.
+         */
+        if (status == 0) {
+            remove_wal(db);
+        }
+    }
+    if (oSegment_close_all(db) != 0) {
         status = 1;
     }
-    if (close_index(db) != 0) {
+    if (close_attr2id(db) != 0) {
         status = 1;
     }
-    if (close(db->lock_file) != 0) {
+    /**
+     * A handle can be opened again after it is closed.
+     */
+    if ((db->lock_file != -1) && (close(db->lock_file) != 0)) {
         oDB_set_msg_of_errno(db, "close failed");
         status = 1;
     }
+    db->lock_file = -1;
     free(db->path);
     return status;
 }
@@ -366,53 +648,100 @@ copy_path(oDB* db, const char* path)
     return 0;
 }
 
+/**
+ * Tokyo Cabinet locks a database shared among threads by itself.
+ */
+static int
+set_mutex(oDB* db)
+{
+    if (!tchdbsetmutex(db->attr2id)) {
+        set_msg(db, "Can't set mutex of attr2id", tchdberrmsg(tchdbecode(db->attr2id)));
+        return 1;
+    }
+    return 0;
+}
+
 static int
-open_attrs(oDB* db, const char* path, int omode)
+replay_put(oDB* db, o_doc_id_t doc_id, oAttr attrs[], int attrs_num, const char* doc, size_t size)
 {
-    char dir[1024];
-    format_attrs_dir(dir, array_sizeof(dir), path);
+    /**
+     * The writer may crash after it commits documents and before it truncates
+     * the log.
+     */
+    if (doc_id < db->next_doc_id) {
+        return 0;
+    }
+    if (db->next_doc_id < doc_id) {
+        set_msg(db, "Write-ahead log lacks documents", NULL);
+        return 1;
+    }
+    oPut* put = oDB_put_begin(db);
+    if (put == NULL) {
+        return 1;
+    }
+    if (oDB_put_write(db, put, doc, size) != 0) {
+        oDB_put_abort(db, put);
+        return 1;
+    }
+    return oDB_put_end(db, put, attrs, attrs_num);
+}
 
-    TCHDB* hdb = db->attr2id;
-    if (!tchdbiterinit(hdb)) {
-        set_msg(db, "Can't initialize iterator", tchdberrmsg(tchdbecode(hdb)));
+/**
+ * Documents in the write-ahead log of a writer which crashed are put again
+ * with the same IDs, and committed before the log is emptied.
+ */
+static int
+recover(oDB* db)
+{
+    int replayed;
+    if (oWAL_replay(db, replay_put, &replayed) != 0) {
         return 1;
     }
-    char* key;
-    while ((key = tchdbiternext2(hdb)) != NULL) {
-        int sp;
-        int* pindex = (int*)tchdbget(hdb, key, strlen(key), &sp);
-        TCHDB* attr = tchdbnew();
-        if (open_attr(db, attr, dir, key, omode) != 0) {
-            return 1;
-        }
-        db->attrs[*pindex] = attr;
-        free(key);
+    if ((0 < replayed) && (oSegment_commit(db) != 0)) {
+        return 1;
     }
-    return 0;
+    if (!db->uses_wal) {
+        remove_wal(db);
+        return 0;
+    }
+    db->wal = oWAL_open(db, db->wal_sync_docs, db->wal_sync_ms);
+    return db->wal != NULL ? 0 : 1;
 }
 
+/**
+ * Only writers take the lock, which keeps one writer at a time. Readers don't
+ * wait for a writer, because they read segments in the manifest, which the
+ * writer never changes.
+ */
 static int
-open_db(oDB* db, const char* path, int lock_operation, int index_mode, int doc_mode)
+open_db(oDB* db, const char* path, BOOL writable, BOOL is_shared)
 {
     if (copy_path(db, path) != 0) {
         return 1;
     }
-    if (lock_db(db, path, lock_operation) != 0) {
+    if (writable && (lock_db(db, path, LOCK_EX) != 0)) {
+        return 1;
+    }
+    db->writable = writable;
+    if (read_config(db, path) != 0) {
+        return 1;
+    }
+    if (read_dict(db, path) != 0) {
         return 1;
     }
-    if (open_index(db, path, index_mode) != 0) {
+    if (is_shared && (db->codec->prepare != NULL) && (db->codec->prepare(db) != 0)) {
         return 1;
     }
-    if (read_doc_id(db, path, &db->next_doc_id) != 0) {
+    if (is_shared && (set_mutex(db) != 0)) {
         return 1;
     }
-    if (open_doc(db, path, doc_mode) != 0) {
+    if (open_attr2id(db, path, HDBOREADER | HDBONOLCK) != 0) {
         return 1;
     }
-    if (open_attr2id(db, path, HDBOREADER) != 0) {
+    if (oSegment_open_all(db, is_shared) != 0) {
         return 1;
     }
-    if (open_attrs(db, path, doc_mode) != 0) {
+    if (writable && (recover(db) != 0)) {
         return 1;
     }
     return 0;
@@ -421,46 +750,53 @@ open_db(oDB* db, const char* path, int lock_operation, int index_mode, int doc_m
 int
 oDB_open_to_read(oDB* db, const char* path)
 {
-    return open_db(db, path, LOCK_SH, BDBOREADER, HDBOREADER);
+    return open_db(db, path, FALSE, FALSE);
 }
 
 int
 oDB_open_to_write(oDB* db, const char* path)
 {
-    return open_db(db, path, LOCK_EX, BDBOWRITER, HDBOWRITER);
+    return open_db(db, path, TRUE, FALSE);
 }
 
-static int
-get_char_size(char c)
+/**
+ * A database opened by oDB_open_to_share() is read by handles given by
+ * oDB_share() in many threads at once. The handle itself must not be used
+ * while they search, and must be closed after them.
+ */
+int
+oDB_open_to_share(oDB* db, const char* path)
 {
-    unsigned char ch = (unsigned char)c;
-    if ((0xc0 <= ch) && (ch <= 0xdf)) {
-        return 2;
-    }
-    if ((0xe0 <= ch) && (ch <= 0xef)) {
-        return 3;
-    }
-    if ((0xf0 <= ch) && (ch <= 0xf7)) {
-        return 4;
-    }
-    if ((0xf8 <= ch) && (ch <= 0xfb)) {
-        return 5;
-    }
-    if ((0xfc <= ch) && (ch <= 0xfd)) {
-        return 6;
-    }
-    return 1;
+    return open_db(db, path, FALSE, TRUE);
 }
 
-static int
-get_term_size(const char* pc)
+/**
+ * db must be initialized by oDB_init(), and is closed by oDB_close() and
+ * oDB_fini() as the others, but they don't close databases of owner.
+ */
+int
+oDB_share(oDB* db, oDB* owner)
 {
-    int first_char_size = get_char_size(*pc);
-    char second_char = pc[first_char_size];
-    if (second_char == '\0') {
-        return first_char_size;
+    if (copy_path(db, owner->path) != 0) {
+        return 1;
     }
-    return first_char_size + get_char_size(second_char);
+    tchdbdel(db->attr2id);
+    db->next_doc_id = owner->next_doc_id;
+    db->doc_format = owner->doc_format;
+    db->doc_store = owner->doc_store;
+    db->index_format = owner->index_format;
+    db->tokenizer = owner->tokenizer;
+    db->ngram = owner->ngram;
+    db->postings = owner->postings;
+    db->codec = owner->codec;
+    db->dict = owner->dict;
+    db->dict_size = owner->dict_size;
+    db->codec_data = owner->codec_data;
+    db->attr2id = owner->attr2id;
+    db->segments = owner->segments;
+    db->segments_num = owner->segments_num;
+    db->owner = owner;
+    return 0;
 }
 
 static void
@@ -478,6 +814,23 @@ compress_num(int n, char* p, int* size)
     *size = i;
 }
 
+static int
+decompress_num(const char* p, int* size)
+{
+    int n = 0;
+    int i = 0;
+    char m = 0;
+    int base = 1;
+    do {
+        m = p[i];
+        n += base * (m & 0x7f);
+        base *= 128;
+        i++;
+    } while ((m & 0x80) != 0);
+    *size = i;
+    return n;
+}
+
 static void
 compress_posting(o_doc_id_t doc_id, o_attr_id_t attr_id, int* pos, int pos_num, char* data, int* data_size)
 {
@@ -502,903 +855,4021 @@ compress_posting(o_doc_id_t doc_id, o_attr_id_t attr_id, int* pos, int pos_num,
     *data_size = p - data;
 }
 
-static TCXSTR*
-compress_doc(oDB* db, const char* doc, size_t size)
+static int
+decompress_doc(oDB* db, const char* compressed, int size, int raw_size, oSink sink, void* arg)
+{
+    return db->codec->decompress(db, compressed, size, raw_size, sink, arg);
+}
+
+/**
+ * Deflated streams are stored as they are for compatibility. The other codecs
+ * need the uncompressed size, so it precedes the compressed document.
+ */
+static BOOL
+is_size_prefixed(oDB* db)
+{
+    return db->codec != oCodec_default();
+}
+
+/**
+ * A chunked document consists of a block table and blocks. The table starts
+ * with the number of blocks, and each entry of the table has the number of
+ * characters, the uncompressed size and the compressed size of a block. Every
+ * block is deflated independently, so a part of a document can be extracted
+ * without inflating preceding blocks.
+ */
+#define DOC_BLOCK_SIZE  (16 * 1024)
+
+struct DocBlock {
+    int first_char;
+    int chars_num;
+    int size;
+    int compressed_size;
+    const char* compressed;
+};
+
+typedef struct DocBlock DocBlock;
+
+static void
+append_num(TCXSTR* xstr, int n)
+{
+    char buf[8];
+    int size;
+    compress_num(n, buf, &size);
+    tcxstrcat(xstr, buf, size);
+}
+
+static DocBlock*
+read_block_table(oDB* db, const char* chunked, int* blocks_num)
 {
-    z_stream z;
-    z.zalloc = Z_NULL;
-    z.zfree = Z_NULL;
-    z.opaque = Z_NULL;
-    if (deflateInit(&z, Z_DEFAULT_COMPRESSION) != Z_OK) {
-        set_msg(db, "deflateInit failed", z.msg);
+    const char* p = chunked;
+#define DECOMPRESS(num) do { \
+    int size; \
+    num = decompress_num(p, &size); \
+    p += size; \
+} while (0)
+    int num;
+    DECOMPRESS(num);
+    DocBlock* blocks = (DocBlock*)malloc(sizeof(DocBlock) * (num + 1));
+    if (blocks == NULL) {
+        oDB_set_msg_of_errno(db, "Can't allocate block table");
         return NULL;
     }
-    TCXSTR* compressed = tcxstrnew();
-    z.avail_in = size;
-    z.next_in = (Bytef*)doc;
-#define CONCAT  tcxstrcat(compressed, out_buf, sizeof(out_buf) - z.avail_out)
-    while (0 < z.avail_in) {
-        char out_buf[1024];
-        z.next_out = (Bytef*)out_buf;
-        z.avail_out = sizeof(out_buf);
-        if (deflate(&z, Z_NO_FLUSH) != Z_OK) {
-            deflateEnd(&z);
-            set_msg(db, "deflate failed for Z_NO_FLUSH", z.msg);
-            tcxstrdel(compressed);
-            return NULL;
-        }
-        CONCAT;
+    int first_char = 0;
+    int i;
+    for (i = 0; i < num; i++) {
+        DocBlock* block = &blocks[i];
+        block->first_char = first_char;
+        DECOMPRESS(block->chars_num);
+        DECOMPRESS(block->size);
+        DECOMPRESS(block->compressed_size);
+        first_char += block->chars_num;
     }
-    while (1) {
-        char out_buf[1024];
-        z.next_out = (Bytef*)out_buf;
-        z.avail_out = sizeof(out_buf);
-        int retval = deflate(&z, Z_FINISH);
-        if (retval == Z_STREAM_END) {
-            CONCAT;
-            break;
-        }
-        if (retval != Z_OK) {
-            deflateEnd(&z);
-            set_msg(db, "deflate failed for Z_FINISH", z.msg);
-            tcxstrdel(compressed);
-            return NULL;
-        }
-        CONCAT;
+#undef DECOMPRESS
+    for (i = 0; i < num; i++) {
+        blocks[i].compressed = p;
+        p += blocks[i].compressed_size;
     }
-#undef CONCAT
+    *blocks_num = num;
+    return blocks;
+}
 
-    if (deflateEnd(&z) != Z_OK) {
-        set_msg(db, "deflateEnd failed", z.msg);
-        tcxstrdel(compressed);
+/**
+ * A document in a log is not copied. In this case, *buf is set to NULL.
+ * Otherwise *buf must be released by the caller.
+ */
+static const char*
+get_compressed_doc(oDB* db, o_doc_id_t doc_id, int* size, char** buf)
+{
+    oSegment* segment = oSegment_find(db, doc_id);
+    if (segment == NULL) {
+        set_msg(db, "Document not found", NULL);
+        return NULL;
+    }
+    if (db->doc_store == DOC_STORE_LOG) {
+        size_t log_size;
+        const char* compressed = oDocLog_get(db, segment->doc_log, doc_id, &log_size);
+        *size = log_size;
+        *buf = NULL;
+        return compressed;
+    }
+    char* compressed = (char*)tchdbget(segment->doc, &doc_id, sizeof(doc_id), size);
+    if (compressed == NULL) {
+        set_msg(db, "Document not found", NULL);
         return NULL;
     }
+    *buf = compressed;
     return compressed;
 }
 
-char*
-oDB_get(oDB* db, o_doc_id_t doc_id)
+/**
+ * RangeSink passes characters from offset to end to another sink. pos is the
+ * offset of the next character. A character can be split into two pieces, so
+ * is_in_range remembers whether the last character is in the range.
+ */
+struct RangeSink {
+    int offset;
+    int end;
+    int pos;
+    BOOL is_in_range;
+    oSink sink;
+    void* arg;
+};
+
+typedef struct RangeSink RangeSink;
+
+static int
+write_range(const char* s, size_t size, void* arg)
+{
+    RangeSink* range = (RangeSink*)arg;
+    size_t from = range->is_in_range ? 0 : size;
+    size_t to = size;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        if ((s[i] & 0xc0) == 0x80) {
+            continue;
+        }
+        range->is_in_range = (range->offset <= range->pos) && (range->pos < range->end);
+        range->pos++;
+        if (range->is_in_range && (from == size)) {
+            from = i;
+        }
+        if (range->end < range->pos) {
+            to = i;
+            break;
+        }
+    }
+    if (to <= from) {
+        return 0;
+    }
+    return range->sink(&s[from], to - from, range->arg);
+}
+
+static int
+get_doc_to(oDB* db, o_doc_id_t doc_id, int offset, int length, oSink sink, void* arg)
 {
     int sp;
-    char* compressed = (char*)tchdbget(db->doc, &doc_id, sizeof(doc_id), &sp);
+    char* buf;
+    const char* compressed = get_compressed_doc(db, doc_id, &sp, &buf);
     if (compressed == NULL) {
-        set_msg(db, "Document not found", NULL);
-        return NULL;
+        return 1;
     }
 
-    z_stream z;
-    z.zalloc = Z_NULL;
-    z.zfree = Z_NULL;
-    z.opaque = Z_NULL;
-    z.next_in = Z_NULL;
-    z.avail_in = 0;
-    if (inflateInit(&z) != Z_OK) {
-        set_msg(db, "inflateInit failed", z.msg);
-        return NULL;
+    RangeSink range;
+    range.offset = offset;
+    range.end = offset + length;
+    range.pos = 0;
+    range.is_in_range = FALSE;
+    range.sink = sink;
+    range.arg = arg;
+    if ((offset != 0) || (length != INT_MAX)) {
+        sink = write_range;
+        arg = &range;
     }
 
-    TCXSTR* doc = tcxstrnew();
-    z.avail_in = sp;
-    z.next_in = (Bytef*)compressed;
-    while (0 < z.avail_in) {
-#define CONCAT  tcxstrcat(doc, buf, sizeof(buf) - z.avail_out)
-        char buf[1024];
-        z.next_out = (Bytef*)buf;
-        z.avail_out = sizeof(buf);
-        int retval = inflate(&z, Z_NO_FLUSH);
-        if (retval == Z_STREAM_END) {
-            CONCAT;
-            break;
+    int status = 0;
+    if (db->doc_format == DOC_FORMAT_CHUNKED) {
+        int blocks_num;
+        DocBlock* blocks = read_block_table(db, compressed, &blocks_num);
+        if (blocks == NULL) {
+            free(buf);
+            return 1;
         }
-        if (retval != Z_OK) {
-            set_msg(db, "inflate failed", z.msg);
-            inflateEnd(&z);
-            tcxstrdel(doc);
-            return NULL;
+        int i;
+        for (i = 0; (i < blocks_num) && (status == 0); i++) {
+            DocBlock* block = &blocks[i];
+            if (block->first_char + block->chars_num <= offset) {
+                continue;
+            }
+            if (range.end <= block->first_char) {
+                break;
+            }
+            range.pos = block->first_char;
+            status = decompress_doc(db, block->compressed, block->compressed_size, block->size, sink, arg);
         }
-        CONCAT;
-#undef CONCAT
+        free(blocks);
+    }
+    else if (is_size_prefixed(db)) {
+        int size;
+        int raw_size = decompress_num(compressed, &size);
+        status = decompress_doc(db, compressed + size, sp - size, raw_size, sink, arg);
+    }
+    else {
+        status = decompress_doc(db, compressed, sp, 0, sink, arg);
     }
+    free(buf);
+    return status;
+}
+
+static int
+append_to_xstr(const char* s, size_t size, void* arg)
+{
+    tcxstrcat((TCXSTR*)arg, s, size);
+    return 0;
+}
 
-    if (inflateEnd(&z) != Z_OK) {
-        set_msg(db, "inflateEnd failed", z.msg);
+static char*
+get_doc_range(oDB* db, o_doc_id_t doc_id, int offset, int length)
+{
+    TCXSTR* doc = tcxstrnew();
+    if (get_doc_to(db, doc_id, offset, length, append_to_xstr, doc) != 0) {
         tcxstrdel(doc);
         return NULL;
     }
-    free(compressed);
+    return tcxstrtomalloc(doc);
+}
 
-    int size = tcxstrsize(doc) + 1;
-    char* s = (char*)malloc(size);
-    if (s == NULL) {
-        oDB_set_msg_of_errno(db, "Can't allocate string");
-        tcxstrdel(doc);
-        return NULL;
+static BOOL
+is_valid_range(oDB* db, int offset, int* length)
+{
+    if ((offset < 0) || (*length < 0)) {
+        set_msg(db, "Invalid range", NULL);
+        return FALSE;
     }
-    memcpy(s, tcxstrptr(doc), size - 1);
-    s[size - 1] = '\0';
-    tcxstrdel(doc);
+    if (INT_MAX - offset < *length) {
+        *length = INT_MAX - offset;
+    }
+    return TRUE;
+}
 
-    return s;
+char*
+oDB_get(oDB* db, o_doc_id_t doc_id)
+{
+    return get_doc_range(db, doc_id, 0, INT_MAX);
 }
 
-static int
-put_doc(oDB* db, o_doc_id_t doc_id, const char* doc, size_t size)
+char*
+oDB_get_range(oDB* db, o_doc_id_t doc_id, int offset, int length)
 {
-    TCXSTR* compressed = compress_doc(db, doc, size);
-    if (compressed == NULL) {
-        return 1;
+    if (!is_valid_range(db, offset, &length)) {
+        return NULL;
     }
-    if (!tchdbput(db->doc, &doc_id, sizeof(doc_id), tcxstrptr(compressed), tcxstrsize(compressed))) {
-        set_msg(db, "Can't register doc", tchdberrmsg(tchdbecode(db->doc)));
+    return get_doc_range(db, doc_id, offset, length);
+}
+
+int
+oDB_get_to(oDB* db, o_doc_id_t doc_id, int offset, int length, oSink sink, void* arg)
+{
+    if (!is_valid_range(db, offset, &length)) {
         return 1;
     }
-    tcxstrdel(compressed);
-    return 0;
+    return get_doc_to(db, doc_id, offset, length, sink, arg);
 }
 
-typedef int offset_t;
+struct FdSink {
+    oDB* db;
+    int fd;
+};
+
+typedef struct FdSink FdSink;
 
 static int
-put_index(oDB* db, o_doc_id_t doc_id, o_attr_id_t attr_id, const char* doc)
+write_to_fd(const char* s, size_t size, void* arg)
 {
-    TCMAP* term2pos = tcmapnew();
-    size_t size = strlen(doc);
-    unsigned int pos = 0;
-    offset_t offset = 0;
-    while (pos < size) {
-        const char* pc = &doc[pos];
-        int term_size = get_term_size(pc);
-        tcmapputcat(term2pos, pc, term_size, &offset, sizeof(offset));
-        pos += get_char_size(doc[pos]);
-        offset++;
-    }
-
-    tcmapiterinit(term2pos);
-    int key_size;
-    const void* key;
-    while ((key = tcmapiternext(term2pos, &key_size)) != NULL) {
-        int val_size;
-        const void* val = tcmapget(term2pos, key, key_size, &val_size);
-        assert(val != NULL);
-        assert(val_size % sizeof(int) == 0);
-        int pos_num = val_size / sizeof(int);
-        /**
-         * 2 of (2 + pos_num) is for a document ID and a attribute ID. Each
-         * number in postings needs 8 bytes at most.
-         */
-        char data[(2 + pos_num) * 8];
-        int data_size;
-        compress_posting(doc_id, attr_id, (int*)val, pos_num, data, &data_size);
-        if (!tcbdbputdup(db->index, key, key_size, data, data_size)) {
-            set_msg(db, "Can't register any term", tcbdberrmsg(tcbdbecode(db->index)));
+    FdSink* fd_sink = (FdSink*)arg;
+    while (0 < size) {
+        ssize_t n = write(fd_sink->fd, s, size);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            oDB_set_msg_of_errno(fd_sink->db, "write failed");
             return 1;
         }
+        s += n;
+        size -= n;
     }
-    tcmapdel(term2pos);
-
     return 0;
 }
 
-static void
-normalize_doc(char* dest, const char* src)
+int
+oDB_get_to_fd(oDB* db, o_doc_id_t doc_id, int offset, int length, int fd)
 {
-    BOOL is_prev_alpha = FALSE;
-    char* last = dest - 1;
-    char* p = dest;
-    const char* q;
-    for (q = src; *q != '\0'; q++) {
-        char c = *q;
-        if (isspace(c)) {
-            if (is_prev_alpha) {
-                *p = ' ';
-                p++;
-            }
-            is_prev_alpha = FALSE;
-            continue;
+    FdSink fd_sink;
+    fd_sink.db = db;
+    fd_sink.fd = fd;
+    return oDB_get_to(db, doc_id, offset, length, write_to_fd, &fd_sink);
+}
+
+/**
+ * A document is put piece by piece. oNormalizer, Tokenizer and DocWriter carry
+ * their states from a piece to the next one, so that a whole document is never
+ * held in memory.
+ */
+#define PUT_PIECE_SIZE  (16 * 1024)
+
+typedef int offset_t;
+
+/**
+ * A packed term is a pair of packed characters in a 64-bit integer. A valid
+ * UTF-8 character is packed into its codepoint plus one, so that 0 means no
+ * character. The index needs only to tell characters apart, so an invalid
+ * sequence of three bytes or less is packed into its bytes with the highest
+ * bit, and a longer one into its hash.
+ */
+static uint32_t
+pack_char(const char* c, int size)
+{
+    static const unsigned char lead_masks[] = { 0, 0x7f, 0x1f, 0x0f, 0x07 };
+    static const unsigned char lead_bits[] = { 0, 0x00, 0xc0, 0xe0, 0xf0 };
+    static const uint32_t min_codepoints[] = { 0, 0, 0x80, 0x800, 0x10000 };
+    const unsigned char* u = (const unsigned char*)c;
+    int i;
+    if ((0 < size) && (size < array_sizeof(lead_masks)) && ((u[0] & ~lead_masks[size]) == lead_bits[size])) {
+        uint32_t codepoint = u[0] & lead_masks[size];
+        for (i = 1; i < size; i++) {
+            codepoint = (codepoint << 6) | (u[i] & 0x3f);
+        }
+        if ((min_codepoints[size] <= codepoint) && (codepoint <= 0x10ffff)) {
+            return codepoint + 1;
+        }
+    }
+    if (size <= 3) {
+        uint32_t packed = 0x80000000;
+        for (i = 0; i < size; i++) {
+            packed |= (uint32_t)u[i] << (16 - 8 * i);
         }
-        *p = c;
-        is_prev_alpha = isalpha(c) ? TRUE : FALSE;
-        last = p;
-        p++;
+        return packed;
+    }
+    uint32_t hash = 2166136261u;
+    for (i = 0; i < size; i++) {
+        hash = (hash ^ u[i]) * 16777619u;
     }
-    *(last + 1) = '\0';
+    return 0x40000000 | (hash & 0x3fffffff);
 }
 
-static o_attr_id_t
-get_attr_id(oDB* db, const char* name)
+static uint64_t
+pack_term(uint32_t first, uint32_t second)
 {
-    int sp;
-    o_attr_id_t* pid = (o_attr_id_t*)tchdbget(db->attr2id, name, strlen(name), &sp);
-    if (pid == NULL) {
-        return -1;
-    }
-    return *pid;
+    return ((uint64_t)first << 32) | second;
 }
 
-static int
-put_attr(oDB* db, o_doc_id_t doc_id, o_attr_id_t attr_id, const char* doc)
+/**
+ * TermTable collects positions of packed terms in a document. It is a hash
+ * table of open addressing. Positions of all terms are nodes in one array,
+ * and each term links its own nodes, so that a new term needs no allocation.
+ * Like TCMAP, running out of memory is fatal.
+ */
+struct TermNode {
+    offset_t offset;
+    int next;
+};
+
+typedef struct TermNode TermNode;
+
+struct TermEntry {
+    uint64_t term;
+    int first;
+    int last;
+    int num;
+};
+
+typedef struct TermEntry TermEntry;
+
+struct TermTable {
+    TermEntry* entries;
+    int capacity;
+    int num;
+    TermNode* nodes;
+    int nodes_num;
+    int nodes_capacity;
+};
+
+typedef struct TermTable TermTable;
+
+#define TERM_TABLE_INITIAL_CAPACITY 1024
+
+static void
+TermTable_init(TermTable* table)
 {
-    TCHDB* hdb = db->attrs[attr_id];
-    if (!tchdbput(hdb, &doc_id, sizeof(doc_id), doc, strlen(doc))) {
-        set_msg(db, "Can't put attribute", tchdberrmsg(tchdbecode(hdb)));
-        return 1;
-    }
-    return 0;
+    table->capacity = TERM_TABLE_INITIAL_CAPACITY;
+    table->entries = (TermEntry*)tccalloc(table->capacity, sizeof(TermEntry));
+    table->num = 0;
+    table->nodes_capacity = TERM_TABLE_INITIAL_CAPACITY;
+    table->nodes = (TermNode*)tcmalloc(sizeof(TermNode) * table->nodes_capacity);
+    table->nodes_num = 0;
 }
 
-int
-oDB_put(oDB* db, const char* doc, oAttr attrs[], int attrs_num)
+static void
+TermTable_fini(TermTable* table)
 {
-    o_doc_id_t doc_id = db->next_doc_id;
+    tcfree(table->nodes);
+    tcfree(table->entries);
+}
 
-#define NORMALIZE(normalized, text) do { \
-    normalized = (char*)alloca(strlen((text)) + 1); \
-    normalize_doc(normalized, (text)); \
-} while (0)
-    char* normalized;
-    NORMALIZE(normalized, doc);
-    if (put_index(db, doc_id, -1, normalized) != 0) {
-        return 1;
-    }
-    if (put_doc(db, doc_id, normalized, strlen(normalized)) != 0) {
-        return 1;
+/**
+ * No packed term is 0, so 0 marks an empty entry.
+ */
+static TermEntry*
+TermTable_find(TermEntry* entries, int capacity, uint64_t term)
+{
+    int mask = capacity - 1;
+    int i = (int)((term * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+    while ((entries[i].term != 0) && (entries[i].term != term)) {
+        i = (i + 1) & mask;
     }
+    return &entries[i];
+}
 
+static void
+TermTable_grow(TermTable* table)
+{
+    int capacity = 2 * table->capacity;
+    TermEntry* entries = (TermEntry*)tccalloc(capacity, sizeof(TermEntry));
     int i;
-    for (i = 0; i < attrs_num; i++) {
-        o_attr_id_t attr_id = get_attr_id(db, attrs[i].name);
-        if (attr_id == -1) {
-            return 1;
-        }
-        char* normalized;
-        NORMALIZE(normalized, attrs[i].val);
-        if (put_index(db, doc_id, attr_id, normalized) != 0) {
-            return 1;
-        }
-        if (put_attr(db, doc_id, attr_id, normalized) != 0) {
-            return 1;
+    for (i = 0; i < table->capacity; i++) {
+        TermEntry* entry = &table->entries[i];
+        if (entry->term != 0) {
+            *TermTable_find(entries, capacity, entry->term) = *entry;
         }
     }
-#undef NORMALIZE
+    tcfree(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+}
 
-    db->next_doc_id++;
+static void
+TermTable_add(TermTable* table, uint64_t term, offset_t offset)
+{
+    if (table->capacity < 2 * (table->num + 1)) {
+        TermTable_grow(table);
+    }
+    if (table->nodes_capacity <= table->nodes_num) {
+        table->nodes_capacity *= 2;
+        table->nodes = (TermNode*)tcrealloc(table->nodes, sizeof(TermNode) * table->nodes_capacity);
+    }
+    int node = table->nodes_num;
+    table->nodes[node].offset = offset;
+    table->nodes[node].next = -1;
+    table->nodes_num++;
 
-    return 0;
+    TermEntry* entry = TermTable_find(table->entries, table->capacity, term);
+    if (entry->term == 0) {
+        entry->term = term;
+        entry->first = node;
+        entry->last = node;
+        entry->num = 1;
+        table->num++;
+        return;
+    }
+    table->nodes[entry->last].next = node;
+    entry->last = node;
+    entry->num++;
 }
 
-struct Posting {
-    o_doc_id_t doc_id;
-    o_attr_id_t attr_id;
-    int term_size;
-    offset_t* offset;
-    int offset_size;
+/**
+ * The hybrid tokenizer makes a term of a word of Latin letters and digits, and
+ * terms of every other character and the next one (grams) from the other
+ * characters. ASCII spaces and symbols separate terms and are not indexed.
+ * The bigram tokenizer makes grams of all characters.
+ */
+enum CharClass {
+    CHAR_CLASS_GRAM,
+    CHAR_CLASS_WORD,
+    CHAR_CLASS_SEPARATOR,
 };
 
-typedef struct Posting Posting;
+typedef enum CharClass CharClass;
 
-/**
- * -Werror option stops compile if unused functions found. So I implement this
- * as a macro.
+static CharClass
+classify_char(const char* c, int size)
+{
+    unsigned char u = (unsigned char)c[0];
+    if (size == 1) {
+        BOOL is_alnum = (('0' <= u) && (u <= '9')) || ((unsigned char)((u | 0x20) - 'a') < 26);
+        return is_alnum ? CHAR_CLASS_WORD : CHAR_CLASS_SEPARATOR;
+    }
+    if (size == 2) {
+        /**
+         * Latin letters are U+00C0-U+024F, the letters of Latin-1 Supplement
+         * and Latin Extended-A/B, without the multiplication sign and the
+         * division sign.
+         */
+        uint32_t codepoint = ((u & 0x1f) << 6) | (c[1] & 0x3f);
+        if ((0xc0 <= codepoint) && (codepoint <= 0x24f) && (codepoint != 0xd7) && (codepoint != 0xf7)) {
+            return CHAR_CLASS_WORD;
+        }
+    }
+    return CHAR_CLASS_GRAM;
+}
+
+/**
+ * Words are lowercased. ASCII, Latin-1 and Latin Extended-A/B capitals are
+ * supported, and the lowercase of them has the same size.
  */
-#define DUMP_POSTING_LIST(list) do { \
-    printf("%s:%u <", __FILE__, __LINE__); \
-    int num = tclistnum((list)); \
-    int i; \
-    for (i = 0; i < num; i++) { \
-        Posting* posting = *((Posting**)tclistval2((list), i)); \
-        printf("<%d:%d", posting->doc_id, posting->offset[0]); \
-        int j; \
-        for (j = 1; j < posting->offset_size; j++) { \
-            printf(",%d", posting->offset[j]); \
-        } \
-        printf(">"); \
-    } \
-    printf(">\n"); \
-} while (0)
+static void
+lower_char(char* dest, const char* c, int size)
+{
+    memcpy(dest, c, size);
+    unsigned char u = (unsigned char)c[0];
+    if ((size == 1) && ('A' <= u) && (u <= 'Z')) {
+        dest[0] = u | 0x20;
+        return;
+    }
+    if (size != 2) {
+        return;
+    }
+    unsigned char v = (unsigned char)c[1];
+    if (u == 0xc3) {
+        if ((0x80 <= v) && (v <= 0x9e) && (v != 0x97)) {
+            dest[1] = v | 0x20;
+        }
+        return;
+    }
+    int codepoint = ((u & 0x1f) << 6) | (v & 0x3f);
+    int lower = oNormalize_lower(codepoint);
+    if (lower != codepoint) {
+        dest[0] = 0xc0 | (lower >> 6);
+        dest[1] = 0x80 | (lower & 0x3f);
+    }
+}
+
+/**
+ * An invalid sequence longer than any character is cut into this size.
+ */
+#define CHAR_SIZE_MAX   8
+#define GRAM_SIZE_MAX   3
 
 static int
-decompress_num(const char* p, int* size)
+get_gram_size(oDB* db)
 {
-    int n = 0;
-    int i = 0;
-    char m = 0;
-    int base = 1;
-    do {
-        m = p[i];
-        n += base * (m & 0x7f);
-        base *= 128;
-        i++;
-    } while ((m & 0x80) != 0);
-    *size = i;
-    return n;
+    return db->ngram == NGRAM_TRIGRAM ? 3 : 2;
 }
 
-static Posting*
-Posting_new(oDB* db)
+/**
+ * A gram is gram_size characters in a row. window keeps the last characters,
+ * up to gram_size. At the end of grams, the grams which begin with the rest of
+ * window are shorter. The last character of a piece may continue in the next
+ * piece, so it is kept in partial. A word is kept in word until its end.
+ */
+struct Tokenizer {
+    oIndexFormat format;
+    oTokenizerType type;
+    int gram_size;
+    BOOL has_unigrams;
+    BOOL has_positions;
+    TCMAP* term2pos;
+    TermTable terms;
+    offset_t offset;
+    char window[GRAM_SIZE_MAX][CHAR_SIZE_MAX];
+    int window_sizes[GRAM_SIZE_MAX];
+    uint32_t window_packed[GRAM_SIZE_MAX];
+    int window_num;
+    char partial[CHAR_SIZE_MAX];
+    int partial_size;
+    TCXSTR* word;
+};
+
+typedef struct Tokenizer Tokenizer;
+
+static void
+Tokenizer_init(Tokenizer* tokenizer, oDB* db)
 {
-    Posting* posting = (Posting*)malloc(sizeof(Posting));
-    if (posting == NULL) {
-        oDB_set_msg_of_errno(db, "Can't allocate memory");
-        return NULL;
+    tokenizer->format = db->index_format;
+    tokenizer->type = db->tokenizer;
+    tokenizer->gram_size = get_gram_size(db);
+    tokenizer->has_unigrams = db->ngram == NGRAM_UNIGRAM_BIGRAM;
+    tokenizer->has_positions = db->postings == POSTINGS_POSITIONS;
+    if (tokenizer->format == INDEX_FORMAT_PACKED) {
+        TermTable_init(&tokenizer->terms);
     }
-    posting->doc_id = 0;
-    posting->attr_id = -1;
-    posting->term_size = 0;
-    posting->offset = NULL;
-    posting->offset_size = 0;
-    return posting;
+    else {
+        tokenizer->term2pos = tcmapnew();
+    }
+    tokenizer->offset = 0;
+    tokenizer->window_num = 0;
+    tokenizer->partial_size = 0;
+    tokenizer->word = tcxstrnew();
 }
 
-static Posting*
-Posting_of_offset_size(oDB* db, int offset_size)
+static void
+Tokenizer_fini(Tokenizer* tokenizer)
 {
-    Posting* posting = Posting_new(db);
-    if (posting == NULL) {
-        return NULL;
+    tcxstrdel(tokenizer->word);
+    if (tokenizer->format == INDEX_FORMAT_PACKED) {
+        TermTable_fini(&tokenizer->terms);
+        return;
     }
-    offset_t* offset = (offset_t*)malloc(sizeof(offset_t) * offset_size);
-    if (offset == NULL) {
-        oDB_set_msg_of_errno(db, "malloc failed");
-        return NULL;
+    tcmapdel(tokenizer->term2pos);
+}
+
+/**
+ * Without positions, only the first offset of a term is kept.
+ */
+static void
+add_text_term(Tokenizer* tokenizer, const char* term, int term_size, offset_t offset)
+{
+    if (tokenizer->has_positions) {
+        tcmapputcat(tokenizer->term2pos, term, term_size, &offset, sizeof(offset));
+        return;
     }
-    posting->offset = offset;
-    posting->offset_size = offset_size;
-    return posting;
+    tcmapputkeep(tokenizer->term2pos, term, term_size, &offset, sizeof(offset));
 }
 
-static Posting*
-decompress_posting(oDB* db, const char* compressed_posting)
+/**
+ * Adds a gram of window[from] to window[to - 1]. A packed index has grams of
+ * two characters at most.
+ */
+static void
+add_gram(Tokenizer* tokenizer, int from, int to)
 {
-    Posting* posting = Posting_new(db);
-    if (posting == NULL) {
-        return NULL;
+    offset_t offset = tokenizer->offset - tokenizer->window_num + from;
+    if (tokenizer->format == INDEX_FORMAT_PACKED) {
+        uint32_t second = from + 1 < to ? tokenizer->window_packed[from + 1] : 0;
+        uint64_t term = pack_term(tokenizer->window_packed[from], second);
+        TermTable* terms = &tokenizer->terms;
+        if (!tokenizer->has_positions && (TermTable_find(terms->entries, terms->capacity, term)->term == term)) {
+            return;
+        }
+        TermTable_add(terms, term, offset);
+        return;
     }
-    const char* p = compressed_posting;
-#define DECOMPRESS(num) do { \
-    int size; \
-    num = decompress_num(p, &size); \
-    p += size; \
-} while (0)
-    o_doc_id_t tagged_doc_id;
-    DECOMPRESS(tagged_doc_id);
-    posting->doc_id = tagged_doc_id >> 1;
-    if ((tagged_doc_id & 1) != 0) {
-        o_attr_id_t attr_id;
-        DECOMPRESS(attr_id);
-        posting->attr_id = attr_id;
+    char term[GRAM_SIZE_MAX * CHAR_SIZE_MAX];
+    int term_size = 0;
+    int i;
+    for (i = from; i < to; i++) {
+        memcpy(&term[term_size], tokenizer->window[i], tokenizer->window_sizes[i]);
+        term_size += tokenizer->window_sizes[i];
     }
+    add_text_term(tokenizer, term, term_size, offset);
+}
 
-    int offset_size;
-    DECOMPRESS(offset_size);
-    posting->offset_size = offset_size;
-    offset_t* offset = (offset_t*)malloc(sizeof(offset_t) * offset_size);
-    if (offset == NULL) {
-        oDB_set_msg_of_errno(db, "Can't allocate offset");
-        return NULL;
+static void
+push_gram_char(Tokenizer* tokenizer, const char* c, int size)
+{
+    int gram_size = tokenizer->gram_size;
+    int n = tokenizer->window_num;
+    if (n == gram_size) {
+        memmove(tokenizer->window[0], tokenizer->window[1], sizeof(tokenizer->window[0]) * (n - 1));
+        memmove(&tokenizer->window_sizes[0], &tokenizer->window_sizes[1], sizeof(tokenizer->window_sizes[0]) * (n - 1));
+        memmove(&tokenizer->window_packed[0], &tokenizer->window_packed[1], sizeof(tokenizer->window_packed[0]) * (n - 1));
+        n--;
     }
-    posting->offset = offset;
-
-    int i;
-    for (i = 0; i < offset_size; i++) {
-        offset_t offset;
-        DECOMPRESS(offset);
-        posting->offset[i] = offset;
+    memcpy(tokenizer->window[n], c, size);
+    tokenizer->window_sizes[n] = size;
+    if (tokenizer->format == INDEX_FORMAT_PACKED) {
+        tokenizer->window_packed[n] = pack_char(c, size);
     }
-#undef DECOMPRESS
+    n++;
+    tokenizer->window_num = n;
+    tokenizer->offset++;
+    if (tokenizer->has_unigrams) {
+        add_gram(tokenizer, n - 1, n);
+    }
+    if (n == gram_size) {
+        add_gram(tokenizer, 0, n);
+    }
+}
 
-    return posting;
+/**
+ * Characters at the end of grams begin shorter grams.
+ */
+static void
+end_grams(Tokenizer* tokenizer)
+{
+    int n = tokenizer->window_num;
+    int from = n == tokenizer->gram_size ? 1 : 0;
+    int min_size = tokenizer->has_unigrams ? 2 : 1;
+    for (; from <= n - min_size; from++) {
+        add_gram(tokenizer, from, n);
+    }
+    tokenizer->window_num = 0;
 }
 
-static TCLIST*
-search_posting_list(oDB* db, const char* term, int term_size)
+static void
+end_word(Tokenizer* tokenizer)
 {
-    TCLIST* compressed_posting_list = tcbdbget4(db->index, term, term_size);
-    TCLIST* posting_list = tclistnew();
-    if (compressed_posting_list == NULL) {
-        return posting_list;
+    int size = tcxstrsize(tokenizer->word);
+    if (size == 0) {
+        return;
     }
+    offset_t offset = tokenizer->offset;
+    add_text_term(tokenizer, tcxstrptr(tokenizer->word), size, offset);
+    tcxstrclear(tokenizer->word);
+    tokenizer->offset++;
+}
 
-    int num = tclistnum(compressed_posting_list);
-    int i;
-    for (i = 0; i < num; i++) {
-        const char* compressed_posting = tclistval2(compressed_posting_list, i);
-        Posting* posting = decompress_posting(db, compressed_posting);
-        if (posting == NULL) {
-            return NULL;
-        }
-        posting->term_size = BIGRAM_SIZE;
-        tclistpush(posting_list, &posting, sizeof(posting));
+static void
+push_char(Tokenizer* tokenizer, const char* c, int size)
+{
+    if (CHAR_SIZE_MAX < size) {
+        size = CHAR_SIZE_MAX;
     }
-    tclistdel(compressed_posting_list);
-    return posting_list;
+    if (tokenizer->type == TOKENIZER_BIGRAM) {
+        push_gram_char(tokenizer, c, size);
+        return;
+    }
+    CharClass cls = classify_char(c, size);
+    if (cls == CHAR_CLASS_GRAM) {
+        end_word(tokenizer);
+        push_gram_char(tokenizer, c, size);
+        return;
+    }
+    end_grams(tokenizer);
+    if (cls == CHAR_CLASS_SEPARATOR) {
+        end_word(tokenizer);
+        return;
+    }
+    char lower[CHAR_SIZE_MAX];
+    lower_char(lower, c, size);
+    tcxstrcat(tokenizer->word, lower, size);
 }
 
 static void
-Posting_delete(oDB* db, Posting* posting)
+append_partial(Tokenizer* tokenizer, const char* s, size_t size)
 {
-    free(posting->offset);
-    free(posting);
+    size_t room = array_sizeof(tokenizer->partial) - tokenizer->partial_size;
+    size_t n = size < room ? size : room;
+    memcpy(&tokenizer->partial[tokenizer->partial_size], s, n);
+    tokenizer->partial_size += n;
 }
 
-static TCLIST*
-intersect(oDB* db, TCLIST* posting_list1, TCLIST* posting_list2, int gap)
+/**
+ * Offsets of characters are found in a window at a time, so that bigrams are
+ * made in a tight loop without a buffer on the heap.
+ */
+#define TOKENIZE_WINDOW_SIZE    (4 * 1024)
+
+static void
+tokenize(Tokenizer* tokenizer, const char* s, size_t size)
 {
-    /**
-     * This function assume that postings stand in ascending order of the
-     * document ID. It seems depend on Tokyo Cabinet implementation.
-     */
-    TCLIST* result = tclistnew();
-    int num1 = tclistnum(posting_list1);
-    int num2 = tclistnum(posting_list2);
-    int i = 0;
-    int j = 0;
-    while ((i < num1) && (j < num2)) {
-        Posting* posting1 = *((Posting**)tclistval2(posting_list1, i));
-        Posting* posting2 = *((Posting**)tclistval2(posting_list2, j));
-        if (posting1->doc_id < posting2->doc_id) {
-            i++;
-            continue;
-        }
-        if (posting2->doc_id < posting1->doc_id) {
-            j++;
-            continue;
+    uint32_t offsets[TOKENIZE_WINDOW_SIZE];
+    size_t pos = 0;
+    while (pos < size) {
+        const char* window = &s[pos];
+        size_t window_size = size - pos;
+        if (TOKENIZE_WINDOW_SIZE < window_size) {
+            window_size = TOKENIZE_WINDOW_SIZE;
         }
-        if (posting1->attr_id < posting2->attr_id) {
-            i++;
-            continue;
+        pos += window_size;
+        size_t chars_num = oUTF8_scan(window, window_size, offsets);
+        /**
+         * Continuation bytes without a leading byte are ignored.
+         */
+        size_t head = 0 < chars_num ? offsets[0] : window_size;
+        if (0 < tokenizer->partial_size) {
+            append_partial(tokenizer, window, head);
         }
-        if (posting2->attr_id < posting1->attr_id) {
-            j++;
+        if (chars_num == 0) {
             continue;
         }
-
-        int offset_size_min = posting1->offset_size < posting2->offset_size ? posting1->offset_size : posting2->offset_size;
-        offset_t offset[offset_size_min];
-        int offset_size = 0;
-        int k = 0;
-        int l = 0;
-        while ((k < posting1->offset_size) && (l < posting2->offset_size)) {
-            int end_offset = posting1->offset[k] + gap;
-            if (end_offset < posting2->offset[l]) {
-                k++;
-                continue;
-            }
-            if (posting2->offset[l] < end_offset) {
-                l++;
-                continue;
-            }
-            offset[offset_size] = posting1->offset[k];
-            offset_size++;
-            k++;
-            l++;
+        if (0 < tokenizer->partial_size) {
+            push_char(tokenizer, tokenizer->partial, tokenizer->partial_size);
         }
-        if (0 < offset_size) {
-            Posting* posting = Posting_of_offset_size(db, offset_size);
-            if (posting == NULL) {
-                return NULL;
-            }
-            posting->doc_id = posting1->doc_id;
-            posting->term_size = posting2->offset[l] + posting2->term_size - posting1->offset[k];
-            memcpy(posting->offset, offset, sizeof(offset[0]) * offset_size);
-            posting->offset_size = offset_size;
-            tclistpush(result, &posting, sizeof(posting));
+        size_t i;
+        for (i = 0; i + 1 < chars_num; i++) {
+            push_char(tokenizer, &window[offsets[i]], offsets[i + 1] - offsets[i]);
         }
-
-        i++;
-        j++;
+        tokenizer->partial_size = 0;
+        append_partial(tokenizer, &window[offsets[i]], window_size - offsets[i]);
     }
-
-    return result;
 }
 
 static void
-delete_posting_list(oDB* db, TCLIST* posting_list)
+finish_tokenizing(Tokenizer* tokenizer)
 {
-    int num = tclistnum(posting_list);
-    int i;
-    for (i = 0; i < num; i++) {
-        Posting* posting = *((Posting**)tclistval2(posting_list, i));
-        Posting_delete(db, posting);
+    if (0 < tokenizer->partial_size) {
+        push_char(tokenizer, tokenizer->partial, tokenizer->partial_size);
+        tokenizer->partial_size = 0;
     }
-    tclistdel(posting_list);
+    end_word(tokenizer);
+    end_grams(tokenizer);
 }
 
-static unsigned int
-count_chars(const char* s)
+static int
+put_posting(oDB* db, const void* term, int term_size, o_doc_id_t doc_id, o_attr_id_t attr_id, int* pos, int pos_num)
 {
-    unsigned int n = 0;
-    const char* pc = s;
-    while (*pc != '\0') {
-        pc += get_char_size(*pc);
-        n++;
-    };
-    return n;
+    /**
+     * 2 of (2 + pos_num) is for a document ID and a attribute ID. Each number
+     * in postings needs 8 bytes at most. A frequent term in a large document
+     * can have too many positions for the stack. A posting in memory follows
+     * its size.
+     */
+    char buf[256];
+    uint32_t size;
+    size_t capacity = sizeof(size) + (2 + (size_t)pos_num) * 8;
+    char* data = capacity <= sizeof(buf) ? buf : (char*)malloc(capacity);
+    if (data == NULL) {
+        oDB_set_msg_of_errno(db, "Can't allocate posting");
+        return 1;
+    }
+    int data_size;
+    compress_posting(doc_id, attr_id, pos, db->postings == POSTINGS_DOCS ? 0 : pos_num, data + sizeof(size), &data_size);
+    size = data_size;
+    memcpy(data, &size, sizeof(size));
+    tctreeputcat(db->writing->postings, term, term_size, data, sizeof(size) + data_size);
+    if (data != buf) {
+        free(data);
+    }
+    return 0;
+}
+
+/**
+ * Same order as tccmpint64().
+ */
+static int
+compare_term_entries(const void* a, const void* b)
+{
+    int64_t x = (int64_t)((const TermEntry*)a)->term;
+    int64_t y = (int64_t)((const TermEntry*)b)->term;
+    return x < y ? -1 : x > y;
+}
+
+static int
+put_packed_postings(oDB* db, o_doc_id_t doc_id, o_attr_id_t attr_id, TermTable* table)
+{
+    int* pos = (int*)malloc(sizeof(int) * (table->nodes_num + 1));
+    if (pos == NULL) {
+        oDB_set_msg_of_errno(db, "Can't allocate positions");
+        return 1;
+    }
+    /**
+     * Terms are put in the order of the index, so that each leaf of the
+     * index is visited once.
+     */
+    int num = 0;
+    int i;
+    for (i = 0; i < table->capacity; i++) {
+        if (table->entries[i].term != 0) {
+            table->entries[num] = table->entries[i];
+            num++;
+        }
+    }
+    qsort(table->entries, num, sizeof(TermEntry), compare_term_entries);
+    table->capacity = 0;
+    int status = 0;
+    for (i = 0; (i < num) && (status == 0); i++) {
+        TermEntry* entry = &table->entries[i];
+        int pos_num = 0;
+        int node;
+        for (node = entry->first; node != -1; node = table->nodes[node].next) {
+            pos[pos_num] = table->nodes[node].offset;
+            pos_num++;
+        }
+        status = put_posting(db, &entry->term, sizeof(entry->term), doc_id, attr_id, pos, pos_num);
+    }
+    free(pos);
+    return status;
+}
+
+static int
+put_postings(oDB* db, o_doc_id_t doc_id, o_attr_id_t attr_id, Tokenizer* tokenizer)
+{
+    if (tokenizer->format == INDEX_FORMAT_PACKED) {
+        return put_packed_postings(db, doc_id, attr_id, &tokenizer->terms);
+    }
+    TCMAP* term2pos = tokenizer->term2pos;
+    tcmapiterinit(term2pos);
+    int key_size;
+    const void* key;
+    while ((key = tcmapiternext(term2pos, &key_size)) != NULL) {
+        int val_size;
+        const void* val = tcmapget(term2pos, key, key_size, &val_size);
+        assert(val != NULL);
+        assert(val_size % sizeof(int) == 0);
+        int pos_num = val_size / sizeof(int);
+        if (put_posting(db, key, key_size, doc_id, attr_id, (int*)val, pos_num) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+put_index(oDB* db, o_doc_id_t doc_id, o_attr_id_t attr_id, const char* doc)
+{
+    Tokenizer tokenizer;
+    Tokenizer_init(&tokenizer, db);
+    tokenize(&tokenizer, doc, strlen(doc));
+    finish_tokenizing(&tokenizer);
+    int status = put_postings(db, doc_id, attr_id, &tokenizer);
+    Tokenizer_fini(&tokenizer);
+    return status;
+}
+
+/**
+ * DocWriter compresses a document as it comes. A deflated stream goes to a
+ * document log as soon as it is compressed. A chunked document is compressed
+ * block by block, but the block table precedes the blocks, so the compressed
+ * blocks are kept until the end. Codecs which need the size of a whole
+ * document keep uncompressed text until the end.
+ */
+struct DocWriter {
+    void* stream;
+    TCXSTR* text;
+    TCXSTR* table;
+    TCXSTR* body;
+    int blocks_num;
+    size_t written;
+};
+
+typedef struct DocWriter DocWriter;
+
+static void
+DocWriter_fini(oDB* db, DocWriter* writer)
+{
+    if (writer->stream != NULL) {
+        db->codec->stream_del(writer->stream);
+    }
+    tcxstrdel(writer->body);
+    tcxstrdel(writer->table);
+    tcxstrdel(writer->text);
+}
+
+static int
+DocWriter_init(oDB* db, DocWriter* writer)
+{
+    writer->stream = NULL;
+    writer->text = tcxstrnew();
+    writer->table = tcxstrnew();
+    writer->body = tcxstrnew();
+    writer->blocks_num = 0;
+    writer->written = 0;
+    BOOL is_stream = (db->doc_format == DOC_FORMAT_STREAM) && !is_size_prefixed(db);
+    if (is_stream && (db->codec->stream_new != NULL)) {
+        writer->stream = db->codec->stream_new(db);
+        if (writer->stream == NULL) {
+            DocWriter_fini(db, writer);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+compress_block(oDB* db, DocWriter* writer, const char* s, size_t size)
+{
+    int body_size = tcxstrsize(writer->body);
+    if (db->codec->compress(db, s, size, writer->body) != 0) {
+        return 1;
+    }
+    append_num(writer->table, oUTF8_count(s, size));
+    append_num(writer->table, size);
+    append_num(writer->table, tcxstrsize(writer->body) - body_size);
+    writer->blocks_num++;
+    return 0;
+}
+
+/**
+ * Compresses full blocks in the text. A block ends at a character boundary. If
+ * finish is TRUE, the rest of the text makes the last block.
+ */
+static int
+compress_blocks(oDB* db, DocWriter* writer, BOOL finish)
+{
+    const char* text = tcxstrptr(writer->text);
+    size_t size = tcxstrsize(writer->text);
+    size_t pos = 0;
+    while (pos < size) {
+        size_t end = pos + DOC_BLOCK_SIZE;
+        if (size <= end) {
+            if (!finish) {
+                break;
+            }
+            end = size;
+        }
+        else {
+            while ((text[end] & 0xc0) == 0x80) {
+                end--;
+            }
+        }
+        if (compress_block(db, writer, &text[pos], end - pos) != 0) {
+            return 1;
+        }
+        pos = end;
+    }
+    if (0 < pos) {
+        TCXSTR* rest = tcxstrnew();
+        tcxstrcat(rest, &text[pos], size - pos);
+        tcxstrdel(writer->text);
+        writer->text = rest;
+    }
+    return 0;
+}
+
+static int
+DocWriter_write(oDB* db, DocWriter* writer, const char* s, size_t size)
+{
+    if (writer->stream == NULL) {
+        tcxstrcat(writer->text, s, size);
+        if (db->doc_format == DOC_FORMAT_CHUNKED) {
+            return compress_blocks(db, writer, FALSE);
+        }
+        return 0;
+    }
+    if (db->codec->stream_write(db, writer->stream, s, size, FALSE, writer->body) != 0) {
+        return 1;
+    }
+    if (db->doc_store != DOC_STORE_LOG) {
+        return 0;
+    }
+    const char* body = tcxstrptr(writer->body);
+    int body_size = tcxstrsize(writer->body);
+    if (oDocLog_write(db, db->writing->doc_log, writer->written, body, body_size) != 0) {
+        return 1;
+    }
+    writer->written += body_size;
+    tcxstrclear(writer->body);
+    return 0;
+}
+
+/**
+ * head gets what precedes the body of a document.
+ */
+static int
+finish_body(oDB* db, DocWriter* writer, TCXSTR* head)
+{
+    if (writer->stream != NULL) {
+        return db->codec->stream_write(db, writer->stream, "", 0, TRUE, writer->body);
+    }
+    if (db->doc_format == DOC_FORMAT_CHUNKED) {
+        if (compress_blocks(db, writer, TRUE) != 0) {
+            return 1;
+        }
+        append_num(head, writer->blocks_num);
+        tcxstrcat(head, tcxstrptr(writer->table), tcxstrsize(writer->table));
+        return 0;
+    }
+    const char* text = tcxstrptr(writer->text);
+    int size = tcxstrsize(writer->text);
+    if (is_size_prefixed(db)) {
+        append_num(head, size);
+    }
+    return db->codec->compress(db, text, size, writer->body);
+}
+
+static int
+store_doc(oDB* db, DocWriter* writer, o_doc_id_t doc_id, TCXSTR* head)
+{
+    const char* body = tcxstrptr(writer->body);
+    int body_size = tcxstrsize(writer->body);
+    if (db->doc_store == DOC_STORE_LOG) {
+        oDocLog* log = db->writing->doc_log;
+        size_t pos = writer->written;
+        int head_size = tcxstrsize(head);
+        if (oDocLog_write(db, log, pos, tcxstrptr(head), head_size) != 0) {
+            return 1;
+        }
+        if (oDocLog_write(db, log, pos + head_size, body, body_size) != 0) {
+            return 1;
+        }
+        return oDocLog_commit(db, log, doc_id, pos + head_size + body_size);
+    }
+    tcxstrcat(head, body, body_size);
+    TCHDB* doc = db->writing->doc;
+    if (!tchdbput(doc, &doc_id, sizeof(doc_id), tcxstrptr(head), tcxstrsize(head))) {
+        set_msg(db, "Can't register doc", tchdberrmsg(tchdbecode(doc)));
+        return 1;
+    }
+    return 0;
+}
+
+static int
+DocWriter_finish(oDB* db, DocWriter* writer, o_doc_id_t doc_id)
+{
+    TCXSTR* head = tcxstrnew();
+    int status = finish_body(db, writer, head);
+    if (status == 0) {
+        status = store_doc(db, writer, doc_id, head);
+    }
+    tcxstrdel(head);
+    return status;
+}
+
+static o_attr_id_t
+get_attr_id(oDB* db, const char* name)
+{
+    int sp;
+    o_attr_id_t* pid = (o_attr_id_t*)tchdbget(db->attr2id, name, strlen(name), &sp);
+    if (pid == NULL) {
+        return -1;
+    }
+    o_attr_id_t id = *pid;
+    free(pid);
+    return id;
+}
+
+/**
+ * An attribute of a document is in the segment of the document.
+ */
+static char*
+read_attr(oDB* db, o_doc_id_t doc_id, o_attr_id_t attr_id, int* size)
+{
+    oSegment* segment = oSegment_find(db, doc_id);
+    if ((segment == NULL) || (segment->attrs[attr_id] == NULL)) {
+        return NULL;
+    }
+    return (char*)tchdbget(segment->attrs[attr_id], &doc_id, sizeof(doc_id), size);
+}
+
+static int
+put_attr(oDB* db, o_doc_id_t doc_id, o_attr_id_t attr_id, const char* doc)
+{
+    TCHDB* hdb = db->writing->attrs[attr_id];
+    if (!tchdbput(hdb, &doc_id, sizeof(doc_id), doc, strlen(doc))) {
+        set_msg(db, "Can't put attribute", tchdberrmsg(tchdbecode(hdb)));
+        return 1;
+    }
+    return 0;
+}
+
+static int
+put_attrs(oDB* db, o_doc_id_t doc_id, oAttr attrs[], int attrs_num)
+{
+    int i;
+    for (i = 0; i < attrs_num; i++) {
+        o_attr_id_t attr_id = get_attr_id(db, attrs[i].name);
+        if (attr_id == -1) {
+            set_msg(db, "Unknown attribute", attrs[i].name);
+            return 1;
+        }
+        char* normalized = (char*)malloc(strlen(attrs[i].val) + 1);
+        if (normalized == NULL) {
+            oDB_set_msg_of_errno(db, "malloc failed");
+            return 1;
+        }
+        oNormalize(normalized, attrs[i].val, db->tokenizer);
+        int status = put_index(db, doc_id, attr_id, normalized);
+        if (status == 0) {
+            status = put_attr(db, doc_id, attr_id, normalized);
+        }
+        free(normalized);
+        if (status != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * The document is written to the write-ahead log as it is given while
+ * is_logging.
+ */
+struct oPut {
+    o_doc_id_t doc_id;
+    oNormalizer normalizer;
+    Tokenizer tokenizer;
+    DocWriter writer;
+    BOOL is_logging;
+};
+
+oPut*
+oDB_put_begin(oDB* db)
+{
+    if (oSegment_get_writing(db) == NULL) {
+        return NULL;
+    }
+    oPut* put = (oPut*)malloc(sizeof(oPut));
+    if (put == NULL) {
+        oDB_set_msg_of_errno(db, "malloc failed");
+        return NULL;
+    }
+    if (DocWriter_init(db, &put->writer) != 0) {
+        free(put);
+        return NULL;
+    }
+    put->doc_id = db->next_doc_id;
+    oNormalizer_init(&put->normalizer, db->tokenizer);
+    Tokenizer_init(&put->tokenizer, db);
+    put->is_logging = FALSE;
+    if ((db->wal != NULL) && (oWAL_begin(db, db->wal, put->doc_id) != 0)) {
+        oDB_put_abort(db, put);
+        return NULL;
+    }
+    put->is_logging = db->wal != NULL;
+    return put;
+}
+
+int
+oDB_put_write(oDB* db, oPut* put, const char* s, size_t size)
+{
+    if (put->is_logging && (oWAL_write(db, db->wal, s, size) != 0)) {
+        return 1;
+    }
+    char buf[PUT_PIECE_SIZE + NORMALIZE_MARGIN];
+    size_t pos = 0;
+    while (pos < size) {
+        size_t piece_size = size - pos;
+        if (PUT_PIECE_SIZE < piece_size) {
+            piece_size = PUT_PIECE_SIZE;
+        }
+        size_t normalized_size = oNormalizer_normalize(&put->normalizer, buf, &s[pos], piece_size);
+        tokenize(&put->tokenizer, buf, normalized_size);
+        if (DocWriter_write(db, &put->writer, buf, normalized_size) != 0) {
+            return 1;
+        }
+        pos += piece_size;
+    }
+    return 0;
+}
+
+void
+oDB_put_abort(oDB* db, oPut* put)
+{
+    DocWriter_fini(db, &put->writer);
+    Tokenizer_fini(&put->tokenizer);
+    if (put->is_logging) {
+        oWAL_abort(db, db->wal);
+    }
+    free(put);
+}
+
+/**
+ * Removes postings and attributes of a document which failed to be put, so
+ * that the next document, which takes the same ID, doesn't get them. The
+ * postings are the last of their terms in the buffer.
+ */
+static void
+unput_doc(oDB* db, o_doc_id_t doc_id)
+{
+    TCTREE* postings = db->writing->postings;
+    TCLIST* keys = tclistnew();
+    TCLIST* vals = tclistnew();
+    tctreeiterinit(postings);
+    int key_size;
+    const char* key;
+    while ((key = (const char*)tctreeiternext(postings, &key_size)) != NULL) {
+        int size;
+        const char* val = (const char*)tctreeget(postings, key, key_size, &size);
+        const char* p = val;
+        const char* end = val + size;
+        while (p < end) {
+            uint32_t posting_size;
+            memcpy(&posting_size, p, sizeof(posting_size));
+            int n;
+            if ((decompress_num(p + sizeof(posting_size), &n) >> 1) == doc_id) {
+                break;
+            }
+            p += sizeof(posting_size) + posting_size;
+        }
+        if (p < end) {
+            tclistpush(keys, key, key_size);
+            tclistpush(vals, val, p - val);
+        }
+    }
+    int i;
+    for (i = 0; i < tclistnum(keys); i++) {
+        int size;
+        const char* k = (const char*)tclistval(keys, i, &key_size);
+        const char* v = (const char*)tclistval(vals, i, &size);
+        if (size == 0) {
+            tctreeout(postings, k, key_size);
+        }
+        else {
+            tctreeput(postings, k, key_size, v, size);
+        }
+    }
+    tclistdel(vals);
+    tclistdel(keys);
+    for (i = 0; i < MAX_ATTRS; i++) {
+        TCHDB* hdb = db->writing->attrs[i];
+        if (hdb != NULL) {
+            tchdbout(hdb, &doc_id, sizeof(doc_id));
+        }
+    }
+}
+
+int
+oDB_put_end(oDB* db, oPut* put, oAttr attrs[], int attrs_num)
+{
+    char buf[NORMALIZE_MARGIN];
+    size_t size = oNormalizer_finish(&put->normalizer, buf);
+    tokenize(&put->tokenizer, buf, size);
+    finish_tokenizing(&put->tokenizer);
+    int status = DocWriter_write(db, &put->writer, buf, size);
+    if (status == 0) {
+        status = put_postings(db, put->doc_id, -1, &put->tokenizer);
+    }
+    if (status == 0) {
+        status = DocWriter_finish(db, &put->writer, put->doc_id);
+    }
+    if (status == 0) {
+        status = put_attrs(db, put->doc_id, attrs, attrs_num);
+    }
+    if ((status == 0) && put->is_logging) {
+        /**
+         * A record which failed is removed by oDB_put_abort() below.
+         */
+        status = oWAL_end(db, db->wal, attrs, attrs_num);
+        put->is_logging = status != 0;
+    }
+    if (status != 0) {
+        unput_doc(db, put->doc_id);
+        oDB_put_abort(db, put);
+        return status;
+    }
+    db->next_doc_id++;
+    db->writing->end_doc_id = db->next_doc_id;
+    if (db->buffer_size <= tctreemsiz(db->writing->postings)) {
+        status = oSegment_flush(db, db->writing);
+    }
+    oDB_put_abort(db, put);
+    return status;
+}
+
+int
+oDB_put(oDB* db, const char* doc, oAttr attrs[], int attrs_num)
+{
+    oPut* put = oDB_put_begin(db);
+    if (put == NULL) {
+        return 1;
+    }
+    if (oDB_put_write(db, put, doc, strlen(doc)) != 0) {
+        oDB_put_abort(db, put);
+        return 1;
+    }
+    return oDB_put_end(db, put, attrs, attrs_num);
+}
+
+/**
+ * Documents are stored normalized, so a dictionary must be trained with
+ * normalized samples too.
+ */
+int
+oDB_train_dict(oDB* db, const char* samples[], int samples_num)
+{
+    const char* normalized[samples_num + 1];
+    int sizes[samples_num + 1];
+    int status = 0;
+    int i;
+    for (i = 0; i < samples_num; i++) {
+        char* s = (char*)malloc(strlen(samples[i]) + 1);
+        if (s == NULL) {
+            oDB_set_msg_of_errno(db, "malloc failed");
+            status = 1;
+            break;
+        }
+        oNormalize(s, samples[i], db->tokenizer);
+        normalized[i] = s;
+        sizes[i] = strlen(s);
+    }
+    if (status == 0) {
+        TCXSTR* dict = tcxstrnew();
+        status = oCodec_train(db, db->codec, normalized, sizes, samples_num, dict);
+        if ((status == 0) && (0 < tcxstrsize(dict))) {
+            free(db->dict);
+            db->dict_size = tcxstrsize(dict);
+            db->dict = tcxstrtomalloc(dict);
+        }
+        else {
+            tcxstrdel(dict);
+        }
+    }
+    int j;
+    for (j = 0; j < i; j++) {
+        free((char*)normalized[j]);
+    }
+    return status;
+}
+
+struct Posting {
+    o_doc_id_t doc_id;
+    o_attr_id_t attr_id;
+    int term_size;
+    offset_t* offset;
+    int offset_size;
+};
+
+typedef struct Posting Posting;
+
+/**
+ * -Werror option stops compile if unused functions found. So I implement this
+ * as a macro.
+ */
+#define DUMP_POSTING_LIST(list) do { \
+    printf("%s:%u <", __FILE__, __LINE__); \
+    int num = tclistnum((list)); \
+    int i; \
+    for (i = 0; i < num; i++) { \
+        Posting* posting = *((Posting**)tclistval2((list), i)); \
+        printf("<%d:%d", posting->doc_id, posting->offset[0]); \
+        int j; \
+        for (j = 1; j < posting->offset_size; j++) { \
+            printf(",%d", posting->offset[j]); \
+        } \
+        printf(">"); \
+    } \
+    printf(">\n"); \
+} while (0)
+
+static Posting*
+Posting_new(oDB* db)
+{
+    Posting* posting = (Posting*)malloc(sizeof(Posting));
+    if (posting == NULL) {
+        oDB_set_msg_of_errno(db, "Can't allocate memory");
+        return NULL;
+    }
+    posting->doc_id = 0;
+    posting->attr_id = -1;
+    posting->term_size = 0;
+    posting->offset = NULL;
+    posting->offset_size = 0;
+    return posting;
+}
+
+static Posting*
+Posting_of_offset_size(oDB* db, int offset_size)
+{
+    Posting* posting = Posting_new(db);
+    if (posting == NULL) {
+        return NULL;
+    }
+    offset_t* offset = (offset_t*)malloc(sizeof(offset_t) * offset_size);
+    if (offset == NULL) {
+        oDB_set_msg_of_errno(db, "malloc failed");
+        return NULL;
+    }
+    posting->offset = offset;
+    posting->offset_size = offset_size;
+    return posting;
+}
+
+/**
+ * Counts work for oDB_explain(). db->stats is NULL unless a query is
+ * explained.
+ */
+#define COUNT_STATS(db, field, n) do { \
+    if ((db)->stats != NULL) { \
+        (db)->stats->field += (n); \
+    } \
+} while (0)
+
+static Posting*
+decompress_posting(oDB* db, const char* compressed_posting)
+{
+    Posting* posting = Posting_new(db);
+    if (posting == NULL) {
+        return NULL;
+    }
+    const char* p = compressed_posting;
+#define DECOMPRESS(num) do { \
+    int size; \
+    num = decompress_num(p, &size); \
+    p += size; \
+} while (0)
+    o_doc_id_t tagged_doc_id;
+    DECOMPRESS(tagged_doc_id);
+    posting->doc_id = tagged_doc_id >> 1;
+    if ((tagged_doc_id & 1) != 0) {
+        o_attr_id_t attr_id;
+        DECOMPRESS(attr_id);
+        posting->attr_id = attr_id;
+    }
+
+    int offset_size;
+    DECOMPRESS(offset_size);
+    posting->offset_size = offset_size;
+    offset_t* offset = (offset_t*)malloc(sizeof(offset_t) * offset_size);
+    if (offset == NULL) {
+        oDB_set_msg_of_errno(db, "Can't allocate offset");
+        return NULL;
+    }
+    posting->offset = offset;
+
+    int i;
+    for (i = 0; i < offset_size; i++) {
+        offset_t offset;
+        DECOMPRESS(offset);
+        posting->offset[i] = offset;
+    }
+#undef DECOMPRESS
+    COUNT_STATS(db, postings, 1);
+    COUNT_STATS(db, bytes, p - compressed_posting);
+
+    return posting;
+}
+
+/**
+ * Postings of segments are concatenated in the order of segments, which is
+ * the order of document IDs. Postings in memory follow ones in the index of
+ * the same segment.
+ */
+static TCLIST*
+read_segments(oDB* db, const void* key, int key_size)
+{
+    TCLIST* posting_list = NULL;
+    int i;
+    for (i = 0; i < db->segments_num; i++) {
+        oSegment* segment = db->segments[i];
+        TCLIST* list = tcbdbget4(segment->index, key, key_size);
+        if ((list != NULL) && (posting_list == NULL)) {
+            posting_list = list;
+        }
+        else if (list != NULL) {
+            int j;
+            for (j = 0; j < tclistnum(list); j++) {
+                int size;
+                const char* posting = (const char*)tclistval(list, j, &size);
+                tclistpush(posting_list, posting, size);
+            }
+            tclistdel(list);
+        }
+        if (segment->postings == NULL) {
+            continue;
+        }
+        int size;
+        const char* p = (const char*)tctreeget(segment->postings, key, key_size, &size);
+        if (p == NULL) {
+            continue;
+        }
+        if (posting_list == NULL) {
+            posting_list = tclistnew();
+        }
+        oSegment_split_postings(p, size, posting_list);
+    }
+    return posting_list;
+}
+
+static TCLIST*
+read_compressed_posting_list(oDB* db, const char* term, int term_size)
+{
+    if (db->index_format != INDEX_FORMAT_PACKED) {
+        return read_segments(db, term, term_size);
+    }
+    uint32_t offsets[term_size + 1];
+    size_t chars_num = oUTF8_scan(term, term_size, offsets);
+    if (chars_num == 0) {
+        return NULL;
+    }
+    offsets[chars_num] = term_size;
+    uint32_t first = pack_char(term, offsets[1]);
+    uint32_t second = 0;
+    if (1 < chars_num) {
+        second = pack_char(&term[offsets[1]], term_size - offsets[1]);
+    }
+    uint64_t key = pack_term(first, second);
+    return read_segments(db, &key, sizeof(key));
+}
+
+static TCLIST*
+get_compressed_posting_list(oDB* db, const char* term, int term_size)
+{
+    TCLIST* posting_list = read_compressed_posting_list(db, term, term_size);
+    if (db->stats == NULL) {
+        return posting_list;
+    }
+    db->stats->terms++;
+    int num = posting_list != NULL ? tclistnum(posting_list) : 0;
+    size_t size = 0;
+    int i;
+    for (i = 0; i < num; i++) {
+        int sp;
+        tclistval(posting_list, i, &sp);
+        size += sp;
+    }
+    tcxstrcat2(db->stats->detail, "term \"");
+    tcxstrcat(db->stats->detail, term, term_size);
+    tcxstrprintf(db->stats->detail, "\": %d postings, %lld bytes\n", num, (long long)size);
+    return posting_list;
+}
+
+static void
+Posting_delete(oDB* db, Posting* posting)
+{
+    free(posting->offset);
+    free(posting);
+}
+
+static void
+delete_posting_list(oDB* db, TCLIST* posting_list)
+{
+    int num = tclistnum(posting_list);
+    int i;
+    for (i = 0; i < num; i++) {
+        Posting* posting = *((Posting**)tclistval2(posting_list, i));
+        Posting_delete(db, posting);
+    }
+    tclistdel(posting_list);
+}
+
+/**
+ * compressed_posting_list is deleted.
+ */
+static TCLIST*
+decompress_posting_list(oDB* db, TCLIST* compressed_posting_list)
+{
+    TCLIST* posting_list = tclistnew();
+    if (compressed_posting_list == NULL) {
+        return posting_list;
+    }
+
+    int num = tclistnum(compressed_posting_list);
+    int i;
+    for (i = 0; i < num; i++) {
+        const char* compressed_posting = tclistval2(compressed_posting_list, i);
+        Posting* posting = decompress_posting(db, compressed_posting);
+        if (posting == NULL) {
+            return NULL;
+        }
+        posting->term_size = get_gram_size(db);
+        tclistpush(posting_list, &posting, sizeof(posting));
+    }
+    tclistdel(compressed_posting_list);
+    return posting_list;
+}
+
+static TCLIST*
+search_posting_list(oDB* db, const char* term, int term_size)
+{
+    return decompress_posting_list(db, get_compressed_posting_list(db, term, term_size));
+}
+
+static int
+compare_postings(const void* a, const void* b)
+{
+    const Posting* x = *((const Posting**)a);
+    const Posting* y = *((const Posting**)b);
+    if (x->doc_id != y->doc_id) {
+        return x->doc_id < y->doc_id ? -1 : 1;
+    }
+    if (x->attr_id != y->attr_id) {
+        return x->attr_id < y->attr_id ? -1 : 1;
+    }
+    return 0;
+}
+
+static int
+compare_offsets(const void* a, const void* b)
+{
+    offset_t x = *((const offset_t*)a);
+    offset_t y = *((const offset_t*)b);
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Merges runs of postings into one posting list in order of documents. A run
+ * is postings of a term, and runs[i] to runs[i + 1] - 1 in postings are the
+ * i-th run. The runs are merged at once with a heap of their heads. Postings of
+ * a same document and a same attribute are merged into one posting.
+ */
+struct RunMerger {
+    Posting** postings;
+    int* heads;
+    int* ends;
+    int* heap;
+    int heap_size;
+};
+
+typedef struct RunMerger RunMerger;
+
+static BOOL
+is_run_less(RunMerger* merger, int run1, int run2)
+{
+    Posting** postings = merger->postings;
+    return compare_postings(&postings[merger->heads[run1]], &postings[merger->heads[run2]]) < 0;
+}
+
+static void
+sift_down(RunMerger* merger, int i)
+{
+    int* heap = merger->heap;
+    while (1) {
+        int child = 2 * i + 1;
+        if (merger->heap_size <= child) {
+            break;
+        }
+        if ((child + 1 < merger->heap_size) && is_run_less(merger, heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!is_run_less(merger, heap[child], heap[i])) {
+            break;
+        }
+        int run = heap[i];
+        heap[i] = heap[child];
+        heap[child] = run;
+        i = child;
+    }
+}
+
+static int
+push_merged_posting(oDB* db, TCLIST* posting_list, const Posting* head, const offset_t* offset, int offset_size)
+{
+    Posting* posting = Posting_of_offset_size(db, offset_size);
+    if (posting == NULL) {
+        return 1;
+    }
+    posting->doc_id = head->doc_id;
+    posting->attr_id = head->attr_id;
+    posting->term_size = head->term_size;
+    memcpy(posting->offset, offset, sizeof(offset_t) * offset_size);
+    qsort(posting->offset, offset_size, sizeof(offset_t), compare_offsets);
+    tclistpush(posting_list, &posting, sizeof(posting));
+    return 0;
+}
+
+static TCLIST*
+merge_runs(oDB* db, Posting** postings, const int* runs, int runs_num)
+{
+    int heads[runs_num + 1];
+    int ends[runs_num + 1];
+    int heap[runs_num + 1];
+    RunMerger merger;
+    merger.postings = postings;
+    merger.heads = heads;
+    merger.ends = ends;
+    merger.heap = heap;
+    merger.heap_size = 0;
+    int i;
+    for (i = 0; i < runs_num; i++) {
+        heads[i] = runs[i];
+        ends[i] = runs[i + 1];
+        qsort(&postings[runs[i]], runs[i + 1] - runs[i], sizeof(postings[0]), compare_postings);
+        if (heads[i] < ends[i]) {
+            heap[merger.heap_size] = i;
+            merger.heap_size++;
+        }
+    }
+    for (i = merger.heap_size / 2 - 1; 0 <= i; i--) {
+        sift_down(&merger, i);
+    }
+
+    TCLIST* posting_list = tclistnew();
+    const Posting* last = NULL;
+    TCXSTR* offsets = tcxstrnew();
+    while (0 < merger.heap_size) {
+        int run = heap[0];
+        const Posting* posting = postings[heads[run]];
+        if ((last != NULL) && (compare_postings(&last, &posting) != 0)) {
+            int offset_size = tcxstrsize(offsets) / sizeof(offset_t);
+            if (push_merged_posting(db, posting_list, last, (const offset_t*)tcxstrptr(offsets), offset_size) != 0) {
+                tcxstrdel(offsets);
+                delete_posting_list(db, posting_list);
+                return NULL;
+            }
+            tcxstrclear(offsets);
+        }
+        tcxstrcat(offsets, posting->offset, sizeof(offset_t) * posting->offset_size);
+        last = posting;
+        heads[run]++;
+        if (heads[run] == ends[run]) {
+            merger.heap_size--;
+            heap[0] = heap[merger.heap_size];
+        }
+        sift_down(&merger, 0);
+    }
+    int status = 0;
+    if (last != NULL) {
+        int offset_size = tcxstrsize(offsets) / sizeof(offset_t);
+        status = push_merged_posting(db, posting_list, last, (const offset_t*)tcxstrptr(offsets), offset_size);
+    }
+    tcxstrdel(offsets);
+    if (status != 0) {
+        delete_posting_list(db, posting_list);
+        return NULL;
+    }
+    return posting_list;
+}
+
+static BOOL
+has_prefix(oDB* db, const char* key, int key_size, const char* prefix, int prefix_size)
+{
+    if (db->index_format == INDEX_FORMAT_PACKED) {
+        uint64_t term;
+        memcpy(&term, key, sizeof(term));
+        return (key_size == sizeof(term)) && ((uint32_t)(term >> 32) == pack_char(prefix, prefix_size));
+    }
+    return (prefix_size <= key_size) && (memcmp(key, prefix, prefix_size) == 0);
+}
+
+/**
+ * Searches all terms which begin with prefix. Terms are sorted, so the terms
+ * are in a row from the smallest one beginning with prefix, and the cursor
+ * scans the range of them. A packed prefix is one character. A prefix which
+ * too many terms begin with is an error.
+ */
+#define PREFIX_TERMS_MAX    4096
+
+/**
+ * A term of each segment is a run.
+ */
+static int
+scan_prefix(oDB* db, TCBDB* index, const void* first, int first_size, const char* prefix, int prefix_size, TCLIST* postings, int* runs, int* runs_num)
+{
+    /**
+     * Records are copied, because a record pointed by a cursor may be spoiled
+     * by a thread searching the shared index at the same time.
+     */
+    TCXSTR* last_key = tcxstrnew();
+    TCXSTR* key_buf = tcxstrnew();
+    TCXSTR* val_buf = tcxstrnew();
+    int status = 0;
+    BOOL is_first = TRUE;
+    BDBCUR* cur = tcbdbcurnew(index);
+    BOOL ok = tcbdbcurjump(cur, first, first_size);
+    while (ok && tcbdbcurrec(cur, key_buf, val_buf)) {
+        const char* key = tcxstrptr(key_buf);
+        int key_size = tcxstrsize(key_buf);
+        if (!has_prefix(db, key, key_size, prefix, prefix_size)) {
+            break;
+        }
+        if (is_first || (tcxstrsize(last_key) != key_size) || (memcmp(tcxstrptr(last_key), key, key_size) != 0)) {
+            if (*runs_num == PREFIX_TERMS_MAX) {
+                set_msg(db, "Too many terms begin with prefix", NULL);
+                status = 1;
+                break;
+            }
+            runs[*runs_num] = tclistnum(postings);
+            (*runs_num)++;
+            is_first = FALSE;
+            tcxstrclear(last_key);
+            tcxstrcat(last_key, key, key_size);
+        }
+        Posting* posting = decompress_posting(db, tcxstrptr(val_buf));
+        if (posting == NULL) {
+            status = 1;
+            break;
+        }
+        posting->term_size = get_gram_size(db);
+        tclistpush(postings, &posting, sizeof(posting));
+        ok = tcbdbcurnext(cur);
+    }
+    tcbdbcurdel(cur);
+    tcxstrdel(val_buf);
+    tcxstrdel(key_buf);
+    tcxstrdel(last_key);
+    return status;
+}
+
+static int
+scan_buffer_prefix(oDB* db, TCTREE* buffer, const void* first, int first_size, const char* prefix, int prefix_size, TCLIST* postings, int* runs, int* runs_num)
+{
+    TCLIST* vals = tclistnew();
+    int status = 0;
+    tctreeiterinit2(buffer, first, first_size);
+    const char* key;
+    int key_size;
+    while ((status == 0) && ((key = (const char*)tctreeiternext(buffer, &key_size)) != NULL)) {
+        if (!has_prefix(db, key, key_size, prefix, prefix_size)) {
+            break;
+        }
+        if (*runs_num == PREFIX_TERMS_MAX) {
+            set_msg(db, "Too many terms begin with prefix", NULL);
+            status = 1;
+            break;
+        }
+        runs[*runs_num] = tclistnum(postings);
+        (*runs_num)++;
+        int size;
+        const char* p = (const char*)tctreeiterval(key, &size);
+        tclistclear(vals);
+        oSegment_split_postings(p, size, vals);
+        int i;
+        for (i = 0; i < tclistnum(vals); i++) {
+            Posting* posting = decompress_posting(db, tclistval2(vals, i));
+            if (posting == NULL) {
+                status = 1;
+                break;
+            }
+            posting->term_size = get_gram_size(db);
+            tclistpush(postings, &posting, sizeof(posting));
+        }
+    }
+    tclistdel(vals);
+    return status;
+}
+
+static TCLIST*
+search_prefix_posting_list(oDB* db, const char* prefix, int prefix_size)
+{
+    const void* first = prefix;
+    int first_size = prefix_size;
+    uint64_t term;
+    if (db->index_format == INDEX_FORMAT_PACKED) {
+        term = pack_term(pack_char(prefix, prefix_size), 0);
+        first = &term;
+        first_size = sizeof(term);
+    }
+    TCLIST* postings = tclistnew();
+    int runs[PREFIX_TERMS_MAX + 1];
+    int runs_num = 0;
+    int status = 0;
+    int i;
+    for (i = 0; (status == 0) && (i < db->segments_num); i++) {
+        oSegment* segment = db->segments[i];
+        status = scan_prefix(db, segment->index, first, first_size, prefix, prefix_size, postings, runs, &runs_num);
+        if ((status == 0) && (segment->postings != NULL)) {
+            status = scan_buffer_prefix(db, segment->postings, first, first_size, prefix, prefix_size, postings, runs, &runs_num);
+        }
+    }
+    runs[runs_num] = tclistnum(postings);
+    if (db->stats != NULL) {
+        db->stats->terms += runs_num;
+        tcxstrcat2(db->stats->detail, "prefix \"");
+        tcxstrcat(db->stats->detail, prefix, prefix_size);
+        tcxstrprintf(db->stats->detail, "\": %d terms, %d postings\n", runs_num, tclistnum(postings));
+    }
+
+    TCLIST* posting_list = NULL;
+    if (status == 0) {
+        int num = tclistnum(postings);
+        Posting** array = (Posting**)malloc(sizeof(Posting*) * (num + 1));
+        if (array == NULL) {
+            oDB_set_msg_of_errno(db, "Can't allocate postings");
+        }
+        int i;
+        for (i = 0; (array != NULL) && (i < num); i++) {
+            array[i] = *((Posting**)tclistval2(postings, i));
+        }
+        posting_list = array != NULL ? merge_runs(db, array, runs, runs_num) : NULL;
+        free(array);
+    }
+    delete_posting_list(db, postings);
+    return posting_list;
+}
+
+
+static TCLIST*
+intersect(oDB* db, TCLIST* posting_list1, TCLIST* posting_list2, int gap)
+{
+    /**
+     * This function assume that postings stand in ascending order of the
+     * document ID. It seems depend on Tokyo Cabinet implementation.
+     */
+    TCLIST* result = tclistnew();
+    int num1 = tclistnum(posting_list1);
+    int num2 = tclistnum(posting_list2);
+    int i = 0;
+    int j = 0;
+    while ((i < num1) && (j < num2)) {
+        Posting* posting1 = *((Posting**)tclistval2(posting_list1, i));
+        Posting* posting2 = *((Posting**)tclistval2(posting_list2, j));
+        if (posting1->doc_id < posting2->doc_id) {
+            i++;
+            continue;
+        }
+        if (posting2->doc_id < posting1->doc_id) {
+            j++;
+            continue;
+        }
+        if (posting1->attr_id < posting2->attr_id) {
+            i++;
+            continue;
+        }
+        if (posting2->attr_id < posting1->attr_id) {
+            j++;
+            continue;
+        }
+
+        int offset_size_min = posting1->offset_size < posting2->offset_size ? posting1->offset_size : posting2->offset_size;
+        offset_t offset[offset_size_min];
+        int offset_size = 0;
+        int k = 0;
+        int l = 0;
+        while ((k < posting1->offset_size) && (l < posting2->offset_size)) {
+            int end_offset = posting1->offset[k] + gap;
+            if (end_offset < posting2->offset[l]) {
+                k++;
+                continue;
+            }
+            if (posting2->offset[l] < end_offset) {
+                l++;
+                continue;
+            }
+            offset[offset_size] = posting1->offset[k];
+            offset_size++;
+            k++;
+            l++;
+        }
+        COUNT_STATS(db, comparisons, k + l);
+        if (0 < offset_size) {
+            Posting* posting = Posting_of_offset_size(db, offset_size);
+            if (posting == NULL) {
+                return NULL;
+            }
+            posting->doc_id = posting1->doc_id;
+            posting->attr_id = posting1->attr_id;
+            posting->term_size = gap + posting2->term_size;
+            memcpy(posting->offset, offset, sizeof(offset[0]) * offset_size);
+            posting->offset_size = offset_size;
+            tclistpush(result, &posting, sizeof(posting));
+        }
+
+        i++;
+        j++;
+    }
+
+    return result;
 }
 
 static oHits*
 oHits_new(oDB* db, int num)
 {
-    size_t size = sizeof(oHits) + sizeof(o_doc_id_t) * (num - 1);
-    oHits* hits = (oHits*)malloc(size);
-    if (hits == NULL) {
-        oDB_set_msg_of_errno(db, "oHits allocation failed");
-        return NULL;
+    size_t size = sizeof(oHits) + sizeof(o_doc_id_t) * (0 < num ? num - 1 : 0);
+    oHits* hits = (oHits*)malloc(size);
+    if (hits == NULL) {
+        oDB_set_msg_of_errno(db, "oHits allocation failed");
+        return NULL;
+    }
+    hits->num = num;
+    hits->spans = NULL;
+    return hits;
+}
+
+void
+oHits_delete(oDB* db, oHits* hits)
+{
+    if (hits == NULL) {
+        return;
+    }
+    free(hits->spans);
+    free(hits);
+}
+
+static int search_phrase(oDB* db, const char* phrase, oHits* within, oHits** phits);
+
+/**
+ * doc2hits maps a document ID to a list of pointers to hits.
+ */
+static void
+delete_fuzzy_hits(TCMAP* doc2hits)
+{
+    tcmapiterinit(doc2hits);
+    int sp;
+    const void* key;
+    while ((key = tcmapiternext(doc2hits, &sp)) != NULL) {
+        TCLIST* hits = *((TCLIST**)tcmapget(doc2hits, key, sp, &sp));
+        int i;
+        for (i = 0; i < tclistnum(hits); i++) {
+            free(*((void**)tclistval2(hits, i)));
+        }
+        tclistdel(hits);
+    }
+    tcmapdel(doc2hits);
+}
+
+static int
+search_fuzzily(oDB* db, const char* phrase, oHits** phits)
+{
+    struct FuzzyHit {
+        unsigned int offsets_size;
+        offset_t offsets[1];
+    };
+    typedef struct FuzzyHit FuzzyHit;
+
+    /**
+     * Grams overlap each other by one character, so that any gram in the
+     * phrase can be found.
+     */
+    size_t size = strlen(phrase);
+    uint32_t offsets[size + 1];
+    int phrase_size = oUTF8_scan(phrase, size, offsets);
+    offsets[phrase_size] = size;
+    int gram_size = get_gram_size(db);
+    int terms_num = phrase_size - gram_size + 1;
+    if (terms_num < 2) {
+        return search_phrase(db, phrase, NULL, phits);
+    }
+    TCMAP* doc2hits = tcmapnew();
+    unsigned int i;
+    for (i = 0; i < terms_num; i++) {
+        const char* term = &phrase[offsets[i]];
+        int term_size = offsets[i + gram_size] - offsets[i];
+        TCLIST* posting_list = search_posting_list(db, term, term_size);
+        if (posting_list == NULL) {
+            tcmapdel(doc2hits);
+            return 1;
+        }
+        int doc_num = tclistnum(posting_list);
+        int i;
+        for (i = 0; i < doc_num; i++) {
+            Posting* posting = *((Posting**)tclistval2(posting_list, i));
+            if (posting->attr_id != -1) {
+                continue;
+            }
+            int sp;
+            o_doc_id_t doc_id = posting->doc_id;
+            TCLIST** p = (TCLIST**)tcmapget(doc2hits, &doc_id, sizeof(doc_id), &sp);
+            if (p == NULL) {
+                TCLIST* list = tclistnew();
+                int i;
+                for (i = 0; i < posting->offset_size; i++) {
+                    FuzzyHit* hit = (FuzzyHit*)malloc(sizeof(FuzzyHit) + (terms_num - 1) * sizeof(offset_t));
+                    if (hit == NULL) {
+                        oDB_set_msg_of_errno(db, "malloc failed");
+                        return 1;
+                    }
+                    hit->offsets_size = 1;
+                    hit->offsets[0] = posting->offset[i];
+                    tclistpush(list, &hit, sizeof(hit));
+                }
+                tcmapput(doc2hits, &doc_id, sizeof(doc_id), &list, sizeof(list));
+                continue;
+            }
+            TCLIST* hits = *p;
+            int hits_num = tclistnum(hits);
+            TCLIST* new_hits = tclistnew();
+            int i = 0;
+            int j = 0;
+            while ((i < hits_num) && (j < posting->offset_size)) {
+                FuzzyHit* hit = *((FuzzyHit**)tclistval2(hits, i));
+                if (posting->offset[j] < hit->offsets[0]) {
+                    FuzzyHit* new_hit = (FuzzyHit*)malloc(sizeof(FuzzyHit) + (terms_num - 1) * sizeof(offset_t));
+                    if (new_hit == NULL) {
+                        oDB_set_msg_of_errno(db, "malloc failed");
+                        return 1;
+                    }
+                    new_hit->offsets_size = 1;
+                    new_hit->offsets[0] = posting->offset[j];
+                    tclistpush(new_hits, &new_hit, sizeof(new_hit));
+                    j++;
+                    continue;
+                }
+                if (i < hits_num - 1) {
+                    FuzzyHit* next_hit = *((FuzzyHit**)tclistval2(hits, i + 1));
+                    if (next_hit->offsets[next_hit->offsets_size - 1] < posting->offset[j]) {
+                        i++;
+                        continue;
+                    }
+                }
+                if (phrase_size / 2 < gram_size + hit->offsets[hit->offsets_size - 1] - posting->offset[j]) {
+                    FuzzyHit* new_hit = (FuzzyHit*)malloc(sizeof(FuzzyHit) + (terms_num - 1) * sizeof(offset_t));
+                    if (new_hit == NULL) {
+                        oDB_set_msg_of_errno(db, "malloc failed");
+                        return 1;
+                    }
+                    new_hit->offsets_size = 1;
+                    new_hit->offsets[0] = posting->offset[j];
+                    tclistpush(new_hits, &new_hit, sizeof(new_hit));
+                    i++;
+                    continue;
+                }
+                hit->offsets[hit->offsets_size] = posting->offset[j];
+                hit->offsets_size++;
+                i++;
+                j++;
+            }
+            int k;
+            for (k = 0; k < tclistnum(new_hits); k++) {
+                FuzzyHit* new_hit = *((FuzzyHit**)tclistval2(new_hits, k));
+                int l;
+                for (l = 0; l < tclistnum(hits) - 1; l++) {
+                    FuzzyHit* hit = *((FuzzyHit**)tclistval2(hits, l));
+                    if (new_hit->offsets[0] < hit->offsets[0]) {
+                        break;
+                    }
+                }
+                tclistinsert(hits, l, &new_hit, sizeof(new_hit));
+            }
+            tclistdel(new_hits);
+        }
+        delete_posting_list(db, posting_list);
+    }
+
+    tcmapiterinit(doc2hits);
+    int n = 0;
+    int sp;
+    o_doc_id_t* key;
+    while ((key = (o_doc_id_t*)tcmapiternext(doc2hits, &sp)) != NULL) {
+        const TCLIST* hits = *((const TCLIST**)tcmapget(doc2hits, key, sizeof(*key), &sp));
+        BOOL flag = FALSE;
+        int i;
+        for (i = 0; i < tclistnum(hits); i++) {
+            FuzzyHit* hit = *((FuzzyHit**)tclistval2(hits, i));
+            if (terms_num / 2 <= hit->offsets_size) {
+                flag = TRUE;
+                break;
+            }
+        }
+        if (!flag) {
+            continue;
+        }
+        n++;
+    }
+    *phits = oHits_new(db, n);
+    if (*phits == NULL) {
+        delete_fuzzy_hits(doc2hits);
+        return 1;
+    }
+    int m = 0;
+    tcmapiterinit(doc2hits);
+    while ((key = (o_doc_id_t*)tcmapiternext(doc2hits, &sp)) != NULL) {
+        const TCLIST* hits = *((const TCLIST**)tcmapget(doc2hits, key, sizeof(*key), &sp));
+        int i;
+        for (i = 0; i < tclistnum(hits); i++) {
+            FuzzyHit* hit = *((FuzzyHit**)tclistval2(hits, i));
+            if (terms_num / 2 <= hit->offsets_size) {
+                (*phits)->doc_id[m] = *key;
+                m++;
+                break;
+            }
+        }
+    }
+
+#if 0
+    tcmapiterinit(doc2hits);
+    while ((key = (o_doc_id_t*)tcmapiternext(doc2hits, &sp)) != NULL) {
+        TRACE("docid=%d", *key);
+        const TCLIST* hits = *((const TCLIST**)tcmapget(doc2hits, key, sizeof(*key), &sp));
+        int i;
+        for (i = 0; i < tclistnum(hits); i++) {
+            TRACE("hit #%d", i);
+            FuzzyHit* hit = *((FuzzyHit**)tclistval2(hits, i));
+            int j;
+            for (j = 0; j < hit->offsets_size; j++) {
+                TRACE("offset[%d]=%d", j, hit->offsets[j]);
+            }
+        }
+    }
+#endif
+
+    delete_fuzzy_hits(doc2hits);
+    return 0;
+}
+
+/**
+ * A term of a phrase to search. begin and size are in bytes, and pos is the
+ * position of the term relative to the first one. If is_prefix is TRUE, all
+ * terms beginning with it are searched.
+ */
+struct QueryTerm {
+    int begin;
+    int size;
+    int pos;
+    BOOL is_prefix;
+};
+
+typedef struct QueryTerm QueryTerm;
+
+static int
+add_query_term(QueryTerm* terms, int terms_num, int begin, int end, int pos)
+{
+    terms[terms_num].begin = begin;
+    terms[terms_num].size = end - begin;
+    terms[terms_num].pos = pos;
+    terms[terms_num].is_prefix = FALSE;
+    return terms_num + 1;
+}
+
+/**
+ * Picks terms which cover a phrase in the same way as documents are tokenized.
+ * Grams are from every gram_size characters. The last gram may overlap the
+ * previous one. Characters fewer than gram_size are a prefix of grams, unless
+ * it is one character and every character is indexed alone. Words in s are
+ * lowercased. terms must have one element per character. The number of
+ * positions which s takes is returned by *positions.
+ */
+static int
+find_query_terms(oDB* db, char* s, size_t size, QueryTerm* terms, int* positions)
+{
+    uint32_t offsets[size + 1];
+    int chars_num = oUTF8_scan(s, size, offsets);
+    offsets[chars_num] = size;
+    int gram_size = get_gram_size(db);
+    int terms_num = 0;
+    int pos = 0;
+    int i = 0;
+    while (i < chars_num) {
+        int begin = i;
+        CharClass cls = CHAR_CLASS_GRAM;
+        if (db->tokenizer == TOKENIZER_BIGRAM) {
+            i = chars_num;
+        }
+        else {
+            cls = classify_char(&s[offsets[i]], offsets[i + 1] - offsets[i]);
+            while ((i < chars_num) && (classify_char(&s[offsets[i]], offsets[i + 1] - offsets[i]) == cls)) {
+                i++;
+            }
+        }
+        if (cls == CHAR_CLASS_SEPARATOR) {
+            continue;
+        }
+        if (cls == CHAR_CLASS_WORD) {
+            int j;
+            for (j = begin; j < i; j++) {
+                lower_char(&s[offsets[j]], &s[offsets[j]], offsets[j + 1] - offsets[j]);
+            }
+            terms_num = add_query_term(terms, terms_num, offsets[begin], offsets[i], pos);
+            pos++;
+            continue;
+        }
+        int n = i - begin;
+        if (n < gram_size) {
+            terms_num = add_query_term(terms, terms_num, offsets[begin], offsets[i], pos);
+            terms[terms_num - 1].is_prefix = (1 < n) || (db->ngram != NGRAM_UNIGRAM_BIGRAM);
+            pos += n;
+            continue;
+        }
+        int j;
+        for (j = 0; j + gram_size <= n; j += gram_size) {
+            terms_num = add_query_term(terms, terms_num, offsets[begin + j], offsets[begin + j + gram_size], pos + j);
+        }
+        if (n % gram_size != 0) {
+            int from = n - gram_size;
+            terms_num = add_query_term(terms, terms_num, offsets[begin + from], offsets[i], pos + from);
+        }
+        pos += n;
+    }
+    *positions = pos;
+    return terms_num;
+}
+
+/**
+ * A candidate is a document or an attribute which has all terms of a phrase,
+ * but may not have the phrase. attr_id is -1 for a document.
+ */
+struct Candidate {
+    o_doc_id_t doc_id;
+    o_attr_id_t attr_id;
+};
+
+typedef struct Candidate Candidate;
+
+static int
+compare_candidates(const void* a, const void* b)
+{
+    const Candidate* x = (const Candidate*)a;
+    const Candidate* y = (const Candidate*)b;
+    if (x->doc_id != y->doc_id) {
+        return x->doc_id < y->doc_id ? -1 : 1;
+    }
+    return x->attr_id < y->attr_id ? -1 : x->attr_id > y->attr_id;
+}
+
+/**
+ * Reads only the document ID and the attribute ID of a posting. Positions
+ * after them are not decoded.
+ */
+static void
+read_candidate(const char* compressed_posting, Candidate* candidate)
+{
+    int size;
+    int tagged_doc_id = decompress_num(compressed_posting, &size);
+    candidate->doc_id = tagged_doc_id >> 1;
+    candidate->attr_id = -1;
+    if ((tagged_doc_id & 1) != 0) {
+        candidate->attr_id = decompress_num(compressed_posting + size, &size);
+    }
+}
+
+/**
+ * Returns sorted candidates which have a term. *num can be 0. compressed is
+ * the posting list of the term, or NULL for a prefix term. compressed is
+ * deleted.
+ */
+static Candidate*
+get_candidates(oDB* db, const char* s, const QueryTerm* term, TCLIST* compressed, int* num)
+{
+    TCLIST* posting_list = NULL;
+    int n;
+    if (compressed != NULL) {
+        n = tclistnum(compressed);
+    }
+    else {
+        posting_list = search_prefix_posting_list(db, &s[term->begin], term->size);
+        if (posting_list == NULL) {
+            return NULL;
+        }
+        n = tclistnum(posting_list);
+    }
+    Candidate* candidates = (Candidate*)malloc(sizeof(Candidate) * (n + 1));
+    if (candidates == NULL) {
+        oDB_set_msg_of_errno(db, "Can't allocate candidates");
+    }
+    if (compressed != NULL) {
+        COUNT_STATS(db, postings, n);
+    }
+    int i;
+    for (i = 0; (candidates != NULL) && (i < n); i++) {
+        if (compressed != NULL) {
+            read_candidate(tclistval2(compressed, i), &candidates[i]);
+            continue;
+        }
+        Posting* posting = *((Posting**)tclistval2(posting_list, i));
+        candidates[i].doc_id = posting->doc_id;
+        candidates[i].attr_id = posting->attr_id;
+    }
+    if (compressed != NULL) {
+        tclistdel(compressed);
+    }
+    if (posting_list != NULL) {
+        delete_posting_list(db, posting_list);
+    }
+    if (candidates != NULL) {
+        qsort(candidates, n, sizeof(Candidate), compare_candidates);
+    }
+    *num = n;
+    return candidates;
+}
+
+/**
+ * Leaves candidates which are in both of a and b in a, and returns the number
+ * of them.
+ */
+static int
+intersect_candidates(Candidate* a, int a_num, const Candidate* b, int b_num)
+{
+    int num = 0;
+    int i = 0;
+    int j = 0;
+    while ((i < a_num) && (j < b_num)) {
+        int cmp = compare_candidates(&a[i], &b[j]);
+        if (cmp < 0) {
+            i++;
+            continue;
+        }
+        if (0 < cmp) {
+            j++;
+            continue;
+        }
+        a[num] = a[i];
+        num++;
+        i++;
+        j++;
+    }
+    return num;
+}
+
+/**
+ * FindSink searches needle in a document piece by piece. A phrase can be split
+ * into two pieces, so the last needle_size - 1 bytes of the previous piece are
+ * kept in carry and searched together with the head of the next piece.
+ */
+struct FindSink {
+    const char* needle;
+    size_t needle_size;
+    char* carry;
+    size_t carry_size;
+    BOOL found;
+};
+
+typedef struct FindSink FindSink;
+
+static int
+find_in_piece(const char* s, size_t size, void* arg)
+{
+    FindSink* find = (FindSink*)arg;
+    size_t keep = find->needle_size - 1;
+    size_t head_size = size < keep ? size : keep;
+    memcpy(&find->carry[find->carry_size], s, head_size);
+    find->carry_size += head_size;
+    if ((oUTF8_find(find->carry, find->carry_size, find->needle, find->needle_size) != NULL) || (oUTF8_find(s, size, find->needle, find->needle_size) != NULL)) {
+        find->found = TRUE;
+        return 1;
+    }
+    if (keep < find->carry_size) {
+        const char* tail = keep <= size ? &s[size - keep] : &find->carry[find->carry_size - keep];
+        memmove(find->carry, tail, keep);
+        find->carry_size = keep;
+    }
+    return 0;
+}
+
+static int
+verify_candidate(oDB* db, const Candidate* candidate, const char* phrase, size_t size, BOOL* found)
+{
+    COUNT_STATS(db, docs, 1);
+    if (candidate->attr_id != -1) {
+        int val_size;
+        char* val = read_attr(db, candidate->doc_id, candidate->attr_id, &val_size);
+        *found = (val != NULL) && (oUTF8_find(val, val_size, phrase, size) != NULL);
+        free(val);
+        return 0;
+    }
+    char carry[2 * size];
+    FindSink find;
+    find.needle = phrase;
+    find.needle_size = size;
+    find.carry = carry;
+    find.carry_size = 0;
+    find.found = FALSE;
+    int status = get_doc_to(db, candidate->doc_id, 0, INT_MAX, find_in_piece, &find);
+    *found = find.found;
+    return find.found ? 0 : status;
+}
+
+/**
+ * Costs in nanoseconds to decode and intersect a byte of a posting list, and
+ * to decompress and search a byte of a stored document. They were measured
+ * with zlib and source code of 8KB per document.
+ */
+#define DECODE_COST_PER_BYTE    16
+#define VERIFY_COST_PER_BYTE    20
+
+static double
+get_average_doc_size(oDB* db)
+{
+    if (db->next_doc_id == 0) {
+        return 0;
+    }
+    uint64_t size = 0;
+    uint64_t num = 0;
+    int i;
+    for (i = 0; i < db->segments_num; i++) {
+        oSegment* segment = db->segments[i];
+        if (db->doc_store == DOC_STORE_LOG) {
+            size += segment->doc_log->log_size;
+            continue;
+        }
+        size += tchdbfsiz(segment->doc);
+        num += tchdbrnum(segment->doc);
+    }
+    if (db->doc_store == DOC_STORE_LOG) {
+        return (double)size / db->next_doc_id;
+    }
+    return num == 0 ? 0 : (double)size / num;
+}
+
+static size_t
+get_posting_list_size(TCLIST* posting_list)
+{
+    size_t size = 0;
+    int num = tclistnum(posting_list);
+    int i;
+    for (i = 0; i < num; i++) {
+        int sp;
+        tclistval(posting_list, i, &sp);
+        size += sp;
+    }
+    return size;
+}
+
+/**
+ * Decides whether verifying candidates of the rarest term is cheaper than
+ * decoding and intersecting positions of all terms. The rarest term is
+ * returned by *rarest.
+ */
+static BOOL
+prefers_verification(oDB* db, TCLIST* posting_lists[], int terms_num, int* rarest)
+{
+    size_t total = 0;
+    size_t min_size = SIZE_MAX;
+    int i;
+    for (i = 0; i < terms_num; i++) {
+        size_t size = get_posting_list_size(posting_lists[i]);
+        total += size;
+        if (size < min_size) {
+            min_size = size;
+            *rarest = i;
+        }
+    }
+    double positional_cost = (double)total * DECODE_COST_PER_BYTE;
+    double verification_cost = (double)min_size * DECODE_COST_PER_BYTE + tclistnum(posting_lists[*rarest]) * get_average_doc_size(db) * VERIFY_COST_PER_BYTE;
+    return verification_cost < positional_cost;
+}
+
+static int
+verify_candidates(oDB* db, Candidate* candidates, int num, const char* phrase, oHits** phits)
+{
+    *phits = oHits_new(db, num);
+    if (*phits == NULL) {
+        return 1;
+    }
+    size_t size = strlen(phrase);
+    int hits_num = 0;
+    int i;
+    for (i = 0; i < num; i++) {
+        BOOL found;
+        if (verify_candidate(db, &candidates[i], phrase, size, &found) != 0) {
+            oHits_delete(db, *phits);
+            return 1;
+        }
+        if (found) {
+            (*phits)->doc_id[hits_num] = candidates[i].doc_id;
+            hits_num++;
+        }
+    }
+    (*phits)->num = hits_num;
+    return 0;
+}
+
+/**
+ * Candidates are documents which have all terms. If is_exact is TRUE, the
+ * terms are exactly the phrase, and candidates need no verification.
+ */
+static int
+search_candidates(oDB* db, const char* phrase, const char* s, QueryTerm* terms, TCLIST* posting_lists[], int terms_num, BOOL is_exact, oHits** phits)
+{
+    int num = 0;
+    Candidate* candidates = get_candidates(db, s, &terms[0], posting_lists[0], &num);
+    posting_lists[0] = NULL;
+    if (candidates == NULL) {
+        return 1;
+    }
+    /**
+     * Posting lists left are deleted by the caller.
+     */
+    int i;
+    for (i = 1; i < terms_num; i++) {
+        int other_num = 0;
+        Candidate* other = get_candidates(db, s, &terms[i], posting_lists[i], &other_num);
+        posting_lists[i] = NULL;
+        if (other == NULL) {
+            free(candidates);
+            return 1;
+        }
+        num = intersect_candidates(candidates, num, other, other_num);
+        free(other);
+    }
+    int status;
+    if (is_exact) {
+        *phits = oHits_new(db, num);
+        for (i = 0; (*phits != NULL) && (i < num); i++) {
+            (*phits)->doc_id[i] = candidates[i].doc_id;
+        }
+        status = *phits != NULL ? 0 : 1;
+    }
+    else {
+        status = verify_candidates(db, candidates, num, phrase, phits);
+    }
+    free(candidates);
+    return status;
+}
+
+/**
+ * compressed is deleted.
+ */
+static TCLIST*
+load_posting_list(oDB* db, const char* s, const QueryTerm* term, TCLIST* compressed)
+{
+    if (term->is_prefix) {
+        return search_prefix_posting_list(db, &s[term->begin], term->size);
+    }
+    return decompress_posting_list(db, compressed);
+}
+
+/**
+ * Returns postings of the phrase of terms. Offsets of them are positions where
+ * the phrase begins. A phrase beginning with wildcards needs as many
+ * characters before the first term, so that a posting may have no offsets.
+ */
+static TCLIST*
+get_phrase_postings(oDB* db, const char* s, QueryTerm* terms, TCLIST* posting_lists[], int terms_num)
+{
+    TCLIST* posting_list1 = load_posting_list(db, s, &terms[0], posting_lists[0]);
+    posting_lists[0] = NULL;
+    if (posting_list1 == NULL) {
+        return NULL;
+    }
+    int i;
+    for (i = 1; i < terms_num; i++) {
+        TCLIST* posting_list2 = load_posting_list(db, s, &terms[i], posting_lists[i]);
+        posting_lists[i] = NULL;
+        if (posting_list2 == NULL) {
+            delete_posting_list(db, posting_list1);
+            return NULL;
+        }
+        TCLIST* intersected = intersect(db, posting_list1, posting_list2, terms[i].pos - terms[0].pos);
+        delete_posting_list(db, posting_list1);
+        delete_posting_list(db, posting_list2);
+        if (intersected == NULL) {
+            return NULL;
+        }
+        posting_list1 = intersected;
+    }
+
+    int num = tclistnum(posting_list1);
+    for (i = 0; i < num; i++) {
+        Posting* posting = *((Posting**)tclistval2(posting_list1, i));
+        int offset_size = 0;
+        int j;
+        for (j = 0; j < posting->offset_size; j++) {
+            if (posting->offset[j] < terms[0].pos) {
+                continue;
+            }
+            posting->offset[offset_size] = posting->offset[j] - terms[0].pos;
+            offset_size++;
+        }
+        posting->offset_size = offset_size;
+    }
+    return posting_list1;
+}
+
+static int
+intersect_positions(oDB* db, const char* s, QueryTerm* terms, TCLIST* posting_lists[], int terms_num, oHits** phits)
+{
+    TCLIST* posting_list = get_phrase_postings(db, s, terms, posting_lists, terms_num);
+    if (posting_list == NULL) {
+        return 1;
+    }
+    int num = tclistnum(posting_list);
+    *phits = oHits_new(db, num);
+    if (*phits == NULL) {
+        delete_posting_list(db, posting_list);
+        return 1;
+    }
+    int hits_num = 0;
+    int i;
+    for (i = 0; i < num; i++) {
+        Posting* posting = *((Posting**)tclistval2(posting_list, i));
+        if (posting->offset_size == 0) {
+            continue;
+        }
+        (*phits)->doc_id[hits_num] = posting->doc_id;
+        hits_num++;
+    }
+    (*phits)->num = hits_num;
+    delete_posting_list(db, posting_list);
+    return 0;
+}
+
+/**
+ * Reads compressed posting lists of terms. A prefix term has no posting list
+ * of its own. It is searched when it is used. Returns FALSE if a term is not
+ * found.
+ */
+static BOOL
+get_compressed_posting_lists(oDB* db, const char* s, QueryTerm* terms, int terms_num, TCLIST* posting_lists[], BOOL* has_prefix)
+{
+    *has_prefix = FALSE;
+    BOOL is_empty = FALSE;
+    int i;
+    for (i = 0; i < terms_num; i++) {
+        posting_lists[i] = NULL;
+        if (terms[i].is_prefix) {
+            *has_prefix = TRUE;
+            continue;
+        }
+        if (!is_empty) {
+            posting_lists[i] = get_compressed_posting_list(db, &s[terms[i].begin], terms[i].size);
+            is_empty = posting_lists[i] == NULL;
+        }
+    }
+    return !is_empty;
+}
+
+static void
+delete_compressed_posting_lists(TCLIST* posting_lists[], int num)
+{
+    int i;
+    for (i = 0; i < num; i++) {
+        if (posting_lists[i] != NULL) {
+            tclistdel(posting_lists[i]);
+        }
+    }
+}
+
+static o_doc_id_t
+get_posting_doc_id(TCLIST* compressed, int index)
+{
+    Candidate candidate;
+    read_candidate(tclistval2(compressed, index), &candidate);
+    return candidate.doc_id;
+}
+
+/**
+ * Returns the index of the first posting from from which document ID is
+ * doc_id or larger. Only document IDs of postings are decompressed.
+ */
+static int
+gallop_postings(TCLIST* compressed, int from, o_doc_id_t doc_id)
+{
+    int num = tclistnum(compressed);
+    int low = from;
+    int high = from;
+    int step = 1;
+    while ((high < num) && (get_posting_doc_id(compressed, high) < doc_id)) {
+        low = high + 1;
+        high += step;
+        step *= 2;
+    }
+    if (num < high) {
+        high = num;
+    }
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (get_posting_doc_id(compressed, mid) < doc_id) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * Leaves postings of documents in within which all of the terms have, and
+ * returns FALSE if no document is left. Postings stand in ascending order of
+ * the document ID (see intersect()), so they are galloped by documents of
+ * within, and the others are never decompressed.
+ */
+static BOOL
+restrict_posting_lists(TCLIST* posting_lists[], int num, const oHits* within)
+{
+    TCLIST* restricted[num];
+    int from[num];
+    int i;
+    for (i = 0; i < num; i++) {
+        restricted[i] = tclistnew();
+        from[i] = 0;
+    }
+    BOOL is_over = FALSE;
+    int j;
+    for (j = 0; !is_over && (j < within->num); j++) {
+        o_doc_id_t doc_id = within->doc_id[j];
+        BOOL has_all = TRUE;
+        for (i = 0; has_all && (i < num); i++) {
+            from[i] = gallop_postings(posting_lists[i], from[i], doc_id);
+            is_over = tclistnum(posting_lists[i]) <= from[i];
+            has_all = !is_over && (get_posting_doc_id(posting_lists[i], from[i]) == doc_id);
+        }
+        for (i = 0; has_all && (i < num); i++) {
+            while ((from[i] < tclistnum(posting_lists[i])) && (get_posting_doc_id(posting_lists[i], from[i]) == doc_id)) {
+                int size;
+                const char* posting = (const char*)tclistval(posting_lists[i], from[i], &size);
+                tclistpush(restricted[i], posting, size);
+                from[i]++;
+            }
+        }
+    }
+    BOOL is_found = TRUE;
+    for (i = 0; i < num; i++) {
+        tclistdel(posting_lists[i]);
+        posting_lists[i] = restricted[i];
+        is_found = is_found && (0 < tclistnum(restricted[i]));
+    }
+    return is_found;
+}
+
+/**
+ * Posting lists of all terms are read first, so that sizes of them tell how
+ * to search. Without positions, phrases are always verified. If can_verify is
+ * FALSE, phrase is not a string to search in documents, and terms are always
+ * intersected with positions. If within is not NULL, documents out of it may
+ * be skipped.
+ */
+static int
+search_terms(oDB* db, const char* phrase, const char* s, QueryTerm* terms, int terms_num, BOOL can_verify, oHits* within, oHits** phits)
+{
+    if (terms_num == 0) {
+        *phits = oHits_new(db, 0);
+        return *phits != NULL ? 0 : 1;
+    }
+
+    TCLIST* posting_lists[terms_num];
+    BOOL has_prefix;
+    BOOL is_empty = !get_compressed_posting_lists(db, s, terms, terms_num, posting_lists, &has_prefix);
+    if (!is_empty && (within != NULL) && !has_prefix) {
+        is_empty = !restrict_posting_lists(posting_lists, terms_num, within);
+    }
+    int status;
+    int rarest = 0;
+    if (is_empty) {
+        *phits = oHits_new(db, 0);
+        status = *phits != NULL ? 0 : 1;
+    }
+    else if (can_verify && (db->postings == POSTINGS_DOCS)) {
+        status = search_candidates(db, phrase, s, terms, posting_lists, terms_num, terms_num == 1, phits);
+    }
+    else if (can_verify && (1 < terms_num) && !has_prefix && (db->tokenizer == TOKENIZER_BIGRAM) && prefers_verification(db, posting_lists, terms_num, &rarest)) {
+        status = search_candidates(db, phrase, s, &terms[rarest], &posting_lists[rarest], 1, FALSE, phits);
+    }
+    else {
+        status = intersect_positions(db, s, terms, posting_lists, terms_num, phits);
+    }
+    delete_compressed_posting_lists(posting_lists, terms_num);
+    return status;
+}
+
+static int
+search_phrase(oDB* db, const char* phrase, oHits* within, oHits** phits)
+{
+    size_t size = strlen(phrase);
+    char s[size + 1];
+    memcpy(s, phrase, size + 1);
+    QueryTerm terms[size + 1];
+    int positions;
+    int terms_num = find_query_terms(db, s, size, terms, &positions);
+    return search_terms(db, phrase, s, terms, terms_num, TRUE, within, phits);
+}
+
+static int
+compare_doc_ids(const void* a, const void* b)
+{
+    o_doc_id_t x = *((const o_doc_id_t*)a);
+    o_doc_id_t y = *((const o_doc_id_t*)b);
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Operators merge hits in ascending order of document IDs without
+ * duplication. Hits of a phrase are usually in the order already, because
+ * posting lists are, but a document and its attributes may be found both.
+ */
+static void
+sort_hits(oHits* hits)
+{
+    int i;
+    for (i = 1; i < hits->num; i++) {
+        if (hits->doc_id[i] <= hits->doc_id[i - 1]) {
+            break;
+        }
+    }
+    if (i == hits->num) {
+        return;
+    }
+    free(hits->spans);
+    hits->spans = NULL;
+    qsort(hits->doc_id, hits->num, sizeof(o_doc_id_t), compare_doc_ids);
+    int num = 0;
+    for (i = 0; i < hits->num; i++) {
+        if ((num == 0) || (hits->doc_id[num - 1] != hits->doc_id[i])) {
+            hits->doc_id[num] = hits->doc_id[i];
+            num++;
+        }
+    }
+    hits->num = num;
+}
+
+static int
+alloc_spans(oDB* db, oHits* hits, int num)
+{
+    hits->spans = (oSpan*)malloc(sizeof(oSpan) * (0 < num ? num : 1));
+    if (hits->spans == NULL) {
+        oDB_set_msg_of_errno(db, "malloc failed");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Returns the first index from from, which document ID is doc_id or larger.
+ * The range is doubled until it passes doc_id, and then is bisected, so that
+ * a far document ID costs only a logarithm of the distance.
+ */
+static int
+gallop(const oHits* hits, int from, o_doc_id_t doc_id)
+{
+    int low = from;
+    int high = from;
+    int step = 1;
+    while ((high < hits->num) && (hits->doc_id[high] < doc_id)) {
+        low = high + 1;
+        high += step;
+        step *= 2;
+    }
+    if (hits->num < high) {
+        high = hits->num;
+    }
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (hits->doc_id[mid] < doc_id) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * Spans of the result are of the left hits.
+ */
+static int
+not_op(oDB* db, oHits* left, oHits* right, oHits** phits)
+{
+    *phits = oHits_new(db, left->num);
+    if (*phits == NULL) {
+        return 1;
+    }
+    if ((left->spans != NULL) && (alloc_spans(db, *phits, left->num) != 0)) {
+        return 1;
+    }
+    int num = 0;
+    int j = 0;
+    int i;
+    for (i = 0; i < left->num; i++) {
+        o_doc_id_t doc_id = left->doc_id[i];
+        j = gallop(right, j, doc_id);
+        if ((j < right->num) && (right->doc_id[j] == doc_id)) {
+            continue;
+        }
+        (*phits)->doc_id[num] = doc_id;
+        if (left->spans != NULL) {
+            (*phits)->spans[num] = left->spans[i];
+        }
+        num++;
+    }
+    (*phits)->num = num;
+    return 0;
+}
+
+/**
+ * Every document of the smallest hits is searched in the others from smaller
+ * ones, so that most documents are dropped early, and large hits are skipped
+ * by gallop(). Spans of the result are of the first hits which have them.
+ */
+static int
+and_op(oDB* db, oHits* hits[], int hits_num, oHits** phits)
+{
+    int order[hits_num];
+    int spans_index = -1;
+    int i;
+    for (i = 0; i < hits_num; i++) {
+        int j = i;
+        while ((0 < j) && (hits[i]->num < hits[order[j - 1]]->num)) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+        if ((spans_index == -1) && (hits[i]->spans != NULL)) {
+            spans_index = i;
+        }
+    }
+    oHits* smallest = hits[order[0]];
+    *phits = oHits_new(db, smallest->num);
+    if (*phits == NULL) {
+        return 1;
+    }
+    if ((spans_index != -1) && (alloc_spans(db, *phits, smallest->num) != 0)) {
+        return 1;
+    }
+    int heads[hits_num];
+    memset(heads, 0, sizeof(heads));
+    int num = 0;
+    BOOL is_end = FALSE;
+    for (i = 0; !is_end && (i < smallest->num); i++) {
+        o_doc_id_t doc_id = smallest->doc_id[i];
+        heads[order[0]] = i;
+        BOOL found = TRUE;
+        int j;
+        for (j = 1; found && (j < hits_num); j++) {
+            oHits* other = hits[order[j]];
+            int head = gallop(other, heads[order[j]], doc_id);
+            heads[order[j]] = head;
+            is_end = head == other->num;
+            found = !is_end && (other->doc_id[head] == doc_id);
+        }
+        if (!found) {
+            continue;
+        }
+        (*phits)->doc_id[num] = doc_id;
+        if (spans_index != -1) {
+            (*phits)->spans[num] = hits[spans_index]->spans[heads[spans_index]];
+        }
+        num++;
+    }
+    (*phits)->num = num;
+    return 0;
+}
+
+struct HitsMerger {
+    oHits** hits;
+    int* heads;
+    int* heap;
+    int heap_size;
+};
+
+typedef struct HitsMerger HitsMerger;
+
+/**
+ * Equal document IDs are popped in the order of hits, so that the span of a
+ * document is of the first hits.
+ */
+static BOOL
+is_hits_less(HitsMerger* merger, int index1, int index2)
+{
+    o_doc_id_t doc_id1 = merger->hits[index1]->doc_id[merger->heads[index1]];
+    o_doc_id_t doc_id2 = merger->hits[index2]->doc_id[merger->heads[index2]];
+    return (doc_id1 < doc_id2) || ((doc_id1 == doc_id2) && (index1 < index2));
+}
+
+static void
+sift_down_hits(HitsMerger* merger, int i)
+{
+    int* heap = merger->heap;
+    while (1) {
+        int child = 2 * i + 1;
+        if (merger->heap_size <= child) {
+            break;
+        }
+        if ((child + 1 < merger->heap_size) && is_hits_less(merger, heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!is_hits_less(merger, heap[child], heap[i])) {
+            break;
+        }
+        int index = heap[i];
+        heap[i] = heap[child];
+        heap[child] = index;
+        i = child;
+    }
+}
+
+/**
+ * All hits are merged at once with a heap of their heads. The result has
+ * spans only if all hits have them.
+ */
+static int
+or_op(oDB* db, oHits* hits[], int hits_num, oHits** phits)
+{
+    int max_num = 0;
+    BOOL has_spans = TRUE;
+    int i;
+    for (i = 0; i < hits_num; i++) {
+        max_num += hits[i]->num;
+        has_spans = has_spans && (hits[i]->spans != NULL);
+    }
+    *phits = oHits_new(db, max_num);
+    if (*phits == NULL) {
+        return 1;
+    }
+    if (has_spans && (alloc_spans(db, *phits, max_num) != 0)) {
+        return 1;
+    }
+    int heads[hits_num];
+    int heap[hits_num];
+    HitsMerger merger = { hits, heads, heap, 0 };
+    for (i = 0; i < hits_num; i++) {
+        heads[i] = 0;
+        if (0 < hits[i]->num) {
+            heap[merger.heap_size] = i;
+            merger.heap_size++;
+        }
+    }
+    for (i = merger.heap_size / 2 - 1; 0 <= i; i--) {
+        sift_down_hits(&merger, i);
+    }
+    int num = 0;
+    while (0 < merger.heap_size) {
+        int index = heap[0];
+        o_doc_id_t doc_id = hits[index]->doc_id[heads[index]];
+        if ((num == 0) || ((*phits)->doc_id[num - 1] != doc_id)) {
+            (*phits)->doc_id[num] = doc_id;
+            if (has_spans) {
+                (*phits)->spans[num] = hits[index]->spans[heads[index]];
+            }
+            num++;
+        }
+        heads[index]++;
+        if (heads[index] == hits[index]->num) {
+            merger.heap_size--;
+            heap[0] = heap[merger.heap_size];
+        }
+        sift_down_hits(&merger, 0);
+    }
+    (*phits)->num = num;
+    return 0;
+}
+
+/**
+ * Entry points for o-microbench, which measures kernels in isolation. Loops
+ * over numbers are here, so that compress_num() and decompress_num() are
+ * inlined as they are in indexing and searching.
+ */
+int
+oKernel_compress_nums(const int nums[], int num, char* dest)
+{
+    char* p = dest;
+    int i;
+    for (i = 0; i < num; i++) {
+        int size;
+        compress_num(nums[i], p, &size);
+        p += size;
+    }
+    return p - dest;
+}
+
+int
+oKernel_decompress_nums(const char* src, int num, int nums[])
+{
+    const char* p = src;
+    int i;
+    for (i = 0; i < num; i++) {
+        int size;
+        nums[i] = decompress_num(p, &size);
+        p += size;
+    }
+    return p - src;
+}
+
+int
+oKernel_compress_posting(o_doc_id_t doc_id, int pos[], int pos_num, char* data)
+{
+    int size;
+    compress_posting(doc_id, -1, pos, pos_num, data, &size);
+    return size;
+}
+
+/**
+ * Unlike decompress_posting_list(), compressed_posting_list is kept, so that
+ * it can be decompressed repeatedly.
+ */
+TCLIST*
+oKernel_decompress_postings(oDB* db, TCLIST* compressed_posting_list)
+{
+    int num = tclistnum(compressed_posting_list);
+    TCLIST* posting_list = tclistnew2(num);
+    int i;
+    for (i = 0; i < num; i++) {
+        Posting* posting = decompress_posting(db, tclistval2(compressed_posting_list, i));
+        if (posting == NULL) {
+            delete_posting_list(db, posting_list);
+            return NULL;
+        }
+        posting->term_size = get_gram_size(db);
+        tclistpush(posting_list, &posting, sizeof(posting));
     }
-    hits->num = num;
-    return hits;
+    return posting_list;
 }
 
 void
-oHits_delete(oDB* db, oHits* hits)
+oKernel_delete_postings(oDB* db, TCLIST* posting_list)
 {
-    free(hits);
+    delete_posting_list(db, posting_list);
 }
 
-static int
-search_fuzzily(oDB* db, const char* phrase, oHits** phits)
+TCLIST*
+oKernel_intersect(oDB* db, TCLIST* posting_list1, TCLIST* posting_list2, int gap)
 {
-    struct FuzzyHit {
-        unsigned int offsets_size;
-        offset_t offsets[1];
-    };
-    typedef struct FuzzyHit FuzzyHit;
+    return intersect(db, posting_list1, posting_list2, gap);
+}
 
-    int phrase_size = count_chars(phrase);
-    int terms_num = phrase_size - 1;
-    TCMAP* doc2hits = tcmapnew();
-    unsigned int pos = 0;
-    unsigned int i;
-    for (i = 0; i < terms_num; i++) {
-        const char* term = &phrase[pos];
-        int term_size = get_term_size(term);
-        TCLIST* posting_list = search_posting_list(db, term, term_size);
-        int doc_num = tclistnum(posting_list);
+int
+oKernel_and(oDB* db, oHits* hits[], int hits_num, oHits** phits)
+{
+    return and_op(db, hits, hits_num, phits);
+}
+
+int
+oKernel_or(oDB* db, oHits* hits[], int hits_num, oHits** phits)
+{
+    return or_op(db, hits, hits_num, phits);
+}
+
+int
+oKernel_not(oDB* db, oHits* left, oHits* right, oHits** phits)
+{
+    return not_op(db, left, right, phits);
+}
+
+static int eval(oDB* db, oNode* node, oHits** phits);
+static int eval_in(oDB* db, oNode* node, oHits* within, oHits** phits);
+
+/**
+ * Candidates are documents which satisfy the filter of the expression, or all
+ * documents if there is no filter.
+ */
+static oHits*
+get_regex_candidates(oDB* db, const char* pattern)
+{
+    oNode* filter;
+    if (oRegex_make_filter(db, pattern, &filter) != 0) {
+        return NULL;
+    }
+    oHits* hits = NULL;
+    if (filter == NULL) {
+        hits = oHits_new(db, db->next_doc_id);
         int i;
-        for (i = 0; i < doc_num; i++) {
-            Posting* posting = *((Posting**)tclistval2(posting_list, i));
-            if (posting->attr_id != -1) {
-                continue;
-            }
-            int sp;
-            o_doc_id_t doc_id = posting->doc_id;
-            TCLIST** p = (TCLIST**)tcmapget(doc2hits, &doc_id, sizeof(doc_id), &sp);
-            if (p == NULL) {
-                TCLIST* list = tclistnew();
-                int i;
-                for (i = 0; i < posting->offset_size; i++) {
-                    FuzzyHit* hit = (FuzzyHit*)malloc(sizeof(FuzzyHit) + (terms_num - 1) * sizeof(offset_t));
-                    if (hit == NULL) {
-                        oDB_set_msg_of_errno(db, "malloc failed");
-                        return 1;
-                    }
-                    hit->offsets_size = 1;
-                    hit->offsets[0] = posting->offset[i];
-                    tclistpush(list, &hit, sizeof(hit));
-                }
-                tcmapput(doc2hits, &doc_id, sizeof(doc_id), &list, sizeof(list));
-                continue;
-            }
-            TCLIST* hits = *p;
-            int hits_num = tclistnum(hits);
-            TCLIST* new_hits = tclistnew();
-            int i = 0;
-            int j = 0;
-            while ((i < hits_num) && (j < posting->offset_size)) {
-                FuzzyHit* hit = *((FuzzyHit**)tclistval2(hits, i));
-                if (posting->offset[j] < hit->offsets[0]) {
-                    FuzzyHit* new_hit = (FuzzyHit*)malloc(sizeof(FuzzyHit) + (terms_num - 1) * sizeof(offset_t));
-                    if (new_hit == NULL) {
-                        oDB_set_msg_of_errno(db, "malloc failed");
-                        return 1;
-                    }
-                    new_hit->offsets_size = 1;
-                    new_hit->offsets[0] = posting->offset[j];
-                    tclistpush(new_hits, &new_hit, sizeof(new_hit));
-                    j++;
-                    continue;
-                }
-                if (i < hits_num - 1) {
-                    FuzzyHit* next_hit = *((FuzzyHit**)tclistval2(hits, i + 1));
-                    if (next_hit->offsets[next_hit->offsets_size - 1] < posting->offset[j]) {
-                        i++;
-                        continue;
-                    }
-                }
-                if (phrase_size / 2 < BIGRAM_SIZE + hit->offsets[hit->offsets_size - 1] - posting->offset[j]) {
-                    FuzzyHit* new_hit = (FuzzyHit*)malloc(sizeof(FuzzyHit) + (terms_num - 1) * sizeof(offset_t));
-                    if (new_hit == NULL) {
-                        oDB_set_msg_of_errno(db, "malloc failed");
-                        return 1;
-                    }
-                    new_hit->offsets_size = 1;
-                    new_hit->offsets[0] = posting->offset[j];
-                    tclistpush(new_hits, &new_hit, sizeof(new_hit));
-                    i++;
-                    continue;
-                }
-                hit->offsets[hit->offsets_size] = posting->offset[j];
-                hit->offsets_size++;
-                i++;
-                j++;
-            }
-            int k;
-            for (k = 0; k < tclistnum(new_hits); k++) {
-                FuzzyHit* new_hit = *((FuzzyHit**)tclistval2(new_hits, k));
-                int l;
-                for (l = 0; l < tclistnum(hits) - 1; l++) {
-                    FuzzyHit* hit = *((FuzzyHit**)tclistval2(hits, l));
-                    if (new_hit->offsets[0] < hit->offsets[0]) {
-                        break;
-                    }
-                }
-                tclistinsert(hits, l, &new_hit, sizeof(new_hit));
-            }
+        for (i = 0; (hits != NULL) && (i < db->next_doc_id); i++) {
+            hits->doc_id[i] = i;
         }
-        delete_posting_list(db, posting_list);
-        pos += term_size;
+        return hits;
     }
+    filter = oPlan_optimize(filter);
+    int status = eval(db, filter, &hits);
+    oNode_delete(filter);
+    return status == 0 ? hits : NULL;
+}
 
-    tcmapiterinit(doc2hits);
-    int n = 0;
-    int sp;
-    o_doc_id_t* key;
-    while ((key = (o_doc_id_t*)tcmapiternext(doc2hits, &sp)) != NULL) {
-        const TCLIST* hits = *((const TCLIST**)tcmapget(doc2hits, key, sizeof(key), &sp));
-        BOOL flag = FALSE;
-        int i;
-        for (i = 0; i < tclistnum(hits); i++) {
-            FuzzyHit* hit = *((FuzzyHit**)tclistval2(hits, i));
-            if (terms_num / 2 <= hit->offsets_size) {
-                flag = TRUE;
-                break;
-            }
+/**
+ * Documents are stored normalized, so an expression matches normalized text.
+ * Attributes are matched too, as phrases are searched in them.
+ */
+static int
+match_regex(oDB* db, oRegex* regex, o_doc_id_t doc_id, BOOL* matched)
+{
+    COUNT_STATS(db, docs, 1);
+    char* doc = get_doc_range(db, doc_id, 0, INT_MAX);
+    if (doc == NULL) {
+        return 1;
+    }
+    *matched = oRegex_match(regex, doc);
+    free(doc);
+    int i;
+    for (i = 0; !*matched && (i < MAX_ATTRS); i++) {
+        int sp;
+        char* val = read_attr(db, doc_id, i, &sp);
+        if (val != NULL) {
+            *matched = oRegex_match(regex, val);
+            free(val);
         }
-        if (!flag) {
+    }
+    return 0;
+}
+
+static int
+search_regex(oDB* db, const char* pattern, oHits** phits)
+{
+    oRegex* regex = oRegex_new(db, pattern);
+    if (regex == NULL) {
+        return 1;
+    }
+    oHits* candidates = get_regex_candidates(db, pattern);
+    if (candidates == NULL) {
+        oRegex_delete(regex);
+        return 1;
+    }
+    int num = 0;
+    int i;
+    for (i = 0; i < candidates->num; i++) {
+        BOOL matched;
+        if (match_regex(db, regex, candidates->doc_id[i], &matched) != 0) {
+            oHits_delete(db, candidates);
+            oRegex_delete(regex);
+            return 1;
+        }
+        if (matched) {
+            candidates->doc_id[num] = candidates->doc_id[i];
+            num++;
+        }
+    }
+    candidates->num = num;
+    oRegex_delete(regex);
+    *phits = candidates;
+    return 0;
+}
+
+/**
+ * Without positions, a wildcard phrase is searched as a regular expression.
+ */
+static int
+search_wildcard_by_regex(oDB* db, const char* s, size_t size, oHits** phits)
+{
+    TCXSTR* pattern = tcxstrnew();
+    size_t i;
+    for (i = 0; i < size; i++) {
+        if (s[i] == '?') {
+            tcxstrcat2(pattern, ".");
             continue;
         }
-        n++;
+        if (strchr("\\.[]{}()*+?^$|", s[i]) != NULL) {
+            tcxstrcat2(pattern, "\\");
+        }
+        tcxstrcat(pattern, &s[i], 1);
     }
-    *phits = oHits_new(db, n);
-    if (*phits == NULL) {
+    int status = search_regex(db, tcxstrptr(pattern), phits);
+    tcxstrdel(pattern);
+    return status;
+}
+
+static BOOL
+is_gram_char_at(const char* s, size_t size, size_t pos)
+{
+    if (size <= pos) {
+        return TRUE;
+    }
+    uint32_t offsets[size - pos + 1];
+    size_t chars_num = oUTF8_scan(&s[pos], size - pos, offsets);
+    offsets[chars_num] = size - pos;
+    return classify_char(&s[pos], offsets[1]) == CHAR_CLASS_GRAM;
+}
+
+static BOOL
+is_gram_char_before(const char* s, size_t pos)
+{
+    if (pos == 0) {
+        return TRUE;
+    }
+    size_t begin = pos - 1;
+    while ((0 < begin) && ((s[begin] & 0xc0) == 0x80)) {
+        begin--;
+    }
+    return classify_char(&s[begin], pos - begin) == CHAR_CLASS_GRAM;
+}
+
+/**
+ * "?" in pattern is any one character, and "*" at the end is any characters.
+ * Terms of the parts between "?"s keep their positions in the whole pattern,
+ * so that a "?" is a gap of one position between terms. Grams are substrings
+ * of a document anyway, so "*" only makes the last word of the hybrid
+ * tokenizer a prefix. A word takes one position, so "?" must be between
+ * characters of grams. s is pattern without "*", and terms are in it.
+ */
+static int
+find_wildcard_terms(oDB* db, const char* pattern, char* s, size_t size, BOOL has_star, QueryTerm* terms, int* terms_num, int* positions)
+{
+    *terms_num = 0;
+    int pos = 0;
+    size_t begin = 0;
+    size_t i;
+    for (i = 0; i <= size; i++) {
+        if ((i < size) && (s[i] != '?')) {
+            continue;
+        }
+        if ((i < size) && (db->tokenizer != TOKENIZER_BIGRAM) && (!is_gram_char_before(s, i) || !is_gram_char_at(s, size, i + 1))) {
+            set_msg(db, "Wildcard can't be next to a word", pattern);
+            return 1;
+        }
+        int part_positions = 0;
+        int num = find_query_terms(db, &s[begin], i - begin, &terms[*terms_num], &part_positions);
+        int j;
+        for (j = *terms_num; j < *terms_num + num; j++) {
+            terms[j].begin += begin;
+            terms[j].pos += pos;
+        }
+        *terms_num += num;
+        pos += part_positions + 1;
+        begin = i + 1;
+    }
+    if (has_star && (0 < *terms_num) && (db->tokenizer == TOKENIZER_HYBRID) && !is_gram_char_before(s, size)) {
+        terms[*terms_num - 1].is_prefix = TRUE;
+    }
+    if (*terms_num == 0) {
+        set_msg(db, "Wildcard needs a character", pattern);
         return 1;
     }
-    int m = 0;
-    tcmapiterinit(doc2hits);
-    while ((key = (o_doc_id_t*)tcmapiternext(doc2hits, &sp)) != NULL) {
-        const TCLIST* hits = *((const TCLIST**)tcmapget(doc2hits, key, sizeof(key), &sp));
-        int i;
-        for (i = 0; i < tclistnum(hits); i++) {
-            FuzzyHit* hit = *((FuzzyHit**)tclistval2(hits, i));
-            if (terms_num / 2 <= hit->offsets_size) {
-                (*phits)->doc_id[m] = *key;
-                m++;
-                break;
-            }
+    *positions = pos - 1;
+    return 0;
+}
+
+static BOOL
+ends_with_star(const char* pattern, size_t size)
+{
+    return (0 < size) && (pattern[size - 1] == '*');
+}
+
+static int
+search_wildcard(oDB* db, const char* pattern, oHits** phits)
+{
+    size_t size = strlen(pattern);
+    BOOL star = ends_with_star(pattern, size);
+    if (star) {
+        size--;
+    }
+    if (db->postings == POSTINGS_DOCS) {
+        return search_wildcard_by_regex(db, pattern, size, phits);
+    }
+    char s[size + 1];
+    memcpy(s, pattern, size);
+    s[size] = '\0';
+    QueryTerm terms[size + 1];
+    int terms_num;
+    int positions;
+    if (find_wildcard_terms(db, pattern, s, size, star, terms, &terms_num, &positions) != 0) {
+        return 1;
+    }
+    return search_terms(db, pattern, s, terms, terms_num, FALSE, NULL, phits);
+}
+
+/**
+ * Returns postings of a phrase or a wildcard phrase, which offsets are where
+ * it begins. *positions is how many positions it takes.
+ */
+static TCLIST*
+get_operand_postings(oDB* db, oNode* node, int* positions)
+{
+    const char* phrase = tcxstrptr(node->u.phrase.s);
+    char s[strlen(phrase) + 1];
+    oNormalize(s, phrase, db->tokenizer);
+    size_t size = strlen(s);
+    QueryTerm terms[size + 1];
+    int terms_num = 0;
+    *positions = 0;
+    if (node->type == NODE_WILDCARD) {
+        BOOL star = ends_with_star(s, size);
+        if (star) {
+            s[--size] = '\0';
+        }
+        if (find_wildcard_terms(db, phrase, s, size, star, terms, &terms_num, positions) != 0) {
+            return NULL;
         }
     }
+    else {
+        terms_num = find_query_terms(db, s, size, terms, positions);
+    }
+    if (terms_num == 0) {
+        return tclistnew();
+    }
+    TCLIST* posting_lists[terms_num];
+    BOOL has_prefix;
+    if (!get_compressed_posting_lists(db, s, terms, terms_num, posting_lists, &has_prefix)) {
+        delete_compressed_posting_lists(posting_lists, terms_num);
+        return tclistnew();
+    }
+    TCLIST* postings = get_phrase_postings(db, s, terms, posting_lists, terms_num);
+    delete_compressed_posting_lists(posting_lists, terms_num);
+    return postings;
+}
 
-#if 0
-    tcmapiterinit(doc2hits);
-    while ((key = (o_doc_id_t*)tcmapiternext(doc2hits, &sp)) != NULL) {
-        TRACE("docid=%d", *key);
-        const TCLIST* hits = *((const TCLIST**)tcmapget(doc2hits, key, sizeof(key), &sp));
-        int i;
-        for (i = 0; i < tclistnum(hits); i++) {
-            TRACE("hit #%d", i);
-            FuzzyHit* hit = *((FuzzyHit**)tclistval2(hits, i));
-            int j;
-            for (j = 0; j < hit->offsets_size; j++) {
-                TRACE("offset[%d]=%d", j, hit->offsets[j]);
+/**
+ * Finds the first pair of offsets in posting1 and posting2 which are within
+ * distance. Offsets of both are in ascending order. The one which begins
+ * first is paired with the other only when it begins first too, or it is too
+ * far from any later one.
+ */
+static BOOL
+find_near_span(const Posting* posting1, int size1, const Posting* posting2, int size2, int distance, oSpan* span)
+{
+    int i = 0;
+    int j = 0;
+    while ((i < posting1->offset_size) && (j < posting2->offset_size)) {
+        int begin1 = posting1->offset[i];
+        int begin2 = posting2->offset[j];
+        int end1 = begin1 + size1;
+        int end2 = begin2 + size2;
+        if (begin1 <= begin2) {
+            if (begin2 - end1 <= distance) {
+                span->begin = begin1;
+                span->end = end1 < end2 ? end2 : end1;
+                return TRUE;
             }
+            i++;
+            continue;
         }
+        if (begin1 - end2 <= distance) {
+            span->begin = begin2;
+            span->end = end1 < end2 ? end2 : end1;
+            return TRUE;
+        }
+        j++;
     }
-#endif
-
-    tcmapdel(doc2hits);
-    return 0;
+    return FALSE;
 }
 
+/**
+ * Documents which have both phrases are found by the same merge as
+ * intersect(), and then positions of them are merged to find a span where
+ * they are within the distance. A document is found once even if its
+ * attributes have the phrases too.
+ */
 static int
-search_phrase(oDB* db, const char* phrase, oHits** phits)
+search_near(oDB* db, oNode* node, oHits** phits)
 {
-    int term_size = get_term_size(phrase);
-    TCLIST* posting_list1 = search_posting_list(db, phrase, term_size);
-    if (posting_list1 == NULL) {
+    if (db->postings == POSTINGS_DOCS) {
+        set_msg(db, "NEAR needs positions", "--postings=docs");
         return 1;
     }
-    if (tclistnum(posting_list1) == 0) {
-        *phits = oHits_new(db, 0);
-        return *phits != NULL ? 0 : 1;
+    int size1;
+    TCLIST* posting_list1 = get_operand_postings(db, node->u.near.left, &size1);
+    if (posting_list1 == NULL) {
+        return 1;
     }
-
-    size_t size = strlen(phrase);
-    unsigned int pos = term_size;
-    int gap = 0;
-    unsigned int prev_pos = 0;
-    while (pos < size) {
-        int char_size = get_char_size(phrase[pos]);
-        int from;
-        if (size <= pos + char_size) {
-            gap += 1;
-            from = prev_pos + get_char_size(phrase[prev_pos]);
-        }
-        else {
-            gap += 2;
-            from = pos;
-        }
-        const char* term = &phrase[from];
-        int term_size = get_term_size(term);
-        TCLIST* posting_list2 = search_posting_list(db, term, term_size);
-        if (posting_list2 == NULL) {
-            tclistdel(posting_list1);
-            return 1;
-        }
-        if (tclistnum(posting_list2) == 0) {
-            tclistdel(posting_list1);
-            tclistdel(posting_list2);
-            return 0;
-        }
-
-        TCLIST* intersected = intersect(db, posting_list1, posting_list2, gap);
+    int size2;
+    TCLIST* posting_list2 = get_operand_postings(db, node->u.near.right, &size2);
+    if (posting_list2 == NULL) {
         delete_posting_list(db, posting_list1);
-        delete_posting_list(db, posting_list2);
-        if (intersected == NULL) {
-            return 1;
-        }
-
-        prev_pos = from;
-        pos = from + term_size;
-        posting_list1 = intersected;
+        return 1;
     }
-
-    int num = tclistnum(posting_list1);
-    *phits = oHits_new(db, tclistnum(posting_list1));
-    if (*phits == NULL) {
+    int num1 = tclistnum(posting_list1);
+    int num2 = tclistnum(posting_list2);
+    int max_num = num1 < num2 ? num1 : num2;
+    *phits = oHits_new(db, max_num);
+    oSpan* spans = (oSpan*)malloc(sizeof(oSpan) * (0 < max_num ? max_num : 1));
+    if ((*phits == NULL) || (spans == NULL)) {
+        oDB_set_msg_of_errno(db, "malloc failed");
+        oHits_delete(db, *phits);
+        free(spans);
         delete_posting_list(db, posting_list1);
+        delete_posting_list(db, posting_list2);
         return 1;
     }
-    int i;
-    for (i = 0; i < num; i++) {
-        Posting* posting = *((Posting**)tclistval2(posting_list1, i));
-        (*phits)->doc_id[i] = posting->doc_id;
+    (*phits)->spans = spans;
+    int hits_num = 0;
+    int i = 0;
+    int j = 0;
+    while ((i < num1) && (j < num2)) {
+        Posting* posting1 = *((Posting**)tclistval2(posting_list1, i));
+        Posting* posting2 = *((Posting**)tclistval2(posting_list2, j));
+        if ((posting1->doc_id < posting2->doc_id) || ((posting1->doc_id == posting2->doc_id) && (posting1->attr_id < posting2->attr_id))) {
+            i++;
+            continue;
+        }
+        if ((posting2->doc_id < posting1->doc_id) || (posting2->attr_id < posting1->attr_id)) {
+            j++;
+            continue;
+        }
+        BOOL is_found = (0 < hits_num) && ((*phits)->doc_id[hits_num - 1] == posting1->doc_id);
+        if (!is_found && find_near_span(posting1, size1, posting2, size2, node->u.near.distance, &spans[hits_num])) {
+            (*phits)->doc_id[hits_num] = posting1->doc_id;
+            hits_num++;
+        }
+        i++;
+        j++;
     }
-
+    (*phits)->num = hits_num;
     delete_posting_list(db, posting_list1);
+    delete_posting_list(db, posting_list2);
     return 0;
 }
 
+/**
+ * A phrase may skip documents out of within if it is not NULL.
+ */
 static int
-not_op(oDB* db, oHits* left, oHits* right, oHits** phits)
+search_text(oDB* db, oNode* node, oHits* within, oHits** phits)
 {
-    int max_num = left->num;
-    *phits = oHits_new(db, max_num);
-    (*phits)->num = 0;
-
-    TCMAP* map = tcmapnew();
-    int val = 1;
-    int i;
-    for (i = 0; i < right->num; i++) {
-        o_doc_id_t doc_id = right->doc_id[i];
-        tcmapput(map, &doc_id, sizeof(doc_id), &val, sizeof(val));
+    /**
+     * A phrase must be normalized as documents are.
+     */
+    const char* phrase = tcxstrptr(node->u.phrase.s);
+    char normalized[strlen(phrase) + 1];
+    oNormalize(normalized, phrase, db->tokenizer);
+    if (normalized[0] == '\0') {
+        *phits = oHits_new(db, 0);
+        return *phits != NULL ? 0 : 1;
     }
-    for (i = 0; i < left->num; i++) {
-        o_doc_id_t doc_id = left->doc_id[i];
-        int sp;
-        const void* val = tcmapget(map, &doc_id, sizeof(doc_id), &sp);
-        if (val != NULL) {
-            continue;
-        }
-        (*phits)->doc_id[(*phits)->num] = doc_id;
-        (*phits)->num++;
+    int status;
+    switch (node->type) {
+    case NODE_PHRASE:
+        status = search_phrase(db, normalized, within, phits);
+        break;
+    case NODE_FUZZY:
+        status = search_fuzzily(db, normalized, phits);
+        break;
+    default:
+        status = search_wildcard(db, normalized, phits);
+        break;
     }
-    tcmapdel(map);
-
+    if (status != 0) {
+        return 1;
+    }
+    sort_hits(*phits);
     return 0;
 }
 
+static BOOL
+is_negation(const oNode* node)
+{
+    return (node->type == NODE_NOT) && (node->u.logical_op.left == NULL);
+}
+
+/**
+ * The difference of within and node is driven by within, so that a phrase is
+ * searched only in documents of within.
+ */
 static int
-and_op(oDB* db, oHits* left, oHits* right, oHits** phits)
+remove_matches(oDB* db, oNode* node, oHits* within, oHits** phits)
 {
-    int max_num = left->num < right->num ? right->num : left->num;
-    *phits = oHits_new(db, max_num);
-    (*phits)->num = 0;
+    oHits* matches = NULL;
+    if (eval_in(db, node, within, &matches) != 0) {
+        return 1;
+    }
+    int status = not_op(db, within, matches, phits);
+    oHits_delete(db, matches);
+    return status;
+}
 
-    TCMAP* map = tcmapnew();
-    int val = 1;
+/**
+ * Operands of AND are evaluated until one of them finds nothing. Negated
+ * operands are evaluated after the others, only in documents they found,
+ * and their documents are removed from the result.
+ */
+static int
+eval_and(oDB* db, oNode* node, oHits** phits)
+{
+    int num = node->u.operands.nodes_num;
+    oNode** operands = node->u.operands.nodes;
+    oHits* hits[num];
+    int hits_num = 0;
+    int status = 0;
     int i;
-    for (i = 0; i < left->num; i++) {
-        o_doc_id_t doc_id = left->doc_id[i];
-        tcmapput(map, &doc_id, sizeof(doc_id), &val, sizeof(val));
+    for (i = 0; (status == 0) && (i < num); i++) {
+        if (is_negation(operands[i])) {
+            continue;
+        }
+        status = eval(db, operands[i], &hits[hits_num]);
+        if (status != 0) {
+            break;
+        }
+        hits_num++;
+        if (hits[hits_num - 1]->num == 0) {
+            break;
+        }
     }
-    for (i = 0; i < right->num; i++) {
-        o_doc_id_t doc_id = right->doc_id[i];
-        int sp;
-        const void* val = tcmapget(map, &doc_id, sizeof(doc_id), &sp);
-        if (val == NULL) {
+    if ((status == 0) && (hits_num == 0)) {
+        set_msg(db, "Invalid query", "NOT needs a phrase to remove from");
+        status = 1;
+    }
+    if (status == 0) {
+        status = and_op(db, hits, hits_num, phits);
+    }
+    for (i = 0; i < hits_num; i++) {
+        oHits_delete(db, hits[i]);
+    }
+    for (i = 0; (status == 0) && (i < num) && (0 < (*phits)->num); i++) {
+        if (!is_negation(operands[i])) {
             continue;
         }
-        (*phits)->doc_id[(*phits)->num] = doc_id;
-        (*phits)->num++;
+        oHits* rest = NULL;
+        status = eval_in(db, operands[i], *phits, &rest);
+        oHits_delete(db, *phits);
+        *phits = rest;
     }
-    tcmapdel(map);
-
-    return 0;
+    return status;
 }
 
 static int
-or_op(oDB* db, oHits* left, oHits* right, oHits** phits)
+eval_or(oDB* db, oNode* node, oHits** phits)
 {
-    int max_num = left->num + right->num;
-    *phits = oHits_new(db, max_num);
-    (*phits)->num = 0;
-
-    TCMAP* map = tcmapnew();
-    int val = 1;
-    int i;
-    for (i = 0; i < left->num; i++) {
-        o_doc_id_t doc_id = left->doc_id[i];
-        tcmapput(map, &doc_id, sizeof(doc_id), &val, sizeof(val));
+    int num = node->u.operands.nodes_num;
+    oHits* hits[num];
+    int status = 0;
+    int evaluated;
+    for (evaluated = 0; evaluated < num; evaluated++) {
+        if (eval(db, node->u.operands.nodes[evaluated], &hits[evaluated]) != 0) {
+            status = 1;
+            break;
+        }
     }
-    for (i = 0; i < right->num; i++) {
-        o_doc_id_t doc_id = right->doc_id[i];
-        tcmapput(map, &doc_id, sizeof(doc_id), &val, sizeof(val));
+    if (status == 0) {
+        status = or_op(db, hits, num, phits);
     }
-    tcmapiterinit(map);
-    const void* key;
-    int sp;
-    while ((key = tcmapiternext(map, &sp)) != NULL) {
-        o_doc_id_t doc_id = *((o_doc_id_t*)key);
-        (*phits)->doc_id[(*phits)->num] = doc_id;
-        (*phits)->num++;
+    int i;
+    for (i = 0; i < evaluated; i++) {
+        oHits_delete(db, hits[i]);
     }
-    tcmapdel(map);
-
-    return 0;
+    return status;
 }
 
 static int
-eval(oDB* db, oNode* node, oHits** phits)
+eval_node(oDB* db, oNode* node, oHits** phits)
 {
-    if ((node->type == NODE_PHRASE) || (node->type == NODE_FUZZY)) {
-        const char* phrase = tcxstrptr(node->u.phrase.s);
-        int (*f)(oDB*, const char*, oHits**) = node->type == NODE_PHRASE ? search_phrase : search_fuzzily;
-        return f(db, phrase, phits);
+    switch (node->type) {
+    case NODE_PHRASE:
+    case NODE_FUZZY:
+    case NODE_WILDCARD:
+        return search_text(db, node, NULL, phits);
+    case NODE_REGEX:
+        return search_regex(db, tcxstrptr(node->u.phrase.s), phits);
+    case NODE_NEAR:
+        return search_near(db, node, phits);
+    case NODE_AND:
+        return eval_and(db, node, phits);
+    case NODE_OR:
+        return eval_or(db, node, phits);
+    default:
+        break;
+    }
+    if (is_negation(node)) {
+        set_msg(db, "Invalid query", "NOT needs a phrase to remove from");
+        return 1;
     }
     oHits* left_hits = NULL;
     if (eval(db, node->u.logical_op.left, &left_hits) != 0) {
         return 1;
     }
-    oHits* right_hits = NULL;
-    if (eval(db, node->u.logical_op.right, &right_hits) != 0) {
+    int status = remove_matches(db, node->u.logical_op.right, left_hits, phits);
+    oHits_delete(db, left_hits);
+    return status;
+}
+
+static oHits*
+copy_hits(oDB* db, const oHits* hits)
+{
+    oHits* copy = oHits_new(db, hits->num);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy->doc_id, hits->doc_id, sizeof(o_doc_id_t) * hits->num);
+    if ((hits->spans != NULL) && (alloc_spans(db, copy, hits->num) != 0)) {
+        oHits_delete(db, copy);
+        return NULL;
+    }
+    if (hits->spans != NULL) {
+        memcpy(copy->spans, hits->spans, sizeof(oSpan) * hits->num);
+    }
+    return copy;
+}
+
+/**
+ * A node shared by the optimizer keeps its result, so that it is evaluated
+ * once in a query.
+ */
+static int
+eval_shared(oDB* db, oNode* node, oHits** phits)
+{
+    if (node->hits != NULL) {
+        COUNT_STATS(db, cached, 1);
+        *phits = copy_hits(db, node->hits);
+        return *phits != NULL ? 0 : 1;
+    }
+    if (eval_node(db, node, phits) != 0) {
         return 1;
     }
-    int (*f)(oDB*, oHits*, oHits*, oHits**);
+    if (node->refs < 2) {
+        return 0;
+    }
+    node->hits = copy_hits(db, *phits);
+    return node->hits != NULL ? 0 : 1;
+}
+
+/**
+ * Seconds of the monotonic clock, to measure intervals.
+ */
+double
+oClock_get_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * A negation finds documents of within which its operand doesn't match. A
+ * phrase may skip documents out of within. The others find all documents.
+ */
+static int
+eval_node_in(oDB* db, oNode* node, oHits* within, oHits** phits)
+{
+    if (within == NULL) {
+        return eval_shared(db, node, phits);
+    }
+    if (is_negation(node)) {
+        return remove_matches(db, node->u.logical_op.right, within, phits);
+    }
+    if ((node->type == NODE_PHRASE) && (node->refs < 2)) {
+        return search_text(db, node, within, phits);
+    }
+    return eval_shared(db, node, phits);
+}
+
+/**
+ * While a node is evaluated, db->stats is of the node, so that functions
+ * which do work count it for the node.
+ */
+static int
+eval_in(oDB* db, oNode* node, oHits* within, oHits** phits)
+{
+    if (node->stats == NULL) {
+        return eval_node_in(db, node, within, phits);
+    }
+    oStats* parent = db->stats;
+    db->stats = node->stats;
+    double begin = oClock_get_seconds();
+    int status = eval_node_in(db, node, within, phits);
+    node->stats->seconds += oClock_get_seconds() - begin;
+    node->stats->evaluations++;
+    if (status == 0) {
+        node->stats->hits = (*phits)->num;
+    }
+    db->stats = parent;
+    return status;
+}
+
+static int
+eval(oDB* db, oNode* node, oHits** phits)
+{
+    return eval_in(db, node, NULL, phits);
+}
+
+static void
+add_stats(oNode* node)
+{
+    if (node->stats != NULL) {
+        return;
+    }
+    node->stats = oStats_new();
     switch (node->type) {
-    case NODE_AND:
-        f = and_op;
+    case NODE_PHRASE:
+    case NODE_FUZZY:
+    case NODE_REGEX:
+    case NODE_WILDCARD:
         break;
-    case NODE_OR:
-        f = or_op;
+    case NODE_NEAR:
+        add_stats(node->u.near.left);
+        add_stats(node->u.near.right);
         break;
-    case NODE_NOT:
-        f = not_op;
+    case NODE_AND:
+    case NODE_OR:
+        {
+            int i;
+            for (i = 0; i < node->u.operands.nodes_num; i++) {
+                add_stats(node->u.operands.nodes[i]);
+            }
+        }
         break;
     default:
-        return 1;
+        if (node->u.logical_op.left != NULL) {
+            add_stats(node->u.logical_op.left);
+        }
+        add_stats(node->u.logical_op.right);
         break;
     }
-    int status = f(db, left_hits, right_hits, phits);
-    oHits_delete(db, left_hits);
-    oHits_delete(db, right_hits);
+}
+
+/**
+ * Queries are appended to the log given by oDB_open_query_log(). A query is
+ * written on a line after its time, its latency in microseconds and the number
+ * of its hits (-1 for an error), separated with tabs. Whitespaces in the query
+ * are folded into one space, so that a line is a query.
+ */
+int
+oDB_open_query_log(oDB* db, const char* path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+        oDB_set_msg_of_errno(db, "Can't open query log");
+        return 1;
+    }
+    if (db->query_log != -1) {
+        close(db->query_log);
+    }
+    db->query_log = fd;
+    return 0;
+}
+
+static void
+append_folded(TCXSTR* s, const char* phrase)
+{
+    BOOL is_first = TRUE;
+    BOOL is_space = FALSE;
+    const char* p;
+    for (p = phrase; *p != '\0'; p++) {
+        if (isspace((unsigned char)*p)) {
+            is_space = TRUE;
+            continue;
+        }
+        if (is_space && !is_first) {
+            tcxstrcat(s, " ", 1);
+        }
+        is_first = FALSE;
+        is_space = FALSE;
+        tcxstrcat(s, p, 1);
+    }
+}
+
+/**
+ * A line is written with one write(2) to a file opened with O_APPEND, so that
+ * lines of processes sharing a log are not mixed.
+ */
+static void
+log_query(oDB* db, const char* phrase, double seconds, int hits_num)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    TCXSTR* line = tcxstrnew();
+    tcxstrprintf(line, "%lld.%06ld\t%lld\t%d\t", (long long)now.tv_sec, now.tv_nsec / 1000, (long long)(seconds * 1000000), hits_num);
+    append_folded(line, phrase);
+    tcxstrcat(line, "\n", 1);
+    if (write(db->query_log, tcxstrptr(line), tcxstrsize(line)) != tcxstrsize(line)) {
+        /**
+         * The log is for measurement, so a search doesn't fail with it.
+         */
+    }
+    tcxstrdel(line);
+}
 
+static int
+search(oDB* db, const char* phrase, oHits** phits)
+{
+    oNode* node = oParser_parse(db, phrase);
+    if (node == NULL) {
+        set_msg(db, "Invalid query", phrase);
+        return 1;
+    }
+    node = oPlan_optimize(node);
+    int status = eval(db, node, phits);
+    oNode_delete(node);
     return status;
 }
 
 int
 oDB_search(oDB* db, const char* phrase, oHits** phits)
+{
+    if (db->query_log == -1) {
+        return search(db, phrase, phits);
+    }
+    double begin = oClock_get_seconds();
+    int status = search(db, phrase, phits);
+    log_query(db, phrase, oClock_get_seconds() - begin, status == 0 ? (*phits)->num : -1);
+    return status;
+}
+
+/**
+ * Searches a query, and returns its optimized plan with statistics of each
+ * node as text, which must be freed.
+ */
+char*
+oDB_explain(oDB* db, const char* phrase)
+{
+    oNode* node = oParser_parse(db, phrase);
+    if (node == NULL) {
+        set_msg(db, "Invalid query", phrase);
+        return NULL;
+    }
+    node = oPlan_optimize(node);
+    add_stats(node);
+    oHits* hits = NULL;
+    if (eval(db, node, &hits) != 0) {
+        oNode_delete(node);
+        return NULL;
+    }
+    oHits_delete(db, hits);
+    TCXSTR* plan = tcxstrnew();
+    oPlan_dump(node, plan);
+    oNode_delete(node);
+    return tcxstrtomalloc(plan);
+}
+
+/**
+ * Returns the optimized plan of a query as text, which must be freed.
+ */
+char*
+oDB_get_plan(oDB* db, const char* phrase)
 {
     oNode* node = oParser_parse(db, phrase);
-    return eval(db, node, phits);
+    if (node == NULL) {
+        set_msg(db, "Invalid query", phrase);
+        return NULL;
+    }
+    node = oPlan_optimize(node);
+    TCXSTR* plan = tcxstrnew();
+    oPlan_dump(node, plan);
+    oNode_delete(node);
+    return tcxstrtomalloc(plan);
 }
 
 char*
@@ -1410,7 +4881,7 @@ oDB_get_attr(oDB* db, o_doc_id_t doc_id, const char* attr)
         return NULL;
     }
     int sp;
-    return (char*)tchdbget(db->attrs[attr_id], &doc_id, sizeof(doc_id), &sp);
+    return read_attr(db, doc_id, attr_id, &sp);
 }
 
 /**
@@ -0,0 +1,334 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "tcutil.h"
+#include "o.h"
+#include "o/private.h"
+
+/**
+ * A document log is a pair of files. doc.log is a sequence of compressed
+ * documents, which are appended only. doc.idx is an array of oDocLogEntry
+ * indexed by document IDs. Both files are mapped into memory, so reading a
+ * document needs neither a system call nor a copy.
+ */
+struct oDocLogEntry {
+    uint64_t offset;
+    uint64_t size;
+};
+
+typedef struct oDocLogEntry oDocLogEntry;
+
+static int
+open_file(oDB* db, const char* dir, const char* name, int flags)
+{
+    char path[1024];
+    snprintf(path, array_sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, flags, 0644);
+    if (fd == -1) {
+        oDB_set_msg_of_errno(db, "Can't open document log");
+    }
+    return fd;
+}
+
+int
+oDocLog_create(oDB* db, const char* dir)
+{
+    const char* names[] = { "doc.log", "doc.idx" };
+    int i;
+    for (i = 0; i < array_sizeof(names); i++) {
+        int fd = open_file(db, dir, names[i], O_WRONLY | O_CREAT | O_EXCL);
+        if (fd == -1) {
+            return 1;
+        }
+        if (close(fd) != 0) {
+            oDB_set_msg_of_errno(db, "Can't close document log");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+unmap_file(char** map, size_t* size)
+{
+    if (*map != NULL) {
+        munmap(*map, *size);
+    }
+    *map = NULL;
+    *size = 0;
+}
+
+static int
+map_file(oDB* db, int fd, char** map, size_t* size)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        oDB_set_msg_of_errno(db, "Can't stat document log");
+        return 1;
+    }
+    unmap_file(map, size);
+    if (st.st_size == 0) {
+        return 0;
+    }
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        oDB_set_msg_of_errno(db, "Can't map document log");
+        return 1;
+    }
+    *map = (char*)p;
+    *size = st.st_size;
+    return 0;
+}
+
+struct oDocLogMap {
+    char* map;
+    size_t size;
+};
+
+typedef struct oDocLogMap oDocLogMap;
+
+static void
+retire_map(oDocLog* log, char** map, size_t* size)
+{
+    if (*map != NULL) {
+        oDocLogMap retired = { *map, *size };
+        tclistpush(log->retired, &retired, sizeof(retired));
+    }
+    *map = NULL;
+    *size = 0;
+}
+
+static int
+remap(oDB* db, oDocLog* log)
+{
+    if (log->is_shared) {
+        retire_map(log, &log->log_map, &log->log_map_size);
+        retire_map(log, &log->idx_map, &log->idx_map_size);
+    }
+    if (map_file(db, log->log_fd, &log->log_map, &log->log_map_size) != 0) {
+        return 1;
+    }
+    if (map_file(db, log->idx_fd, &log->idx_map, &log->idx_map_size) != 0) {
+        return 1;
+    }
+    return 0;
+}
+
+oDocLog*
+oDocLog_open(oDB* db, const char* dir, BOOL writable)
+{
+    oDocLog* log = (oDocLog*)malloc(sizeof(oDocLog));
+    if (log == NULL) {
+        oDB_set_msg_of_errno(db, "malloc failed");
+        return NULL;
+    }
+    log->log_map = NULL;
+    log->log_map_size = 0;
+    log->idx_map = NULL;
+    log->idx_map_size = 0;
+    log->is_shared = FALSE;
+    pthread_mutex_init(&log->lock, NULL);
+    log->retired = tclistnew();
+    int flags = writable ? O_RDWR : O_RDONLY;
+    log->log_fd = open_file(db, dir, "doc.log", flags);
+    if (log->log_fd == -1) {
+        tclistdel(log->retired);
+        pthread_mutex_destroy(&log->lock);
+        free(log);
+        return NULL;
+    }
+    log->idx_fd = open_file(db, dir, "doc.idx", flags);
+    if (log->idx_fd == -1) {
+        close(log->log_fd);
+        tclistdel(log->retired);
+        pthread_mutex_destroy(&log->lock);
+        free(log);
+        return NULL;
+    }
+    if (remap(db, log) != 0) {
+        oDocLog_close(db, log);
+        return NULL;
+    }
+    /**
+     * Documents are appended in order of their IDs, so the last entry tells
+     * the end of the log. A crash can leave a document without its entry at
+     * the end of doc.log. Such bytes are overwritten by the next document.
+     */
+    log->log_size = 0;
+    size_t i = log->idx_map_size / sizeof(oDocLogEntry);
+    while (0 < i) {
+        i--;
+        const oDocLogEntry* entry = &((const oDocLogEntry*)log->idx_map)[i];
+        if (0 < entry->size) {
+            log->log_size = entry->offset + entry->size;
+            break;
+        }
+    }
+    return log;
+}
+
+int
+oDocLog_close(oDB* db, oDocLog* log)
+{
+    int status = 0;
+    unmap_file(&log->log_map, &log->log_map_size);
+    unmap_file(&log->idx_map, &log->idx_map_size);
+    while (0 < tclistnum(log->retired)) {
+        oDocLogMap* retired = (oDocLogMap*)tclistpop2(log->retired);
+        unmap_file(&retired->map, &retired->size);
+        free(retired);
+    }
+    tclistdel(log->retired);
+    pthread_mutex_destroy(&log->lock);
+    if (close(log->idx_fd) != 0) {
+        oDB_set_msg_of_errno(db, "Can't close document log");
+        status = 1;
+    }
+    if (close(log->log_fd) != 0) {
+        oDB_set_msg_of_errno(db, "Can't close document log");
+        status = 1;
+    }
+    free(log);
+    return status;
+}
+
+static int
+write_fully(oDB* db, int fd, const void* data, size_t size, off_t offset)
+{
+    const char* p = (const char*)data;
+    while (0 < size) {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            oDB_set_msg_of_errno(db, "Can't write document log");
+            return 1;
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+ * A document can be written in pieces. pos is relative to the end of the log.
+ * The document is not a part of the log until oDocLog_commit() is called.
+ */
+int
+oDocLog_write(oDB* db, oDocLog* log, size_t pos, const char* data, size_t size)
+{
+    return write_fully(db, log->log_fd, data, size, log->log_size + pos);
+}
+
+int
+oDocLog_commit(oDB* db, oDocLog* log, o_doc_id_t doc_id, size_t size)
+{
+    oDocLogEntry entry;
+    entry.offset = log->log_size;
+    entry.size = size;
+    off_t offset = (off_t)doc_id * sizeof(entry);
+    if (write_fully(db, log->idx_fd, &entry, sizeof(entry), offset) != 0) {
+        return 1;
+    }
+    log->log_size += size;
+    return 0;
+}
+
+/**
+ * Returns a pointer into the mapped log. It is valid until the next call of
+ * oDocLog_get() or oDocLog_close(), or until oDocLog_close() if the log is
+ * shared.
+ */
+static const char*
+get(oDB* db, oDocLog* log, o_doc_id_t doc_id, size_t* size)
+{
+    size_t end = ((size_t)doc_id + 1) * sizeof(oDocLogEntry);
+    if ((doc_id < 0) || (log->idx_map_size < end)) {
+        /**
+         * The document may be appended after the log was mapped.
+         */
+        if (remap(db, log) != 0) {
+            return NULL;
+        }
+        if ((doc_id < 0) || (log->idx_map_size < end)) {
+            oDB_set_msg(db, "Document not found", NULL);
+            return NULL;
+        }
+    }
+    const oDocLogEntry* entry = &((const oDocLogEntry*)log->idx_map)[doc_id];
+    if (entry->size == 0) {
+        oDB_set_msg(db, "Document not found", NULL);
+        return NULL;
+    }
+    if (log->log_map_size < entry->offset + entry->size) {
+        if (remap(db, log) != 0) {
+            return NULL;
+        }
+        entry = &((const oDocLogEntry*)log->idx_map)[doc_id];
+        if (log->log_map_size < entry->offset + entry->size) {
+            oDB_set_msg(db, "Document log is broken", NULL);
+            return NULL;
+        }
+    }
+    *size = entry->size;
+    return &log->log_map[entry->offset];
+}
+
+const char*
+oDocLog_get(oDB* db, oDocLog* log, o_doc_id_t doc_id, size_t* size)
+{
+    if (!log->is_shared) {
+        return get(db, log, doc_id, size);
+    }
+    pthread_mutex_lock(&log->lock);
+    const char* doc = get(db, log, doc_id, size);
+    pthread_mutex_unlock(&log->lock);
+    return doc;
+}
+
+int
+oDocLog_sync(oDB* db, oDocLog* log)
+{
+    if ((fdatasync(log->log_fd) != 0) || (fdatasync(log->idx_fd) != 0)) {
+        oDB_set_msg_of_errno(db, "Can't sync document log");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Appends documents from first_doc_id to end_doc_id - 1 in src to dest.
+ */
+int
+oDocLog_copy(oDB* db, oDocLog* dest, oDocLog* src, o_doc_id_t first_doc_id, o_doc_id_t end_doc_id)
+{
+    o_doc_id_t doc_id;
+    for (doc_id = first_doc_id; doc_id < end_doc_id; doc_id++) {
+        size_t size;
+        const char* doc = oDocLog_get(db, src, doc_id, &size);
+        if (doc == NULL) {
+            return 1;
+        }
+        if (oDocLog_write(db, dest, 0, doc, size) != 0) {
+            return 1;
+        }
+        if (oDocLog_commit(db, dest, doc_id, size) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
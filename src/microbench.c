@@ -0,0 +1,516 @@
+#if defined(HAVE_CONFIG_H)
+#   include "o/config.h"
+#endif
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(HAVE_LINUX_PERF_EVENT_H)
+#   include <linux/perf_event.h>
+#   include <sys/ioctl.h>
+#   include <sys/syscall.h>
+#endif
+#include "tcutil.h"
+#include "o.h"
+#include "o/private.h"
+
+/**
+ * o-microbench measures the kernels of core.c with synthetic posting lists.
+ * An element is a number which a kernel reads: a varint, a position in
+ * posting lists, or a document ID in hits. Results are "name<TAB>value" lines
+ * like o-bench.
+ */
+
+struct Random {
+    uint64_t state;
+};
+
+typedef struct Random Random;
+
+static uint64_t
+Random_next(Random* random)
+{
+    uint64_t x = random->state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    random->state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static int
+Random_range(Random* random, int n)
+{
+    return (int)(Random_next(random) % (uint64_t)n);
+}
+
+/**
+ * Cycles are counted by perf_event_open(2) when the kernel allows it. fd is -1
+ * if not.
+ */
+struct Counter {
+    int fd;
+};
+
+typedef struct Counter Counter;
+
+static void
+Counter_open(Counter* counter)
+{
+    counter->fd = -1;
+#if defined(HAVE_LINUX_PERF_EVENT_H)
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    counter->fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+static void
+Counter_close(Counter* counter)
+{
+    if (counter->fd != -1) {
+        close(counter->fd);
+    }
+}
+
+static void
+Counter_start(Counter* counter)
+{
+#if defined(HAVE_LINUX_PERF_EVENT_H)
+    if (counter->fd != -1) {
+        ioctl(counter->fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter->fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+static long long
+Counter_stop(Counter* counter)
+{
+    long long cycles = 0;
+#if defined(HAVE_LINUX_PERF_EVENT_H)
+    if (counter->fd != -1) {
+        ioctl(counter->fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter->fd, &cycles, sizeof(cycles)) != sizeof(cycles)) {
+            cycles = 0;
+        }
+    }
+#endif
+    return cycles;
+}
+
+struct Bench {
+    oDB* db;
+    Random random;
+    double min_seconds;
+    const char* filter;
+    Counter counter;
+};
+
+typedef struct Bench Bench;
+
+/**
+ * A kernel runs once per call, and returns non-zero on error.
+ */
+typedef int (*Kernel)(Bench* bench, void* arg);
+
+static void
+print_double(const char* name, const char* key, double val)
+{
+    printf("%s.%s\t%.3f\n", name, key, val);
+}
+
+static BOOL
+is_selected(Bench* bench, const char* name)
+{
+    return (bench->filter == NULL) || (strstr(name, bench->filter) != NULL);
+}
+
+/**
+ * A kernel is repeated until min_seconds passes, so that short ones are
+ * measured over many runs.
+ */
+static int
+measure(Bench* bench, const char* name, long long elems, Kernel kernel, void* arg)
+{
+    if (!is_selected(bench, name)) {
+        return 0;
+    }
+    long long runs = 0;
+    long long cycles = 0;
+    double seconds = 0;
+    do {
+        double begin = oClock_get_seconds();
+        Counter_start(&bench->counter);
+        if (kernel(bench, arg) != 0) {
+            fprintf(stderr, "%s failed - %s\n", name, bench->db->msg);
+            return 1;
+        }
+        cycles += Counter_stop(&bench->counter);
+        seconds += oClock_get_seconds() - begin;
+        runs++;
+    } while (seconds < bench->min_seconds);
+
+    double total = (double)runs * elems;
+    printf("%s.elems\t%lld\n", name, elems);
+    print_double(name, "ns_per_elem", seconds * 1e9 / total);
+    if (bench->counter.fd != -1) {
+        print_double(name, "cycles_per_elem", cycles / total);
+    }
+    return 0;
+}
+
+/**
+ * Varints. Numbers of a set are below 128, gaps of positions, or large
+ * document IDs, to cover encodings of one to four bytes.
+ */
+#define NUMS_NUM    (1024 * 1024)
+
+struct Varints {
+    int* nums;
+    int* decompressed;
+    char* compressed;
+};
+
+typedef struct Varints Varints;
+
+static int
+compress_nums(Bench* bench, void* arg)
+{
+    Varints* varints = (Varints*)arg;
+    oKernel_compress_nums(varints->nums, NUMS_NUM, varints->compressed);
+    return 0;
+}
+
+static int
+decompress_nums(Bench* bench, void* arg)
+{
+    Varints* varints = (Varints*)arg;
+    oKernel_decompress_nums(varints->compressed, NUMS_NUM, varints->decompressed);
+    return 0;
+}
+
+static int
+bench_varints(Bench* bench)
+{
+    const char* names[] = { "small", "gaps", "large" };
+    const int maxes[] = { 128, 64, 1 << 28 };
+    Varints varints;
+    varints.nums = (int*)tcmalloc(sizeof(int) * NUMS_NUM);
+    varints.decompressed = (int*)tcmalloc(sizeof(int) * NUMS_NUM);
+    varints.compressed = (char*)tcmalloc(5 * NUMS_NUM);
+    int status = 0;
+    int i;
+    for (i = 0; (status == 0) && (i < array_sizeof(names)); i++) {
+        int j;
+        for (j = 0; j < NUMS_NUM; j++) {
+            int n = Random_range(&bench->random, maxes[i]);
+            /**
+             * Gaps of positions are mostly small with a long tail.
+             */
+            varints.nums[j] = i == 1 ? n * n : n;
+        }
+        oKernel_compress_nums(varints.nums, NUMS_NUM, varints.compressed);
+        char name[64];
+        snprintf(name, array_sizeof(name), "compress_num.%s", names[i]);
+        status = measure(bench, name, NUMS_NUM, compress_nums, &varints);
+        snprintf(name, array_sizeof(name), "decompress_num.%s", names[i]);
+        if (status == 0) {
+            status = measure(bench, name, NUMS_NUM, decompress_nums, &varints);
+        }
+    }
+    free(varints.compressed);
+    free(varints.decompressed);
+    free(varints.nums);
+    return status;
+}
+
+/**
+ * A posting list of a term. Documents are skewed: most of them are close to
+ * each other, and some are far. Gaps between them are multiplied by spread,
+ * so that a short list ranges as widely as a long one. Every document has
+ * positions_min to positions_max positions.
+ */
+struct PostingList {
+    TCLIST* compressed;
+    TCLIST* postings;
+    long long elems;
+};
+
+typedef struct PostingList PostingList;
+
+static int
+make_posting_list(Bench* bench, PostingList* list, int docs_num, int spread, int positions_min, int positions_max, int first_pos)
+{
+    list->compressed = tclistnew2(docs_num);
+    list->elems = 0;
+    int* pos = (int*)tcmalloc(sizeof(int) * positions_max);
+    char* data = (char*)tcmalloc(5 * (positions_max + 3));
+    Random* random = &bench->random;
+    o_doc_id_t doc_id = 0;
+    int i;
+    for (i = 0; i < docs_num; i++) {
+        int gap = Random_range(random, 10) == 0 ? 1 + Random_range(random, 1000) : 1 + Random_range(random, 2);
+        doc_id += spread * gap;
+        int pos_num = positions_min + Random_range(random, positions_max - positions_min + 1);
+        int p = first_pos;
+        int j;
+        for (j = 0; j < pos_num; j++) {
+            pos[j] = p;
+            p += 1 + Random_range(random, 16);
+        }
+        int size = oKernel_compress_posting(doc_id, pos, pos_num, data);
+        tclistpush(list->compressed, data, size);
+        list->elems += pos_num;
+    }
+    free(data);
+    free(pos);
+    list->postings = oKernel_decompress_postings(bench->db, list->compressed);
+    return list->postings == NULL ? 1 : 0;
+}
+
+static void
+delete_posting_list(Bench* bench, PostingList* list)
+{
+    if (list->postings != NULL) {
+        oKernel_delete_postings(bench->db, list->postings);
+    }
+    tclistdel(list->compressed);
+}
+
+static int
+decompress_postings(Bench* bench, void* arg)
+{
+    PostingList* list = (PostingList*)arg;
+    TCLIST* postings = oKernel_decompress_postings(bench->db, list->compressed);
+    if (postings == NULL) {
+        return 1;
+    }
+    oKernel_delete_postings(bench->db, postings);
+    return 0;
+}
+
+static int
+intersect(Bench* bench, void* arg)
+{
+    PostingList* lists = (PostingList*)arg;
+    TCLIST* result = oKernel_intersect(bench->db, lists[0].postings, lists[1].postings, 1);
+    if (result == NULL) {
+        return 1;
+    }
+    oKernel_delete_postings(bench->db, result);
+    return 0;
+}
+
+/**
+ * Lists are of short documents, which have a few positions, and of long ones.
+ * The second term of a pair is shifted by one position, so that it follows
+ * the first term in some documents.
+ */
+static int
+bench_postings(Bench* bench)
+{
+    struct {
+        const char* name;
+        int docs_num[2];
+        int spreads[2];
+        int positions_min;
+        int positions_max;
+    } cases[] = {
+        { "short_docs", { 100000, 100000 }, { 1, 1 }, 1, 3 },
+        { "skewed", { 1000, 100000 }, { 100, 1 }, 1, 3 },
+        { "long_docs", { 1000, 1000 }, { 1, 1 }, 200, 2000 } };
+    int status = 0;
+    int i;
+    for (i = 0; (status == 0) && (i < array_sizeof(cases)); i++) {
+        PostingList lists[2];
+        memset(lists, 0, sizeof(lists));
+        int j;
+        for (j = 0; (status == 0) && (j < 2); j++) {
+            status = make_posting_list(bench, &lists[j], cases[i].docs_num[j], cases[i].spreads[j], cases[i].positions_min, cases[i].positions_max, j);
+        }
+        char name[64];
+        if (status == 0) {
+            snprintf(name, array_sizeof(name), "decompress_posting.%s", cases[i].name);
+            status = measure(bench, name, lists[1].elems, decompress_postings, &lists[1]);
+        }
+        if (status == 0) {
+            snprintf(name, array_sizeof(name), "intersect.%s", cases[i].name);
+            status = measure(bench, name, lists[0].elems + lists[1].elems, intersect, lists);
+        }
+        for (j = 0; j < 2; j++) {
+            if (lists[j].compressed != NULL) {
+                delete_posting_list(bench, &lists[j]);
+            }
+        }
+    }
+    return status;
+}
+
+/**
+ * Hits of a density, which is the per mille of documents in a range. Cases
+ * below give the same range to all hits.
+ */
+static oHits*
+make_hits(Bench* bench, int num, int density)
+{
+    oHits* hits = (oHits*)tcmalloc(sizeof(oHits) + sizeof(o_doc_id_t) * num);
+    hits->num = num;
+    hits->spans = NULL;
+    o_doc_id_t doc_id = 0;
+    int i;
+    for (i = 0; i < num; i++) {
+        while (density <= Random_range(&bench->random, 1000)) {
+            doc_id++;
+        }
+        hits->doc_id[i] = doc_id;
+        doc_id++;
+    }
+    return hits;
+}
+
+struct HitsSet {
+    oHits* hits[8];
+    int hits_num;
+    int (*op)(oDB* db, oHits* hits[], int hits_num, oHits** phits);
+};
+
+typedef struct HitsSet HitsSet;
+
+static int
+merge_hits(Bench* bench, void* arg)
+{
+    HitsSet* set = (HitsSet*)arg;
+    oHits* hits = NULL;
+    int status = set->op(bench->db, set->hits, set->hits_num, &hits);
+    oHits_delete(bench->db, hits);
+    return status;
+}
+
+static int
+not_op(oDB* db, oHits* hits[], int hits_num, oHits** phits)
+{
+    return oKernel_not(db, hits[0], hits[1], phits);
+}
+
+static int
+bench_hits(Bench* bench)
+{
+    struct {
+        const char* name;
+        int (*op)(oDB* db, oHits* hits[], int hits_num, oHits** phits);
+        int nums[8];
+        int densities[8];
+        int hits_num;
+    } cases[] = {
+        { "and.equal", oKernel_and, { 100000, 100000 }, { 500, 500 }, 2 },
+        { "and.skewed", oKernel_and, { 1000, 900000 }, { 1, 900 }, 2 },
+        { "and.3way", oKernel_and, { 10000, 100000, 900000 }, { 10, 100, 900 }, 3 },
+        { "or.equal", oKernel_or, { 100000, 100000 }, { 500, 500 }, 2 },
+        { "or.8way", oKernel_or, { 50000, 50000, 50000, 50000, 50000, 50000, 50000, 50000 }, { 500, 500, 500, 500, 500, 500, 500, 500 }, 8 },
+        { "not.equal", not_op, { 100000, 100000 }, { 500, 500 }, 2 },
+        { "not.skewed", not_op, { 900000, 1000 }, { 900, 1 }, 2 } };
+    int status = 0;
+    int i;
+    for (i = 0; (status == 0) && (i < array_sizeof(cases)); i++) {
+        if (!is_selected(bench, cases[i].name)) {
+            continue;
+        }
+        HitsSet set;
+        set.hits_num = cases[i].hits_num;
+        set.op = cases[i].op;
+        long long elems = 0;
+        int j;
+        for (j = 0; j < set.hits_num; j++) {
+            set.hits[j] = make_hits(bench, cases[i].nums[j], cases[i].densities[j]);
+            elems += cases[i].nums[j];
+        }
+        status = measure(bench, cases[i].name, elems, merge_hits, &set);
+        for (j = 0; j < set.hits_num; j++) {
+            oHits_delete(bench->db, set.hits[j]);
+        }
+    }
+    return status;
+}
+
+static void
+usage()
+{
+    printf("usage:\n");
+    printf("  o-microbench [--min-time=seconds] [--seed=n] [--filter=name]\n");
+}
+
+static int
+run(oDB* db, int argc, char* argv[])
+{
+    Bench bench;
+    bench.db = db;
+    bench.random.state = 1;
+    bench.min_seconds = 0.2;
+    bench.filter = NULL;
+    struct option options[] = {
+        { "min-time", required_argument, NULL, 't' },
+        { "seed", required_argument, NULL, 'r' },
+        { "filter", required_argument, NULL, 'f' },
+        { 0, 0, 0, 0 } };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            bench.min_seconds = atof(optarg);
+            break;
+        case 'r':
+            bench.random.state = strtoull(optarg, NULL, 10);
+            break;
+        case 'f':
+            bench.filter = optarg;
+            break;
+        case '?':
+        default:
+            usage();
+            return 1;
+            break;
+        }
+    }
+    if ((optind < argc) || (bench.random.state == 0)) {
+        usage();
+        return 1;
+    }
+
+    Counter_open(&bench.counter);
+    printf("cycles\t%d\n", bench.counter.fd != -1 ? 1 : 0);
+    int status = bench_varints(&bench);
+    if (status == 0) {
+        status = bench_postings(&bench);
+    }
+    if (status == 0) {
+        status = bench_hits(&bench);
+    }
+    Counter_close(&bench.counter);
+    return status;
+}
+
+int
+main(int argc, char* argv[])
+{
+    oDB db;
+    oDB_init(&db);
+    int status = run(&db, argc, argv);
+    oDB_fini(&db);
+
+    return status;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,439 @@
+#if defined(HAVE_CONFIG_H)
+#   include "o/config.h"
+#endif
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#endif
+#include "tcutil.h"
+#include "o.h"
+#include "o/private.h"
+#include "normalize_table.h"
+
+/**
+ * Documents and queries are normalized in the same way.
+ *
+ *   - Spaces are removed, but one space between alphabets is kept.
+ *   - Fullwidth alphanumerics and symbols are folded into ASCII.
+ *   - An ideographic space (U+3000) is a space.
+ *   - Halfwidth katakana are folded into fullwidth ones. A katakana and a
+ *     following (semi-)voiced sound mark are composed.
+ *
+ * Characters to fold are in U+3000-U+30FF or U+FF00-U+FFEF, so only three-byte
+ * sequences beginning with 0xe3 or 0xef are decoded. The other bytes are
+ * copied as they are.
+ *
+ * The hybrid tokenizer makes words of Latin letters and digits, so spaces
+ * after them are kept too.
+ */
+void
+oNormalizer_init(oNormalizer* normalizer, oTokenizerType tokenizer)
+{
+    normalizer->classes = tokenizer == TOKENIZER_HYBRID ? word_byte_class : byte_class;
+    normalizer->is_prev_alpha = FALSE;
+    normalizer->has_space = FALSE;
+    normalizer->kana = 0;
+    normalizer->partial_size = 0;
+}
+
+/**
+ * Trailing spaces are removed, so a space is not written until a next
+ * character comes.
+ */
+static char*
+put_space(oNormalizer* normalizer, char* p)
+{
+    if (!normalizer->has_space) {
+        return p;
+    }
+    *p = ' ';
+    normalizer->has_space = FALSE;
+    return p + 1;
+}
+
+static char*
+put_ascii(oNormalizer* normalizer, char* p, char c)
+{
+    int cls = normalizer->classes[(unsigned char)c];
+    if (cls == CLASS_SPACE) {
+        if (normalizer->is_prev_alpha) {
+            normalizer->has_space = TRUE;
+        }
+        normalizer->is_prev_alpha = FALSE;
+        return p;
+    }
+    p = put_space(normalizer, p);
+    *p = c;
+    normalizer->is_prev_alpha = cls == CLASS_ALPHA;
+    return p + 1;
+}
+
+static char*
+put_bytes(oNormalizer* normalizer, char* p, const char* s, size_t size)
+{
+    p = put_space(normalizer, p);
+    memcpy(p, s, size);
+    normalizer->is_prev_alpha = FALSE;
+    return p + size;
+}
+
+static char*
+put_codepoint(oNormalizer* normalizer, char* p, int cp)
+{
+    if (cp < 0x80) {
+        return put_ascii(normalizer, p, cp);
+    }
+    char buf[3];
+    int size;
+    if (cp < 0x800) {
+        buf[0] = 0xc0 | (cp >> 6);
+        buf[1] = 0x80 | (cp & 0x3f);
+        size = 2;
+    }
+    else {
+        buf[0] = 0xe0 | (cp >> 12);
+        buf[1] = 0x80 | ((cp >> 6) & 0x3f);
+        buf[2] = 0x80 | (cp & 0x3f);
+        size = 3;
+    }
+    return put_bytes(normalizer, p, buf, size);
+}
+
+/**
+ * A katakana which can take a sound mark waits for the next character.
+ */
+static char*
+flush_kana(oNormalizer* normalizer, char* p)
+{
+    int kana = normalizer->kana;
+    if (kana == 0) {
+        return p;
+    }
+    normalizer->kana = 0;
+    return put_codepoint(normalizer, p, kana);
+}
+
+static BOOL
+can_take_mark(int cp)
+{
+    if ((cp < KANA_FIRST) || (KANA_LAST < cp)) {
+        return FALSE;
+    }
+    int i = cp - KANA_FIRST;
+    return (voiced_table[i] != 0) || (semi_voiced_table[i] != 0);
+}
+
+static int
+compose(int kana, int mark)
+{
+    const uint16_t* table = mark == VOICED_MARK ? voiced_table : semi_voiced_table;
+    return table[kana - KANA_FIRST];
+}
+
+/**
+ * s is a three-byte sequence beginning with 0xe3 or 0xef.
+ */
+static char*
+put_wide_char(oNormalizer* normalizer, char* p, const char* s)
+{
+    const unsigned char* u = (const unsigned char*)s;
+    if (((u[1] & 0xc0) != 0x80) || ((u[2] & 0xc0) != 0x80)) {
+        p = flush_kana(normalizer, p);
+        return put_bytes(normalizer, p, s, 3);
+    }
+    int cp = ((u[0] & 0x0f) << 12) | ((u[1] & 0x3f) << 6) | (u[2] & 0x3f);
+    if (cp == 0x3000) {
+        p = flush_kana(normalizer, p);
+        return put_ascii(normalizer, p, ' ');
+    }
+    int folded = cp;
+    if ((WIDTH_FIRST <= cp) && (cp <= WIDTH_LAST) && (width_table[cp - WIDTH_FIRST] != 0)) {
+        folded = width_table[cp - WIDTH_FIRST];
+    }
+    int kana = normalizer->kana;
+    if ((kana != 0) && ((folded == VOICED_MARK) || (folded == SEMI_VOICED_MARK))) {
+        int composed = compose(kana, folded);
+        if (composed != 0) {
+            normalizer->kana = 0;
+            return put_codepoint(normalizer, p, composed);
+        }
+    }
+    p = flush_kana(normalizer, p);
+    if (can_take_mark(folded)) {
+        p = put_space(normalizer, p);
+        normalizer->kana = folded;
+        normalizer->is_prev_alpha = FALSE;
+        return p;
+    }
+    if (folded == cp) {
+        return put_bytes(normalizer, p, s, 3);
+    }
+    return put_codepoint(normalizer, p, folded);
+}
+
+static BOOL
+is_mark(const unsigned char* u)
+{
+    if ((u[0] == 0xe3) && (u[1] == 0x82)) {
+        return (u[2] == 0x99) || (u[2] == 0x9a);
+    }
+    if ((u[0] == 0xef) && (u[1] == 0xbe)) {
+        return (u[2] == 0x9e) || (u[2] == 0x9f);
+    }
+    return FALSE;
+}
+
+/**
+ * Returns TRUE for a character beginning with 0xe3 which is written as it is.
+ * u points the second byte, and next is the following bytes. The character is
+ * in U+3000-U+3FFF, and it is not an ideographic space, a sound mark or a
+ * katakana followed by a sound mark.
+ */
+static BOOL
+is_plain_e3(const unsigned char* u, const char* next, size_t next_size)
+{
+    switch (u[0]) {
+    case 0x80:
+        return u[1] != 0x80;
+    case 0x81:
+        return TRUE;
+    case 0x82:
+        if (u[1] < 0x97) {
+            return TRUE;
+        }
+        if (u[1] < 0xa0) {
+            return FALSE;
+        }
+        /* FALLTHROUGH */
+    case 0x83:
+        return (3 <= next_size) && !is_mark((const unsigned char*)next);
+    default:
+        return TRUE;
+    }
+}
+
+#if defined(__SSE2__)
+/**
+ * Returns TRUE if all of 16 bytes are plain.
+ */
+static BOOL
+is_plain_block(const char* s)
+{
+    __m128i v = _mm_loadu_si128((const __m128i*)s);
+    /**
+     * Bytes larger than 0x7f are negative in signed comparison, so they are
+     * taken from the sign bits.
+     */
+    __m128i printable = _mm_cmpgt_epi8(v, _mm_set1_epi8(0x20));
+    __m128i e3 = _mm_cmpeq_epi8(v, _mm_set1_epi8((char)0xe3));
+    __m128i ef = _mm_cmpeq_epi8(v, _mm_set1_epi8((char)0xef));
+    __m128i plain = _mm_andnot_si128(_mm_or_si128(e3, ef), _mm_or_si128(printable, v));
+    return _mm_movemask_epi8(plain) == 0xffff;
+}
+
+/**
+ * Tells if the character before s[end] is an alphabet. A continuation byte
+ * has the class of its leading byte.
+ */
+static BOOL
+is_alpha_before(const uint8_t* classes, const char* s, size_t begin, size_t end)
+{
+    size_t i = end;
+    while (begin < i) {
+        i--;
+        int cls = classes[(unsigned char)s[i]];
+        if (cls != CLASS_INHERIT) {
+            return cls == CLASS_ALPHA;
+        }
+    }
+    return FALSE;
+}
+#endif
+
+/**
+ * Normalizes bytes from src[*pos] until a character which put_wide_char()
+ * must handle. The state is kept in local variables in this loop.
+ *
+ * What is kept from the previous piece makes dest at most 6 bytes longer than
+ * src consumed, so 16 bytes at p can be stored while 32 bytes remain in src.
+ */
+static char*
+normalize_run(oNormalizer* normalizer, char* p, const char* src, size_t size, size_t* pos)
+{
+    const uint8_t* classes = normalizer->classes;
+    int is_prev_alpha = normalizer->is_prev_alpha ? 1 : 0;
+    int has_space = normalizer->has_space ? 1 : 0;
+    size_t i = *pos;
+#if defined(__SSE2__)
+    BOOL is_word_head = TRUE;
+    size_t word_head = i;
+#endif
+    while (i < size) {
+#if defined(__SSE2__)
+        if (is_word_head && (i + 32 <= size) && is_plain_block(&src[i])) {
+            size_t begin = i;
+            *p = ' ';
+            p += has_space;
+            has_space = 0;
+            do {
+                __m128i v = _mm_loadu_si128((const __m128i*)&src[i]);
+                _mm_storeu_si128((__m128i*)p, v);
+                p += 16;
+                i += 16;
+            } while ((i + 32 <= size) && is_plain_block(&src[i]));
+            is_prev_alpha = is_alpha_before(classes, src, begin, i) ? 1 : 0;
+        }
+        is_word_head = FALSE;
+#endif
+        unsigned char c = (unsigned char)src[i];
+        int cls = classes[c];
+        if (cls == CLASS_SPACE) {
+            has_space |= is_prev_alpha;
+            is_prev_alpha = 0;
+#if defined(__SSE2__)
+            /**
+             * Checking every short word for a long run costs more than it
+             * saves.
+             */
+            is_word_head = 16 <= i - word_head;
+            word_head = i + 1;
+#endif
+            i++;
+            continue;
+        }
+        /**
+         * A pending space is written without a branch, which is hard to
+         * predict.
+         */
+        *p = ' ';
+        p += has_space;
+        if (cls != CLASS_WIDE) {
+            has_space = 0;
+            *p = c;
+            p++;
+            /**
+             * A continuation byte keeps is_prev_alpha.
+             */
+            is_prev_alpha = (cls == CLASS_ALPHA) | (is_prev_alpha & (cls >> 3));
+            i++;
+            continue;
+        }
+        if ((size < i + 3) || (c == 0xef) || !is_plain_e3((const unsigned char*)&src[i + 1], &src[i + 3], size - i - 3)) {
+            p -= has_space;
+            break;
+        }
+        has_space = 0;
+        memcpy(p, &src[i], 3);
+        p += 3;
+        is_prev_alpha = 0;
+        i += 3;
+    }
+    normalizer->is_prev_alpha = is_prev_alpha ? TRUE : FALSE;
+    normalizer->has_space = has_space ? TRUE : FALSE;
+    *pos = i;
+    return p;
+}
+
+/**
+ * dest must have (size + NORMALIZE_MARGIN) bytes at least. Returns the size
+ * of dest.
+ */
+size_t
+oNormalizer_normalize(oNormalizer* normalizer, char* dest, const char* src, size_t size)
+{
+    char* p = dest;
+    size_t i = 0;
+    if (0 < normalizer->partial_size) {
+        while ((normalizer->partial_size < 3) && (i < size)) {
+            normalizer->partial[normalizer->partial_size] = src[i];
+            normalizer->partial_size++;
+            i++;
+        }
+        if (normalizer->partial_size < 3) {
+            return 0;
+        }
+        p = put_wide_char(normalizer, p, normalizer->partial);
+        normalizer->partial_size = 0;
+    }
+    while (i < size) {
+        if (normalizer->kana != 0) {
+            /**
+             * A katakana is waiting for a sound mark.
+             */
+            unsigned char c = (unsigned char)src[i];
+            if ((c == 0xe3) || (c == 0xef)) {
+                if (size < i + 3) {
+                    break;
+                }
+                p = put_wide_char(normalizer, p, &src[i]);
+                i += 3;
+                continue;
+            }
+            p = flush_kana(normalizer, p);
+        }
+        p = normalize_run(normalizer, p, src, size, &i);
+        if (size <= i) {
+            break;
+        }
+        if (size < i + 3) {
+            break;
+        }
+        p = put_wide_char(normalizer, p, &src[i]);
+        i += 3;
+    }
+    if (i < size) {
+        memcpy(normalizer->partial, &src[i], size - i);
+        normalizer->partial_size = size - i;
+    }
+    return p - dest;
+}
+
+/**
+ * Writes what is left at the end of a document. dest must have
+ * NORMALIZE_MARGIN bytes at least.
+ */
+size_t
+oNormalizer_finish(oNormalizer* normalizer, char* dest)
+{
+    char* p = flush_kana(normalizer, dest);
+    if (0 < normalizer->partial_size) {
+        p = put_bytes(normalizer, p, normalizer->partial, normalizer->partial_size);
+        normalizer->partial_size = 0;
+    }
+    normalizer->has_space = FALSE;
+    return p - dest;
+}
+
+/**
+ * Returns the lowercase of a letter of Latin Extended-A/B, or codepoint as it
+ * is. The lowercase has the same size in UTF-8.
+ */
+int
+oNormalize_lower(int codepoint)
+{
+    if ((codepoint < LATIN_FIRST) || (LATIN_LAST < codepoint)) {
+        return codepoint;
+    }
+    int lower = lower_table[codepoint - LATIN_FIRST];
+    return lower != 0 ? lower : codepoint;
+}
+
+/**
+ * A normalized string is not longer than the original one, so dest needs
+ * (strlen(src) + 1) bytes.
+ */
+void
+oNormalize(char* dest, const char* src, oTokenizerType tokenizer)
+{
+    oNormalizer normalizer;
+    oNormalizer_init(&normalizer, tokenizer);
+    size_t size = oNormalizer_normalize(&normalizer, dest, src, strlen(src));
+    size += oNormalizer_finish(&normalizer, &dest[size]);
+    dest[size] = '\0';
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,218 @@
+/**
+ * Generated by tools/gen_normalize_table.py (Unicode 14.0.0). Do not edit.
+ */
+#define WIDTH_FIRST 0xff00
+#define WIDTH_LAST 0xffef
+#define KANA_FIRST 0x30a0
+#define KANA_LAST 0x30ff
+#define VOICED_MARK 0x3099
+#define SEMI_VOICED_MARK 0x309a
+#define LATIN_FIRST 0x0100
+#define LATIN_LAST 0x024f
+#define CLASS_SPACE 1
+#define CLASS_ALPHA 2
+#define CLASS_WIDE 4
+#define CLASS_INHERIT 8
+
+/**
+ * Classes of bytes. CLASS_SPACE and CLASS_ALPHA are same as isspace() and
+ * isalpha() of the C locale. CLASS_WIDE is a leading byte of a character
+ * which may be folded.
+ */
+static const uint8_t byte_class[] = {
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    1, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 0, 0, 0, 0, 0,
+    0, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 4, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 4,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+/**
+ * Classes of bytes for words of the hybrid tokenizer. Digits and leading
+ * bytes of Latin letters (U+00C0-U+024F) are CLASS_ALPHA too. The leading
+ * byte 0xc9 also covers U+0250-U+027F, which only keeps a few more spaces. A
+ * continuation byte is CLASS_INHERIT, which has the class of its leading byte.
+ */
+static const uint8_t word_byte_class[] = {
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    1, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 0, 0, 0, 0, 0, 0,
+    0, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 0, 0, 0, 0, 0,
+    0, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 0, 0, 0, 0, 0,
+    8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8,
+    0, 0, 0, 2, 2, 2, 2, 2,
+    2, 2, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 4, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 4,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+/**
+ * NFKC of Halfwidth and Fullwidth Forms. 0 means no change.
+ */
+static const uint16_t width_table[] = {
+    0x0000, 0x0021, 0x0022, 0x0023, 0x0024, 0x0025, 0x0026, 0x0027,
+    0x0028, 0x0029, 0x002a, 0x002b, 0x002c, 0x002d, 0x002e, 0x002f,
+    0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+    0x0038, 0x0039, 0x003a, 0x003b, 0x003c, 0x003d, 0x003e, 0x003f,
+    0x0040, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+    0x0048, 0x0049, 0x004a, 0x004b, 0x004c, 0x004d, 0x004e, 0x004f,
+    0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+    0x0058, 0x0059, 0x005a, 0x005b, 0x005c, 0x005d, 0x005e, 0x005f,
+    0x0060, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+    0x0068, 0x0069, 0x006a, 0x006b, 0x006c, 0x006d, 0x006e, 0x006f,
+    0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+    0x0078, 0x0079, 0x007a, 0x007b, 0x007c, 0x007d, 0x007e, 0x2985,
+    0x2986, 0x3002, 0x300c, 0x300d, 0x3001, 0x30fb, 0x30f2, 0x30a1,
+    0x30a3, 0x30a5, 0x30a7, 0x30a9, 0x30e3, 0x30e5, 0x30e7, 0x30c3,
+    0x30fc, 0x30a2, 0x30a4, 0x30a6, 0x30a8, 0x30aa, 0x30ab, 0x30ad,
+    0x30af, 0x30b1, 0x30b3, 0x30b5, 0x30b7, 0x30b9, 0x30bb, 0x30bd,
+    0x30bf, 0x30c1, 0x30c4, 0x30c6, 0x30c8, 0x30ca, 0x30cb, 0x30cc,
+    0x30cd, 0x30ce, 0x30cf, 0x30d2, 0x30d5, 0x30d8, 0x30db, 0x30de,
+    0x30df, 0x30e0, 0x30e1, 0x30e2, 0x30e4, 0x30e6, 0x30e8, 0x30e9,
+    0x30ea, 0x30eb, 0x30ec, 0x30ed, 0x30ef, 0x30f3, 0x3099, 0x309a,
+    0x1160, 0x1100, 0x1101, 0x11aa, 0x1102, 0x11ac, 0x11ad, 0x1103,
+    0x1104, 0x1105, 0x11b0, 0x11b1, 0x11b2, 0x11b3, 0x11b4, 0x11b5,
+    0x111a, 0x1106, 0x1107, 0x1108, 0x1121, 0x1109, 0x110a, 0x110b,
+    0x110c, 0x110d, 0x110e, 0x110f, 0x1110, 0x1111, 0x1112, 0x0000,
+    0x0000, 0x0000, 0x1161, 0x1162, 0x1163, 0x1164, 0x1165, 0x1166,
+    0x0000, 0x0000, 0x1167, 0x1168, 0x1169, 0x116a, 0x116b, 0x116c,
+    0x0000, 0x0000, 0x116d, 0x116e, 0x116f, 0x1170, 0x1171, 0x1172,
+    0x0000, 0x0000, 0x1173, 0x1174, 0x1175, 0x0000, 0x0000, 0x0000,
+    0x00a2, 0x00a3, 0x00ac, 0x0000, 0x00a6, 0x00a5, 0x20a9, 0x0000,
+    0x2502, 0x2190, 0x2191, 0x2192, 0x2193, 0x25a0, 0x25cb, 0x0000,
+};
+
+/**
+ * Katakana with a voiced/semi-voiced sound mark. 0 means none.
+ */
+static const uint16_t voiced_table[] = {
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x30f4, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x30ac, 0x0000, 0x30ae, 0x0000, 0x30b0,
+    0x0000, 0x30b2, 0x0000, 0x30b4, 0x0000, 0x30b6, 0x0000, 0x30b8,
+    0x0000, 0x30ba, 0x0000, 0x30bc, 0x0000, 0x30be, 0x0000, 0x30c0,
+    0x0000, 0x30c2, 0x0000, 0x0000, 0x30c5, 0x0000, 0x30c7, 0x0000,
+    0x30c9, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x30d0,
+    0x0000, 0x0000, 0x30d3, 0x0000, 0x0000, 0x30d6, 0x0000, 0x0000,
+    0x30d9, 0x0000, 0x0000, 0x30dc, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x30f7,
+    0x30f8, 0x30f9, 0x30fa, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x30fe, 0x0000, 0x0000,
+};
+
+static const uint16_t semi_voiced_table[] = {
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x30d1,
+    0x0000, 0x0000, 0x30d4, 0x0000, 0x0000, 0x30d7, 0x0000, 0x0000,
+    0x30da, 0x0000, 0x0000, 0x30dd, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+};
+
+/**
+ * Lowercase of Latin Extended-A/B. 0 means no change, which includes
+ * capitals whose lowercase is out of U+00C0-U+024F, such as IPA letters.
+ */
+static const uint16_t lower_table[] = {
+    0x0101, 0x0000, 0x0103, 0x0000, 0x0105, 0x0000, 0x0107, 0x0000,
+    0x0109, 0x0000, 0x010b, 0x0000, 0x010d, 0x0000, 0x010f, 0x0000,
+    0x0111, 0x0000, 0x0113, 0x0000, 0x0115, 0x0000, 0x0117, 0x0000,
+    0x0119, 0x0000, 0x011b, 0x0000, 0x011d, 0x0000, 0x011f, 0x0000,
+    0x0121, 0x0000, 0x0123, 0x0000, 0x0125, 0x0000, 0x0127, 0x0000,
+    0x0129, 0x0000, 0x012b, 0x0000, 0x012d, 0x0000, 0x012f, 0x0000,
+    0x0000, 0x0000, 0x0133, 0x0000, 0x0135, 0x0000, 0x0137, 0x0000,
+    0x0000, 0x013a, 0x0000, 0x013c, 0x0000, 0x013e, 0x0000, 0x0140,
+    0x0000, 0x0142, 0x0000, 0x0144, 0x0000, 0x0146, 0x0000, 0x0148,
+    0x0000, 0x0000, 0x014b, 0x0000, 0x014d, 0x0000, 0x014f, 0x0000,
+    0x0151, 0x0000, 0x0153, 0x0000, 0x0155, 0x0000, 0x0157, 0x0000,
+    0x0159, 0x0000, 0x015b, 0x0000, 0x015d, 0x0000, 0x015f, 0x0000,
+    0x0161, 0x0000, 0x0163, 0x0000, 0x0165, 0x0000, 0x0167, 0x0000,
+    0x0169, 0x0000, 0x016b, 0x0000, 0x016d, 0x0000, 0x016f, 0x0000,
+    0x0171, 0x0000, 0x0173, 0x0000, 0x0175, 0x0000, 0x0177, 0x0000,
+    0x00ff, 0x017a, 0x0000, 0x017c, 0x0000, 0x017e, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0183, 0x0000, 0x0185, 0x0000, 0x0000, 0x0188,
+    0x0000, 0x0000, 0x0000, 0x018c, 0x0000, 0x0000, 0x01dd, 0x0000,
+    0x0000, 0x0192, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0199, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x01a1, 0x0000, 0x01a3, 0x0000, 0x01a5, 0x0000, 0x0000, 0x01a8,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x01ad, 0x0000, 0x0000, 0x01b0,
+    0x0000, 0x0000, 0x0000, 0x01b4, 0x0000, 0x01b6, 0x0000, 0x0000,
+    0x01b9, 0x0000, 0x0000, 0x0000, 0x01bd, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x01c6, 0x01c6, 0x0000, 0x01c9,
+    0x01c9, 0x0000, 0x01cc, 0x01cc, 0x0000, 0x01ce, 0x0000, 0x01d0,
+    0x0000, 0x01d2, 0x0000, 0x01d4, 0x0000, 0x01d6, 0x0000, 0x01d8,
+    0x0000, 0x01da, 0x0000, 0x01dc, 0x0000, 0x0000, 0x01df, 0x0000,
+    0x01e1, 0x0000, 0x01e3, 0x0000, 0x01e5, 0x0000, 0x01e7, 0x0000,
+    0x01e9, 0x0000, 0x01eb, 0x0000, 0x01ed, 0x0000, 0x01ef, 0x0000,
+    0x0000, 0x01f3, 0x01f3, 0x0000, 0x01f5, 0x0000, 0x0195, 0x01bf,
+    0x01f9, 0x0000, 0x01fb, 0x0000, 0x01fd, 0x0000, 0x01ff, 0x0000,
+    0x0201, 0x0000, 0x0203, 0x0000, 0x0205, 0x0000, 0x0207, 0x0000,
+    0x0209, 0x0000, 0x020b, 0x0000, 0x020d, 0x0000, 0x020f, 0x0000,
+    0x0211, 0x0000, 0x0213, 0x0000, 0x0215, 0x0000, 0x0217, 0x0000,
+    0x0219, 0x0000, 0x021b, 0x0000, 0x021d, 0x0000, 0x021f, 0x0000,
+    0x019e, 0x0000, 0x0223, 0x0000, 0x0225, 0x0000, 0x0227, 0x0000,
+    0x0229, 0x0000, 0x022b, 0x0000, 0x022d, 0x0000, 0x022f, 0x0000,
+    0x0231, 0x0000, 0x0233, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x023c, 0x0000, 0x019a, 0x0000, 0x0000,
+    0x0000, 0x0242, 0x0000, 0x0180, 0x0000, 0x0000, 0x0247, 0x0000,
+    0x0249, 0x0000, 0x024b, 0x0000, 0x024d, 0x0000, 0x024f, 0x0000,
+};
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -1,11 +1,23 @@
 #include <assert.h>
 #include <errno.h>
+#include <arpa/inet.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 #include "tcutil.h"
 #include "o.h"
 #include "o/private.h"
@@ -14,10 +26,16 @@ static void
 usage()
 {
     printf("usage:\n");
-    printf("  o create [--attr=name] db\n");
-    printf("  o get [--attr=name] db doc_id\n");
+    printf("  o create [--attr=name] [--doc-format=stream|chunked] [--doc-store=hash|log] [--codec=zlib|lz4|zstd] [--index-format=text|packed] [--tokenizer=bigram|hybrid] [--ngram=2|1+2|3] [--postings=positions|docs] [--dict-sample=path] db\n");
+    printf("  o get [--attr=name] [--offset=n] [--length=n] db doc_id\n");
+    printf("  o get --socket=path [--attr=name] [--offset=n] [--length=n] doc_id\n");
     printf("  o put [--attr=name:value] db\n");
-    printf("  o search db phrase\n");
+    printf("  o put --socket=path [--attr=name:value]\n");
+    printf("  o search [--spans] [--plan] [--explain] [--query-log=path] db phrase\n");
+    printf("  o search --socket=path [--spans] phrase\n");
+    printf("  o replay [--concurrency=n] [--speed=x] db query_log\n");
+    printf("  o replay --socket=path [--concurrency=n] [--speed=x] query_log\n");
+    printf("  o serve --socket=path [--workers=n] [--read-only] [--commit-interval=seconds] [--sync-docs=n] [--sync-ms=n] db\n");
     printf("  o words db\n");
 }
 
@@ -31,205 +49,1659 @@ print_error(const char* msg, const char* reason)
     fprintf(stderr, "%s - %s\n", msg, reason);
 }
 
+static int
+open_db_to_read(oDB* db, const char* path)
+{
+    if (oDB_open_to_read(db, path) != 0) {
+        print_error("Can't open database to read", db->msg);
+        return 1;
+    }
+    return 0;
+}
+
+static int
+open_db_to_write(oDB* db, const char* path)
+{
+    if (oDB_open_to_write(db, path) != 0) {
+        print_error("Can't open database to write", db->msg);
+        return 1;
+    }
+    return 0;
+}
+
+static int
+close_db(oDB* db)
+{
+    if (oDB_close(db) != 0) {
+        print_error("Can't close databse", db->msg);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * "o serve" and its clients exchange frames. A frame is a payload after its
+ * size in 4 bytes of network byte order. A request is fields terminated with
+ * NUL, and the first field is the name of a command. A response is a status
+ * byte, 0 for success, and output of the command or an error message.
+ */
+#define MAX_FRAME_SIZE  (256 * 1024 * 1024)
+
+static int
+write_all(int fd, const char* buf, size_t size)
+{
+    while (0 < size) {
+        ssize_t n = write(fd, buf, size);
+        if ((n == -1) && (errno == EINTR)) {
+            continue;
+        }
+        if (n == -1) {
+            return 1;
+        }
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int
+read_all(int fd, char* buf, size_t size)
+{
+    while (0 < size) {
+        ssize_t n = read(fd, buf, size);
+        if ((n == -1) && (errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            return 1;
+        }
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/**
+ * A frame is built in a TCXSTR which begins with room for the size, so that
+ * it is sent by one write(2).
+ */
+static TCXSTR*
+Frame_new()
+{
+    TCXSTR* frame = tcxstrnew();
+    uint32_t size = 0;
+    tcxstrcat(frame, &size, sizeof(size));
+    return frame;
+}
+
+static void
+Frame_add_field(TCXSTR* frame, const char* field)
+{
+    tcxstrcat(frame, field, strlen(field) + 1);
+}
+
+static int
+Frame_send(int fd, TCXSTR* frame)
+{
+    uint32_t size = htonl(tcxstrsize(frame) - sizeof(size));
+    memcpy((char*)tcxstrptr(frame), &size, sizeof(size));
+    return write_all(fd, tcxstrptr(frame), tcxstrsize(frame));
+}
+
+/**
+ * Returns a payload terminated with NUL, which must be freed, or NULL at the
+ * end of the connection or on an error.
+ */
+static char*
+Frame_receive(int fd, int* size)
+{
+    uint32_t header;
+    if (read_all(fd, (char*)&header, sizeof(header)) != 0) {
+        return NULL;
+    }
+    uint32_t payload_size = ntohl(header);
+    if (MAX_FRAME_SIZE < payload_size) {
+        return NULL;
+    }
+    char* payload = (char*)malloc(payload_size + 1);
+    if (payload == NULL) {
+        return NULL;
+    }
+    if (read_all(fd, payload, payload_size) != 0) {
+        free(payload);
+        return NULL;
+    }
+    payload[payload_size] = '\0';
+    *size = payload_size;
+    return payload;
+}
+
+/**
+ * Fields is a cursor on a request.
+ */
+struct Fields {
+    char* p;
+    char* end;
+};
+
+typedef struct Fields Fields;
+
+static const char*
+Fields_next(Fields* fields)
+{
+    if (fields->end <= fields->p) {
+        return NULL;
+    }
+    char* field = fields->p;
+    fields->p += strlen(field) + 1;
+    return field;
+}
+
+static int
+connect_server(const char* path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    if (array_sizeof(addr.sun_path) <= strlen(path)) {
+        print_error("Socket path is too long", path);
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        print_error("Can't create socket", strerror(errno));
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        print_error("Can't connect to server", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Returns the response to request, which must be freed, or NULL.
+ */
 static char*
-read_file(oDB* db, FILE* fp)
+call_server(int fd, TCXSTR* request, int* size)
+{
+    char* response = NULL;
+    if (Frame_send(fd, request) == 0) {
+        response = Frame_receive(fd, size);
+    }
+    if ((response != NULL) && (*size < 1)) {
+        free(response);
+        response = NULL;
+    }
+    if (response == NULL) {
+        print_error("Can't talk to server", strerror(errno));
+    }
+    return response;
+}
+
+/**
+ * Output of the command is written to stdout, and an error message to stderr.
+ */
+static int
+request_server(const char* path, TCXSTR* request)
+{
+    int fd = connect_server(path);
+    if (fd == -1) {
+        return 1;
+    }
+    int size;
+    char* response = call_server(fd, request, &size);
+    close(fd);
+    if (response == NULL) {
+        return 1;
+    }
+    int status = response[0];
+    if (status != 0) {
+        fprintf(stderr, "%s\n", &response[1]);
+    }
+    else {
+        fwrite(&response[1], 1, size - 1, stdout);
+    }
+    free(response);
+    return status;
+}
+
+static TCXSTR*
+make_search_request(const char* phrase, BOOL prints_spans)
+{
+    TCXSTR* request = Frame_new();
+    Frame_add_field(request, "search");
+    Frame_add_field(request, phrase);
+    if (prints_spans) {
+        Frame_add_field(request, "spans");
+    }
+    return request;
+}
+
+/**
+ * A document is read from fp piece by piece, so its size is not limited by
+ * memory.
+ */
+static int
+put_from_file(oDB* db, FILE* fp, oAttr attrs[], int attrs_num)
+{
+    oPut* put = oDB_put_begin(db);
+    if (put == NULL) {
+        print_error("Can't put document", db->msg);
+        return 1;
+    }
+    char buf[64 * 1024];
+    size_t size;
+    while ((size = fread(buf, 1, array_sizeof(buf), fp)) != 0) {
+        if (oDB_put_write(db, put, buf, size) != 0) {
+            print_error("Can't put document", db->msg);
+            oDB_put_abort(db, put);
+            return 1;
+        }
+    }
+    if (ferror(fp)) {
+        print_error("Can't read document", strerror(errno));
+        oDB_put_abort(db, put);
+        return 1;
+    }
+    if (oDB_put_end(db, put, attrs, attrs_num) != 0) {
+        print_error("Can't put document", db->msg);
+        return 1;
+    }
+    return 0;
+}
+
+static int
+put_doc(oDB* db, const char* path, FILE* fp, oAttr attrs[], int attrs_num)
+{
+    if (open_db_to_write(db, path) != 0) {
+        return 1;
+    }
+    if (put_from_file(db, fp, attrs, attrs_num) != 0) {
+        return 1;
+    }
+    if (close_db(db) != 0) {
+        return 1;
+    }
+    return 0;
+}
+
+static void
+format_hits(oHits* hits, BOOL prints_spans, TCXSTR* out)
+{
+    int i;
+    for (i = 0; i < hits->num; i++) {
+        if (prints_spans && (hits->spans != NULL)) {
+            tcxstrprintf(out, "%d %d %d\n", hits->doc_id[i], hits->spans[i].begin, hits->spans[i].end);
+            continue;
+        }
+        tcxstrprintf(out, "%d\n", hits->doc_id[i]);
+    }
+}
+
+/**
+ * With --spans, the span of a match follows the document ID if the query
+ * finds it. --plan outputs how the query is evaluated instead of results, and
+ * --explain outputs it with statistics of evaluation. --query-log appends the
+ * query to a log, which "o replay" reads. With --socket, the query is searched
+ * by "o serve" instead of opening a database.
+ */
+static int
+search(oDB* db, int argc, char* argv[])
+{
+    BOOL prints_spans = FALSE;
+    BOOL prints_plan = FALSE;
+    BOOL explains = FALSE;
+    const char* query_log = NULL;
+    const char* socket_path = NULL;
+    struct option options[] = {
+        { "spans", no_argument, NULL, 's' },
+        { "plan", no_argument, NULL, 'p' },
+        { "explain", no_argument, NULL, 'e' },
+        { "query-log", required_argument, NULL, 'l' },
+        { "socket", required_argument, NULL, 'S' },
+        { 0, 0, 0, 0 } };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            prints_spans = TRUE;
+            break;
+        case 'p':
+            prints_plan = TRUE;
+            break;
+        case 'e':
+            explains = TRUE;
+            break;
+        case 'l':
+            query_log = optarg;
+            break;
+        case 'S':
+            socket_path = optarg;
+            break;
+        case '?':
+        default:
+            usage();
+            return 1;
+            break;
+        }
+    }
+    if ((socket_path != NULL) && (optind < argc)) {
+        TCXSTR* request = make_search_request(argv[optind], prints_spans);
+        int status = request_server(socket_path, request);
+        tcxstrdel(request);
+        return status;
+    }
+    if (argc - 1 <= optind) {
+        usage();
+        return 1;
+    }
+
+    const char* phrase = argv[optind + 1];
+    if (prints_plan) {
+        char* plan = oDB_get_plan(db, phrase);
+        if (plan == NULL) {
+            print_error("Can't make plan", db->msg);
+            return 1;
+        }
+        printf("%s", plan);
+        free(plan);
+        return 0;
+    }
+    const char* path = argv[optind];
+    if ((query_log != NULL) && (oDB_open_query_log(db, query_log) != 0)) {
+        print_error("Can't open query log", db->msg);
+        return 1;
+    }
+    if (open_db_to_read(db, path) != 0) {
+        return 1;
+    }
+    if (explains) {
+        char* plan = oDB_explain(db, phrase);
+        if (plan == NULL) {
+            print_error("Can't search document", db->msg);
+            return 1;
+        }
+        printf("%s", plan);
+        free(plan);
+        return close_db(db);
+    }
+    oHits* hits = NULL;
+    if (oDB_search(db, phrase, &hits) != 0) {
+        print_error("Can't search document", db->msg);
+        return 1;
+    }
+    if (close_db(db) != 0) {
+        return 1;
+    }
+
+    TCXSTR* out = tcxstrnew();
+    format_hits(hits, prints_spans, out);
+    fwrite(tcxstrptr(out), 1, tcxstrsize(out), stdout);
+    tcxstrdel(out);
+    oHits_delete(db, hits);
+    return 0;
+}
+
+/**
+ * A query of a log written by oDB_search().
+ */
+struct Query {
+    double time;
+    int hits_num;
+    const char* phrase;
+};
+
+typedef struct Query Query;
+
+/**
+ * Workers of "o replay" are processes, because Tokyo Cabinet doesn't open a
+ * database twice in a process. Worker i searches the i-th query and every
+ * concurrency-th query after it. With pacing, a query is not searched before
+ * its time in the log divided by speed passes since the first one. latencies,
+ * errors and hits_changed are in memory shared with workers, and errors and
+ * hits_changed have a counter for each worker.
+ */
+struct Replay {
+    const char* path;
+    const char* socket_path;
+    Query* queries;
+    int queries_num;
+    int concurrency;
+    double speed;
+    double begin;
+    double* latencies;
+    int* errors;
+    int* hits_changed;
+};
+
+typedef struct Replay Replay;
+
+static void
+sleep_until(double time)
+{
+    double rest = time - oClock_get_seconds();
+    if (rest <= 0) {
+        return;
+    }
+    struct timespec ts;
+    ts.tv_sec = (time_t)rest;
+    ts.tv_nsec = (long)((rest - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+static int
+search_local(oDB* db, const char* phrase, int* hits_num)
+{
+    oHits* hits = NULL;
+    if (oDB_search(db, phrase, &hits) != 0) {
+        return 1;
+    }
+    *hits_num = hits->num;
+    oHits_delete(db, hits);
+    return 0;
+}
+
+/**
+ * A server responds one line per hit.
+ */
+static int
+search_remote(int fd, const char* phrase, int* hits_num)
+{
+    TCXSTR* request = make_search_request(phrase, FALSE);
+    int size;
+    char* response = call_server(fd, request, &size);
+    tcxstrdel(request);
+    if (response == NULL) {
+        return 1;
+    }
+    int status = response[0];
+    int n = 0;
+    int i;
+    for (i = 1; i < size; i++) {
+        n += response[i] == '\n' ? 1 : 0;
+    }
+    free(response);
+    *hits_num = n;
+    return status;
+}
+
+static int
+replay_queries(Replay* replay, int worker)
+{
+    oDB db;
+    oDB_init(&db);
+    int fd = -1;
+    if (replay->socket_path != NULL) {
+        fd = connect_server(replay->socket_path);
+        if (fd == -1) {
+            oDB_fini(&db);
+            return 1;
+        }
+    }
+    else if (open_db_to_read(&db, replay->path) != 0) {
+        oDB_fini(&db);
+        return 1;
+    }
+    double first = replay->queries[0].time;
+    int i;
+    for (i = worker; i < replay->queries_num; i += replay->concurrency) {
+        Query* query = &replay->queries[i];
+        if (0 < replay->speed) {
+            sleep_until(replay->begin + (query->time - first) / replay->speed);
+        }
+        double begin = oClock_get_seconds();
+        int hits_num;
+        int status = fd != -1 ? search_remote(fd, query->phrase, &hits_num) : search_local(&db, query->phrase, &hits_num);
+        replay->latencies[i] = oClock_get_seconds() - begin;
+        if (status != 0) {
+            replay->errors[worker]++;
+            continue;
+        }
+        if (hits_num != query->hits_num) {
+            replay->hits_changed[worker]++;
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+        oDB_fini(&db);
+        return 0;
+    }
+    int status = close_db(&db);
+    oDB_fini(&db);
+    return status;
+}
+
+/**
+ * Lines are "time<TAB>latency<TAB>hits<TAB>query". Fields are overwritten
+ * with NUL in log.
+ */
+static int
+parse_query_log(char* log, Query** pqueries)
+{
+    int max_num = 1;
+    char* p;
+    for (p = log; *p != '\0'; p++) {
+        max_num += *p == '\n' ? 1 : 0;
+    }
+    Query* queries = (Query*)malloc(sizeof(Query) * max_num);
+    if (queries == NULL) {
+        print_error("Can't allocate queries", strerror(errno));
+        return -1;
+    }
+    int num = 0;
+    int line = 1;
+    char* next;
+    for (p = log; *p != '\0'; p = next, line++) {
+        char* end = strchr(p, '\n');
+        next = end != NULL ? end + 1 : p + strlen(p);
+        if (end != NULL) {
+            *end = '\0';
+        }
+        if (*p == '\0') {
+            continue;
+        }
+        char* fields[4];
+        int i;
+        for (i = 0; (i < 3) && (p != NULL); i++) {
+            fields[i] = p;
+            p = strchr(p, '\t');
+            if (p != NULL) {
+                *p = '\0';
+                p++;
+            }
+        }
+        if (p == NULL) {
+            fprintf(stderr, "Invalid query log at line %d\n", line);
+            free(queries);
+            return -1;
+        }
+        fields[3] = p;
+        queries[num].time = atof(fields[0]);
+        queries[num].hits_num = atoi(fields[2]);
+        queries[num].phrase = fields[3];
+        num++;
+    }
+    *pqueries = queries;
+    return num;
+}
+
+static int
+compare_latencies(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : (y < x ? 1 : 0);
+}
+
+static void
+print_latency(const char* name, const double* sorted, int num, int per_mille)
+{
+    printf("replay.%s_ms\t%.3f\n", name, sorted[(long long)(num - 1) * per_mille / 1000] * 1000);
+}
+
+static int
+sum_counters(const int counters[], int num)
+{
+    int sum = 0;
+    int i;
+    for (i = 0; i < num; i++) {
+        sum += counters[i];
+    }
+    return sum;
+}
+
+static void
+print_replay(Replay* replay, double seconds)
+{
+    int num = replay->queries_num;
+    qsort(replay->latencies, num, sizeof(replay->latencies[0]), compare_latencies);
+    printf("replay.queries\t%d\n", num);
+    printf("replay.errors\t%d\n", sum_counters(replay->errors, replay->concurrency));
+    printf("replay.hits_changed\t%d\n", sum_counters(replay->hits_changed, replay->concurrency));
+    printf("replay.seconds\t%.3f\n", seconds);
+    printf("replay.qps\t%.3f\n", 0 < seconds ? num / seconds : 0);
+    print_latency("p50", replay->latencies, num, 500);
+    print_latency("p90", replay->latencies, num, 900);
+    print_latency("p99", replay->latencies, num, 990);
+    print_latency("p999", replay->latencies, num, 999);
+    print_latency("max", replay->latencies, num, 1000);
+}
+
+static int
+run_replay(Replay* replay)
+{
+    int concurrency = replay->concurrency;
+    size_t size = sizeof(double) * replay->queries_num + sizeof(int) * 2 * concurrency;
+    void* shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        print_error("Can't map memory", strerror(errno));
+        return 1;
+    }
+    replay->latencies = (double*)shared;
+    replay->errors = (int*)&replay->latencies[replay->queries_num];
+    replay->hits_changed = &replay->errors[concurrency];
+    fflush(stdout);
+    replay->begin = oClock_get_seconds();
+    int status = 0;
+    int started;
+    for (started = 0; started < concurrency; started++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            print_error("Can't fork", strerror(errno));
+            status = 1;
+            break;
+        }
+        if (pid == 0) {
+            _exit(replay_queries(replay, started));
+        }
+    }
+    int i;
+    for (i = 0; i < started; i++) {
+        int child_status;
+        if ((wait(&child_status) == -1) || !WIFEXITED(child_status) || (WEXITSTATUS(child_status) != 0)) {
+            status = 1;
+        }
+    }
+    double seconds = oClock_get_seconds() - replay->begin;
+    if (status == 0) {
+        print_replay(replay, seconds);
+    }
+    munmap(shared, size);
+    return status;
+}
+
+/**
+ * Replays a query log with concurrent workers. --speed=0, the default,
+ * searches queries as fast as possible, and --speed=1 at the pace of the log.
+ */
+static int
+replay(oDB* db, int argc, char* argv[])
+{
+    const char* socket_path = NULL;
+    int concurrency = 1;
+    double speed = 0;
+    struct option options[] = {
+        { "socket", required_argument, NULL, 'S' },
+        { "concurrency", required_argument, NULL, 'c' },
+        { "speed", required_argument, NULL, 's' },
+        { 0, 0, 0, 0 } };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case 'S':
+            socket_path = optarg;
+            break;
+        case 'c':
+            concurrency = atoi(optarg);
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        case '?':
+        default:
+            usage();
+            return 1;
+            break;
+        }
+    }
+    int args_num = socket_path != NULL ? 1 : 2;
+    if ((argc - args_num < optind) || (concurrency < 1) || (speed < 0)) {
+        usage();
+        return 1;
+    }
+
+    const char* log_path = argv[optind + args_num - 1];
+    char* log = (char*)tcreadfile(log_path, 0, NULL);
+    if (log == NULL) {
+        print_error("Can't read query log", log_path);
+        return 1;
+    }
+    Replay replay;
+    replay.path = argv[optind];
+    replay.socket_path = socket_path;
+    replay.concurrency = concurrency;
+    replay.speed = speed;
+    replay.queries_num = parse_query_log(log, &replay.queries);
+    if (replay.queries_num < 1) {
+        if (replay.queries_num == 0) {
+            print_error("No queries in log", log_path);
+            free(replay.queries);
+        }
+        free(log);
+        return 1;
+    }
+    int status = run_replay(&replay);
+    free(replay.queries);
+    free(log);
+    return status;
+}
+
+/**
+ * A request of put is the number of attributes, a name and a value of each
+ * attribute, and the document, which is the rest of the request.
+ */
+static int
+put_remote(const char* socket_path, FILE* fp, oAttr attrs[], int attrs_num)
+{
+    TCXSTR* request = Frame_new();
+    Frame_add_field(request, "put");
+    char num[16];
+    snprintf(num, array_sizeof(num), "%d", attrs_num);
+    Frame_add_field(request, num);
+    int i;
+    for (i = 0; i < attrs_num; i++) {
+        Frame_add_field(request, attrs[i].name);
+        Frame_add_field(request, attrs[i].val);
+    }
+    char buf[64 * 1024];
+    size_t size;
+    while ((size = fread(buf, 1, array_sizeof(buf), fp)) != 0) {
+        tcxstrcat(request, buf, size);
+    }
+    if (ferror(fp)) {
+        print_error("Can't read document", strerror(errno));
+        tcxstrdel(request);
+        return 1;
+    }
+    int status = request_server(socket_path, request);
+    tcxstrdel(request);
+    return status;
+}
+
+static int
+put(oDB* db, int argc, char* argv[])
+{
+    oAttr attrs[MAX_ATTRS];
+    int attrs_num = 0;
+    const char* socket_path = NULL;
+
+    struct option options[] = {
+        { "attr", required_argument, NULL, 'a' },
+        { "socket", required_argument, NULL, 'S' },
+        { 0, 0, 0, 0 } };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case 'a':
+            if (MAX_ATTRS <= attrs_num) {
+                fprintf(stderr, "At most %d attributes acceptable", MAX_ATTRS);
+                return 1;
+            }
+            {
+                char* pc = strchr(optarg, ':');
+                if (pc == NULL) {
+                    fprintf(stderr, "Attribute must be NAME:VALUE");
+                    return 1;
+                }
+                *pc = '\0';
+                attrs[attrs_num].name = optarg;
+                attrs[attrs_num].val = pc + 1;
+                attrs_num++;
+            }
+            break;
+        case 'S':
+            socket_path = optarg;
+            break;
+        case '?':
+        default:
+            usage();
+            return 1;
+            break;
+        }
+    }
+    if (socket_path != NULL) {
+        return put_remote(socket_path, stdin, attrs, attrs_num);
+    }
+    if (argc <= optind) {
+        usage();
+        return 1;
+    }
+    return put_doc(db, argv[optind], stdin, attrs, attrs_num);
+}
+
+static int
+train_dict(oDB* db, TCLIST* sample_paths)
+{
+    int samples_num = tclistnum(sample_paths);
+    const char* samples[samples_num + 1];
+    int status = 0;
+    int i;
+    for (i = 0; i < samples_num; i++) {
+        const char* path = tclistval2(sample_paths, i);
+        char* sample = (char*)tcreadfile(path, 0, NULL);
+        if (sample == NULL) {
+            print_error("Can't read sample", path);
+            status = 1;
+            break;
+        }
+        samples[i] = sample;
+    }
+    if ((status == 0) && (oDB_train_dict(db, samples, samples_num) != 0)) {
+        print_error("Can't train dictionary", db->msg);
+        status = 1;
+    }
+    int j;
+    for (j = 0; j < i; j++) {
+        free((char*)samples[j]);
+    }
+    return status;
+}
+
+static int
+create(oDB* db, int argc, char* argv[])
+{
+    const char* attrs[MAX_ATTRS];
+    int attrs_num = 0;
+    TCLIST* sample_paths = tclistnew();
+
+    struct option options[] = {
+        { "attr", required_argument, NULL, 'a' },
+        { "doc-format", required_argument, NULL, 'f' },
+        { "doc-store", required_argument, NULL, 'd' },
+        { "codec", required_argument, NULL, 'c' },
+        { "index-format", required_argument, NULL, 'i' },
+        { "tokenizer", required_argument, NULL, 't' },
+        { "ngram", required_argument, NULL, 'n' },
+        { "postings", required_argument, NULL, 'p' },
+        { "dict-sample", required_argument, NULL, 's' },
+        { 0, 0, 0, 0 } };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case 'a':
+            if (MAX_ATTRS <= attrs_num) {
+                fprintf(stderr, "Maximum attributes number is %d", MAX_ATTRS);
+                tclistdel(sample_paths);
+                return 1;
+            }
+            attrs[attrs_num] = optarg;
+            attrs_num++;
+            break;
+        case 'f':
+            if (oDB_set_doc_format(db, optarg) != 0) {
+                print_error("Can't create database", db->msg);
+                tclistdel(sample_paths);
+                return 1;
+            }
+            break;
+        case 'd':
+            if (oDB_set_doc_store(db, optarg) != 0) {
+                print_error("Can't create database", db->msg);
+                tclistdel(sample_paths);
+                return 1;
+            }
+            break;
+        case 'c':
+            if (oDB_set_codec(db, optarg) != 0) {
+                print_error("Can't create database", db->msg);
+                tclistdel(sample_paths);
+                return 1;
+            }
+            break;
+        case 'i':
+            if (oDB_set_index_format(db, optarg) != 0) {
+                print_error("Can't create database", db->msg);
+                tclistdel(sample_paths);
+                return 1;
+            }
+            break;
+        case 't':
+            if (oDB_set_tokenizer(db, optarg) != 0) {
+                print_error("Can't create database", db->msg);
+                tclistdel(sample_paths);
+                return 1;
+            }
+            break;
+        case 'n':
+            if (oDB_set_ngram(db, optarg) != 0) {
+                print_error("Can't create database", db->msg);
+                tclistdel(sample_paths);
+                return 1;
+            }
+            break;
+        case 'p':
+            if (oDB_set_postings(db, optarg) != 0) {
+                print_error("Can't create database", db->msg);
+                tclistdel(sample_paths);
+                return 1;
+            }
+            break;
+        case 's':
+            tclistpush2(sample_paths, optarg);
+            break;
+        case '?':
+        default:
+            usage();
+            tclistdel(sample_paths);
+            return 1;
+            break;
+        }
+    }
+    if (argc <= optind) {
+        usage();
+        tclistdel(sample_paths);
+        return 1;
+    }
+    if ((0 < tclistnum(sample_paths)) && (train_dict(db, sample_paths) != 0)) {
+        tclistdel(sample_paths);
+        return 1;
+    }
+    tclistdel(sample_paths);
+
+    int status = oDB_create(db, argv[optind], attrs, attrs_num);
+    if (status != 0) {
+        print_error("Can't create database", db->msg);
+        return status;
+    }
+    return 0;
+}
+
+/**
+ * A request of get is a document ID, an offset, a length, and the name of an
+ * attribute to get it instead of the document.
+ */
+static int
+get_remote(const char* socket_path, const char* doc_id, int offset, int length, const char* attr)
+{
+    TCXSTR* request = Frame_new();
+    Frame_add_field(request, "get");
+    Frame_add_field(request, doc_id);
+    char num[16];
+    snprintf(num, array_sizeof(num), "%d", offset);
+    Frame_add_field(request, num);
+    snprintf(num, array_sizeof(num), "%d", length);
+    Frame_add_field(request, num);
+    if (attr != NULL) {
+        Frame_add_field(request, attr);
+    }
+    int status = request_server(socket_path, request);
+    tcxstrdel(request);
+    return status;
+}
+
+static int
+get(oDB* db, int argc, char* argv[])
+{
+    const char* attr = NULL;
+    int offset = 0;
+    int length = -1;
+    const char* socket_path = NULL;
+    struct option options[] = {
+        { "attr", required_argument, NULL, 'a' },
+        { "offset", required_argument, NULL, 'o' },
+        { "length", required_argument, NULL, 'l' },
+        { "socket", required_argument, NULL, 'S' },
+        { 0, 0, 0, 0 } };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case 'a':
+            attr = optarg;
+            break;
+        case 'o':
+            offset = atoi(optarg);
+            break;
+        case 'l':
+            length = atoi(optarg);
+            break;
+        case 'S':
+            socket_path = optarg;
+            break;
+        case '?':
+        default:
+            usage();
+            return 1;
+            break;
+        }
+    }
+    if ((socket_path != NULL) && (optind < argc)) {
+        return get_remote(socket_path, argv[optind], offset, length, attr);
+    }
+    if (argc - 1 <= optind) {
+        usage();
+        return 1;
+    }
+    const char* path = argv[optind];
+    if (open_db_to_read(db, path) != 0) {
+        return 1;
+    }
+
+    o_doc_id_t doc_id = atoi(argv[optind + 1]);
+    if (attr == NULL) {
+        if (oDB_get_to_fd(db, doc_id, offset, length == -1 ? INT_MAX : length, STDOUT_FILENO) != 0) {
+            print_error("Can't get document", db->msg);
+            close_db(db);
+            return 1;
+        }
+        return close_db(db);
+    }
+    char* doc = oDB_get_attr(db, doc_id, attr);
+    if (doc == NULL) {
+        print_error("Can't get document", db->msg);
+        close_db(db);
+        return 1;
+    }
+    printf("%s", doc);
+    free(doc);
+
+    if (close_db(db) != 0) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * "o serve" keeps a database open, and serves requests of connections with a
+ * pool of worker threads. A connection waits in conns until a worker takes it,
+ * and then the worker serves its requests until the client closes it. active
+ * has the connection which each worker serves, or -1, so that they are shut
+ * down to stop the server. A read only server gives each worker its own
+ * handle by oDB_share(), and they search at once. A handle to write is not
+ * safe among threads, so db_lock serializes calls of it.
+ */
+struct Server {
+    oDB* db;
+    BOOL is_read_only;
+    pthread_mutex_t db_lock;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    TCLIST* conns;
+    int* active;
+    int workers_num;
+    BOOL is_stopping;
+    /**
+     * Puts are committed at most once in commit_interval seconds, or each
+     * time if it is 0. Searches through the server see documents before they
+     * are committed. uncommitted_since is when the oldest uncommitted put was
+     * done, or 0. They are guarded by db_lock.
+     */
+    double commit_interval;
+    double uncommitted_since;
+    /**
+     * Puts are logged to the write-ahead log, which is synced every sync_docs
+     * documents or sync_ms milliseconds. If both are 0, a put is answered
+     * after the log is synced, and puts at once share one sync.
+     */
+    int sync_docs;
+    int sync_ms;
+    /**
+     * A commit wakes merger up by merge_cond, and merger merges segments
+     * without db_lock while workers serve requests. wants_merge and
+     * stops_merger are guarded by db_lock.
+     */
+    pthread_t merger;
+    pthread_cond_t merge_cond;
+    BOOL wants_merge;
+    BOOL stops_merger;
+};
+
+typedef struct Server Server;
+
+struct Worker {
+    Server* server;
+    int index;
+    oDB db;
+    pthread_t thread;
+};
+
+typedef struct Worker Worker;
+
+static oDB*
+lock_db(Worker* worker)
 {
-    TCXSTR* xstr = tcxstrnew();
-    char buf[4096];
-    while (fgets(buf, array_sizeof(buf), fp) != NULL) {
-        tcxstrcat2(xstr, buf);
+    Server* server = worker->server;
+    if (server->is_read_only) {
+        return &worker->db;
     }
-    char* s = (char*)malloc(tcxstrsize(xstr));
-    if (s == NULL) {
-        print_error("malloc failed", strerror(errno));
-        tcxstrdel(xstr);
-        return NULL;
+    pthread_mutex_lock(&server->db_lock);
+    return server->db;
+}
+
+static void
+unlock_db(Worker* worker)
+{
+    Server* server = worker->server;
+    if (!server->is_read_only) {
+        pthread_mutex_unlock(&server->db_lock);
     }
-    strcpy(s, tcxstrptr(xstr));
-    tcxstrdel(xstr);
+}
+
+/**
+ * The caller holds db_lock.
+ */
+static void
+request_merge(Server* server)
+{
+    server->wants_merge = TRUE;
+    pthread_cond_signal(&server->merge_cond);
+}
 
-    return s;
+static volatile sig_atomic_t is_signaled = 0;
+
+static void
+stop_server(int signum)
+{
+    is_signaled = 1;
 }
 
 static int
-open_db_to_read(oDB* db, const char* path)
+set_error(TCXSTR* body, const char* msg, const char* reason)
 {
-    if (oDB_open_to_read(db, path) != 0) {
-        print_error("Can't open database to read", db->msg);
+    tcxstrclear(body);
+    if (reason[0] == '\0') {
+        tcxstrcat2(body, msg);
         return 1;
     }
-    return 0;
+    tcxstrprintf(body, "%s - %s", msg, reason);
+    return 1;
 }
 
 static int
-open_db_to_write(oDB* db, const char* path)
+serve_search(Worker* worker, Fields* fields, TCXSTR* body)
 {
-    if (oDB_open_to_write(db, path) != 0) {
-        print_error("Can't open database to write", db->msg);
+    const char* phrase = Fields_next(fields);
+    if (phrase == NULL) {
+        return set_error(body, "Invalid request", "search needs a phrase");
+    }
+    const char* option = Fields_next(fields);
+    BOOL prints_spans = (option != NULL) && (strcmp(option, "spans") == 0);
+    oDB* db = lock_db(worker);
+    oHits* hits = NULL;
+    int status = oDB_search(db, phrase, &hits);
+    if (status != 0) {
+        set_error(body, "Can't search document", db->msg);
+    }
+    unlock_db(worker);
+    if (status != 0) {
         return 1;
     }
+    format_hits(hits, prints_spans, body);
+    oHits_delete(db, hits);
     return 0;
 }
 
 static int
-close_db(oDB* db)
+append_to_body(const char* s, size_t size, void* arg)
 {
-    if (oDB_close(db) != 0) {
-        print_error("Can't close databse", db->msg);
-        return 1;
-    }
+    tcxstrcat((TCXSTR*)arg, s, size);
     return 0;
 }
 
 static int
-put_doc(oDB* db, const char* path, const char* doc, oAttr attrs[], int attrs_num)
+serve_get(Worker* worker, Fields* fields, TCXSTR* body)
 {
-    if (open_db_to_write(db, path) != 0) {
-        return 1;
+    const char* doc_id = Fields_next(fields);
+    const char* offset = Fields_next(fields);
+    const char* length = Fields_next(fields);
+    if (length == NULL) {
+        return set_error(body, "Invalid request", "get needs a document ID, an offset and a length");
     }
-    if (oDB_put(db, doc, attrs, attrs_num) != 0) {
-        print_error("Can't put document", db->msg);
-        return 1;
+    const char* attr = Fields_next(fields);
+    int status = 0;
+    oDB* db = lock_db(worker);
+    if (attr == NULL) {
+        int n = atoi(length);
+        if (oDB_get_to(db, atoi(doc_id), atoi(offset), n == -1 ? INT_MAX : n, append_to_body, body) != 0) {
+            status = set_error(body, "Can't get document", db->msg);
+        }
     }
-    if (close_db(db) != 0) {
-        return 1;
+    else {
+        char* val = oDB_get_attr(db, atoi(doc_id), attr);
+        if (val == NULL) {
+            status = set_error(body, "Can't get document", db->msg);
+        }
+        else {
+            tcxstrcat2(body, val);
+            free(val);
+        }
     }
-    return 0;
+    unlock_db(worker);
+    return status;
 }
 
+/**
+ * A put request has the number of attributes, their names and values, and
+ * then the document till the end.
+ */
 static int
-search(oDB* db, int argc, char* argv[])
+serve_put(Worker* worker, Fields* fields, TCXSTR* body)
 {
-    if (argc < 3) {
-        usage();
-        return 1;
+    if (worker->server->is_read_only) {
+        return set_error(body, "Can't put document", "server is read only");
+    }
+    const char* num = Fields_next(fields);
+    int attrs_num = num != NULL ? atoi(num) : -1;
+    if ((attrs_num < 0) || (MAX_ATTRS < attrs_num)) {
+        return set_error(body, "Invalid request", "put needs the number of attributes");
+    }
+    oAttr attrs[MAX_ATTRS];
+    int i;
+    for (i = 0; i < attrs_num; i++) {
+        attrs[i].name = Fields_next(fields);
+        attrs[i].val = Fields_next(fields);
+        if (attrs[i].val == NULL) {
+            return set_error(body, "Invalid request", "put needs a name and a value of each attribute");
+        }
+    }
+    const char* doc = fields->p < fields->end ? fields->p : fields->end;
+    int status = 0;
+    oDB* db = lock_db(worker);
+    oPut* put = oDB_put_begin(db);
+    if ((put != NULL) && (oDB_put_write(db, put, doc, fields->end - doc) != 0)) {
+        oDB_put_abort(db, put);
+        put = NULL;
+    }
+    if ((put == NULL) || (oDB_put_end(db, put, attrs, attrs_num) != 0)) {
+        status = set_error(body, "Can't put document", db->msg);
+    }
+    /**
+     * Other processes see the document after the commit.
+     */
+    Server* server = worker->server;
+    if ((status == 0) && (server->commit_interval == 0)) {
+        if (oDB_commit(db) != 0) {
+            status = set_error(body, "Can't commit document", db->msg);
+        }
+        request_merge(server);
+    }
+    if ((status == 0) && (0 < server->commit_interval) && (server->uncommitted_since == 0)) {
+        server->uncommitted_since = oClock_get_seconds();
     }
+    unlock_db(worker);
+    BOOL waits_sync = (server->sync_docs == 0) && (server->sync_ms == 0);
+    if ((status == 0) && waits_sync && (oDB_sync(db) != 0)) {
+        status = set_error(body, "Can't sync document", db->msg);
+    }
+    return status;
+}
 
-    int optind = 1;
-    const char* path = argv[optind];
-    if (open_db_to_read(db, path) != 0) {
-        return 1;
+/**
+ * A response has a status byte, 0 on success, and a body, which is the output
+ * of the command or an error message.
+ */
+static TCXSTR*
+serve_request(Worker* worker, char* request, int size)
+{
+    TCXSTR* body = tcxstrnew();
+    Fields fields = { request, request + size };
+    const char* cmd = Fields_next(&fields);
+    int status;
+    if (cmd == NULL) {
+        status = set_error(body, "Invalid request", "");
     }
-    const char* phrase = argv[optind + 1];
-    oHits* hits = NULL;
-    if (oDB_search(db, phrase, &hits) != 0) {
-        print_error("Can't search document", db->msg);
-        return 1;
+    else if (strcmp(cmd, "search") == 0) {
+        status = serve_search(worker, &fields, body);
     }
-    if (close_db(db) != 0) {
-        return 1;
+    else if (strcmp(cmd, "get") == 0) {
+        status = serve_get(worker, &fields, body);
+    }
+    else if (strcmp(cmd, "put") == 0) {
+        status = serve_put(worker, &fields, body);
+    }
+    else {
+        status = set_error(body, "Unknown command", cmd);
     }
+    TCXSTR* response = Frame_new();
+    char c = status;
+    tcxstrcat(response, &c, sizeof(c));
+    tcxstrcat(response, tcxstrptr(body), tcxstrsize(body));
+    tcxstrdel(body);
+    return response;
+}
 
-    int i;
-    for (i = 0; i < hits->num; i++) {
-        printf("%d\n", hits->doc_id[i]);
+static void
+serve_conn(Worker* worker, int fd)
+{
+    char* request;
+    int size;
+    while ((request = Frame_receive(fd, &size)) != NULL) {
+        TCXSTR* response = serve_request(worker, request, size);
+        int status = Frame_send(fd, response);
+        tcxstrdel(response);
+        free(request);
+        if (status != 0) {
+            break;
+        }
     }
-    free(hits);
-    return 0;
 }
 
 static int
-put(oDB* db, int argc, char* argv[])
+take_conn(Server* server, int index)
 {
-    oAttr attrs[MAX_ATTRS];
-    int attrs_num = 0;
+    pthread_mutex_lock(&server->lock);
+    while (!server->is_stopping && (tclistnum(server->conns) == 0)) {
+        pthread_cond_wait(&server->cond, &server->lock);
+    }
+    int fd = -1;
+    if (!server->is_stopping) {
+        int* pfd = (int*)tclistshift2(server->conns);
+        fd = *pfd;
+        free(pfd);
+    }
+    server->active[index] = fd;
+    pthread_mutex_unlock(&server->lock);
+    return fd;
+}
 
-    struct option options[] = {
-        { "attr", required_argument, NULL, 'a' },
-        { 0, 0, 0, 0 } };
-    int opt;
-    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
-        switch (opt) {
-        case 'a':
-            if (MAX_ATTRS <= attrs_num) {
-                fprintf(stderr, "At most %d attributes acceptable", MAX_ATTRS);
-                return 1;
+static void*
+work(void* arg)
+{
+    Worker* worker = (Worker*)arg;
+    Server* server = worker->server;
+    int fd;
+    while ((fd = take_conn(server, worker->index)) != -1) {
+        serve_conn(worker, fd);
+        pthread_mutex_lock(&server->lock);
+        server->active[worker->index] = -1;
+        pthread_mutex_unlock(&server->lock);
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * A socket left by a server which has gone is removed. A socket of a running
+ * server is not, because it accepts a connection.
+ */
+static int
+listen_socket(const char* path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    if (array_sizeof(addr.sun_path) <= strlen(path)) {
+        print_error("Socket path is too long", path);
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    struct stat st;
+    if ((stat(path, &st) == 0) && S_ISSOCK(st.st_mode)) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if ((fd != -1) && (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)) {
+            unlink(path);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        print_error("Can't create socket", strerror(errno));
+        return -1;
+    }
+    if ((bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) || (listen(fd, SOMAXCONN) != 0)) {
+        print_error("Can't listen socket", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Returns seconds until the next commit may be due, or 0 if puts are committed
+ * each time. A put done while the main thread waits is committed when it
+ * wakes up next, so it waits commit_interval seconds at most.
+ */
+static double
+commit_if_due(Server* server)
+{
+    if (server->commit_interval == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&server->db_lock);
+    double now = oClock_get_seconds();
+    double since = server->uncommitted_since;
+    if ((0 < since) && (since + server->commit_interval <= now)) {
+        if (oDB_commit(server->db) != 0) {
+            print_error("Can't commit documents", server->db->msg);
+        }
+        server->uncommitted_since = 0;
+        request_merge(server);
+        since = 0;
+    }
+    double rest = 0 < since ? since + server->commit_interval - now : server->commit_interval;
+    pthread_mutex_unlock(&server->db_lock);
+    return rest;
+}
+
+/**
+ * Documents put in the last sync_ms milliseconds are synced even if no more
+ * documents come.
+ */
+static void
+sync_if_due(Server* server)
+{
+    if ((server->sync_ms != 0) && (oDB_sync(server->db) != 0)) {
+        print_error("Can't sync documents", server->db->msg);
+    }
+}
+
+/**
+ * SIGINT and SIGTERM are blocked except while the main thread waits for a
+ * connection in pselect(2), so that they stop the server there. The main
+ * thread wakes up when a commit is due, and every sync_ms milliseconds.
+ */
+static void
+accept_conns(Server* server, int listener, const sigset_t* orig_mask)
+{
+    while (!is_signaled) {
+        double seconds = commit_if_due(server);
+        if ((0 < server->sync_ms) && ((seconds == 0) || (server->sync_ms / 1000.0 < seconds))) {
+            seconds = server->sync_ms / 1000.0;
+        }
+        struct timespec interval;
+        interval.tv_sec = (time_t)seconds;
+        interval.tv_nsec = (long)((seconds - interval.tv_sec) * 1e9);
+        const struct timespec* timeout = 0 < seconds ? &interval : NULL;
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(listener, &fds);
+        int n = pselect(listener + 1, &fds, NULL, NULL, timeout, orig_mask);
+        sync_if_due(server);
+        if (n <= 0) {
+            continue;
+        }
+        int fd = accept(listener, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+        pthread_mutex_lock(&server->lock);
+        tclistpush(server->conns, &fd, sizeof(fd));
+        pthread_cond_signal(&server->cond);
+        pthread_mutex_unlock(&server->lock);
+    }
+}
+
+/**
+ * Segments are merged one pair at a time, and db_lock is released while a
+ * pair is copied.
+ */
+static void*
+merge_segments(void* arg)
+{
+    Server* server = (Server*)arg;
+    oDB* db = server->db;
+    pthread_mutex_lock(&server->db_lock);
+    while (!server->stops_merger) {
+        if (!server->wants_merge) {
+            pthread_cond_wait(&server->merge_cond, &server->db_lock);
+            continue;
+        }
+        server->wants_merge = FALSE;
+        oMerge* merge;
+        while (!server->stops_merger) {
+            if (oDB_merge_begin(db, &merge) != 0) {
+                print_error("Can't merge segments", db->msg);
+                break;
             }
-            {
-                char* pc = strchr(optarg, ':');
-                if (pc == NULL) {
-                    fprintf(stderr, "Attribute must be NAME:VALUE");
-                    return 1;
-                }
-                *pc = '\0';
-                attrs[attrs_num].name = optarg;
-                attrs[attrs_num].val = pc + 1;
-                attrs_num++;
+            if (merge == NULL) {
+                break;
+            }
+            pthread_mutex_unlock(&server->db_lock);
+            int status = oDB_merge_run(db, merge);
+            pthread_mutex_lock(&server->db_lock);
+            if (status != 0) {
+                oDB_merge_abort(db, merge);
+                print_error("Can't merge segments", db->msg);
+                break;
+            }
+            if (oDB_merge_end(db, merge) != 0) {
+                print_error("Can't merge segments", db->msg);
+                break;
             }
-            break;
-        case '?':
-        default:
-            usage();
-            return 1;
-            break;
         }
     }
-    if (argc <= optind) {
-        usage();
-        return 1;
+    pthread_mutex_unlock(&server->db_lock);
+    return NULL;
+}
+
+static void
+stop_merger(Server* server)
+{
+    pthread_mutex_lock(&server->db_lock);
+    server->stops_merger = TRUE;
+    pthread_cond_signal(&server->merge_cond);
+    pthread_mutex_unlock(&server->db_lock);
+    pthread_join(server->merger, NULL);
+}
+
+static void
+stop_workers(Server* server, Worker workers[], int workers_num)
+{
+    pthread_mutex_lock(&server->lock);
+    server->is_stopping = TRUE;
+    int i;
+    for (i = 0; i < workers_num; i++) {
+        if (server->active[i] != -1) {
+            shutdown(server->active[i], SHUT_RDWR);
+        }
     }
-    char* doc = read_file(db, stdin);
-    if (doc == NULL) {
-        return 1;
+    pthread_cond_broadcast(&server->cond);
+    pthread_mutex_unlock(&server->lock);
+    for (i = 0; i < workers_num; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (server->is_read_only) {
+            oDB_close(&workers[i].db);
+        }
+        oDB_fini(&workers[i].db);
+    }
+    while (0 < tclistnum(server->conns)) {
+        int* pfd = (int*)tclistshift2(server->conns);
+        close(*pfd);
+        free(pfd);
     }
-    int status = put_doc(db, argv[optind], doc, attrs, attrs_num);
-    free(doc);
-
-    return status;
 }
 
 static int
-create(oDB* db, int argc, char* argv[])
+run_server(Server* server, const char* socket_path)
 {
-    const char* attrs[MAX_ATTRS];
-    int attrs_num = 0;
+    int listener = listen_socket(socket_path);
+    if (listener == -1) {
+        return 1;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
+    action.sa_handler = stop_server;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigset_t mask;
+    sigset_t orig_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &orig_mask);
 
-    struct option options[] = {
-        { "attr", required_argument, NULL, 'a' },
-        { 0, 0, 0, 0 } };
-    int opt;
-    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
-        switch (opt) {
-        case 'a':
-            if (MAX_ATTRS <= attrs_num) {
-                fprintf(stderr, "Maximum attributes number is %d", MAX_ATTRS);
-                return 1;
-            }
-            attrs[attrs_num] = optarg;
-            attrs_num++;
+    if (!server->is_read_only && (pthread_create(&server->merger, NULL, merge_segments, server) != 0)) {
+        print_error("Can't create thread", strerror(errno));
+        close(listener);
+        unlink(socket_path);
+        return 1;
+    }
+    int workers_num = server->workers_num;
+    Worker workers[workers_num];
+    int active[workers_num];
+    server->active = active;
+    int started;
+    for (started = 0; started < workers_num; started++) {
+        Worker* worker = &workers[started];
+        active[started] = -1;
+        worker->server = server;
+        worker->index = started;
+        oDB_init(&worker->db);
+        if (server->is_read_only && (oDB_share(&worker->db, server->db) != 0)) {
+            print_error("Can't share database", worker->db.msg);
+            oDB_fini(&worker->db);
             break;
-        case '?':
-        default:
-            usage();
-            return 1;
+        }
+        if (pthread_create(&worker->thread, NULL, work, worker) != 0) {
+            print_error("Can't create thread", strerror(errno));
+            if (server->is_read_only) {
+                oDB_close(&worker->db);
+            }
+            oDB_fini(&worker->db);
             break;
         }
     }
-    if (argc <= optind) {
-        usage();
-        return 1;
+    if (started == workers_num) {
+        accept_conns(server, listener, &orig_mask);
     }
-
-    int status = oDB_create(db, argv[optind], attrs, attrs_num);
-    if (status != 0) {
-        print_error("Can't create database", db->msg);
-        return status;
+    stop_workers(server, workers, started);
+    if (!server->is_read_only) {
+        stop_merger(server);
     }
-    return 0;
+    close(listener);
+    unlink(socket_path);
+    return started == workers_num ? 0 : 1;
 }
 
+/**
+ * The database is opened to write unless --read-only is given, and put
+ * requests are served too. It is closed when SIGINT or SIGTERM stops the
+ * server.
+ */
 static int
-get(oDB* db, int argc, char* argv[])
+serve(oDB* db, int argc, char* argv[])
 {
-    const char* attr = NULL;
+    const char* socket_path = NULL;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers_num = 0 < cpus ? cpus : 4;
+    BOOL is_read_only = FALSE;
+    double commit_interval = 0;
+    int sync_docs = 0;
+    int sync_ms = 0;
     struct option options[] = {
-        { "attr", required_argument, NULL, 'a' },
+        { "socket", required_argument, NULL, 'S' },
+        { "workers", required_argument, NULL, 'w' },
+        { "read-only", no_argument, NULL, 'r' },
+        { "commit-interval", required_argument, NULL, 'c' },
+        { "sync-docs", required_argument, NULL, 'd' },
+        { "sync-ms", required_argument, NULL, 'm' },
         { 0, 0, 0, 0 } };
     int opt;
     while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
         switch (opt) {
-        case 'a':
-            attr = optarg;
+        case 'S':
+            socket_path = optarg;
+            break;
+        case 'w':
+            workers_num = atoi(optarg);
+            break;
+        case 'r':
+            is_read_only = TRUE;
+            break;
+        case 'c':
+            commit_interval = atof(optarg);
+            break;
+        case 'd':
+            sync_docs = atoi(optarg);
+            break;
+        case 'm':
+            sync_ms = atoi(optarg);
             break;
         case '?':
         default:
@@ -238,29 +1710,49 @@ get(oDB* db, int argc, char* argv[])
             break;
         }
     }
-    if (argc - 1 <= optind) {
+    if ((argc <= optind) || (socket_path == NULL) || (workers_num < 1) || (commit_interval < 0) || (sync_docs < 0) || (sync_ms < 0)) {
         usage();
         return 1;
     }
     const char* path = argv[optind];
-    if (open_db_to_read(db, path) != 0) {
+    if (is_read_only && (oDB_open_to_share(db, path) != 0)) {
+        print_error("Can't open database to share", db->msg);
         return 1;
     }
-
-    o_doc_id_t doc_id = atoi(argv[optind + 1]);
-    char* doc = attr == NULL ? oDB_get(db, doc_id) : oDB_get_attr(db, doc_id, attr);
-    if (doc == NULL) {
-        print_error("Can't get document", db->msg);
-        close_db(db);
+    if (!is_read_only) {
+        oDB_set_wal(db, sync_docs, sync_ms);
+        oDB_defer_merges(db);
+    }
+    if (!is_read_only && (open_db_to_write(db, path) != 0)) {
         return 1;
     }
-    printf("%s", doc);
-    free(doc);
 
+    Server server;
+    server.db = db;
+    server.is_read_only = is_read_only;
+    pthread_mutex_init(&server.db_lock, NULL);
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.cond, NULL);
+    server.conns = tclistnew();
+    server.workers_num = workers_num;
+    server.is_stopping = FALSE;
+    server.commit_interval = commit_interval;
+    server.uncommitted_since = 0;
+    server.sync_docs = sync_docs;
+    server.sync_ms = sync_ms;
+    pthread_cond_init(&server.merge_cond, NULL);
+    server.wants_merge = FALSE;
+    server.stops_merger = FALSE;
+    int status = run_server(&server, socket_path);
+    pthread_cond_destroy(&server.merge_cond);
+    tclistdel(server.conns);
+    pthread_cond_destroy(&server.cond);
+    pthread_mutex_destroy(&server.lock);
+    pthread_mutex_destroy(&server.db_lock);
     if (close_db(db) != 0) {
         return 1;
     }
-    return 0;
+    return status;
 }
 
 static int
@@ -274,15 +1766,28 @@ words(oDB* db, int argc, char* argv[])
         return 1;
     }
 
-    BDBCUR* cur = tcbdbcurnew(db->index);
-    tcbdbcurfirst(cur);
-    char* term;
-    while ((term = tcbdbcurkey2(cur)) != NULL) {
+    /**
+     * A term can be in many segments.
+     */
+    TCTREE* terms = tctreenew2(db->index_format == INDEX_FORMAT_PACKED ? tccmpint64 : tccmplexical, NULL);
+    int i;
+    for (i = 0; i < db->segments_num; i++) {
+        BDBCUR* cur = tcbdbcurnew(db->segments[i]->index);
+        tcbdbcurfirst(cur);
+        int size;
+        const char* term;
+        while ((term = (const char*)tcbdbcurkey3(cur, &size)) != NULL) {
+            tctreeputkeep(terms, term, size, "", 0);
+            tcbdbcurnext(cur);
+        }
+        tcbdbcurdel(cur);
+    }
+    tctreeiterinit(terms);
+    const char* term;
+    while ((term = tctreeiternext2(terms)) != NULL) {
         printf("%s\n", term);
-        free(term);
-        tcbdbcurnext(cur);
-    };
-    tcbdbcurdel(cur);
+    }
+    tctreedel(terms);
 
     if (close_db(db) != 0) {
         return 1;
@@ -308,6 +1813,12 @@ do_cmd(oDB* db, int argc, char* argv[])
     if (strcmp(cmd, "search") == 0) {
         return search(db, argc, argv);
     }
+    if (strcmp(cmd, "serve") == 0) {
+        return serve(db, argc, argv);
+    }
+    if (strcmp(cmd, "replay") == 0) {
+        return replay(db, argc, argv);
+    }
     if (strcmp(cmd, "words") == 0) {
         return words(db, argc, argv);
     }
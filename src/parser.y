@@ -4,6 +4,9 @@
     Token_delete(arg->db, $$.token);
 }
 %token_type { Symbol }
+%syntax_error {
+    arg->is_error = TRUE;
+}
 %token_prefix TOKEN_
 %include {
 #include <assert.h>
@@ -20,6 +23,7 @@
 struct Arg {
     oDB* db;
     oNode** node;
+    BOOL is_error;
 };
 
 typedef struct Arg Arg;
@@ -33,6 +37,9 @@ oNode_new(oDB* db, oNodeType type)
         return NULL;
     }
     node->type = type;
+    node->refs = 1;
+    node->hits = NULL;
+    node->stats = NULL;
     return node;
 }
 
@@ -41,6 +48,7 @@ struct Token {
     union {
         TCXSTR* phrase;
     } u;
+    int distance;
 };
 
 typedef struct Token Token;
@@ -55,6 +63,7 @@ Token_new(oDB* db, int type)
     }
     token->type = type;
     token->u.phrase = NULL;
+    token->distance = 0;
     return token;
 }
 
@@ -86,7 +95,17 @@ create_logical_op_node(oDB* db, oNodeType type, oNode* left, oNode* right)
 static oNode*
 create_and_node(oDB* db, oNode* left, oNode* right)
 {
-    return create_logical_op_node(db, NODE_AND, left, right);
+    return oNode_join(NODE_AND, left, right);
+}
+
+static oNode*
+create_near_node(oDB* db, oNode* left, oNode* right, int distance)
+{
+    oNode* node = oNode_new(db, NODE_NEAR);
+    node->u.near.left = left;
+    node->u.near.right = right;
+    node->u.near.distance = distance;
+    return node;
 }
 }
 
@@ -100,7 +119,7 @@ or_expr(A) ::= and_expr(B). {
     A = B;
 }
 or_expr(A) ::= or_expr(B) OR and_expr(C). {
-    A.node = create_logical_op_node(arg->db, NODE_OR, B.node, C.node);
+    A.node = oNode_join(NODE_OR, B.node, C.node);
 }
 and_expr(A) ::= not_expr(B). {
     A = B;
@@ -127,10 +146,24 @@ fuzzy_expr(A) ::= PHRASE(B) QUESTION. {
     A.node = oNode_new(arg->db, NODE_FUZZY);
     A.node->u.phrase.s = B.token->u.phrase;
 }
-atom(A) ::= PHRASE(B). {
+atom(A) ::= phrase(B). {
+    A = B;
+}
+atom(A) ::= phrase(B) NEAR(C) phrase(D). {
+    A.node = create_near_node(arg->db, B.node, D.node, C.token->distance);
+}
+phrase(A) ::= PHRASE(B). {
     A.node = oNode_new(arg->db, NODE_PHRASE);
     A.node->u.phrase.s = B.token->u.phrase;
 }
+phrase(A) ::= WILDCARD(B). {
+    A.node = oNode_new(arg->db, NODE_WILDCARD);
+    A.node->u.phrase.s = B.token->u.phrase;
+}
+atom(A) ::= REGEX(B). {
+    A.node = oNode_new(arg->db, NODE_REGEX);
+    A.node->u.phrase.s = B.token->u.phrase;
+}
 atom(A) ::= LPAR expr(B) RPAR. {
     A = B;
 }
@@ -152,6 +185,72 @@ Lexer_init(oDB* db, Lexer* lexer, const char* input)
 
 #define LEXER_NEXT_CHAR(lexer) (lexer)->input[(lexer)->pos]
 
+static BOOL
+is_delimiter(char c)
+{
+    return (c == '\0') || (c == '(') || (c == ')') || (c == '?') || isspace(c);
+}
+
+/**
+ * "?" in a word is a wildcard of one character, and "*" at the end of a word
+ * is a wildcard of any characters. "?" at the end of a word makes a fuzzy
+ * search as before.
+ */
+static BOOL
+is_wildcard(const char* s, int size)
+{
+    return (strchr(s, '?') != NULL) || ((0 < size) && (s[size - 1] == '*'));
+}
+
+/**
+ * "NEAR/N" is an operator which finds two phrases within N positions.
+ */
+static BOOL
+is_near(const char* s)
+{
+    if ((strncasecmp(s, "near/", 5) != 0) || (s[5] == '\0')) {
+        return FALSE;
+    }
+    const char* p;
+    for (p = &s[5]; *p != '\0'; p++) {
+        if ((*p < '0') || ('9' < *p)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * A regular expression follows "re:". It is quoted, or ends at a space. In
+ * quotes, backslashes are kept for the expression except one before a quote.
+ */
+static TCXSTR*
+read_regex(Lexer* lexer)
+{
+    TCXSTR* buf = tcxstrnew();
+    if (LEXER_NEXT_CHAR(lexer) != '\"') {
+        while ((LEXER_NEXT_CHAR(lexer) != '\0') && !isspace(LEXER_NEXT_CHAR(lexer))) {
+            char c = LEXER_NEXT_CHAR(lexer);
+            tcxstrcat(buf, &c, sizeof(c));
+            lexer->pos++;
+        }
+        return buf;
+    }
+    lexer->pos++;
+    while ((LEXER_NEXT_CHAR(lexer) != '\"') && (LEXER_NEXT_CHAR(lexer) != '\0')) {
+        if ((LEXER_NEXT_CHAR(lexer) == '\\') && (lexer->input[lexer->pos + 1] == '\"')) {
+            lexer->pos++;
+        }
+        char c = LEXER_NEXT_CHAR(lexer);
+        tcxstrcat(buf, &c, sizeof(c));
+        lexer->pos++;
+    }
+    if (LEXER_NEXT_CHAR(lexer) == '\"') {
+        lexer->pos++;
+    }
+    return buf;
+}
+
 static BOOL
 Lexer_next_token(oDB* db, Lexer* lexer, Token** token)
 {
@@ -171,6 +270,9 @@ Lexer_next_token(oDB* db, Lexer* lexer, Token** token)
                 tcxstrcat(buf, &c, sizeof(c));
                 lexer->pos++;
             }
+            if (LEXER_NEXT_CHAR(lexer) == '\"') {
+                lexer->pos++;
+            }
             *token = Token_new(db, TOKEN_PHRASE);
             (*token)->u.phrase = buf;
         }
@@ -183,19 +285,35 @@ Lexer_next_token(oDB* db, Lexer* lexer, Token** token)
         lexer->pos++;
         *token = Token_new(db, TOKEN_RPAR);
         break;
-    case '?':
-        lexer->pos++;
-        *token = Token_new(db, TOKEN_QUESTION);
-        break;
     case '\0':
         return FALSE;
         break;
+    case '?':
+        if (is_delimiter(lexer->input[lexer->pos + 1])) {
+            lexer->pos++;
+            *token = Token_new(db, TOKEN_QUESTION);
+            break;
+        }
+        /**
+         * A word beginning with "?" is a wildcard.
+         */
     default:
+        if (strncmp(&lexer->input[lexer->pos], "re:", 3) == 0) {
+            lexer->pos += 3;
+            *token = Token_new(db, TOKEN_REGEX);
+            (*token)->u.phrase = read_regex(lexer);
+            break;
+        }
         {
             TCXSTR* buf = tcxstrnew();
             while (1) {
                 char c = LEXER_NEXT_CHAR(lexer);
-                if ((c == '\0') || (c == '(') || (c == ')') || (c == '?') || isspace(c)) {
+                if ((c == '?') && !is_delimiter(lexer->input[lexer->pos + 1])) {
+                    tcxstrcat(buf, &c, sizeof(c));
+                    lexer->pos++;
+                    continue;
+                }
+                if (is_delimiter(c)) {
                     break;
                 }
                 tcxstrcat(buf, &c, sizeof(c));
@@ -214,8 +332,13 @@ Lexer_next_token(oDB* db, Lexer* lexer, Token** token)
                 *token = Token_new(db, TOKEN_NOT);
                 tcxstrdel(buf);
             }
+            else if (is_near(s)) {
+                *token = Token_new(db, TOKEN_NEAR);
+                (*token)->distance = atoi(&s[5]);
+                tcxstrdel(buf);
+            }
             else {
-                *token = Token_new(db, TOKEN_PHRASE);
+                *token = Token_new(db, is_wildcard(s, tcxstrsize(buf)) ? TOKEN_WILDCARD : TOKEN_PHRASE);
                 (*token)->u.phrase = buf;
             }
         }
@@ -224,6 +347,94 @@ Lexer_next_token(oDB* db, Lexer* lexer, Token** token)
     return TRUE;
 }
 
+oNode*
+oNode_alloc(oNodeType type)
+{
+    oNode* node = (oNode*)tcmalloc(sizeof(oNode));
+    node->type = type;
+    node->refs = 1;
+    node->hits = NULL;
+    node->stats = NULL;
+    return node;
+}
+
+static void
+add_operand(oNode* node, oNode* operand)
+{
+    int num = node->u.operands.nodes_num;
+    int operand_num = operand->type == node->type ? operand->u.operands.nodes_num : 1;
+    oNode** nodes = (oNode**)tcrealloc(node->u.operands.nodes, sizeof(oNode*) * (num + operand_num));
+    node->u.operands.nodes = nodes;
+    node->u.operands.nodes_num = num + operand_num;
+    if (operand->type != node->type) {
+        nodes[num] = operand;
+        return;
+    }
+    memcpy(&nodes[num], operand->u.operands.nodes, sizeof(oNode*) * operand_num);
+    free(operand->u.operands.nodes);
+    free(operand);
+}
+
+/**
+ * AND and OR are associative, so that operands of the same operator are
+ * flattened into one node. "a b c" is an AND of three phrases, not an AND of
+ * an AND.
+ */
+oNode*
+oNode_join(oNodeType type, oNode* left, oNode* right)
+{
+    oNode* node = left;
+    if (left->type != type) {
+        node = oNode_alloc(type);
+        node->u.operands.nodes = NULL;
+        node->u.operands.nodes_num = 0;
+        add_operand(node, left);
+    }
+    add_operand(node, right);
+    return node;
+}
+
+void
+oNode_delete(oNode* node)
+{
+    if (node == NULL) {
+        return;
+    }
+    node->refs--;
+    if (0 < node->refs) {
+        return;
+    }
+    oHits_delete(NULL, node->hits);
+    oStats_delete(node->stats);
+    switch (node->type) {
+    case NODE_PHRASE:
+    case NODE_FUZZY:
+    case NODE_REGEX:
+    case NODE_WILDCARD:
+        tcxstrdel(node->u.phrase.s);
+        break;
+    case NODE_NEAR:
+        oNode_delete(node->u.near.left);
+        oNode_delete(node->u.near.right);
+        break;
+    case NODE_AND:
+    case NODE_OR:
+        {
+            int i;
+            for (i = 0; i < node->u.operands.nodes_num; i++) {
+                oNode_delete(node->u.operands.nodes[i]);
+            }
+            free(node->u.operands.nodes);
+        }
+        break;
+    default:
+        oNode_delete(node->u.logical_op.left);
+        oNode_delete(node->u.logical_op.right);
+        break;
+    }
+    free(node);
+}
+
 oNode*
 oParser_parse(oDB* db, const char* cond)
 {
@@ -232,7 +443,7 @@ oParser_parse(oDB* db, const char* cond)
     Lexer_init(db, &lexer, cond);
     Symbol symbol;
     oNode* node = NULL;
-    Arg arg = { db, &node };
+    Arg arg = { db, &node, FALSE };
 #if 0
     ParseTrace(stdout, "parser: ");
 #endif
@@ -242,6 +453,14 @@ oParser_parse(oDB* db, const char* cond)
     symbol.token = NULL;
     Parse(parser, 0, symbol, &arg);
     ParseFree(parser, free);
+    if (arg.is_error) {
+        /**
+         * A query with a syntax error is invalid, even if the parser recovers
+         * from it and makes a node of a part of the query.
+         */
+        oNode_delete(node);
+        return NULL;
+    }
 
     return node;
 }
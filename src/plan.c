@@ -0,0 +1,491 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tcutil.h"
+#include "o.h"
+#include "o/private.h"
+
+/**
+ * The optimizer rewrites a parsed query before it is evaluated.
+ *
+ * - Identical subtrees are shared (hash-consing), so that eval() computes
+ *   each of them once in a query.
+ * - "A NOT B" becomes an AND of A and a NOT of only B, so that B is checked
+ *   only against documents which A found.
+ * - Operands of AND and OR are sorted and deduplicated, and conjuncts which
+ *   all operands of an OR have are factored out of it. "(a b) OR (a c)" is
+ *   "a (b OR c)", and "a OR (a b)" is "a".
+ */
+struct Optimizer {
+    /**
+     * A key of a node to the node. The table has a reference to the node, so
+     * that a key never points to a freed node.
+     */
+    TCMAP* nodes;
+    /**
+     * A node to its ID. IDs are in the order of nodes shared.
+     */
+    TCMAP* ids;
+    int next_id;
+};
+
+typedef struct Optimizer Optimizer;
+
+static int
+get_id(Optimizer* optimizer, oNode* node)
+{
+    int sp;
+    const int* id = (const int*)tcmapget(optimizer->ids, &node, sizeof(node), &sp);
+    return id != NULL ? *id : -1;
+}
+
+static const char*
+get_type_name(oNodeType type)
+{
+    switch (type) {
+    case NODE_PHRASE:
+        return "PHRASE";
+    case NODE_FUZZY:
+        return "FUZZY";
+    case NODE_REGEX:
+        return "REGEX";
+    case NODE_WILDCARD:
+        return "WILDCARD";
+    case NODE_NEAR:
+        return "NEAR";
+    case NODE_AND:
+        return "AND";
+    case NODE_OR:
+        return "OR";
+    case NODE_NOT:
+        return "NOT";
+    default:
+        return "?";
+    }
+}
+
+static BOOL
+is_text(const oNode* node)
+{
+    switch (node->type) {
+    case NODE_PHRASE:
+    case NODE_FUZZY:
+    case NODE_REGEX:
+    case NODE_WILDCARD:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+/**
+ * Children of node are shared already, so that their IDs identify them.
+ */
+static void
+make_key(Optimizer* optimizer, oNode* node, TCXSTR* key)
+{
+    tcxstrcat2(key, get_type_name(node->type));
+    if (is_text(node)) {
+        tcxstrcat2(key, " ");
+        tcxstrcat(key, tcxstrptr(node->u.phrase.s), tcxstrsize(node->u.phrase.s));
+        return;
+    }
+    switch (node->type) {
+    case NODE_NEAR:
+        tcxstrprintf(key, "/%d %d %d", node->u.near.distance, get_id(optimizer, node->u.near.left), get_id(optimizer, node->u.near.right));
+        break;
+    case NODE_AND:
+    case NODE_OR:
+        {
+            int i;
+            for (i = 0; i < node->u.operands.nodes_num; i++) {
+                tcxstrprintf(key, " %d", get_id(optimizer, node->u.operands.nodes[i]));
+            }
+        }
+        break;
+    default:
+        tcxstrprintf(key, " %d %d", get_id(optimizer, node->u.logical_op.left), get_id(optimizer, node->u.logical_op.right));
+        break;
+    }
+}
+
+/**
+ * Returns the shared node which is same as node. The reference to node is
+ * moved to the returned one, so node is deleted if there is the one already.
+ */
+static oNode*
+share(Optimizer* optimizer, oNode* node)
+{
+    TCXSTR* key = tcxstrnew();
+    make_key(optimizer, node, key);
+    int sp;
+    oNode** found = (oNode**)tcmapget(optimizer->nodes, tcxstrptr(key), tcxstrsize(key), &sp);
+    if (found != NULL) {
+        tcxstrdel(key);
+        oNode* shared = *found;
+        shared->refs++;
+        oNode_delete(node);
+        return shared;
+    }
+    tcmapput(optimizer->nodes, tcxstrptr(key), tcxstrsize(key), &node, sizeof(node));
+    tcxstrdel(key);
+    node->refs++;
+    int id = optimizer->next_id;
+    optimizer->next_id++;
+    tcmapput(optimizer->ids, &node, sizeof(node), &id, sizeof(id));
+    return node;
+}
+
+static BOOL
+is_negation(const oNode* node)
+{
+    return (node->type == NODE_NOT) && (node->u.logical_op.left == NULL);
+}
+
+static oNode**
+get_conjuncts(oNode** node, int* num)
+{
+    if ((*node)->type != NODE_AND) {
+        *num = 1;
+        return node;
+    }
+    *num = (*node)->u.operands.nodes_num;
+    return (*node)->u.operands.nodes;
+}
+
+static BOOL
+contains(oNode** nodes, int num, oNode* node)
+{
+    int i;
+    for (i = 0; i < num; i++) {
+        if (nodes[i] == node) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static oNode* make_operands_node(Optimizer* optimizer, oNodeType type, oNode** nodes, int num);
+
+/**
+ * Returns an AND of conjuncts which all of nodes have, and an OR of the rest
+ * of them. Returns NULL if they have no common conjuncts. A NOT is evaluated
+ * as a filter of an AND, so the rest must not be only NOTs.
+ */
+static oNode*
+factor(Optimizer* optimizer, oNode** nodes, int num)
+{
+    int first_num;
+    oNode** first = get_conjuncts(&nodes[0], &first_num);
+    oNode* common[first_num + 1];
+    int common_num = 0;
+    int i;
+    for (i = 0; i < first_num; i++) {
+        BOOL is_common = TRUE;
+        int j;
+        for (j = 1; is_common && (j < num); j++) {
+            int conjuncts_num;
+            oNode** conjuncts = get_conjuncts(&nodes[j], &conjuncts_num);
+            is_common = contains(conjuncts, conjuncts_num, first[i]);
+        }
+        if (is_common) {
+            common[common_num] = first[i];
+            common_num++;
+        }
+    }
+    if (common_num == 0) {
+        return NULL;
+    }
+
+    oNode* rests[num];
+    int rests_num;
+    for (rests_num = 0; rests_num < num; rests_num++) {
+        int conjuncts_num;
+        oNode** conjuncts = get_conjuncts(&nodes[rests_num], &conjuncts_num);
+        oNode* rest[conjuncts_num];
+        int rest_num = 0;
+        BOOL is_positive = FALSE;
+        for (i = 0; i < conjuncts_num; i++) {
+            if (!contains(common, common_num, conjuncts[i])) {
+                rest[rest_num] = conjuncts[i];
+                rest_num++;
+                is_positive = is_positive || !is_negation(conjuncts[i]);
+            }
+        }
+        if (rest_num == 0) {
+            /**
+             * This operand is the common conjuncts, and absorbs the others.
+             */
+            break;
+        }
+        if (!is_positive) {
+            for (i = 0; i < rests_num; i++) {
+                oNode_delete(rests[i]);
+            }
+            return NULL;
+        }
+        rests[rests_num] = make_operands_node(optimizer, NODE_AND, rest, rest_num);
+    }
+    if (rests_num < num) {
+        for (i = 0; i < rests_num; i++) {
+            oNode_delete(rests[i]);
+        }
+        return make_operands_node(optimizer, NODE_AND, common, common_num);
+    }
+    common[common_num] = make_operands_node(optimizer, NODE_OR, rests, rests_num);
+    for (i = 0; i < rests_num; i++) {
+        oNode_delete(rests[i]);
+    }
+    oNode* node = make_operands_node(optimizer, NODE_AND, common, common_num + 1);
+    oNode_delete(common[common_num]);
+    return node;
+}
+
+/**
+ * Makes an AND or an OR of nodes. Operands of the same operator in nodes are
+ * flattened. Operands are in the order of IDs without duplication.
+ */
+static oNode*
+make_operands_node(Optimizer* optimizer, oNodeType type, oNode** nodes, int num)
+{
+    int max_num = 0;
+    int i;
+    for (i = 0; i < num; i++) {
+        max_num += nodes[i]->type == type ? nodes[i]->u.operands.nodes_num : 1;
+    }
+    oNode* operands[max_num];
+    int operands_num = 0;
+    for (i = 0; i < num; i++) {
+        int children_num = 1;
+        oNode** children = &nodes[i];
+        if (nodes[i]->type == type) {
+            children = nodes[i]->u.operands.nodes;
+            children_num = nodes[i]->u.operands.nodes_num;
+        }
+        int j;
+        for (j = 0; j < children_num; j++) {
+            oNode* child = children[j];
+            int id = get_id(optimizer, child);
+            int k = operands_num;
+            while ((0 < k) && (id < get_id(optimizer, operands[k - 1]))) {
+                k--;
+            }
+            if ((0 < k) && (operands[k - 1] == child)) {
+                continue;
+            }
+            memmove(&operands[k + 1], &operands[k], sizeof(oNode*) * (operands_num - k));
+            operands[k] = child;
+            operands_num++;
+        }
+    }
+    if (operands_num == 1) {
+        operands[0]->refs++;
+        return operands[0];
+    }
+    if (type == NODE_OR) {
+        oNode* factored = factor(optimizer, operands, operands_num);
+        if (factored != NULL) {
+            return factored;
+        }
+    }
+    oNode* node = oNode_alloc(type);
+    node->u.operands.nodes = (oNode**)tcmalloc(sizeof(oNode*) * operands_num);
+    node->u.operands.nodes_num = operands_num;
+    for (i = 0; i < operands_num; i++) {
+        operands[i]->refs++;
+        node->u.operands.nodes[i] = operands[i];
+    }
+    return share(optimizer, node);
+}
+
+/**
+ * node is deleted, and its optimized one is returned.
+ */
+static oNode*
+optimize(Optimizer* optimizer, oNode* node)
+{
+    if (is_text(node)) {
+        return share(optimizer, node);
+    }
+    if (node->type == NODE_NEAR) {
+        node->u.near.left = optimize(optimizer, node->u.near.left);
+        node->u.near.right = optimize(optimizer, node->u.near.right);
+        return share(optimizer, node);
+    }
+    if ((node->type == NODE_AND) || (node->type == NODE_OR)) {
+        int num = node->u.operands.nodes_num;
+        oNode** operands = node->u.operands.nodes;
+        int i;
+        for (i = 0; i < num; i++) {
+            operands[i] = optimize(optimizer, operands[i]);
+        }
+        oNode* optimized = make_operands_node(optimizer, node->type, operands, num);
+        for (i = 0; i < num; i++) {
+            oNode_delete(operands[i]);
+        }
+        free(operands);
+        free(node);
+        return optimized;
+    }
+    if (node->u.logical_op.left == NULL) {
+        node->u.logical_op.right = optimize(optimizer, node->u.logical_op.right);
+        return share(optimizer, node);
+    }
+    oNode* operands[2];
+    operands[0] = optimize(optimizer, node->u.logical_op.left);
+    oNode* negation = oNode_alloc(NODE_NOT);
+    negation->u.logical_op.left = NULL;
+    negation->u.logical_op.right = optimize(optimizer, node->u.logical_op.right);
+    operands[1] = share(optimizer, negation);
+    oNode* optimized = make_operands_node(optimizer, NODE_AND, operands, array_sizeof(operands));
+    oNode_delete(operands[0]);
+    oNode_delete(operands[1]);
+    free(node);
+    return optimized;
+}
+
+oNode*
+oPlan_optimize(oNode* node)
+{
+    Optimizer optimizer;
+    optimizer.nodes = tcmapnew();
+    optimizer.ids = tcmapnew();
+    optimizer.next_id = 0;
+    oNode* optimized = optimize(&optimizer, node);
+    tcmapiterinit(optimizer.nodes);
+    const void* key;
+    int sp;
+    while ((key = tcmapiternext(optimizer.nodes, &sp)) != NULL) {
+        oNode_delete(*((oNode**)tcmapiterval(key, &sp)));
+    }
+    tcmapdel(optimizer.nodes);
+    tcmapdel(optimizer.ids);
+    return optimized;
+}
+
+oStats*
+oStats_new()
+{
+    oStats* stats = (oStats*)tcmalloc(sizeof(oStats));
+    memset(stats, 0, sizeof(*stats));
+    stats->detail = tcxstrnew();
+    return stats;
+}
+
+void
+oStats_delete(oStats* stats)
+{
+    if (stats == NULL) {
+        return;
+    }
+    tcxstrdel(stats->detail);
+    free(stats);
+}
+
+static void
+indent(int depth, TCXSTR* plan)
+{
+    int i;
+    for (i = 0; i < depth; i++) {
+        tcxstrcat2(plan, "  ");
+    }
+}
+
+/**
+ * Only counters which are not zero are shown.
+ */
+static void
+dump_stats(const oStats* stats, int depth, TCXSTR* plan)
+{
+    if (stats->evaluations == 0) {
+        tcxstrcat2(plan, " (not evaluated)\n");
+        return;
+    }
+    tcxstrprintf(plan, " (hits=%d time=%.3fms", stats->hits, stats->seconds * 1000);
+    if (0 < stats->cached) {
+        tcxstrprintf(plan, " cached=%d", stats->cached);
+    }
+    if (0 < stats->terms) {
+        tcxstrprintf(plan, " terms=%d", stats->terms);
+    }
+    if (0 < stats->postings) {
+        tcxstrprintf(plan, " postings=%d", stats->postings);
+    }
+    if (0 < stats->bytes) {
+        tcxstrprintf(plan, " bytes=%lld", (long long)stats->bytes);
+    }
+    if (0 < stats->comparisons) {
+        tcxstrprintf(plan, " comparisons=%lld", (long long)stats->comparisons);
+    }
+    if (0 < stats->docs) {
+        tcxstrprintf(plan, " docs=%d", stats->docs);
+    }
+    tcxstrcat2(plan, ")\n");
+    const char* begin = tcxstrptr(stats->detail);
+    const char* end;
+    while ((end = strchr(begin, '\n')) != NULL) {
+        indent(depth + 1, plan);
+        tcxstrcat(plan, begin, end - begin + 1);
+        begin = end + 1;
+    }
+}
+
+static void
+dump(oNode* node, int depth, TCXSTR* plan)
+{
+    int i;
+    indent(depth, plan);
+    tcxstrcat2(plan, get_type_name(node->type));
+    if (is_text(node)) {
+        tcxstrprintf(plan, " \"%s\"", tcxstrptr(node->u.phrase.s));
+    }
+    else if (node->type == NODE_NEAR) {
+        tcxstrprintf(plan, "/%d", node->u.near.distance);
+    }
+    if (1 < node->refs) {
+        tcxstrcat2(plan, " (shared)");
+    }
+    if (node->stats != NULL) {
+        dump_stats(node->stats, depth, plan);
+    }
+    else {
+        tcxstrcat2(plan, "\n");
+    }
+    if (is_text(node)) {
+        return;
+    }
+    switch (node->type) {
+    case NODE_NEAR:
+        dump(node->u.near.left, depth + 1, plan);
+        dump(node->u.near.right, depth + 1, plan);
+        break;
+    case NODE_AND:
+    case NODE_OR:
+        for (i = 0; i < node->u.operands.nodes_num; i++) {
+            dump(node->u.operands.nodes[i], depth + 1, plan);
+        }
+        break;
+    default:
+        if (node->u.logical_op.left != NULL) {
+            dump(node->u.logical_op.left, depth + 1, plan);
+        }
+        dump(node->u.logical_op.right, depth + 1, plan);
+        break;
+    }
+}
+
+/**
+ * Appends a tree of node to plan. A node is indented under its parent, and
+ * is followed by its statistics if it has them.
+ */
+void
+oPlan_dump(oNode* node, TCXSTR* plan)
+{
+    dump(node, 0, plan);
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,510 @@
+#include <ctype.h>
+#include <locale.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tcutil.h"
+#include "o.h"
+#include "o/private.h"
+
+/**
+ * A regular expression is matched against documents in UTF-8, so it is
+ * compiled and executed in a UTF-8 locale of the calling thread, regardless
+ * of the locale of the process.
+ */
+struct oRegex {
+    regex_t re;
+    locale_t locale;
+};
+
+oRegex*
+oRegex_new(oDB* db, const char* pattern)
+{
+    oRegex* regex = (oRegex*)malloc(sizeof(oRegex));
+    if (regex == NULL) {
+        oDB_set_msg_of_errno(db, "Can't allocate regular expression");
+        return NULL;
+    }
+    regex->locale = newlocale(LC_CTYPE_MASK, "C.UTF-8", (locale_t)0);
+    locale_t old = regex->locale != (locale_t)0 ? uselocale(regex->locale) : (locale_t)0;
+    int status = regcomp(&regex->re, pattern, REG_EXTENDED | REG_NOSUB);
+    if (old != (locale_t)0) {
+        uselocale(old);
+    }
+    if (status != 0) {
+        char msg[128];
+        regerror(status, &regex->re, msg, array_sizeof(msg));
+        oDB_set_msg(db, "Invalid regular expression", msg);
+        if (regex->locale != (locale_t)0) {
+            freelocale(regex->locale);
+        }
+        free(regex);
+        return NULL;
+    }
+    return regex;
+}
+
+void
+oRegex_delete(oRegex* regex)
+{
+    regfree(&regex->re);
+    if (regex->locale != (locale_t)0) {
+        freelocale(regex->locale);
+    }
+    free(regex);
+}
+
+BOOL
+oRegex_match(oRegex* regex, const char* s)
+{
+    locale_t old = regex->locale != (locale_t)0 ? uselocale(regex->locale) : (locale_t)0;
+    int status = regexec(&regex->re, s, 0, NULL, 0);
+    if (old != (locale_t)0) {
+        uselocale(old);
+    }
+    return status == 0;
+}
+
+/**
+ * A filter is a query of phrases which every match of a regular expression
+ * must contain, in the way of Google Code Search. It is made from Info of
+ * each part of the expression. exact is the set of all strings which the part
+ * matches, or NULL if it is unknown or too large. match is a query which a
+ * document matching the part satisfies. NULL in match means any document.
+ */
+#define EXACT_NUM_MAX   16
+#define EXACT_SIZE_MAX  64
+#define CLASS_SIZE_MAX  8
+
+struct Info {
+    TCLIST* exact;
+    oNode* match;
+};
+
+typedef struct Info Info;
+
+struct Parser {
+    oDB* db;
+    const char* p;
+    BOOL failed;
+};
+
+typedef struct Parser Parser;
+
+static oNode*
+and_nodes(oNode* left, oNode* right)
+{
+    if (left == NULL) {
+        return right;
+    }
+    if (right == NULL) {
+        return left;
+    }
+    return oNode_join(NODE_AND, left, right);
+}
+
+static oNode*
+or_nodes(oNode* left, oNode* right)
+{
+    if ((left == NULL) || (right == NULL)) {
+        oNode_delete(left);
+        oNode_delete(right);
+        return NULL;
+    }
+    return oNode_join(NODE_OR, left, right);
+}
+
+/**
+ * A string of one character is not worth searching. The hybrid tokenizer
+ * indexes only whole words, so a string with a part of a word can't be
+ * searched.
+ */
+static oNode*
+new_phrase_node(Parser* parser, const char* s, int size)
+{
+    if (oUTF8_count(s, size) < 2) {
+        return NULL;
+    }
+    if (parser->db->tokenizer == TOKENIZER_HYBRID) {
+        int i;
+        for (i = 0; i < size; i++) {
+            unsigned char c = (unsigned char)s[i];
+            if (isalnum(c) || ((0xc3 <= c) && (c <= 0xc9))) {
+                return NULL;
+            }
+        }
+    }
+    oNode* node = oNode_alloc(NODE_PHRASE);
+    node->u.phrase.s = tcxstrnew();
+    tcxstrcat(node->u.phrase.s, s, size);
+    return node;
+}
+
+/**
+ * Makes a query of any of exact. exact is deleted.
+ */
+static oNode*
+fold_exact(Parser* parser, TCLIST* exact)
+{
+    if (exact == NULL) {
+        return NULL;
+    }
+    oNode* node = NULL;
+    int i;
+    for (i = 0; i < tclistnum(exact); i++) {
+        int size;
+        const char* s = (const char*)tclistval(exact, i, &size);
+        oNode* phrase = new_phrase_node(parser, s, size);
+        if (phrase == NULL) {
+            oNode_delete(node);
+            node = NULL;
+            break;
+        }
+        node = node == NULL ? phrase : oNode_join(NODE_OR, node, phrase);
+    }
+    tclistdel(exact);
+    return node;
+}
+
+static Info
+make_info(TCLIST* exact, oNode* match)
+{
+    Info info;
+    info.exact = exact;
+    info.match = match;
+    return info;
+}
+
+static Info
+make_exact_info(const char* s, int size)
+{
+    TCLIST* exact = tclistnew();
+    tclistpush(exact, s, size);
+    return make_info(exact, NULL);
+}
+
+static void
+Info_fini(Info* info)
+{
+    if (info->exact != NULL) {
+        tclistdel(info->exact);
+    }
+    oNode_delete(info->match);
+}
+
+/**
+ * Returns the query which a document matching info satisfies.
+ */
+static oNode*
+fold_info(Parser* parser, Info* info)
+{
+    return and_nodes(info->match, fold_exact(parser, info->exact));
+}
+
+/**
+ * Returns all concatenations of a string in x and one in y, or NULL if they
+ * are too many or too long.
+ */
+static TCLIST*
+cross_exact(TCLIST* x, TCLIST* y)
+{
+    int x_num = tclistnum(x);
+    int y_num = tclistnum(y);
+    if (EXACT_NUM_MAX < x_num * y_num) {
+        return NULL;
+    }
+    TCLIST* exact = tclistnew();
+    int i;
+    for (i = 0; i < x_num; i++) {
+        int x_size;
+        const char* s = (const char*)tclistval(x, i, &x_size);
+        int j;
+        for (j = 0; j < y_num; j++) {
+            int y_size;
+            const char* t = (const char*)tclistval(y, j, &y_size);
+            if (EXACT_SIZE_MAX < x_size + y_size) {
+                tclistdel(exact);
+                return NULL;
+            }
+            char buf[EXACT_SIZE_MAX];
+            memcpy(buf, s, x_size);
+            memcpy(&buf[x_size], t, y_size);
+            tclistpush(exact, buf, x_size + y_size);
+        }
+    }
+    return exact;
+}
+
+static int
+get_char_size(const char* p)
+{
+    int size = 1;
+    while ((p[size] & 0xc0) == 0x80) {
+        size++;
+    }
+    return size;
+}
+
+/**
+ * A bracket expression is exact if it has a few characters and no ranges of
+ * non-ASCII characters.
+ */
+static Info
+parse_bracket(Parser* parser)
+{
+    const char* p = parser->p;
+    BOOL is_negated = *p == '^';
+    if (is_negated) {
+        p++;
+    }
+    TCLIST* exact = tclistnew();
+    BOOL is_known = !is_negated;
+    BOOL is_first = TRUE;
+    while ((*p != '\0') && ((*p != ']') || is_first)) {
+        is_first = FALSE;
+        if ((*p == '[') && ((p[1] == ':') || (p[1] == '=') || (p[1] == '.'))) {
+            char close = p[1];
+            const char* end = p + 2;
+            while ((*end != '\0') && ((end[0] != close) || (end[1] != ']'))) {
+                end++;
+            }
+            if (*end == '\0') {
+                break;
+            }
+            p = end + 2;
+            is_known = FALSE;
+            continue;
+        }
+        int size = get_char_size(p);
+        if ((p[size] == '-') && (p[size + 1] != ']') && (p[size + 1] != '\0')) {
+            unsigned char first = (unsigned char)*p;
+            unsigned char last = (unsigned char)p[size + 1];
+            if ((size != 1) || (0x80 <= last) || (CLASS_SIZE_MAX < last - first + 1)) {
+                is_known = FALSE;
+            }
+            else {
+                unsigned int c;
+                for (c = first; c <= last; c++) {
+                    char ch = (char)c;
+                    tclistpush(exact, &ch, 1);
+                }
+            }
+            p += size + 1;
+            p += get_char_size(p);
+            continue;
+        }
+        tclistpush(exact, p, size);
+        p += size;
+    }
+    if (*p != ']') {
+        parser->failed = TRUE;
+        tclistdel(exact);
+        return make_info(NULL, NULL);
+    }
+    parser->p = p + 1;
+    if (!is_known || (CLASS_SIZE_MAX < tclistnum(exact))) {
+        tclistdel(exact);
+        return make_info(NULL, NULL);
+    }
+    return make_info(exact, NULL);
+}
+
+static Info parse_alternation(Parser* parser);
+
+static Info
+parse_atom(Parser* parser)
+{
+    const char* p = parser->p;
+    switch (*p) {
+    case '(':
+        {
+            parser->p++;
+            Info info = parse_alternation(parser);
+            if (*parser->p != ')') {
+                parser->failed = TRUE;
+                return info;
+            }
+            parser->p++;
+            return info;
+        }
+    case '[':
+        parser->p++;
+        return parse_bracket(parser);
+    case '.':
+        parser->p++;
+        return make_info(NULL, NULL);
+    case '^':
+    case '$':
+        parser->p++;
+        return make_exact_info("", 0);
+    case '\\':
+        if (p[1] == '\0') {
+            parser->failed = TRUE;
+            return make_info(NULL, NULL);
+        }
+        parser->p += 1 + get_char_size(&p[1]);
+        if (strchr("bB<>`'", p[1]) != NULL) {
+            return make_exact_info("", 0);
+        }
+        if (isalnum((unsigned char)p[1])) {
+            /**
+             * Classes like \w and back references.
+             */
+            return make_info(NULL, NULL);
+        }
+        return make_exact_info(&p[1], get_char_size(&p[1]));
+    default:
+        {
+            int size = get_char_size(p);
+            parser->p += size;
+            return make_exact_info(p, size);
+        }
+    }
+}
+
+static BOOL
+skip_interval(Parser* parser, int* min)
+{
+    const char* p = parser->p + 1;
+    if (!isdigit((unsigned char)*p)) {
+        return FALSE;
+    }
+    *min = atoi(p);
+    while (isdigit((unsigned char)*p) || (*p == ',')) {
+        p++;
+    }
+    if (*p != '}') {
+        return FALSE;
+    }
+    parser->p = p + 1;
+    return TRUE;
+}
+
+/**
+ * A part which may be skipped tells nothing, except an optional exact part.
+ * A part repeated at least once is not exact, but must be in a document.
+ */
+static Info
+parse_repetition(Parser* parser)
+{
+    Info info = parse_atom(parser);
+    while (!parser->failed) {
+        char c = *parser->p;
+        int min = 0;
+        if ((c == '*') || (c == '+') || (c == '?')) {
+            parser->p++;
+            min = c == '+' ? 1 : 0;
+        }
+        else if (c == '{') {
+            if (!skip_interval(parser, &min)) {
+                parser->failed = TRUE;
+                break;
+            }
+        }
+        else {
+            break;
+        }
+        if ((c == '?') && (info.exact != NULL) && (tclistnum(info.exact) < EXACT_NUM_MAX)) {
+            oNode_delete(info.match);
+            info.match = NULL;
+            tclistpush(info.exact, "", 0);
+            continue;
+        }
+        if (0 < min) {
+            info = make_info(NULL, fold_info(parser, &info));
+            continue;
+        }
+        Info_fini(&info);
+        info = make_info(NULL, NULL);
+    }
+    return info;
+}
+
+/**
+ * exact keeps the strings of the current run of exact parts. When the run
+ * ends, the strings are moved into match.
+ */
+static Info
+parse_concatenation(Parser* parser)
+{
+    TCLIST* exact = tclistnew();
+    tclistpush(exact, "", 0);
+    BOOL is_exact = TRUE;
+    oNode* match = NULL;
+    while (!parser->failed && (*parser->p != '\0') && (*parser->p != '|') && (*parser->p != ')')) {
+        Info info = parse_repetition(parser);
+        match = and_nodes(match, info.match);
+        if (info.exact == NULL) {
+            match = and_nodes(match, fold_exact(parser, exact));
+            exact = tclistnew();
+            tclistpush(exact, "", 0);
+            is_exact = FALSE;
+            continue;
+        }
+        TCLIST* crossed = cross_exact(exact, info.exact);
+        if (crossed == NULL) {
+            match = and_nodes(match, fold_exact(parser, exact));
+            exact = info.exact;
+            is_exact = FALSE;
+            continue;
+        }
+        tclistdel(exact);
+        tclistdel(info.exact);
+        exact = crossed;
+    }
+    if (is_exact) {
+        return make_info(exact, match);
+    }
+    return make_info(NULL, and_nodes(match, fold_exact(parser, exact)));
+}
+
+static Info
+parse_alternation(Parser* parser)
+{
+    Info info = parse_concatenation(parser);
+    while (!parser->failed && (*parser->p == '|')) {
+        parser->p++;
+        Info other = parse_concatenation(parser);
+        if ((info.exact != NULL) && (other.exact != NULL) && (tclistnum(info.exact) + tclistnum(other.exact) <= EXACT_NUM_MAX)) {
+            int i;
+            for (i = 0; i < tclistnum(other.exact); i++) {
+                int size;
+                const char* s = (const char*)tclistval(other.exact, i, &size);
+                tclistpush(info.exact, s, size);
+            }
+            tclistdel(other.exact);
+            info.match = or_nodes(info.match, other.match);
+            continue;
+        }
+        info = make_info(NULL, or_nodes(fold_info(parser, &info), fold_info(parser, &other)));
+    }
+    return info;
+}
+
+/**
+ * Makes a query which every document matching pattern satisfies. *filter is
+ * NULL if any document can match. pattern must be a valid extended regular
+ * expression.
+ */
+int
+oRegex_make_filter(oDB* db, const char* pattern, oNode** filter)
+{
+    Parser parser;
+    parser.db = db;
+    parser.p = pattern;
+    parser.failed = FALSE;
+    Info info = parse_alternation(&parser);
+    if (parser.failed || (*parser.p != '\0')) {
+        Info_fini(&info);
+        *filter = NULL;
+        return 0;
+    }
+    *filter = fold_info(&parser, &info);
+    return 0;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
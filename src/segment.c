@@ -0,0 +1,1005 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "tcbdb.h"
+#include "tchdb.h"
+#include "tcutil.h"
+#include "o.h"
+#include "o/private.h"
+
+/**
+ * A database is a sequence of segments. A segment has documents of a range of
+ * IDs, their index and their attributes in a directory under "segments". The
+ * manifest lists segments in the order of IDs, and is replaced by rename(2),
+ * so that a reader opens the segments of a moment without any lock, and
+ * searches them while a writer puts documents.
+ *
+ * A writer, which is one at a time, puts documents into a new segment, which
+ * nobody else sees until it is committed into the manifest. A committed
+ * segment is never changed. The writer merges small segments into a new one,
+ * and removes the old ones, which readers having them open can still read.
+ *
+ * A database made before segments has documents in its own directory, which
+ * is the segment named ".". It is never merged.
+ */
+
+#define MANIFEST_RETRIES    8
+
+static void
+format_dir(oDB* db, const char* name, char* dir, size_t size)
+{
+    if (strcmp(name, ".") == 0) {
+        snprintf(dir, size, "%s", db->path);
+        return;
+    }
+    snprintf(dir, size, "%s/segments/%s", db->path, name);
+}
+
+static oSegment*
+Segment_new(oDB* db, const char* name, o_doc_id_t first_doc_id, o_doc_id_t end_doc_id)
+{
+    oSegment* segment = (oSegment*)malloc(sizeof(oSegment));
+    if (segment == NULL) {
+        oDB_set_msg_of_errno(db, "malloc failed");
+        return NULL;
+    }
+    char dir[1024];
+    format_dir(db, name, dir, array_sizeof(dir));
+    segment->name = tcstrdup(name);
+    segment->dir = tcstrdup(dir);
+    segment->first_doc_id = first_doc_id;
+    segment->end_doc_id = end_doc_id;
+    segment->index = tcbdbnew();
+    segment->postings = NULL;
+    segment->doc = tchdbnew();
+    segment->doc_log = NULL;
+    int i;
+    for (i = 0; i < array_sizeof(segment->attrs); i++) {
+        segment->attrs[i] = NULL;
+    }
+    return segment;
+}
+
+static void
+Segment_delete(oSegment* segment)
+{
+    int i;
+    for (i = 0; i < array_sizeof(segment->attrs); i++) {
+        if (segment->attrs[i] != NULL) {
+            tchdbdel(segment->attrs[i]);
+        }
+    }
+    tchdbdel(segment->doc);
+    if (segment->postings != NULL) {
+        tctreedel(segment->postings);
+    }
+    tcbdbdel(segment->index);
+    free(segment->dir);
+    free(segment->name);
+    free(segment);
+}
+
+static int
+open_index(oDB* db, oSegment* segment, int omode)
+{
+    char index[1024];
+    snprintf(index, array_sizeof(index), "%s/index.tcb", segment->dir);
+    /**
+     * Packed keys are integers in the byte order of the host.
+     */
+    if ((db->index_format == INDEX_FORMAT_PACKED) && !tcbdbsetcmpfunc(segment->index, tccmpint64, NULL)) {
+        oDB_set_msg(db, "Can't set comparator of index", tcbdberrmsg(tcbdbecode(segment->index)));
+        return 1;
+    }
+    if (!tcbdbopen(segment->index, index, omode)) {
+        oDB_set_msg(db, "Can't open index", tcbdberrmsg(tcbdbecode(segment->index)));
+        return 1;
+    }
+    return 0;
+}
+
+static int
+open_doc(oDB* db, oSegment* segment, int omode)
+{
+    if (db->doc_store == DOC_STORE_LOG) {
+        if (((omode & HDBOCREAT) != 0) && (oDocLog_create(db, segment->dir) != 0)) {
+            return 1;
+        }
+        segment->doc_log = oDocLog_open(db, segment->dir, (omode & HDBOWRITER) != 0);
+        return segment->doc_log != NULL ? 0 : 1;
+    }
+    char doc[1024];
+    snprintf(doc, array_sizeof(doc), "%s/doc.tch", segment->dir);
+    if (!tchdbopen(segment->doc, doc, omode)) {
+        oDB_set_msg(db, "Can't open doc", tchdberrmsg(tchdbecode(segment->doc)));
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * A segment has a database for each attribute in attr2id.
+ */
+static int
+open_attrs(oDB* db, oSegment* segment, int omode, BOOL is_shared)
+{
+    TCHDB* hdb = db->attr2id;
+    if (!tchdbiterinit(hdb)) {
+        oDB_set_msg(db, "Can't initialize iterator", tchdberrmsg(tchdbecode(hdb)));
+        return 1;
+    }
+    char* key;
+    while ((key = tchdbiternext2(hdb)) != NULL) {
+        int sp;
+        int* pindex = (int*)tchdbget(hdb, key, strlen(key), &sp);
+        if (pindex == NULL) {
+            free(key);
+            continue;
+        }
+        /**
+         * A segment reopened after it is written has the handles.
+         */
+        TCHDB* attr = segment->attrs[*pindex];
+        if (attr == NULL) {
+            attr = tchdbnew();
+            segment->attrs[*pindex] = attr;
+        }
+        free(pindex);
+        if (is_shared) {
+            tchdbsetmutex(attr);
+        }
+        char path[1024];
+        snprintf(path, array_sizeof(path), "%s/attrs/%s.tch", segment->dir, key);
+        free(key);
+        if (!tchdbopen(attr, path, omode)) {
+            oDB_set_msg(db, "Can't attribute index", tchdberrmsg(tchdbecode(attr)));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+close_files(oDB* db, oSegment* segment)
+{
+    int status = 0;
+    int i;
+    for (i = 0; i < array_sizeof(segment->attrs); i++) {
+        TCHDB* hdb = segment->attrs[i];
+        if ((hdb != NULL) && !tchdbclose(hdb) && (tchdbecode(hdb) != TCEINVALID)) {
+            oDB_set_msg(db, "Can't close attribute index", tchdberrmsg(tchdbecode(hdb)));
+            status = 1;
+        }
+    }
+    if (segment->doc_log != NULL) {
+        oDocLog* log = segment->doc_log;
+        segment->doc_log = NULL;
+        if (oDocLog_close(db, log) != 0) {
+            status = 1;
+        }
+    }
+    if (!tchdbclose(segment->doc) && (tchdbecode(segment->doc) != TCEINVALID)) {
+        oDB_set_msg(db, "Can't close doc", tchdberrmsg(tchdbecode(segment->doc)));
+        status = 1;
+    }
+    if (!tcbdbclose(segment->index) && (tcbdbecode(segment->index) != TCEINVALID)) {
+        oDB_set_msg(db, "Can't close index", tcbdberrmsg(tcbdbecode(segment->index)));
+        status = 1;
+    }
+    return status;
+}
+
+/**
+ * Committed segments are not written by anybody, so they are opened without
+ * file locks, which would wait for a writer of Tokyo Cabinet.
+ */
+static int
+open_files(oDB* db, oSegment* segment, BOOL is_shared)
+{
+    if (is_shared) {
+        tcbdbsetmutex(segment->index);
+        tchdbsetmutex(segment->doc);
+    }
+    if (open_index(db, segment, BDBOREADER | BDBONOLCK) != 0) {
+        return 1;
+    }
+    if (open_doc(db, segment, HDBOREADER | HDBONOLCK) != 0) {
+        return 1;
+    }
+    if (is_shared && (segment->doc_log != NULL)) {
+        segment->doc_log->is_shared = TRUE;
+    }
+    if (open_attrs(db, segment, HDBOREADER | HDBONOLCK, is_shared) != 0) {
+        return 1;
+    }
+    return 0;
+}
+
+static oSegment*
+open_segment(oDB* db, const char* name, o_doc_id_t first_doc_id, o_doc_id_t end_doc_id, BOOL is_shared)
+{
+    oSegment* segment = Segment_new(db, name, first_doc_id, end_doc_id);
+    if (segment == NULL) {
+        return NULL;
+    }
+    if (open_files(db, segment, is_shared) != 0) {
+        close_files(db, segment);
+        Segment_delete(segment);
+        return NULL;
+    }
+    return segment;
+}
+
+static int
+close_segment(oDB* db, oSegment* segment)
+{
+    int status = close_files(db, segment);
+    Segment_delete(segment);
+    return status;
+}
+
+static int
+make_dir(oDB* db, const char* path)
+{
+    if ((mkdir(path, 0755) != 0) && (errno != EEXIST)) {
+        oDB_set_msg_of_errno(db, "mkdir failed");
+        return 1;
+    }
+    return 0;
+}
+
+static int
+remove_dir(oDB* db, const char* path)
+{
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        oDB_set_msg_of_errno(db, "Can't open segment directory");
+        return 1;
+    }
+    int status = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) {
+            continue;
+        }
+        char child[1024];
+        snprintf(child, array_sizeof(child), "%s/%s", path, entry->d_name);
+        if ((unlink(child) != 0) && ((errno != EISDIR) || (remove_dir(db, child) != 0))) {
+            status = 1;
+        }
+    }
+    closedir(dir);
+    if (rmdir(path) != 0) {
+        oDB_set_msg_of_errno(db, "Can't remove segment");
+        return 1;
+    }
+    return status;
+}
+
+/**
+ * A new segment is open to write, and has no document yet.
+ */
+static oSegment*
+create_segment(oDB* db, o_doc_id_t first_doc_id)
+{
+    char name[32];
+    snprintf(name, array_sizeof(name), "%d", db->next_segment);
+    db->next_segment++;
+    char dir[1024];
+    snprintf(dir, array_sizeof(dir), "%s/segments", db->path);
+    if (make_dir(db, dir) != 0) {
+        return NULL;
+    }
+    oSegment* segment = Segment_new(db, name, first_doc_id, first_doc_id);
+    if (segment == NULL) {
+        return NULL;
+    }
+    char attrs[1024];
+    snprintf(attrs, array_sizeof(attrs), "%s/attrs", segment->dir);
+    if ((make_dir(db, segment->dir) != 0) || (make_dir(db, attrs) != 0)) {
+        Segment_delete(segment);
+        return NULL;
+    }
+    if ((open_index(db, segment, BDBOWRITER | BDBOCREAT) != 0) || (open_doc(db, segment, HDBOWRITER | HDBOCREAT) != 0) || (open_attrs(db, segment, HDBOWRITER | HDBOCREAT, FALSE) != 0)) {
+        close_files(db, segment);
+        remove_dir(db, segment->dir);
+        Segment_delete(segment);
+        return NULL;
+    }
+    return segment;
+}
+
+/**
+ * Lines of the manifest are "next_segment n" and "segment name first end".
+ */
+static int
+write_manifest(oDB* db, const char* path, oSegment* segments[], int segments_num, int next_segment)
+{
+    char tmp[1024];
+    snprintf(tmp, array_sizeof(tmp), "%s/manifest.tmp", path);
+    FILE* fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        oDB_set_msg_of_errno(db, "Can't open manifest");
+        return 1;
+    }
+    fprintf(fp, "next_segment %d\n", next_segment);
+    int i;
+    for (i = 0; i < segments_num; i++) {
+        oSegment* segment = segments[i];
+        fprintf(fp, "segment %s %d %d\n", segment->name, segment->first_doc_id, segment->end_doc_id);
+    }
+    if ((fflush(fp) != 0) || (fsync(fileno(fp)) != 0)) {
+        oDB_set_msg_of_errno(db, "Can't write manifest");
+        fclose(fp);
+        return 1;
+    }
+    if (fclose(fp) != 0) {
+        oDB_set_msg_of_errno(db, "Can't close manifest");
+        return 1;
+    }
+    char manifest[1024];
+    snprintf(manifest, array_sizeof(manifest), "%s/manifest", path);
+    if (rename(tmp, manifest) != 0) {
+        oDB_set_msg_of_errno(db, "Can't replace manifest");
+        return 1;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    return 0;
+}
+
+int
+oSegment_create_manifest(oDB* db, const char* path)
+{
+    return write_manifest(db, path, NULL, 0, 1);
+}
+
+/**
+ * Returns the number of segments but the one being written, which is the last.
+ */
+static int
+count_committed(oDB* db)
+{
+    int num = db->segments_num;
+    if ((db->writing != NULL) && (0 < num) && (db->segments[num - 1] == db->writing)) {
+        num--;
+    }
+    return num;
+}
+
+static int
+publish(oDB* db)
+{
+    return write_manifest(db, db->path, db->segments, count_committed(db), db->next_segment);
+}
+
+/**
+ * Entry is a line of the manifest.
+ */
+struct Entry {
+    char name[32];
+    o_doc_id_t first_doc_id;
+    o_doc_id_t end_doc_id;
+};
+
+typedef struct Entry Entry;
+
+/**
+ * A database without the manifest is of before segments. The next document ID
+ * of it is in doc_id.
+ */
+static int
+read_old_manifest(oDB* db, TCLIST* entries, int* next_segment)
+{
+    char path[1024];
+    snprintf(path, array_sizeof(path), "%s/doc_id", db->path);
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        oDB_set_msg_of_errno(db, "Can't open manifest");
+        return 1;
+    }
+    Entry entry;
+    strcpy(entry.name, ".");
+    entry.first_doc_id = 0;
+    entry.end_doc_id = 0;
+    if (fread(&entry.end_doc_id, sizeof(entry.end_doc_id), 1, fp) != 1) {
+        entry.end_doc_id = 0;
+    }
+    fclose(fp);
+    tclistpush(entries, &entry, sizeof(entry));
+    *next_segment = 1;
+    return 0;
+}
+
+static int
+read_manifest(oDB* db, TCLIST* entries, int* next_segment)
+{
+    char path[1024];
+    snprintf(path, array_sizeof(path), "%s/manifest", db->path);
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        if (errno == ENOENT) {
+            return read_old_manifest(db, entries, next_segment);
+        }
+        oDB_set_msg_of_errno(db, "Can't open manifest");
+        return 1;
+    }
+    *next_segment = 1;
+    char line[256];
+    while (fgets(line, array_sizeof(line), fp) != NULL) {
+        Entry entry;
+        if (sscanf(line, "segment %31s %d %d", entry.name, &entry.first_doc_id, &entry.end_doc_id) == 3) {
+            tclistpush(entries, &entry, sizeof(entry));
+            continue;
+        }
+        sscanf(line, "next_segment %d", next_segment);
+    }
+    fclose(fp);
+    return 0;
+}
+
+static int
+add_segment(oDB* db, oSegment* segment)
+{
+    oSegment** segments = (oSegment**)realloc(db->segments, sizeof(segments[0]) * (db->segments_num + 1));
+    if (segments == NULL) {
+        oDB_set_msg_of_errno(db, "realloc failed");
+        return 1;
+    }
+    segments[db->segments_num] = segment;
+    db->segments = segments;
+    db->segments_num++;
+    return 0;
+}
+
+static void
+close_segments(oDB* db)
+{
+    int i;
+    for (i = 0; i < db->segments_num; i++) {
+        close_segment(db, db->segments[i]);
+    }
+    free(db->segments);
+    db->segments = NULL;
+    db->segments_num = 0;
+    db->writing = NULL;
+}
+
+static int
+open_entries(oDB* db, TCLIST* entries, BOOL is_shared)
+{
+    int i;
+    for (i = 0; i < tclistnum(entries); i++) {
+        const Entry* entry = (const Entry*)tclistval2(entries, i);
+        oSegment* segment = open_segment(db, entry->name, entry->first_doc_id, entry->end_doc_id, is_shared);
+        if (segment == NULL) {
+            return 1;
+        }
+        if (add_segment(db, segment) != 0) {
+            close_segment(db, segment);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Directories which are not in the manifest are left by a writer which
+ * crashed. Only a writer removes them.
+ */
+static void
+remove_garbage(oDB* db)
+{
+    char path[1024];
+    snprintf(path, array_sizeof(path), "%s/segments", db->path);
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) {
+            continue;
+        }
+        BOOL is_listed = FALSE;
+        int i;
+        for (i = 0; !is_listed && (i < db->segments_num); i++) {
+            is_listed = strcmp(db->segments[i]->name, entry->d_name) == 0;
+        }
+        if (!is_listed) {
+            char child[2048];
+            snprintf(child, array_sizeof(child), "%s/%s", path, entry->d_name);
+            remove_dir(db, child);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * A writer may merge segments in the manifest which a reader has read, and
+ * remove them before the reader opens them. Then the reader reads the new
+ * manifest again.
+ */
+int
+oSegment_open_all(oDB* db, BOOL is_shared)
+{
+    int retries;
+    for (retries = 0; retries < MANIFEST_RETRIES; retries++) {
+        TCLIST* entries = tclistnew();
+        int status = read_manifest(db, entries, &db->next_segment);
+        /**
+         * Segments are merged while other threads search them if merges are
+         * deferred.
+         */
+        if (status == 0) {
+            status = open_entries(db, entries, is_shared || db->defers_merges);
+        }
+        tclistdel(entries);
+        if (status == 0) {
+            break;
+        }
+        close_segments(db);
+        if (db->writable) {
+            return 1;
+        }
+    }
+    if (retries == MANIFEST_RETRIES) {
+        return 1;
+    }
+    int num = db->segments_num;
+    db->next_doc_id = 0 < num ? db->segments[num - 1]->end_doc_id : 0;
+    if (db->writable) {
+        remove_garbage(db);
+    }
+    return 0;
+}
+
+int
+oSegment_close_all(oDB* db)
+{
+    int status = 0;
+    int i;
+    for (i = 0; i < db->segments_num; i++) {
+        if (close_segment(db, db->segments[i]) != 0) {
+            status = 1;
+        }
+    }
+    free(db->segments);
+    db->segments = NULL;
+    db->segments_num = 0;
+    db->writing = NULL;
+    return status;
+}
+
+/**
+ * Segments are in the order of IDs.
+ */
+oSegment*
+oSegment_find(oDB* db, o_doc_id_t doc_id)
+{
+    int low = 0;
+    int high = db->segments_num;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        oSegment* segment = db->segments[mid];
+        if (doc_id < segment->first_doc_id) {
+            high = mid;
+        }
+        else if (segment->end_doc_id <= doc_id) {
+            low = mid + 1;
+        }
+        else {
+            return segment;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Documents are put into the segment being written, which is made at the
+ * first document after a commit.
+ */
+oSegment*
+oSegment_get_writing(oDB* db)
+{
+    if (db->writing != NULL) {
+        return db->writing;
+    }
+    if (!db->writable) {
+        oDB_set_msg(db, "Database is not opened to write", NULL);
+        return NULL;
+    }
+    oSegment* segment = create_segment(db, db->next_doc_id);
+    if (segment == NULL) {
+        return NULL;
+    }
+    if (add_segment(db, segment) != 0) {
+        close_files(db, segment);
+        remove_dir(db, segment->dir);
+        Segment_delete(segment);
+        return NULL;
+    }
+    /**
+     * Same order as the index.
+     */
+    segment->postings = tctreenew2(db->index_format == INDEX_FORMAT_PACKED ? tccmpint64 : tccmplexical, NULL);
+    db->writing = segment;
+    return segment;
+}
+
+static int
+copy_hash(oDB* db, TCHDB* dest, TCHDB* src)
+{
+    if (!tchdbiterinit(src)) {
+        oDB_set_msg(db, "Can't initialize iterator", tchdberrmsg(tchdbecode(src)));
+        return 1;
+    }
+    TCXSTR* key = tcxstrnew();
+    TCXSTR* val = tcxstrnew();
+    int status = 0;
+    while (tchdbiternext3(src, key, val)) {
+        if (!tchdbput(dest, tcxstrptr(key), tcxstrsize(key), tcxstrptr(val), tcxstrsize(val))) {
+            oDB_set_msg(db, "Can't copy segment", tchdberrmsg(tchdbecode(dest)));
+            status = 1;
+            break;
+        }
+    }
+    tcxstrdel(val);
+    tcxstrdel(key);
+    return status;
+}
+
+/**
+ * Postings of src follow ones of dest for each term, because documents of src
+ * follow.
+ */
+static int
+copy_segment(oDB* db, oSegment* dest, oSegment* src)
+{
+    /**
+     * Records are copied, because src may be searched at the same time.
+     */
+    TCXSTR* key = tcxstrnew();
+    TCXSTR* val = tcxstrnew();
+    int status = 0;
+    BDBCUR* cur = tcbdbcurnew(src->index);
+    BOOL ok = tcbdbcurfirst(cur);
+    while (ok && tcbdbcurrec(cur, key, val)) {
+        if (!tcbdbputdup(dest->index, tcxstrptr(key), tcxstrsize(key), tcxstrptr(val), tcxstrsize(val))) {
+            oDB_set_msg(db, "Can't copy segment", tcbdberrmsg(tcbdbecode(dest->index)));
+            status = 1;
+            break;
+        }
+        ok = tcbdbcurnext(cur);
+    }
+    tcbdbcurdel(cur);
+    tcxstrdel(val);
+    tcxstrdel(key);
+    if (status != 0) {
+        return 1;
+    }
+    if (db->doc_store == DOC_STORE_LOG) {
+        if (oDocLog_copy(db, dest->doc_log, src->doc_log, src->first_doc_id, src->end_doc_id) != 0) {
+            return 1;
+        }
+    }
+    else if (copy_hash(db, dest->doc, src->doc) != 0) {
+        return 1;
+    }
+    int i;
+    for (i = 0; i < array_sizeof(src->attrs); i++) {
+        if ((src->attrs[i] != NULL) && (dest->attrs[i] != NULL) && (copy_hash(db, dest->attrs[i], src->attrs[i]) != 0)) {
+            return 1;
+        }
+    }
+    dest->end_doc_id = src->end_doc_id;
+    return 0;
+}
+
+/**
+ * Pushes postings of a term in memory, which follow their sizes, to list.
+ */
+void
+oSegment_split_postings(const char* p, int size, TCLIST* list)
+{
+    const char* end = p + size;
+    while (p < end) {
+        uint32_t posting_size;
+        memcpy(&posting_size, p, sizeof(posting_size));
+        p += sizeof(posting_size);
+        tclistpush(list, p, posting_size);
+        p += posting_size;
+    }
+}
+
+/**
+ * Postings are put in the order of terms, which is much faster than putting
+ * them one by one for each document.
+ */
+int
+oSegment_flush(oDB* db, oSegment* segment)
+{
+    TCTREE* postings = segment->postings;
+    if ((postings == NULL) || (tctreernum(postings) == 0)) {
+        return 0;
+    }
+    TCLIST* vals = tclistnew();
+    int status = 0;
+    int flushed = 0;
+    tctreeiterinit(postings);
+    const char* key;
+    int key_size;
+    while ((key = (const char*)tctreeiternext(postings, &key_size)) != NULL) {
+        int size;
+        const char* p = (const char*)tctreeiterval(key, &size);
+        tclistclear(vals);
+        oSegment_split_postings(p, size, vals);
+        if (!tcbdbputdup3(segment->index, key, key_size, vals)) {
+            oDB_set_msg(db, "Can't register any term", tcbdberrmsg(tcbdbecode(segment->index)));
+            status = 1;
+            break;
+        }
+        flushed++;
+    }
+    if (status == 0) {
+        tctreeclear(postings);
+        tclistdel(vals);
+        return 0;
+    }
+    /**
+     * Terms registered are removed from the buffer, so that a retry doesn't
+     * register them twice.
+     */
+    tclistclear(vals);
+    tctreeiterinit(postings);
+    while ((0 < flushed) && ((key = (const char*)tctreeiternext(postings, &key_size)) != NULL)) {
+        tclistpush(vals, key, key_size);
+        flushed--;
+    }
+    int i;
+    for (i = 0; i < tclistnum(vals); i++) {
+        key = (const char*)tclistval(vals, i, &key_size);
+        tctreeout(postings, key, key_size);
+    }
+    tclistdel(vals);
+    return status;
+}
+
+/**
+ * A segment is on the disk before the manifest has it.
+ */
+static int
+sync_files(oDB* db, oSegment* segment)
+{
+    if (!tcbdbsync(segment->index)) {
+        oDB_set_msg(db, "Can't sync index", tcbdberrmsg(tcbdbecode(segment->index)));
+        return 1;
+    }
+    if ((segment->doc_log != NULL) && (oDocLog_sync(db, segment->doc_log) != 0)) {
+        return 1;
+    }
+    if ((segment->doc_log == NULL) && !tchdbsync(segment->doc)) {
+        oDB_set_msg(db, "Can't sync doc", tchdberrmsg(tchdbecode(segment->doc)));
+        return 1;
+    }
+    int i;
+    for (i = 0; i < array_sizeof(segment->attrs); i++) {
+        TCHDB* hdb = segment->attrs[i];
+        if ((hdb != NULL) && !tchdbsync(hdb)) {
+            oDB_set_msg(db, "Can't sync attribute index", tchdberrmsg(tchdbecode(hdb)));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * A segment which is written is reopened to read when it is committed.
+ */
+static int
+reopen_to_read(oDB* db, oSegment* segment)
+{
+    if (close_files(db, segment) != 0) {
+        return 1;
+    }
+    return open_files(db, segment, db->defers_merges);
+}
+
+/**
+ * A merge copies two adjacent committed segments into a new one.
+ * oSegment_merge_run() only reads the two, which are never changed, and
+ * writes the new one, so that a caller may run it without the lock of the
+ * database while others search and put documents. The two are opened in the
+ * mutex mode of Tokyo Cabinet then (see oDB_defer_merges()), which doesn't
+ * let a process open a file twice. A database has one merge at a time.
+ *
+ * oSegment_merge_run() touches nothing else of the database. It sets a
+ * message to db, a handle shared with the database, which
+ * oSegment_merge_abort() gives to the database. The new segment is reopened
+ * to read by oSegment_merge_end(), because that walks attr2id.
+ */
+struct oMerge {
+    oDB db;
+    oSegment* left;
+    oSegment* right;
+    oSegment* merged;
+};
+
+static void
+Merge_delete(oDB* db, oMerge* merge)
+{
+    oDB_close(&merge->db);
+    oDB_fini(&merge->db);
+    free(merge);
+    db->is_merging = FALSE;
+}
+
+/**
+ * The last two committed segments are merged if the former has no more
+ * documents than the latter, so that a database has segments as many as the
+ * logarithm of its documents, and a document is copied as many times. *pmerge
+ * is NULL if they are not.
+ */
+int
+oSegment_merge_begin(oDB* db, oMerge** pmerge)
+{
+    *pmerge = NULL;
+    int n = count_committed(db);
+    if (db->is_merging || (n < 2)) {
+        return 0;
+    }
+    oSegment* left = db->segments[n - 2];
+    oSegment* right = db->segments[n - 1];
+    if (strcmp(left->name, ".") == 0) {
+        return 0;
+    }
+    if (right->end_doc_id - right->first_doc_id < left->end_doc_id - left->first_doc_id) {
+        return 0;
+    }
+    oMerge* merge = (oMerge*)malloc(sizeof(oMerge));
+    if (merge == NULL) {
+        oDB_set_msg_of_errno(db, "malloc failed");
+        return 1;
+    }
+    db->is_merging = TRUE;
+    oDB_init(&merge->db);
+    if (oDB_share(&merge->db, db) != 0) {
+        snprintf(db->msg, array_sizeof(db->msg), "%s", merge->db.msg);
+        Merge_delete(db, merge);
+        return 1;
+    }
+    merge->left = left;
+    merge->right = right;
+    merge->merged = create_segment(db, left->first_doc_id);
+    if (merge->merged == NULL) {
+        Merge_delete(db, merge);
+        return 1;
+    }
+    *pmerge = merge;
+    return 0;
+}
+
+int
+oSegment_merge_run(oDB* db, oMerge* merge)
+{
+    oDB* merging = &merge->db;
+    oSegment* merged = merge->merged;
+    if ((copy_segment(merging, merged, merge->left) != 0) || (copy_segment(merging, merged, merge->right) != 0)) {
+        return 1;
+    }
+    return sync_files(merging, merged);
+}
+
+void
+oSegment_merge_abort(oDB* db, oMerge* merge)
+{
+    if (merge->db.msg[0] != '\0') {
+        snprintf(db->msg, array_sizeof(db->msg), "%s", merge->db.msg);
+    }
+    oSegment* merged = merge->merged;
+    close_files(db, merged);
+    remove_dir(db, merged->dir);
+    Segment_delete(merged);
+    Merge_delete(db, merge);
+}
+
+/**
+ * The merged segment replaces the two in the manifest. Segments committed
+ * during the merge follow them, so they are still adjacent.
+ */
+int
+oSegment_merge_end(oDB* db, oMerge* merge)
+{
+    int first;
+    for (first = 0; first + 1 < db->segments_num; first++) {
+        if ((db->segments[first] == merge->left) && (db->segments[first + 1] == merge->right)) {
+            break;
+        }
+    }
+    if (db->segments_num <= first + 1) {
+        oDB_set_msg(db, "Can't find segments to merge", NULL);
+        oSegment_merge_abort(db, merge);
+        return 1;
+    }
+    if (reopen_to_read(db, merge->merged) != 0) {
+        oSegment_merge_abort(db, merge);
+        return 1;
+    }
+    db->segments[first] = merge->merged;
+    memmove(&db->segments[first + 1], &db->segments[first + 2], sizeof(db->segments[0]) * (db->segments_num - first - 2));
+    db->segments_num--;
+    if (publish(db) != 0) {
+        memmove(&db->segments[first + 2], &db->segments[first + 1], sizeof(db->segments[0]) * (db->segments_num - first - 1));
+        db->segments_num++;
+        db->segments[first] = merge->left;
+        db->segments[first + 1] = merge->right;
+        oSegment_merge_abort(db, merge);
+        return 1;
+    }
+    oSegment* olds[] = { merge->left, merge->right };
+    Merge_delete(db, merge);
+    int status = 0;
+    int i;
+    for (i = 0; i < array_sizeof(olds); i++) {
+        char dir[1024];
+        snprintf(dir, array_sizeof(dir), "%s", olds[i]->dir);
+        if (close_segment(db, olds[i]) != 0) {
+            status = 1;
+        }
+        if (remove_dir(db, dir) != 0) {
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/**
+ * Documents put so far are seen by readers which open the database after a
+ * commit.
+ */
+int
+oSegment_commit(oDB* db)
+{
+    oSegment* segment = db->writing;
+    if (segment == NULL) {
+        return 0;
+    }
+    if (segment->first_doc_id == segment->end_doc_id) {
+        db->writing = NULL;
+        db->segments_num--;
+        char dir[1024];
+        snprintf(dir, array_sizeof(dir), "%s", segment->dir);
+        int status = close_segment(db, segment);
+        return remove_dir(db, dir) != 0 ? 1 : status;
+    }
+    /**
+     * The segment is still being written until it is on the disk, so that the
+     * manifest doesn't have it before, and a commit which failed can be
+     * retried.
+     */
+    if ((oSegment_flush(db, segment) != 0) || (sync_files(db, segment) != 0) || (reopen_to_read(db, segment) != 0)) {
+        return 1;
+    }
+    db->writing = NULL;
+    tctreedel(segment->postings);
+    segment->postings = NULL;
+    return publish(db);
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
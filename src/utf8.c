@@ -0,0 +1,175 @@
+#if defined(HAVE_CONFIG_H)
+#   include "o/config.h"
+#endif
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__AVX2__)
+#   include <immintrin.h>
+#elif defined(__SSE2__)
+#   include <emmintrin.h>
+#endif
+#include "tcutil.h"
+#include "o.h"
+#include "o/private.h"
+
+/**
+ * A character starts at every byte except continuation bytes (10xxxxxx), in
+ * the same way as the ranges of oDB_get_to(). Continuation bytes are -128 to
+ * -65 as signed bytes, so one signed comparison of SIMD classifies a byte.
+ * The scalar code tests the upper bits instead, because char may be unsigned.
+ */
+#define CONTINUATION_MAX    (-65)
+
+static BOOL
+is_char_head(char c)
+{
+    return ((uint8_t)c & 0xc0) != 0x80;
+}
+
+#if defined(__AVX2__)
+#   define SCAN_WIDTH  32
+
+static uint32_t
+scan_heads(const char* s)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i*)s);
+    __m256i heads = _mm256_cmpgt_epi8(v, _mm256_set1_epi8(CONTINUATION_MAX));
+    return (uint32_t)_mm256_movemask_epi8(heads);
+}
+#elif defined(__SSE2__)
+#   define SCAN_WIDTH  16
+
+static uint32_t
+scan_heads(const char* s)
+{
+    __m128i v = _mm_loadu_si128((const __m128i*)s);
+    __m128i heads = _mm_cmpgt_epi8(v, _mm_set1_epi8(CONTINUATION_MAX));
+    return (uint32_t)_mm_movemask_epi8(heads);
+}
+#endif
+
+/**
+ * Stores the offset of every character in s into offsets, and returns the
+ * number of them. offsets must have size elements.
+ */
+size_t
+oUTF8_scan(const char* s, size_t size, uint32_t* offsets)
+{
+    uint32_t* p = offsets;
+    size_t pos = 0;
+#if defined(SCAN_WIDTH)
+    const uint32_t all = (uint32_t)(((uint64_t)1 << SCAN_WIDTH) - 1);
+    for (; pos + SCAN_WIDTH <= size; pos += SCAN_WIDTH) {
+        uint32_t heads = scan_heads(&s[pos]);
+        if (heads == all) {
+            /**
+             * ASCII only. This loop is vectorized by compilers.
+             */
+            int i;
+            for (i = 0; i < SCAN_WIDTH; i++) {
+                p[i] = pos + i;
+            }
+            p += SCAN_WIDTH;
+            continue;
+        }
+        while (heads != 0) {
+            *p = pos + __builtin_ctz(heads);
+            p++;
+            heads &= heads - 1;
+        }
+    }
+#endif
+    for (; pos < size; pos++) {
+        *p = pos;
+        p += is_char_head(s[pos]) ? 1 : 0;
+    }
+    return p - offsets;
+}
+
+size_t
+oUTF8_count(const char* s, size_t size)
+{
+    size_t n = 0;
+    size_t pos = 0;
+#if defined(SCAN_WIDTH)
+    for (; pos + SCAN_WIDTH <= size; pos += SCAN_WIDTH) {
+        n += __builtin_popcount(scan_heads(&s[pos]));
+    }
+#endif
+    for (; pos < size; pos++) {
+        n += is_char_head(s[pos]) ? 1 : 0;
+    }
+    return n;
+}
+
+#if defined(__AVX2__)
+static uint32_t
+match_ends(const char* s, size_t last, __m256i first_byte, __m256i last_byte)
+{
+    __m256i head = _mm256_loadu_si256((const __m256i*)s);
+    __m256i tail = _mm256_loadu_si256((const __m256i*)&s[last]);
+    __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(head, first_byte), _mm256_cmpeq_epi8(tail, last_byte));
+    return (uint32_t)_mm256_movemask_epi8(eq);
+}
+#elif defined(__SSE2__)
+static uint32_t
+match_ends(const char* s, size_t last, __m128i first_byte, __m128i last_byte)
+{
+    __m128i head = _mm_loadu_si128((const __m128i*)s);
+    __m128i tail = _mm_loadu_si128((const __m128i*)&s[last]);
+    __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(head, first_byte), _mm_cmpeq_epi8(tail, last_byte));
+    return (uint32_t)_mm_movemask_epi8(eq);
+}
+#endif
+
+/**
+ * Returns the first occurrence of needle in s, or NULL. Matching bytes finds
+ * only whole characters, because no character of UTF-8 begins in the middle
+ * of another one. Positions where both the first and the last byte of needle
+ * match are found SCAN_WIDTH at once, and only they are compared fully.
+ */
+const char*
+oUTF8_find(const char* s, size_t size, const char* needle, size_t needle_size)
+{
+    if (needle_size == 0) {
+        return s;
+    }
+    if (size < needle_size) {
+        return NULL;
+    }
+    if (needle_size == 1) {
+        return (const char*)memchr(s, needle[0], size);
+    }
+    size_t last = needle_size - 1;
+    size_t pos = 0;
+#if defined(__AVX2__)
+    __m256i first_byte = _mm256_set1_epi8(needle[0]);
+    __m256i last_byte = _mm256_set1_epi8(needle[last]);
+#elif defined(__SSE2__)
+    __m128i first_byte = _mm_set1_epi8(needle[0]);
+    __m128i last_byte = _mm_set1_epi8(needle[last]);
+#endif
+#if defined(SCAN_WIDTH)
+    for (; pos + last + SCAN_WIDTH <= size; pos += SCAN_WIDTH) {
+        uint32_t matches = match_ends(&s[pos], last, first_byte, last_byte);
+        while (matches != 0) {
+            size_t i = pos + __builtin_ctz(matches);
+            if (memcmp(&s[i + 1], &needle[1], last - 1) == 0) {
+                return &s[i];
+            }
+            matches &= matches - 1;
+        }
+    }
+#endif
+    for (; pos + last < size; pos++) {
+        if ((s[pos] == needle[0]) && (memcmp(&s[pos + 1], &needle[1], last) == 0)) {
+            return &s[pos];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,407 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "tcutil.h"
+#include "o.h"
+#include "o/private.h"
+
+/**
+ * The write-ahead log keeps documents put after the last commit, so that a
+ * writer which crashed doesn't lose them. The next writer puts them again
+ * with the same IDs, and commits them. A record is a header and its payload,
+ * which is a document ID, the document, and the attributes. The attributes
+ * are their number and their names and values terminated with NUL. The header
+ * has the sizes of the document and the attributes, and the CRC32 of the
+ * payload.
+ *
+ * A document is written as it is put piece by piece, so its size is not
+ * limited by memory. The header is zeros until the record is finished. A
+ * record broken by a crash or left unfinished ends the log.
+ *
+ * Positions in the log count bytes since it was opened, and don't go back
+ * when the log is truncated after a commit.
+ */
+struct oWALHeader {
+    uint64_t doc_size;
+    uint32_t attrs_size;
+    uint32_t crc;
+};
+
+typedef struct oWALHeader oWALHeader;
+
+static void
+format_path(oDB* db, char* path, size_t size)
+{
+    snprintf(path, size, "%s/wal", db->path);
+}
+
+oWAL*
+oWAL_open(oDB* db, int sync_docs, int sync_ms)
+{
+    oWAL* wal = (oWAL*)malloc(sizeof(oWAL));
+    if (wal == NULL) {
+        oDB_set_msg_of_errno(db, "malloc failed");
+        return NULL;
+    }
+    char path[1024];
+    format_path(db, path, array_sizeof(path));
+    wal->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (wal->fd == -1) {
+        oDB_set_msg_of_errno(db, "Can't open write-ahead log");
+        free(wal);
+        return NULL;
+    }
+    wal->written = 0;
+    wal->synced = 0;
+    wal->is_syncing = FALSE;
+    wal->sync_docs = sync_docs;
+    wal->sync_ms = sync_ms;
+    wal->pending = 0;
+    wal->pending_since = 0;
+    wal->end = 0;
+    wal->record = 0;
+    wal->doc_size = 0;
+    wal->crc = 0;
+    wal->is_broken = FALSE;
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->cond, NULL);
+    return wal;
+}
+
+int
+oWAL_close(oDB* db, oWAL* wal)
+{
+    int status = 0;
+    if (close(wal->fd) != 0) {
+        oDB_set_msg_of_errno(db, "Can't close write-ahead log");
+        status = 1;
+    }
+    pthread_cond_destroy(&wal->cond);
+    pthread_mutex_destroy(&wal->lock);
+    free(wal);
+    return status;
+}
+
+/**
+ * The caller holds the lock.
+ */
+static int
+sync_to(oDB* db, oWAL* wal, uint64_t target)
+{
+    while (wal->synced < target) {
+        if (wal->is_syncing) {
+            pthread_cond_wait(&wal->cond, &wal->lock);
+            continue;
+        }
+        /**
+         * Records written by others while fdatasync(2) runs wait for the next
+         * one, which syncs all of them.
+         */
+        wal->is_syncing = TRUE;
+        uint64_t end = wal->written;
+        pthread_mutex_unlock(&wal->lock);
+        int status = fdatasync(wal->fd);
+        int error = errno;
+        pthread_mutex_lock(&wal->lock);
+        wal->is_syncing = FALSE;
+        pthread_cond_broadcast(&wal->cond);
+        if (status != 0) {
+            errno = error;
+            oDB_set_msg_of_errno(db, "Can't sync write-ahead log");
+            return 1;
+        }
+        if (wal->synced < end) {
+            wal->synced = end;
+        }
+        if (wal->synced == wal->written) {
+            wal->pending = 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Records written so far are synced by one fdatasync(2) shared among threads
+ * calling this at once.
+ */
+int
+oWAL_sync(oDB* db, oWAL* wal)
+{
+    pthread_mutex_lock(&wal->lock);
+    int status = sync_to(db, wal, wal->written);
+    pthread_mutex_unlock(&wal->lock);
+    return status;
+}
+
+static uLong
+update_crc(uLong crc, const char* data, uint64_t size)
+{
+    while (0 < size) {
+        uInt n = size < (1 << 30) ? size : (1 << 30);
+        crc = crc32(crc, (const Bytef*)data, n);
+        data += n;
+        size -= n;
+    }
+    return crc;
+}
+
+static int
+write_at(oDB* db, oWAL* wal, off_t offset, const char* data, size_t size)
+{
+    while (0 < size) {
+        ssize_t n = pwrite(wal->fd, data, size, offset);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            oDB_set_msg_of_errno(db, "Can't write write-ahead log");
+            return 1;
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int
+write_payload(oDB* db, oWAL* wal, const char* data, size_t size)
+{
+    if (write_at(db, wal, wal->end, data, size) != 0) {
+        return 1;
+    }
+    wal->end += size;
+    wal->crc = update_crc(wal->crc, data, size);
+    return 0;
+}
+
+/**
+ * Starts a record of a document. Only the writer writes records, one at a
+ * time, by oWAL_begin(), oWAL_write() and oWAL_end(), or oWAL_abort() when it
+ * fails.
+ */
+int
+oWAL_begin(oDB* db, oWAL* wal, o_doc_id_t doc_id)
+{
+    if (wal->is_broken) {
+        oDB_set_msg(db, "Write-ahead log is broken", "an unfinished record can't be removed");
+        return 1;
+    }
+    wal->record = wal->end;
+    wal->doc_size = 0;
+    wal->crc = crc32(0, NULL, 0);
+    oWALHeader header = { 0, 0, 0 };
+    int status = write_at(db, wal, wal->end, (const char*)&header, sizeof(header));
+    if (status == 0) {
+        wal->end += sizeof(header);
+        status = write_payload(db, wal, (const char*)&doc_id, sizeof(doc_id));
+    }
+    if (status != 0) {
+        oWAL_abort(db, wal);
+    }
+    return status;
+}
+
+int
+oWAL_write(oDB* db, oWAL* wal, const char* s, size_t size)
+{
+    if (write_payload(db, wal, s, size) != 0) {
+        return 1;
+    }
+    wal->doc_size += size;
+    return 0;
+}
+
+/**
+ * The log is synced when sync_docs documents are not synced, or when the
+ * oldest of them is older than sync_ms milliseconds. Otherwise the caller
+ * syncs it by oWAL_sync(). If this fails, the caller removes the record by
+ * oWAL_abort().
+ */
+int
+oWAL_end(oDB* db, oWAL* wal, oAttr attrs[], int attrs_num)
+{
+    TCXSTR* block = tcxstrnew();
+    int32_t num = attrs_num;
+    tcxstrcat(block, &num, sizeof(num));
+    int i;
+    for (i = 0; i < attrs_num; i++) {
+        tcxstrcat(block, attrs[i].name, strlen(attrs[i].name) + 1);
+        tcxstrcat(block, attrs[i].val, strlen(attrs[i].val) + 1);
+    }
+    int status = write_payload(db, wal, tcxstrptr(block), tcxstrsize(block));
+    oWALHeader header = { wal->doc_size, tcxstrsize(block), wal->crc };
+    tcxstrdel(block);
+    if (status == 0) {
+        status = write_at(db, wal, wal->record, (const char*)&header, sizeof(header));
+    }
+    if (status != 0) {
+        return status;
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    uint64_t size = wal->end - wal->record;
+    wal->written += size;
+    if (wal->pending == 0) {
+        wal->pending_since = oClock_get_seconds();
+    }
+    wal->pending++;
+    BOOL is_many = (0 < wal->sync_docs) && (wal->sync_docs <= wal->pending);
+    BOOL is_old = (0 < wal->sync_ms) && (wal->sync_ms <= (oClock_get_seconds() - wal->pending_since) * 1000);
+    if (is_many || is_old) {
+        status = sync_to(db, wal, wal->written);
+    }
+    if (status != 0) {
+        wal->written -= size;
+        wal->pending--;
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return status;
+}
+
+/**
+ * Removes the record being written, so that a record which failed midway
+ * doesn't end the log before records written later. If it can't be removed,
+ * no more records are written.
+ */
+void
+oWAL_abort(oDB* db, oWAL* wal)
+{
+    if (ftruncate(wal->fd, wal->record) != 0) {
+        wal->is_broken = TRUE;
+        return;
+    }
+    wal->end = wal->record;
+}
+
+/**
+ * Documents in the log are committed, so the log is emptied.
+ */
+int
+oWAL_truncate(oDB* db, oWAL* wal)
+{
+    pthread_mutex_lock(&wal->lock);
+    while (wal->is_syncing) {
+        pthread_cond_wait(&wal->cond, &wal->lock);
+    }
+    int status = 0;
+    if (ftruncate(wal->fd, 0) != 0) {
+        oDB_set_msg_of_errno(db, "Can't truncate write-ahead log");
+        status = 1;
+    }
+    if (status == 0) {
+        wal->synced = wal->written;
+        wal->pending = 0;
+        wal->end = 0;
+        wal->record = 0;
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return status;
+}
+
+static int
+replay_record(oDB* db, const char* p, const oWALHeader* header, oWALReplayer replay)
+{
+    o_doc_id_t doc_id;
+    memcpy(&doc_id, p, sizeof(doc_id));
+    const char* doc = p + sizeof(doc_id);
+    p = doc + header->doc_size;
+    const char* end = p + header->attrs_size;
+    int32_t attrs_num;
+    memcpy(&attrs_num, p, sizeof(attrs_num));
+    p += sizeof(attrs_num);
+    if ((attrs_num < 0) || (MAX_ATTRS < attrs_num)) {
+        oDB_set_msg(db, "Write-ahead log is broken", NULL);
+        return 1;
+    }
+    oAttr attrs[MAX_ATTRS];
+    int i;
+    for (i = 0; i < attrs_num; i++) {
+        const char* name = p;
+        const char* val = memchr(name, '\0', end - name);
+        val = val != NULL ? val + 1 : NULL;
+        const char* next = val != NULL ? memchr(val, '\0', end - val) : NULL;
+        if (next == NULL) {
+            oDB_set_msg(db, "Write-ahead log is broken", NULL);
+            return 1;
+        }
+        attrs[i].name = name;
+        attrs[i].val = val;
+        p = next + 1;
+    }
+    return replay(db, doc_id, attrs, attrs_num, doc, header->doc_size);
+}
+
+/**
+ * Passes documents in the log to replay in order. A missing log is empty. The
+ * log is mapped into memory, so that a large document isn't read into memory
+ * at once.
+ */
+int
+oWAL_replay(oDB* db, oWALReplayer replay, int* replayed)
+{
+    *replayed = 0;
+    char path[1024];
+    format_path(db, path, array_sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        oDB_set_msg_of_errno(db, "Can't open write-ahead log");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        oDB_set_msg_of_errno(db, "Can't stat write-ahead log");
+        close(fd);
+        return 1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    void* log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (log == MAP_FAILED) {
+        oDB_set_msg_of_errno(db, "Can't map write-ahead log");
+        return 1;
+    }
+    int status = 0;
+    const char* p = (const char*)log;
+    const char* end = p + st.st_size;
+    while ((status == 0) && (sizeof(oWALHeader) <= end - p)) {
+        oWALHeader header;
+        memcpy(&header, p, sizeof(header));
+        p += sizeof(header);
+        uint64_t rest = end - p;
+        uint64_t attrs_end = sizeof(o_doc_id_t) + header.attrs_size;
+        if ((header.attrs_size < sizeof(int32_t)) || (rest < attrs_end) || (rest - attrs_end < header.doc_size)) {
+            break;
+        }
+        uint64_t size = attrs_end + header.doc_size;
+        if (update_crc(crc32(0, NULL, 0), p, size) != header.crc) {
+            break;
+        }
+        status = replay_record(db, p, &header, replay);
+        p += size;
+        (*replayed)++;
+    }
+    munmap(log, st.st_size);
+    return status;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,46 @@
+# Helpers for tests of o serve. A test sources this file after it sets db.
+# The server listens on sock, and pid is its process.
+
+sock="${TMPDIR}/sock"
+
+# Waits for the socket of the server started in the background. The test
+# fails if the socket doesn't appear in 5 seconds.
+wait_server() {
+  pid=$!
+  tries=0
+  while [ ! -S "${sock}" ]; do
+    tries=`expr ${tries} + 1`
+    if [ 50 -lt ${tries} ]; then
+      kill ${pid}
+      exit 1
+    fi
+    sleep 0.1
+  done
+}
+
+# Starts o serve for db with the given options.
+start_server() {
+  ${O} serve --socket="${sock}" "$@" "${db}" &
+  wait_server
+}
+
+# Stops the server, and returns its exit status.
+stop_server() {
+  kill ${pid}
+  wait ${pid}
+}
+
+# Kills the server as a crash does.
+crash_server() {
+  kill -9 ${pid}
+  wait ${pid} 2>/dev/null
+  rm -f "${sock}"
+}
+
+# Stops the server, and fails the test.
+fail() {
+  kill ${pid}
+  exit 1
+}
+
+# vim: tabstop=2 shiftwidth=2 expandtab softtabstop=2
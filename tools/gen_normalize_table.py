@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+# Generates src/normalize_table.h from the Unicode database of Python.
+#
+#   tools/gen_normalize_table.py > src/normalize_table.h
+import unicodedata
+
+WIDTH_FIRST = 0xff00
+WIDTH_LAST = 0xffef
+KANA_FIRST = 0x30a0
+KANA_LAST = 0x30ff
+VOICED_MARK = 0x3099
+SEMI_VOICED_MARK = 0x309a
+LATIN_FIRST = 0x0100
+LATIN_LAST = 0x024f
+
+
+def nfkc(cp):
+    s = unicodedata.normalize("NFKC", chr(cp))
+    if (len(s) != 1) or (s == chr(cp)):
+        return 0
+    return ord(s)
+
+
+def compose(cp, mark):
+    s = unicodedata.normalize("NFC", chr(cp) + chr(mark))
+    return ord(s) if len(s) == 1 else 0
+
+
+def lower(cp):
+    s = chr(cp).lower()
+    if (len(s) != 1) or (s == chr(cp)) or not (0xc0 <= ord(s) <= LATIN_LAST):
+        return 0
+    return ord(s)
+
+
+CLASS_SPACE = 1
+CLASS_ALPHA = 2
+CLASS_WIDE = 4
+CLASS_INHERIT = 8
+
+
+def classify(c):
+    if (c == 0x20) or (0x09 <= c <= 0x0d):
+        return CLASS_SPACE
+    if (0x41 <= c <= 0x5a) or (0x61 <= c <= 0x7a):
+        return CLASS_ALPHA
+    if c in (0xe3, 0xef):
+        return CLASS_WIDE
+    return 0
+
+
+def classify_word(c):
+    if 0x30 <= c <= 0x39:
+        return CLASS_ALPHA
+    if 0xc3 <= c <= 0xc9:
+        return CLASS_ALPHA
+    if 0x80 <= c <= 0xbf:
+        return CLASS_INHERIT
+    return classify(c)
+
+
+def print_table(name, values, type="uint16_t", fmt="0x%04x"):
+    print("static const %s %s[] = {" % (type, name))
+    for i in range(0, len(values), 8):
+        line = ", ".join(fmt % (v, ) for v in values[i:i + 8])
+        print("    %s," % (line, ))
+    print("};")
+
+
+def main():
+    print("/**")
+    print(" * Generated by tools/gen_normalize_table.py (Unicode %s). Do not edit."
+          % (unicodedata.unidata_version, ))
+    print(" */")
+    print("#define WIDTH_FIRST 0x%04x" % (WIDTH_FIRST, ))
+    print("#define WIDTH_LAST 0x%04x" % (WIDTH_LAST, ))
+    print("#define KANA_FIRST 0x%04x" % (KANA_FIRST, ))
+    print("#define KANA_LAST 0x%04x" % (KANA_LAST, ))
+    print("#define VOICED_MARK 0x%04x" % (VOICED_MARK, ))
+    print("#define SEMI_VOICED_MARK 0x%04x" % (SEMI_VOICED_MARK, ))
+    print("#define LATIN_FIRST 0x%04x" % (LATIN_FIRST, ))
+    print("#define LATIN_LAST 0x%04x" % (LATIN_LAST, ))
+    print("#define CLASS_SPACE %d" % (CLASS_SPACE, ))
+    print("#define CLASS_ALPHA %d" % (CLASS_ALPHA, ))
+    print("#define CLASS_WIDE %d" % (CLASS_WIDE, ))
+    print("#define CLASS_INHERIT %d" % (CLASS_INHERIT, ))
+    print("")
+    print("/**")
+    print(" * Classes of bytes. CLASS_SPACE and CLASS_ALPHA are same as isspace() and")
+    print(" * isalpha() of the C locale. CLASS_WIDE is a leading byte of a character")
+    print(" * which may be folded.")
+    print(" */")
+    print_table("byte_class", [classify(c) for c in range(256)], "uint8_t", "%d")
+    print("")
+    print("/**")
+    print(" * Classes of bytes for words of the hybrid tokenizer. Digits and leading")
+    print(" * bytes of Latin letters (U+00C0-U+024F) are CLASS_ALPHA too. The leading")
+    print(" * byte 0xc9 also covers U+0250-U+027F, which only keeps a few more spaces. A")
+    print(" * continuation byte is CLASS_INHERIT, which has the class of its leading byte.")
+    print(" */")
+    print_table("word_byte_class", [classify_word(c) for c in range(256)], "uint8_t", "%d")
+    print("")
+    print("/**")
+    print(" * NFKC of Halfwidth and Fullwidth Forms. 0 means no change.")
+    print(" */")
+    width = [nfkc(cp) for cp in range(WIDTH_FIRST, WIDTH_LAST + 1)]
+    print_table("width_table", width)
+    print("")
+    print("/**")
+    print(" * Katakana with a voiced/semi-voiced sound mark. 0 means none.")
+    print(" */")
+    kana = range(KANA_FIRST, KANA_LAST + 1)
+    print_table("voiced_table", [compose(cp, VOICED_MARK) for cp in kana])
+    print("")
+    print_table("semi_voiced_table", [compose(cp, SEMI_VOICED_MARK) for cp in kana])
+    print("")
+    print("/**")
+    print(" * Lowercase of Latin Extended-A/B. 0 means no change, which includes")
+    print(" * capitals whose lowercase is out of U+00C0-U+024F, such as IPA letters.")
+    print(" */")
+    latin = range(LATIN_FIRST, LATIN_LAST + 1)
+    print_table("lower_table", [lower(cp) for cp in latin])
+    print("")
+    print("/**")
+    print(" * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4")
+    print(" */")
+
+
+if __name__ == "__main__":
+    main()
+
+# vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4